@@ -0,0 +1,266 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Channels between fibers of a scheduler.
+ *
+ *  The buffer is a ring of 'nbelem' elements, 'count' of them starting
+ *  at index 'start' are in use.
+ *
+ *  Blocked fibers are linked in 'recvq' or 'sendq'. A waiter's 'data'
+ *  points to the caller buffer so that the peer copies the element
+ *  directly from or to it before waking the fiber up. There can be
+ *  receivers waiting only while the buffer is empty and senders waiting
+ *  only while it is full.
+ * ----------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "taskint.h"
+#include "channel.h"
+
+/*
+ * --------------------------------------------------------------------------
+ *  Channel structure
+ * --------------------------------------------------------------------------
+ */
+struct channel {
+  size_t     szelem;     /* size of an element */
+  size_t     nbelem;     /* size in elements of the ring, can be 0 */
+  size_t     start;      /* index of next element to read */
+  size_t     count;      /* number of elements in the ring */
+  waitq_t    recvq;      /* fibers blocked in receive */
+  waitq_t    sendq;      /* fibers blocked in send */
+  char       data[1];    /* contains nbelem elements of size szelem */
+};
+
+/*
+ * --------------------------------------------------------------------------
+ *  Allocates a new channel
+ * --------------------------------------------------------------------------
+ */
+channel_t *channel_new( size_t szelem, size_t nbelem )
+{
+  channel_t *chan;
+
+  if ( szelem < 1 ) {
+    szelem = 1;
+  }
+  chan = (channel_t*) malloc( sizeof(channel_t) + nbelem*szelem );
+  if ( chan == NULL ) {
+    return NULL;
+  }
+  memset( chan, 0, sizeof(*chan));
+  chan->szelem = szelem;
+  chan->nbelem = nbelem;
+
+  return chan;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Frees a channel object
+ * --------------------------------------------------------------------------
+ */
+void channel_free( channel_t *chan )
+{
+  free( chan );
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Send without blocking : hand the element to a waiting receiver
+ *  or store it in the ring.
+ * --------------------------------------------------------------------------
+ */
+static int channelTrySend( channel_t *chan, const void *data )
+{
+  waiter_t *waiter;
+  size_t idx;
+
+  if ( (waiter = waitqFirst( &chan->recvq )) != NULL ) {
+    memcpy( waiter->data, data, chan->szelem );
+    waiterFire( waiter );
+    return FIBER_OK;
+  }
+  if ( chan->count < chan->nbelem ) {
+    idx = (chan->start + chan->count) % chan->nbelem;
+    memcpy( chan->data + idx*chan->szelem, data, chan->szelem );
+    chan->count ++;
+    return FIBER_OK;
+  }
+  return FIBER_TIMEOUT;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Receive without blocking : take the first element of the ring, letting
+ *  a waiting sender refill it, or take the element of a waiting sender.
+ * --------------------------------------------------------------------------
+ */
+static int channelTryRecv( channel_t *chan, void *data )
+{
+  waiter_t *waiter;
+  size_t idx;
+
+  if ( chan->count > 0 ) {
+    memcpy( data, chan->data + chan->start*chan->szelem, chan->szelem );
+    chan->start = (chan->start + 1) % chan->nbelem;
+    chan->count --;
+
+    if ( (waiter = waitqFirst( &chan->sendq )) != NULL ) {
+      idx = (chan->start + chan->count) % chan->nbelem;
+      memcpy( chan->data + idx*chan->szelem, waiter->data, chan->szelem );
+      chan->count ++;
+      waiterFire( waiter );
+    }
+    return FIBER_OK;
+  }
+  if ( (waiter = waitqFirst( &chan->sendq )) != NULL ) {
+    memcpy( data, waiter->data, chan->szelem );
+    waiterFire( waiter );
+    return FIBER_OK;
+  }
+  return FIBER_TIMEOUT;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Try the operation of a case without blocking
+ * --------------------------------------------------------------------------
+ */
+int channelTryCase( channel_case_t *c )
+{
+  if ( c->op == CHANNEL_SEND ) {
+    return channelTrySend( c->chan, c->data );
+  }
+  return channelTryRecv( c->chan, c->data );
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Link the waiter of a case in the queue of its channel
+ * --------------------------------------------------------------------------
+ */
+void channelPushCase( channel_case_t *c, waiter_t *waiter )
+{
+  waiter->data = c->data;
+  waitqPush( (c->op == CHANNEL_SEND) ? &c->chan->sendq : &c->chan->recvq, waiter );
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  channel_try_send --
+ * --------------------------------------------------------------------------
+ */
+int channel_try_send( channel_t *chan, const void *data )
+{
+  return channelTrySend( chan, data );
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  channel_try_recv --
+ * --------------------------------------------------------------------------
+ */
+int channel_try_recv( channel_t *chan, void *data )
+{
+  return channelTryRecv( chan, data );
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  channel_send --
+ * --------------------------------------------------------------------------
+ */
+int channel_send( fiber_t *fiber, channel_t *chan, const void *data, uint32_t msec )
+{
+  if ( channelTrySend( chan, data ) == FIBER_OK ) {
+    return FIBER_OK;
+  }
+  return fiberWaitQueue( fiber, &chan->sendq, (void*) data, msec );
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  channel_recv --
+ * --------------------------------------------------------------------------
+ */
+int channel_recv( fiber_t *fiber, channel_t *chan, void *data, uint32_t msec )
+{
+  if ( channelTryRecv( chan, data ) == FIBER_OK ) {
+    return FIBER_OK;
+  }
+  return fiberWaitQueue( fiber, &chan->recvq, data, msec );
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  fiber_select --
+ *
+ *  If no operation can be done right away, one waiter per case is linked
+ *  in the queue of its channel. They share 'fired' so that only one
+ *  of them completes.
+ * --------------------------------------------------------------------------
+ */
+int fiber_select( fiber_t *fiber, uint32_t msec, channel_case_t *cases, int n,
+		  int *index )
+{
+  int i, ret, fired = -1;
+
+  if ( n <= 0 || cases == NULL ) {
+    return FIBER_ERROR;
+  }
+
+  /* first ready operation wins */
+  for( i = 0; i < n; ++i ) {
+    if ( channelTryCase( &cases[i] ) == FIBER_OK ) {
+      if ( index ) *index = i;
+      return FIBER_OK;
+    }
+  }
+
+  if ( fiberCheckBlock( fiber ) != FIBER_OK ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+
+  /* wait on all of them */
+  {
+    waiter_t waiters[n];
+
+    for( i = 0; i < n; ++i ) {
+      waiters[i].fiber = fiber;
+      waiters[i].index = i;
+      waiters[i].fired = &fired;
+      channelPushCase( &cases[i], &waiters[i] );
+    }
+    ret = fiberWaitOn( fiber, waiters, n, msec );
+  }
+
+  if ( ret == FIBER_OK && index ) {
+    *index = fired;
+  }
+  return ret;
+}
@@ -0,0 +1,147 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_CHANNEL_H__
+#define __FIBER_CHANNEL_H__
+
+#include "task.h"
+
+/* typedefs */
+typedef struct channel channel_t;
+typedef struct channel_case channel_case_t;
+
+/* ---------------------------------------------------------------------------
+ *  Channels
+ *
+ *  A channel is a fifo of fixed size elements used to exchange messages
+ *  between fibers of the same scheduler.
+ *
+ *  A channel created with 'nbelem' = 0 has no buffer : a sender blocks
+ *  until a receiver takes its element (rendezvous).
+ *
+ *  Fibers blocked on a channel are linked in its wait queues, they are
+ *  not polled by the scheduler. When a receiver is already waiting, the
+ *  element is copied directly from the sender to the receiver.
+ *  A fiber woken up by its peer runs as soon as the peer gives back control
+ *  to the scheduler, during the same cycle.
+ *
+ *  Channels are not thread safe, see xchannel.h for that purpose.
+ * ---------------------------------------------------------------------------
+ */
+enum channel_op_e
+  {
+   CHANNEL_SEND = 0,
+   CHANNEL_RECV,
+  };
+
+/* ---------------------------------------------------------------------------
+ *  One of the operations fiber_select() chooses from
+ * ---------------------------------------------------------------------------
+ */
+struct channel_case {
+  channel_t *chan;          /* channel to operate on */
+  int        op;            /* CHANNEL_SEND or CHANNEL_RECV */
+  void      *data;          /* element to send or buffer to receive in */
+};
+
+
+/* ---------------------------------------------------------------------------
+ * channel_new --
+ *
+ * Allocates a channel that can buffer 'nbelem' elements of 'szelem' bytes.
+ * 'nbelem' can be 0 to get an unbuffered channel.
+ *
+ * Returns NULL on memory allocation failure.
+ * ---------------------------------------------------------------------------
+ */
+channel_t *channel_new( size_t szelem, size_t nbelem );
+
+
+/* ---------------------------------------------------------------------------
+ * channel_free --
+ *
+ * Frees a channel. No fiber must be blocked on it.
+ * ---------------------------------------------------------------------------
+ */
+void channel_free( channel_t *chan );
+
+
+/* ---------------------------------------------------------------------------
+ * channel_send --
+ *
+ * Sends one element. If no receiver is waiting and the buffer is full,
+ * the fiber is suspended until a receiver takes the element or until
+ * 'msec' milliseconds elapsed. 'msec' = 0 means no timeout.
+ *
+ * Returns FIBER_OK, FIBER_TIMEOUT or FIBER_CANCELED.
+ * ---------------------------------------------------------------------------
+ */
+int channel_send( fiber_t *fiber, channel_t *chan, const void *data, uint32_t msec );
+
+
+/* ---------------------------------------------------------------------------
+ * channel_recv --
+ *
+ * Receives one element. If the channel is empty the fiber is suspended
+ * until an element is sent or until 'msec' milliseconds elapsed.
+ * 'msec' = 0 means no timeout.
+ *
+ * Returns FIBER_OK, FIBER_TIMEOUT or FIBER_CANCELED.
+ * ---------------------------------------------------------------------------
+ */
+int channel_recv( fiber_t *fiber, channel_t *chan, void *data, uint32_t msec );
+
+
+/* ---------------------------------------------------------------------------
+ * channel_try_send --
+ * channel_try_recv --
+ *
+ * Same as channel_send() and channel_recv() but they never block.
+ * They can be called from outside of a fiber.
+ *
+ * Return FIBER_OK or FIBER_TIMEOUT if the operation would block.
+ * ---------------------------------------------------------------------------
+ */
+int channel_try_send( channel_t *chan, const void *data );
+int channel_try_recv( channel_t *chan, void *data );
+
+
+/* ---------------------------------------------------------------------------
+ * fiber_select --
+ *
+ * Waits until one of the 'n' operations described by 'cases' can be done
+ * and does it. When several are ready the first one in 'cases' wins.
+ * The fiber is suspended at most 'msec' milliseconds, 'msec' = 0 means
+ * no timeout.
+ *
+ * Returns FIBER_OK and stores the index of the operation done in '*index',
+ * FIBER_TIMEOUT or FIBER_CANCELED. FIBER_ERROR is returned when 'n' is not
+ * positive.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_select( fiber_t *fiber, uint32_t msec, channel_case_t *cases, int n,
+		  int *index );
+
+
+#endif
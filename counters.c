@@ -0,0 +1,281 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Hardware performance counters : the events of sched_set_perf_events()
+ *  are opened with perf_event_open() as a single group on the scheduler
+ *  thread. They are read on each switch when accounting is on, with rdpmc
+ *  when the kernel allows it for all of them, otherwise with one read()
+ *  of the group.
+ * ----------------------------------------------------------------------------*/
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/perf_event.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "taskint.h"
+
+/* events of perf_event_open() counted by a scheduler */
+struct perf_events {
+  int fd[FIBER_EVENT_NUM_KINDS];    /* -1 if not counted */
+  int slot[FIBER_EVENT_NUM_KINDS];  /* position in a read of the group */
+  volatile struct perf_event_mmap_page *page[FIBER_EVENT_NUM_KINDS];
+				    /* mapped if read with rdpmc, or NULL */
+  int group;                        /* fd of the group leader */
+  int nr;                           /* number of events in the group */
+  int rdpmc;                        /* all of them are read with rdpmc */
+  uint64_t last[FIBER_EVENT_NUM_KINDS]; /* values at the last switch */
+  int mask;                         /* events counted */
+};
+
+/* type and config of the events */
+static const uint32_t perfTypes[FIBER_EVENT_NUM_KINDS] = {
+  PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+  PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE,
+};
+static const uint64_t perfConfigs[FIBER_EVENT_NUM_KINDS] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+  PERF_COUNT_HW_CACHE_MISSES,
+  PERF_COUNT_HW_BRANCH_MISSES,
+  PERF_COUNT_SW_PAGE_FAULTS,
+};
+
+#ifdef SCHED_HAS_TSC
+/* ----------------------------------------------------------------------------
+ * Current value of an event read from its user page with rdpmc, as
+ * described in linux/perf_event.h
+ * ----------------------------------------------------------------------------*/
+static uint64_t schedPerfRdpmc( volatile struct perf_event_mmap_page *pc )
+{
+  uint64_t count;
+  uint32_t seq, idx;
+  int64_t pmc;
+
+  do {
+    seq = pc->lock;
+    __atomic_signal_fence( __ATOMIC_SEQ_CST );
+    idx = pc->index;
+    count = pc->offset;
+    if ( pc->cap_user_rdpmc && idx != 0 ) {
+      pmc = (int64_t) __rdpmc( idx - 1 );
+      pmc <<= 64 - pc->pmc_width;
+      pmc >>= 64 - pc->pmc_width;
+      count += pmc;
+    }
+    __atomic_signal_fence( __ATOMIC_SEQ_CST );
+  } while( pc->lock != seq );
+  return count;
+}
+#endif
+
+/* ----------------------------------------------------------------------------
+ * Current values of the events counted, stored in 'v'
+ * ----------------------------------------------------------------------------*/
+static void schedPerfRead( struct perf_events *pe, uint64_t *v )
+{
+  uint64_t buf[1 + FIBER_EVENT_NUM_KINDS];
+  int k;
+
+#ifdef SCHED_HAS_TSC
+  if ( pe->rdpmc ) {
+    for( k = 0; k < FIBER_EVENT_NUM_KINDS; ++k ) {
+      if ( pe->fd[k] >= 0 ) {
+	v[k] = schedPerfRdpmc( pe->page[k] );
+      }
+    }
+    return;
+  }
+#endif
+
+  /* the number of events then their values */
+  if ( read( pe->group, buf, sizeof(buf)) < (ssize_t) ((1 + pe->nr)*sizeof(uint64_t)) ) {
+    memcpy( v, pe->last, sizeof(pe->last));
+    return;
+  }
+  for( k = 0; k < FIBER_EVENT_NUM_KINDS; ++k ) {
+    if ( pe->fd[k] >= 0 ) {
+      v[k] = buf[1 + pe->slot[k]];
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * 'prev', if not NULL, gives back control : the events since the last
+ * switch are its own. Called when accounting is on.
+ * ----------------------------------------------------------------------------*/
+void schedPerfSwitch( scheduler_t *sched, fiber_t *prev )
+{
+  struct perf_events *pe = sched->perf;
+  uint64_t v[FIBER_EVENT_NUM_KINDS];
+  int k;
+
+  schedPerfRead( pe, v );
+  for( k = 0; k < FIBER_EVENT_NUM_KINDS; ++k ) {
+    if ( pe->fd[k] < 0 ) {
+      continue;
+    }
+    if ( prev != NULL ) {
+      prev->stats.events[k] += v[k] - pe->last[k];
+    }
+    pe->last[k] = v[k];
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Adds to 'stats' the events of the running fiber since it was switched to
+ * ----------------------------------------------------------------------------*/
+void schedPerfPending( scheduler_t *sched, fiber_stats_t *stats )
+{
+  struct perf_events *pe = sched->perf;
+  uint64_t v[FIBER_EVENT_NUM_KINDS];
+  int k;
+
+  schedPerfRead( pe, v );
+  for( k = 0; k < FIBER_EVENT_NUM_KINDS; ++k ) {
+    if ( pe->fd[k] >= 0 ) {
+      stats->events[k] += v[k] - pe->last[k];
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Closes the events of a scheduler, the group leader last
+ * ----------------------------------------------------------------------------*/
+void schedPerfClose( scheduler_t *sched )
+{
+  struct perf_events *pe = sched->perf;
+  long pagesz = sysconf( _SC_PAGESIZE );
+  int k;
+
+  if ( pe == NULL ) {
+    return;
+  }
+  sched->perf = NULL;
+  for( k = FIBER_EVENT_NUM_KINDS - 1; k >= 0; --k ) {
+    if ( pe->page[k] != NULL ) {
+      munmap( (void*) pe->page[k], pagesz );
+    }
+    if ( pe->fd[k] >= 0 ) {
+      close( pe->fd[k] );
+    }
+  }
+  free( pe );
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_set_perf_events --
+ * --------------------------------------------------------------------------*/
+int sched_set_perf_events( scheduler_t *sched, int events )
+{
+  struct perf_event_attr attr;
+  struct perf_events *pe;
+  long pagesz = sysconf( _SC_PAGESIZE );
+  void *page;
+  int k;
+
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
+  }
+  schedPerfClose( sched );
+  if ( (events & FIBER_EVENTS_ALL) == 0 ) {
+    return FIBER_OK;
+  }
+
+  pe = (struct perf_events*) calloc( 1, sizeof(*pe));
+  if ( pe == NULL ) {
+    return FIBER_MEMORY_ALLOCATION_ERROR;
+  }
+  pe->group = -1;
+  pe->rdpmc = 1;
+  for( k = 0; k < FIBER_EVENT_NUM_KINDS; ++k ) {
+    pe->fd[k] = -1;
+    if ( !(events & FIBER_EVENT_MASK(k)) ) {
+      continue;
+    }
+
+    /* the calling thread, on any cpu, in user mode, the first event
+     * opened leads the group */
+    memset( &attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perfTypes[k];
+    attr.config = perfConfigs[k];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    pe->fd[k] = (int) syscall( SYS_perf_event_open, &attr, 0, -1, pe->group,
+			       PERF_FLAG_FD_CLOEXEC );
+    if ( pe->fd[k] < 0 ) {
+      debug( "sched_set_perf_events : event %d not counted (%s).\n", k, strerror( errno ));
+      continue;
+    }
+    if ( pe->group < 0 ) {
+      pe->group = pe->fd[k];
+    }
+    pe->slot[k] = pe->nr++;
+    pe->mask |= FIBER_EVENT_MASK(k);
+
+    /* the user page is only worth it with rdpmc */
+    page = mmap( NULL, pagesz, PROT_READ, MAP_SHARED, pe->fd[k], 0 );
+    if ( page != MAP_FAILED ) {
+      if ( ((struct perf_event_mmap_page*) page)->cap_user_rdpmc ) {
+	pe->page[k] = (struct perf_event_mmap_page*) page;
+      }
+      else {
+	munmap( page, pagesz );
+      }
+    }
+    if ( pe->page[k] == NULL ) {
+      pe->rdpmc = 0;
+    }
+  }
+
+  if ( pe->mask == 0 ) {
+    free( pe );
+    return FIBER_ERROR;
+  }
+#ifndef SCHED_HAS_TSC
+  pe->rdpmc = 0;
+#endif
+  sched->perf = pe;
+  schedPerfRead( pe, pe->last );
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_get_perf_events --
+ * --------------------------------------------------------------------------*/
+int sched_get_perf_events( scheduler_t *sched )
+{
+  if ( sched == NULL || sched->perf == NULL ) {
+    return 0;
+  }
+  return sched->perf->mask;
+}
@@ -32,6 +32,7 @@
  *        but sends an heartbeat message on the bus each 500 msec.
  * ----------------------------------------------------------------------------*/
 #include "task.h"
+#include "waitany.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -53,7 +54,7 @@
  * ----------------------------------------------------------------------------*/
 typedef struct extra_s {
   int socket;         /* socket attached to fiber */
-  int hasdata;        /* tells if data is ready on socket */
+  int hasdata;        /* a frame is waiting to be processed */
   int canid;          /* associated can message identifier */
   can_frame_t frame;  /* can frame passed to the fiber */
 } extra_t;
@@ -176,12 +177,18 @@ void read_task( fiber_t *fiber )
 {
   extra_t *extra = fiber_get_extra( fiber );
   int fd = extra->socket;
+  wait_source_t src[2];
+  int index;
+
+  memset( src, 0, sizeof(src));
+  src[0].type = WAIT_READ;
+  src[0].fd = fd;
+  src[1].type = WAIT_VAR;
+  src[1].value = 0;
   
   while(1) {
   redo:
-    fiber_wait_for_var( fiber, extra->hasdata, 1);
-    if ( extra->hasdata ) {
-      extra->hasdata = 0;
+    if ( fiber_wait_any( fiber, src, 1, NULL ) == FIBER_OK ) {
 
       /* read frames (up to 64) */
       do {
@@ -218,13 +225,23 @@ void read_task( fiber_t *fiber )
 	fiber_t *f = canid_get_fiber( canid );
 	if ( f != NULL ) {
 	  extra_t *e = fiber_get_extra(f);
-	  /* wait until f has processed its data */
-	  if ( e->hasdata ) {
-	    while(fiber_fait_for_var( fiber, MSEC, f->hasdata, 0) == FIBER_TIMEOUT);
+	  /* wait until f has processed its data, reading the frames
+	   * coming in meanwhile as long as there is room in the ring */
+	  src[1].var = &e->hasdata;
+	  while( e->hasdata ) {
+	    if ( ring_end - ring_start < 64 ) {
+	      fiber_wait_any( fiber, src, 2, &index );
+	      if ( index == 0 && read( fd, ring + (ring_end % 64), sizeof(can_frame_t)) > 0 ) {
+		ring_end ++;
+	      }
+	    }
+	    else {
+	      fiber_wait_any( fiber, src + 1, 1, NULL );
+	    }
 	  }
 	  /* push data to f */
 	  memcpy( e->frame, &ring[ring_start % 64], sizeof(can_frame_t));
-	  f->hasdata = 1;
+	  fiber_var_store( fiber_get_scheduler(fiber), &e->hasdata, 1 );
 	}
 	ring_start++;
       }
@@ -262,44 +279,15 @@ void msg_task( fiber_t *fiber )
   int scan = extra->socket;
 
   while(1) {
-    fiber_wait_for_var( fiber, extra->hasdata, 1);
+    fiber_var_wait( fiber, 0, &extra->hasdata, 1);
     if ( extra->hasdata ) {
-      extra->hasdata = 0;
       info("Message 0x%x received\n");
+      /* tells the reader it can push the next frame */
+      fiber_var_store( fiber_get_scheduler(fiber), &extra->hasdata, 0 );
     }
   }
 }
 
-/* --------------------------------------------------------------------------
- *  Call select to find which connection has pending data to read
- *  Arrange for the fiber handling th connection to wake up.
- *
- *  This function is called at the beginnig of each scheduler cycle.
- * --------------------------------------------------------------------------*/
-int selectloop( fiber_t *fiber ) {
-  extra_t *extra = (extra_t*) fiber_get_extra(fiber);
-  struct timeval tv;
-  fd_set rdfs;
-  int retval, selectfd = extra->socket;
-
-  /* Watch sockets to see when they have input. */
-  FD_ZERO(&rdfs);
-  FD_SET(&rdfs, selectfd );
-
-  /* Wait up to 50 msecs. */
-  tv.tv_sec = 0;
-  tv.tv_usec = 5000;
-
-  retval = select( selectfd+1, &rdfs, NULL, NULL, &tv);
-
-  if (retval == -1) {
-    perror("select()");
-    
-  } else if (retval && FD_ISSET(&rdfs, selectfd)) {
-    data->hasdata = 1;
-  }
-}
-
 /* --------------------------------------------------------------------------
  *  Creates a fiber
  * --------------------------------------------------------------------------*/
@@ -355,7 +343,7 @@ void server( char *device )
   }
   
   while(1) {
-    selectloop( freader );
+    sched_poll( sched, 5 );
     sched_cycle( sched, sched_elapsed() );
   }
 }
@@ -38,12 +38,13 @@
 #include <fcntl.h>
 
 #include "task.h"
+#include "waitany.h"
+#include "pool.h"
 #include "card.h"
 
 /* data associated to a fiber */
 typedef struct extra_s {
   int fd;       /* socket attached to fiber */
-  int hasdata;  /* tells if data is ready on socket */
   FILE *fin;    /* some fibers open a file, that where they store it */
 } extra_t;
 
@@ -51,18 +52,21 @@ typedef struct extra_s {
 /* this boundary is used in the video sample */
 static char *boundary = "--myboundary";
 
-/* this set contains the current sockets to watch */
-static fd_set cnxset;
-static int  cnxmaxfd = 0;
-
 #define BACKLOG 5
 #define CNXMAX 64
-static fiber_t *cnx2fiber[CNXMAX];
+static int cnxcount;
+
+/* connections are served by a pool of workers
+ * keeping a few of them between bursts */
+#define WORKERS_MIN 4
+#define WORKERS_IDLE 10000
+static fiber_pool_t *workers;
 
 /* all the cards, defined in main.c */
 extern card_t *allcards[];
 
-#define MSEC 100
+/* pause between two chunks of a stream */
+#define PAUSE 5
 
 /* --------------------------------------------------------------------------
  *  Get the socket of fiber
@@ -74,12 +78,16 @@ static int get_fiber_fd( fiber_t *f )
 }
 
 /* --------------------------------------------------------------------------
- *  Set the hasdata flag of fiber
+ *  Wait until the socket of fiber is readable
  * --------------------------------------------------------------------------*/
-static void set_fiber_hasdata( fiber_t *fiber, int val )
+static void wait_readable( fiber_t *fiber )
 {
-  extra_t *extra = (extra_t*) fiber_get_extra(fiber);
-  extra->hasdata = val;
+  wait_source_t src;
+
+  memset( &src, 0, sizeof(src));
+  src.type = WAIT_READ;
+  src.fd = get_fiber_fd( fiber );
+  fiber_wait_any( fiber, &src, 1, NULL );
 }
 
 /* --------------------------------------------------------------------------
@@ -151,16 +159,22 @@ static void image_headers( int fd, card_t *card )
  * --------------------------------------------------------------------------*/
 static void pausef( fiber_t *fiber )
 {
-  int n, nothing = 1, fd = get_fiber_fd(fiber);
-  extra_t *extra = fiber_get_extra( fiber );
+  int n, index, nothing = 1, fd = get_fiber_fd(fiber);
+  wait_source_t src[2];
   char buffer[4096];
 
+  /* the pause ends early if the client sends something */
+  memset( src, 0, sizeof(src));
+  src[0].type = WAIT_READ;
+  src[0].fd = fd;
+  src[1].type = WAIT_DEADLINE;
+  src[1].deadline = sched_timestamp( fiber_get_scheduler( fiber )) + PAUSE;
+
  redo:
-  fiber_yield( fiber );
+  fiber_wait_any( fiber, src, 2, &index );
 
   /* data pending ? */
-  if ( extra->hasdata ) {
-    extra->hasdata = 0;
+  if ( index == 0 ) {
     do {
       n = read( fd, buffer, sizeof(buffer));
       if ( n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
@@ -181,9 +195,9 @@ static void pausef( fiber_t *fiber )
 
 /* --------------------------------------------------------------------------
  *  Send mjpeg video
- * --myboundary
- * Content-Type: image/jpeg
- * Content-Length: 42149
+ * --myboundary
+ * Content-Type: image/jpeg
+ * Content-Length: 42149
  * --------------------------------------------------------------------------*/
 void video( fiber_t *fiber, char *fname )
 {
@@ -359,18 +373,13 @@ void deck52( fiber_t *fiber )
  * --------------------------------------------------------------------------*/
 void generic_task( fiber_t *fiber )
 {
-  extra_t *extra = (extra_t*) fiber_get_extra( fiber );
-  int n, ret, fd = get_fiber_fd( fiber );
+  int n, fd = get_fiber_fd( fiber );
   char buffer[4096];
   char *location;
 
   /* wait for incoming data */
-  do {
-    extra->hasdata = 0;
-    ret = fiber_wait_for_var( fiber, MSEC, &extra->hasdata, 1);
-  } while( FIBER_TIMEOUT == ret );
+  wait_readable( fiber );
 
-  
   /* read request */
   n = read( fd, buffer, sizeof(buffer));
   puts(buffer);
@@ -419,120 +428,66 @@ void generic_task( fiber_t *fiber )
 }
 
 /* --------------------------------------------------------------------------
- *  Called once fiber has finished running
+ *  Called once the connection has been served
+ *  It also runs if the worker is stopped, for instance when the remote
+ *  end closes the connection during a video.
  * --------------------------------------------------------------------------*/
-void done( fiber_t *fiber )
+static void done( void *arg )
 {
-  extra_t *extra = fiber_get_extra( fiber );
-  int i, fd = get_fiber_fd(fiber);
+  extra_t *extra = (extra_t*) arg;
 
   if ( extra->fin != NULL ) {
     fclose( extra->fin );
   }
-  
-  for ( i = 0; i < CNXMAX; ++i ) {
-    if ( cnx2fiber[i] == fiber ) {
-      cnx2fiber[i] = NULL;
-    }
-  }
-  close(fd);
-  FD_CLR( fd, &cnxset );
-  /* recompute cnxmaxfd if needed */
-  if ( cnxmaxfd == fd ) {
-    for( i = cnxmaxfd = 0; i < CNXMAX; ++i ) {
-      if ( cnx2fiber[i] != NULL ) {
-	fd = get_fiber_fd( cnx2fiber[i] );
-	if ( fd > cnxmaxfd ) {
-	  cnxmaxfd = fd;
-	}
-      }
-    }
-  }
-  /* safe to free fiber. Its stack has already been deallocated */
-  free( fiber_get_extra( fiber ) );
-  free( fiber );
+  close( extra->fd );
+  free( extra );
+  cnxcount --;
 }
 
-
 /* --------------------------------------------------------------------------
- *  Call select to find which connection has pending data to read
- *  Arrange for the fiber handling th connection to wake up.
- *
- *  This function is called at the beginnig of each scheduler cycle.
+ *  Job run by a worker for each connection
  * --------------------------------------------------------------------------*/
-int selectloop(void) {
-  fd_set rdfs;
-  struct timeval tv;
-  int i, retval;
-
-  /* Watch sockets to see when they have input. */
-  FD_ZERO(&rdfs);
-  memcpy( &rdfs, &cnxset, sizeof(rdfs) );
-
-  /* Wait up to 50 msecs. */
-  tv.tv_sec = 0;
-  tv.tv_usec = 5000;
-
-  retval = select( cnxmaxfd+1, &rdfs, NULL, NULL, &tv);
-
-  if (retval == -1) {
-    perror("select()");
-    
-  } else if (retval) {
-    /* loop over connections */
-    for( i = 0; i < CNXMAX; ++i ) {
-      fiber_t *fiber = cnx2fiber[i];
-      if ( fiber != NULL ) {
-	extra_t *extra = fiber_get_extra( fiber );
-	int fd = get_fiber_fd( fiber );
-	if ( FD_ISSET( fd, &rdfs) ) {
-	  /* it will wake up the fiber */
-	  extra->hasdata = 1; 
-	}
-      }
-    }
-  }
+static void serve( fiber_t *fiber, void *arg )
+{
+  fiber_cleanup_t cleanup;
+
+  fiber_cleanup_push( fiber, &cleanup, done, arg );
+  generic_task( fiber );
+  fiber_cleanup_pop( fiber, 1 );
 }
 
+
 /* --------------------------------------------------------------------------
- *  Create a task to handle connection
+ *  Hand over the connection to a worker
  * --------------------------------------------------------------------------*/
 void mktask( scheduler_t *sched, int fd )
 {
   extra_t *extra;
-  fiber_t *fiber;
-  int i;
+  int flags;
 
-  for( i = 0 ; i < CNXMAX; ++i ) {
-    if ( cnx2fiber[i] == NULL ) {
-      break;
-    }
-  }
-  if ( i == CNXMAX ) {
+  if ( cnxcount == CNXMAX ) {
     error("Maximum number of connection reached.\n");
+    close(fd);
+    return;
   }
-  else { 
-    int flags;
 
-    extra = (extra_t*) malloc(sizeof(extra_t));
-    extra->fd = fd;
-    extra->hasdata = 0;
-    extra->fin = NULL;
+  extra = (extra_t*) malloc(sizeof(extra_t));
+  if ( extra == NULL ) {
+    close(fd);
+    return;
+  }
+  extra->fd = fd;
+  extra->fin = NULL;
 
-    flags = fcntl(fd ,F_GETFL, 0);
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-    
-    FD_SET( fd, &cnxset );
-    if ( fd > cnxmaxfd ) {
-      cnxmaxfd = fd;
-    }
-  
-    fiber = fiber_new( generic_task, extra);
-    fiber_set_done_func( fiber, done);
-    fiber_start( sched, fiber);
+  flags = fcntl(fd ,F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 
-    cnx2fiber[i] = fiber;
+  if ( pool_submit( workers, serve, extra ) != FIBER_OK ) {
+    close(fd);
+    free(extra);
+    return;
   }
+  cnxcount ++;
 }
 
 /* --------------------------------------------------------------------------
@@ -541,16 +496,11 @@ void mktask( scheduler_t *sched, int fd )
  * --------------------------------------------------------------------------*/
 void accept_task( fiber_t *fiber )
 {
-  int ret, newfd, fd = get_fiber_fd( fiber );
-  extra_t *extra = (extra_t*) fiber_get_extra( fiber );
+  int newfd, fd = get_fiber_fd( fiber );
 
   while(1) {
-    /* wait for incoming data */
-    extra->hasdata = 0;
-    ret = fiber_wait_for_var( fiber, MSEC, &extra->hasdata, 1);
-    if ( ret == FIBER_TIMEOUT ) {
-      continue;
-    }
+    /* wait for incoming connections */
+    wait_readable( fiber );
 
     /* create new connection and new fiber to serve it */
     newfd = accept(fd, NULL, NULL);
@@ -572,6 +522,7 @@ void server( short portno )
 {
   struct sockaddr_in server_addr;
   int serverfd;
+  uint32_t now, deadline;
   scheduler_t *sched;
   fiber_t *fiber;
   extra_t *extra;
@@ -600,12 +551,12 @@ void server( short portno )
     exit(1);
   }
  
-  /* add server socket to watched fd set */
-  cnxmaxfd = serverfd;
-  FD_SET( serverfd, &cnxset );
-
-  /* create scheduler */
+  /* create scheduler and the workers */
   sched = sched_new();
+  workers = pool_new( sched, WORKERS_MIN, CNXMAX, WORKERS_IDLE );
+  if ( workers == NULL ) {
+    exit(1);
+  }
 
   /* create the fiber that will accept
    * incoming connections */
@@ -614,15 +565,17 @@ void server( short portno )
     exit(1);
   }
   extra->fd = serverfd;
-  extra->hasdata = 0;
+  extra->fin = NULL;
 
   fiber = fiber_new( accept_task, extra );
   fiber_start( sched, fiber );
 
-  cnx2fiber[0] = fiber;
-  
   while(1) {
-    selectloop();
+    /* sleep until a socket is ready or a fiber must run */
+    now = sched_elapsed();
+    deadline = sched_deadline( sched );
+    sched_poll( sched, (deadline == UINT_MAX) ? UINT_MAX :
+		(deadline > now) ? deadline - now : 0 );
     sched_cycle( sched, sched_elapsed() );
   }
 }
@@ -0,0 +1,176 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  NUMA benchmark
+ *
+ *  A scheduler is pinned on the first cpu of node 0 and runs fibers which
+ *  walk through a buffer on their stack and through their `extra' buffer
+ *  each time they are dispatched.
+ *
+ *  Usage : numa [local|remote|default]
+ *
+ *   - local   : memory comes from node 0, the node of the scheduler cpu.
+ *   - remote  : memory comes from the last node of the machine.
+ *   - default : memory comes from malloc, it is placed according to the
+ *               process policy (see numactl --membind / --interleave).
+ *
+ *  Without argument local and remote are run one after the other.
+ *  On a single node machine there is no remote memory : the remote case
+ *  cannot be measured, all runs use local memory.
+ * ----------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "task.h"
+
+#define NFIBERS   64
+#define STACKSZ   (256*1024)
+#define TOUCHSZ   (128*1024)
+#define EXTRASZ   (64*1024)
+#define NCYCLES   2000
+
+volatile long sum = 0;
+
+/* --------------------------------------------------------------------------
+ *  Each time it runs, the fiber reads its stack buffer and its extra buffer
+ * --------------------------------------------------------------------------*/
+void run( fiber_t *fiber )
+{
+  volatile char buffer[TOUCHSZ];
+  char *extra = (char*) fiber_get_extra( fiber );
+  long s;
+  int i;
+
+  memset( (char*) buffer, 1, sizeof(buffer));
+  memset( extra, 2, EXTRASZ );
+  while(1) {
+    for( s = 0, i = 0; i < TOUCHSZ; i += 64 ) s += buffer[i];
+    for( i = 0; i < EXTRASZ; i += 64 ) s += extra[i];
+    sum += s;
+    fiber_yield( fiber );
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Count NUMA nodes
+ * --------------------------------------------------------------------------*/
+static int count_nodes()
+{
+  DIR *dir = opendir("/sys/devices/system/node");
+  struct dirent *de;
+  int n = 0, node;
+
+  if ( dir == NULL ) return 1;
+  while( (de = readdir(dir)) != NULL ) {
+    if ( sscanf( de->d_name, "node%d", &node ) == 1 ) ++n;
+  }
+  closedir(dir);
+  return n ? n : 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  First cpu of a node
+ * --------------------------------------------------------------------------*/
+static int node_first_cpu( int node )
+{
+  char path[64];
+  FILE *f;
+  int cpu = 0;
+
+  snprintf( path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  f = fopen( path, "r" );
+  if ( f != NULL ) {
+    if ( fscanf( f, "%d", &cpu ) != 1 ) cpu = 0;
+    fclose(f);
+  }
+  return cpu;
+}
+
+/* --------------------------------------------------------------------------
+ *  Run the benchmark with memory on 'memnode' (-1 : malloc)
+ * --------------------------------------------------------------------------*/
+static void bench( const char *name, int memnode )
+{
+  scheduler_t *sched;
+  fiber_t *fiber;
+  void *extras[NFIBERS];
+  uint32_t t0, t;
+  int i, cpu = node_first_cpu(0);
+
+  sched = sched_new();
+  sched_set_cpus( sched, &cpu, 1 );
+  sched_set_node( sched, memnode );
+
+  for( i = 0; i < NFIBERS; ++i ) {
+    extras[i] = sched_alloc( sched, EXTRASZ );
+    fiber = sched_fiber_new( sched, run, extras[i] );
+    fiber_set_stack_size( fiber, STACKSZ );
+    fiber_start( sched, fiber );
+  }
+
+  /* first cycle binds the thread and touches the memory */
+  sched_cycle( sched, 0 );
+  
+  t0 = sched_elapsed();
+  for( i = 0; i < NCYCLES; ++i ) {
+    sched_cycle( sched, 0 );
+  }
+  t = sched_elapsed() - t0;
+  
+  printf("%-8s cpu %d memory node %2d : %6u msec for %d cycles of %d fibers\n",
+	 name, cpu, memnode, t, NCYCLES, NFIBERS);
+
+  sched_stop( sched );
+  sched_cycle( sched, 0 );
+  for( i = 0; i < NFIBERS; ++i ) {
+    sched_release( sched, extras[i] );
+  }
+  sched_free( sched );
+}
+
+int main( int argc, char **argv )
+{
+  int nodes = count_nodes();
+
+  sched_elapsed();
+  if ( nodes < 2 ) {
+    printf("single NUMA node : the remote case can't be measured, "
+	   "it is the same as the local one.\n");
+  }
+  
+  if ( argc < 2 || strcmp( argv[1], "local" ) == 0 ) {
+    bench( "local", 0 );
+  }
+  if ( argc < 2 || strcmp( argv[1], "remote" ) == 0 ) {
+    bench( "remote", nodes - 1 );
+  }
+  if ( argc >= 2 && strcmp( argv[1], "default" ) == 0 ) {
+    bench( "default", -1 );
+  }
+  return 0;
+}
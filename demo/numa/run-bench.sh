@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Runs the NUMA benchmark.
+#
+# On a machine with several nodes, the local and remote cases are measured
+# directly, then the default (malloc) case with memory bound to the last
+# node by numactl. A single node machine has no remote memory : the remote
+# case can't be measured there and only the local case is run.
+#
+
+[ -x ./numa ] || make || exit 1
+
+nodes=$(ls -d /sys/devices/system/node/node[0-9]* 2>/dev/null | wc -l)
+
+if [ "$nodes" -ge 2 ]; then
+    ./numa local
+    ./numa remote
+    if command -v numactl >/dev/null 2>&1; then
+        numactl --membind=$((nodes - 1)) ./numa default
+    fi
+else
+    echo "single node : no remote memory, local run only"
+    ./numa local
+fi
@@ -1,6 +1,12 @@
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 
 #include "task.h"
+#include "generator.h"
+#include "tasklet.h"
+#include "tracer.h"
+#include "recorder.h"
 
 volatile int count = 0;
 
@@ -12,13 +18,241 @@ void run( fiber_t *fiber)
   }
 }
 
-int main()
+/* two fibers switching directly to each other */
+fiber_t *peers[2];
+
+void run_pingpong( fiber_t *fiber)
+{
+  fiber_t *other = (fiber == peers[0]) ? peers[1] : peers[0];
+  
+  while( count < 50000000 ) {
+    count ++;
+    fiber_yield_to( fiber, other );
+  }
+}
+
+int pingpong( const char *mode )
+{
+  scheduler_t *sched;
+  uint32_t t;
+  int i;
+
+  sched = sched_new();
+  if ( strcmp( mode, "recorder" ) == 0 ) {
+    sched_recorder_open( sched, NULL, 1024 );
+  }
+  if ( strcmp( mode, "trace" ) == 0 && sched_trace_start( sched, 1 << 16 ) != FIBER_OK ) {
+    printf("Tracing not compiled in, build with CFLAGS=-DFIBER_TRACE\n");
+    return 1;
+  }
+  if ( strcmp( mode, "events" ) == 0 ) {
+    if ( sched_set_perf_events( sched, FIBER_EVENTS_ALL ) != FIBER_OK ) {
+      printf("No performance counter available\n");
+      return 1;
+    }
+    sched_set_accounting( sched, 1 );
+  }
+  for( i = 0; i < 2; ++i ) {
+    peers[i] = fiber_new( run_pingpong, NULL);
+    fiber_start( sched, peers[i] );
+  }
+
+  sched_elapsed();
+  while( sched_numfibers( sched ) > 0 ) {
+    sched_cycle( sched, 0 );
+  }
+  t = sched_elapsed();
+  if ( t == 0 ) t = 1;
+
+  printf("Number of direct switch  : %d\n", count);
+  printf("Direct switch / second   : %d\n", 1000*(count/t));
+  printf("Nanoseconds / switch     : %.1f\n", 1e6*t/count);
+
+  if ( sched_get_perf_events( sched ) != 0 ) {
+    static const char *names[FIBER_EVENT_NUM_KINDS] =
+      { "Cycles", "Instructions", "L1d misses", "LLC misses", "Branch misses", "Page faults" };
+    fiber_run_stats_t rs;
+
+    sched_get_run_stats( sched, &rs, 1 );
+    for( i = 0; i < FIBER_EVENT_NUM_KINDS; ++i ) {
+      if ( sched_get_perf_events( sched ) & FIBER_EVENT_MASK(i) ) {
+	printf("%-14s / switch  : %.2f\n", names[i], (double) rs.stats.events[i]/count);
+      }
+    }
+  }
+  return 0;
+}
+
+/* compute bound fibers checking their time slice */
+static int yields = 0;
+
+void run_sliced( fiber_t *fiber )
+{
+  while( count < 200000000 ) {
+    count ++;
+    if ( fiber_should_yield( fiber ) ) {
+      yields ++;
+      fiber_yield( fiber );
+    }
+  }
+}
+
+int slices()
+{
+  scheduler_t *sched;
+  uint32_t t;
+  int i;
+
+  sched = sched_new();
+  sched_set_time_slice( sched, 100 );
+  for( i = 0; i < 4; ++i ) {
+    fiber_start( sched, fiber_new( run_sliced, NULL ));
+  }
+
+  sched_elapsed();
+  while( sched_numfibers( sched ) > 0 ) {
+    sched_cycle( sched, 0 );
+  }
+  t = sched_elapsed();
+  if ( t == 0 ) t = 1;
+
+  printf("Number of checks         : %d\n", count);
+  printf("Nanoseconds / check      : %.1f\n", 1e6*t/count);
+  printf("Slices used up           : %d\n", yields);
+  printf("Microseconds / slice     : %.1f\n", yields ? 1e3*t/yields : 0.0);
+
+  sched_free( sched );
+  return 0;
+}
+
+/* a generator and its consumer */
+void *gen_numbers( fiber_t *fiber, void *arg )
+{
+  intptr_t x = 0;
+  while(1) {
+    gen_yield( fiber, (void*) x++ );
+  }
+  return NULL;
+}
+
+void run_consumer( fiber_t *fiber)
+{
+  gen_t *gen = (gen_t*) fiber_get_extra( fiber );
+  void *value;
+
+  while( count < 20000000 ) {
+    gen_next( fiber, gen, &value );
+    count ++;
+  }
+  gen_free( gen );
+}
+
+int generator()
+{
+  scheduler_t *sched;
+  uint32_t t;
+
+  sched = sched_new();
+  fiber_start( sched, fiber_new( run_consumer, gen_new( sched, gen_numbers, NULL )));
+
+  sched_elapsed();
+  while( sched_numfibers( sched ) > 0 ) {
+    sched_cycle( sched, 0 );
+  }
+  t = sched_elapsed();
+  if ( t == 0 ) t = 1;
+
+  printf("Number of values         : %d\n", count);
+  printf("Values / second          : %d\n", 1000*(count/t));
+
+  return 0;
+}
+
+/* trivial requests served by a fiber each, or by a tasklet each */
+void run_request( fiber_t *fiber )
+{
+  count ++;
+}
+
+void done_request( fiber_t *fiber )
+{
+  free( fiber );
+}
+
+void run_request_tasklet( fiber_t *fiber )
+{
+  count ++;
+  tasklet_free( tasklet_self( fiber ));
+}
+
+int requests()
+{
+  scheduler_t *sched;
+  fiber_t *fiber;
+  uint32_t t;
+  int i, j;
+
+  sched = sched_new();
+
+  /* elapsed time is counted from the first call */
+  t = sched_elapsed();
+  for( i = 0; i < 10000; ++i ) {
+    for( j = 0; j < 100; ++j ) {
+      fiber = fiber_new( run_request, NULL );
+      fiber_set_done_func( fiber, done_request );
+      fiber_start( sched, fiber );
+    }
+    sched_cycle( sched, 0 );
+  }
+  t = sched_elapsed() - t;
+  if ( t == 0 ) t = 1;
+  printf("Fiber requests / second  : %d\n", 1000*(count/t));
+
+  count = 0;
+  t = sched_elapsed();
+  for( i = 0; i < 10000; ++i ) {
+    for( j = 0; j < 100; ++j ) {
+      tasklet_schedule( tasklet_new( sched, run_request_tasklet, NULL ));
+    }
+    sched_cycle( sched, 0 );
+  }
+  t = sched_elapsed() - t;
+  if ( t == 0 ) t = 1;
+  printf("Tasklet requests / second: %d\n", 1000*(count/t));
+
+  sched_free( sched );
+  return 0;
+}
+
+int main( int argc, char **argv )
 {
   scheduler_t *sched;
   fiber_t *fiber;
   uint32_t t;
   int i;
 
+  if ( argc > 1 && strcmp( argv[1], "pingpong" ) == 0 ) {
+    return pingpong( argv[1] );
+  }
+  if ( argc > 1 && strcmp( argv[1], "trace" ) == 0 ) {
+    return pingpong( argv[1] );
+  }
+  if ( argc > 1 && strcmp( argv[1], "recorder" ) == 0 ) {
+    return pingpong( argv[1] );
+  }
+  if ( argc > 1 && strcmp( argv[1], "events" ) == 0 ) {
+    return pingpong( argv[1] );
+  }
+  if ( argc > 1 && strcmp( argv[1], "slice" ) == 0 ) {
+    return slices();
+  }
+  if ( argc > 1 && strcmp( argv[1], "generator" ) == 0 ) {
+    return generator();
+  }
+  if ( argc > 1 && strcmp( argv[1], "tasklet" ) == 0 ) {
+    return requests();
+  }
+
   /* create scheduler */
   sched = sched_new();
   
@@ -21,21 +21,13 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
-
 #include "task.h"
+#include "generator.h"
 #include "logger.h"
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <stddef.h>
-
-// @todo: will go th header
-typedef struct channel channel_t;
-channel_t *channel_new( size_t szelem, size_t nbelem );
-void channel_free( channel_t *chan );
-void channel_send( fiber_t *fiber, channel_t *chan, char *data );
-void channel_recv( fiber_t *fiber, channel_t *chan, char *data );
-
+#include <stdint.h>
 
 /*
  * --------------------------------------------------------------------------
@@ -43,128 +35,43 @@ void channel_recv( fiber_t *fiber, channel_t *chan, char *data );
  * --------------------------------------------------------------------------
  */
 int done = 0;  /* becomes one when it's time to stop */
+int nprimes = 20;  /* number of primes to compute */
 
 /*
  * --------------------------------------------------------------------------
- *  Each fiber has a such a structure attached to it.
- *  'call_chan' is used to post work to the fiber
- *  When doing its work the fiber will post work to the 'source' fiber
- *  which will reply and return its result by posting it to the 'repl_chan'
+ *  Each filtering generator reads the integers of its 'source' generator
+ *  and drops the multiples of 'n'.
  * --------------------------------------------------------------------------
  */
 typedef struct {
-  channel_t *call_chan;   /* channel to use to post work to fiber */
-  channel_t *reply_chan;  /* channel used to return result of current call */
-  channel_t *return_chan; /* channel used by 'source' fiber to return 
-			   * its result. */
-  fiber_t   *source;      /* integer stream generator */
-  int        n;           /* used to filter output of 'source' */
-} extra_t;
-
-/*
- * --------------------------------------------------------------------------
- *  Cleanup
- * --------------------------------------------------------------------------
- */
-void generator_done( fiber_t *fiber )
-{
-  extra_t *extra = (extra_t*) fiber_get_extra(fiber);
-  channel_free( extra->call_chan );
-  channel_free( extra->return_chan );
-  free( extra );
-}
-
-/*
- * --------------------------------------------------------------------------
- *  Creates a generator
- * --------------------------------------------------------------------------
- */
-fiber_t *generator_new( fiber_t *source, pf_run_t task_func, int n)
-{
-  channel_t *return_chan;
-  channel_t *call_chan;
-  scheduler_t *sched;
-  fiber_t *fiber;
-  extra_t *extra;
-
-  if ( source != NULL ) {
-    sched = fiber_get_scheduler( source );
-    fatalif( sched == NULL, "scheduler null" );
-  }
-  else {
-    sched = sched_new();
-  }
- 
-  extra = (extra_t*) malloc( sizeof(extra_t) );
-  fatalif ( extra == NULL, "memory allocation error !\n");
-
-  extra->source = source;
-  extra->n = n;
-  extra->reply_chan = NULL;
-
-  return_chan = channel_new( sizeof(int), 1);
-  fatalif( return_chan == NULL, "memory allocation error !\n");
-  extra->return_chan = return_chan;
-  
-  call_chan = channel_new( sizeof(channel_t*), 1);
-  fatalif( call_chan == NULL, "memory allocation error !\n");  
-  extra->call_chan = call_chan;
-  
-  fiber = fiber_new( task_func, extra );
-  fatalif ( fiber == NULL, "memory allocation error !\n");
-
-  fiber_set_stack_size( fiber, 4096 );
-  fiber_set_done_func( fiber, generator_done );
-  fiber_start( sched, fiber );
-
-  return fiber;
-}
+  gen_t *source;          /* integer stream generator */
+  int    n;               /* used to filter output of 'source' */
+} filter_t;
 
 /*
  * --------------------------------------------------------------------------
- *  This function will return an integer by 'calling' the 'source'
- *  integer generator associated with fiber.
+ *  Creates a generator, the program stops if it fails
  * --------------------------------------------------------------------------
  */
-int next_integer( fiber_t *fiber )
+gen_t *generator_new( scheduler_t *sched, pf_gen_t func, void *arg )
 {
-  extra_t *xfiber  = (extra_t*) fiber_get_extra( fiber );
-  extra_t *xsource = (extra_t*) fiber_get_extra( xfiber->source );
-  int n = 0;
-  
-  /* send a pointer to the channel to use to send back result */
-  channel_send( fiber, xsource->call_chan, (char*) &xfiber->return_chan );
-
-  /* wait for answer and return it */
-  channel_recv( fiber, xfiber->return_chan, (char*) &n );
-  return n;
+  gen_t *gen = gen_new( sched, func, arg );
+  fatalif ( gen == NULL, "memory allocation error !\n");
+  return gen;
 }
 
 /*
  * --------------------------------------------------------------------------
- *  Block until another fiber asks 'fiber' to do some work
+ *  Returns the next integer generated by 'source'
  * --------------------------------------------------------------------------
  */
-int receive( fiber_t *fiber )
+int next_integer( fiber_t *fiber, gen_t *source )
 {
-  extra_t *extra = (extra_t*) fiber_get_extra(fiber);
-  extra->reply_chan = NULL;
-  channel_recv( fiber, extra->call_chan, (char*) &extra->reply_chan );
-  return (extra->reply_chan != NULL);
+  void *value = NULL;
+  gen_next( fiber, source, &value );
+  return (int) (intptr_t) value;
 }
 
-/*
- * --------------------------------------------------------------------------
- *  Sends an integer to the channel that was received
- * --------------------------------------------------------------------------
- */
-void send( fiber_t *fiber, int x )
-{
-  extra_t *extra = (extra_t*) fiber_get_extra(fiber);
-  channel_send( fiber, extra->reply_chan, (char*) &x);
-}
-
-
 /*
  * --------------------------------------------------------------------------
  *  Each time it gets 'called' this generator returns an integer
@@ -176,20 +83,19 @@ void send( fiber_t *fiber, int x )
  *  is returned it is a prime number.
  * --------------------------------------------------------------------------
  */
-void filter_by_factor_task( fiber_t *fiber )
+void *filter_by_factor_task( fiber_t *fiber, void *arg )
 {
-  extra_t *extra = (extra_t*) fiber_get_extra(fiber);
-  int x, n = extra->n;
-  /* wait for being called */
-  while( receive( fiber ) ) {
-    /* loop until we get a number not multiple of n */
-    do {
-      x = next_integer( fiber );
-      if ( x % n ) {
-	send( fiber, x );
-      }
-    } while( (x % n) == 0 );
+  filter_t filter = *(filter_t*) arg;
+  int x;
+
+  free( arg );
+  for(;;) {
+    x = next_integer( fiber, filter.source );
+    if ( x % filter.n ) {
+      gen_yield( fiber, (void*) (intptr_t) x );
+    }
   }
+  return NULL;
 }
 
 /*
@@ -197,13 +103,13 @@ void filter_by_factor_task( fiber_t *fiber )
  *  Simple generator that returns integers one by one
  * --------------------------------------------------------------------------
  */
-void all_numbers_task( fiber_t * fiber )
+void *all_numbers_task( fiber_t *fiber, void *arg )
 {
-  int x = 2;
-  /* wait for being called */
-  while( receive( fiber ) ) {
-    send( fiber, x++ );
+  intptr_t x = 2;
+  for(;;) {
+    gen_yield( fiber, (void*) x++ );
   }
+  return NULL;
 }
 
 /*
@@ -211,30 +117,38 @@ void all_numbers_task( fiber_t * fiber )
  *  This generator returns only prime numbers
  * --------------------------------------------------------------------------
  */
-void eratosthene_task( fiber_t *fiber )
+void *eratosthene_task( fiber_t *fiber, void *arg )
 {
-  extra_t *extra = (extra_t*) fiber_get_extra(fiber);
+  scheduler_t *sched = fiber_get_scheduler( fiber );
+  gen_t *source = (gen_t*) arg;
+  filter_t *filter;
   int n;
-  /* wait for being called */
-  while( receive( fiber ) ) {
-    n = next_integer( fiber );
-    send( fiber, n );
+
+  for(;;) {
+    n = next_integer( fiber, source );
+    gen_yield( fiber, (void*) (intptr_t) n );
     /* chain generator */
-    extra->source = generator_new( extra->source, filter_by_factor_task, n );
+    filter = (filter_t*) malloc( sizeof(filter_t) );
+    fatalif ( filter == NULL, "memory allocation error !\n");
+    filter->source = source;
+    filter->n = n;
+    source = generator_new( sched, filter_by_factor_task, filter );
   }
+  return NULL;
 }
 
 /*
  * --------------------------------------------------------------------------
- *  This task calls 20 times the eratosthene prime generator
- *  It will give the 20 first prime numbers
+ *  This task calls 'nprimes' times the eratosthene prime generator
+ *  It will give the 'nprimes' first prime numbers
  * --------------------------------------------------------------------------
  */
 void main_task( fiber_t *fiber )
 {
+  gen_t *sieve = (gen_t*) fiber_get_extra( fiber );
   int i;
-  for( i = 1; i <= 20; ++i ) {
-    printf("prime#%d = %d\n", i, next_integer( fiber ));
+  for( i = 1; i <= nprimes; ++i ) {
+    printf("prime#%d = %d\n", i, next_integer( fiber, sieve ));
   }
   /* tell it is the end */
   done = 1;
@@ -245,18 +159,27 @@ void main_task( fiber_t *fiber )
  *  Main program
  * --------------------------------------------------------------------------
  */
-int main()
+int main( int argc, char **argv )
 {
-  fiber_t *fmain, *fsieve, *fallnumbers;
+  gen_t *sieve, *allnumbers;
   scheduler_t *sched;
+  fiber_t *fmain;
 
-  /* create main tasks */
-  fallnumbers = generator_new( NULL, all_numbers_task, 0 );
-  fsieve      = generator_new( fallnumbers, eratosthene_task, 0 );
-  fmain       = generator_new( fsieve, main_task, 0 );
+  /* each prime found adds a filtering fiber */
+  if ( argc > 1 ) {
+    nprimes = atoi( argv[1] );
+    fatalif( nprimes < 1 || nprimes > MAXFIBERS - 4,
+	     "number of primes must be between 1 and %d\n", MAXFIBERS - 4 );
+  }
 
-  /* retrieve scheuler */
-  sched = fiber_get_scheduler( fallnumbers );
+  /* create main tasks */
+  sched = sched_new();
+  fatalif( sched == NULL, "memory allocation error !\n");
+  allnumbers = generator_new( sched, all_numbers_task, NULL );
+  sieve      = generator_new( sched, eratosthene_task, allnumbers );
+  fmain      = fiber_new( main_task, sieve );
+  fatalif ( fmain == NULL, "memory allocation error !\n");
+  fiber_start( sched, fmain );
 
   /* loop while main isn't finished */
   while( !done ) {
@@ -274,4 +197,3 @@ int main()
   
   return 0;
 }
-
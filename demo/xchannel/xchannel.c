@@ -0,0 +1,157 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Cross thread channel benchmark
+ *
+ *  Two threads run a scheduler each, pinned on two different cpus when
+ *  the machine has more than one. A fiber of the first scheduler sends
+ *  integers to a fiber of the second one through a xchannel.
+ *
+ *  Usage : xchannel [batch size] [spsc|mpsc]
+ * ----------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "task.h"
+#include "xchannel.h"
+
+#define NMSGS (20*1000*1000)
+#define BATCHMAX 1024
+#define SPINS 64
+
+static xchannel_t *chan;
+static size_t batch = 64;
+static volatile int finished = 0;
+
+/* --------------------------------------------------------------------------
+ *  Sending fiber
+ * --------------------------------------------------------------------------*/
+void producer( fiber_t *fiber )
+{
+  uint64_t msgs[BATCHMAX];
+  uint64_t n = 0;
+  size_t i;
+
+  while( n < NMSGS ) {
+    for( i = 0; i < batch; ++i ) msgs[i] = n + i;
+    if ( batch == 1 ) {
+      xchannel_send( fiber, chan, msgs, 0 );
+    }
+    else {
+      xchannel_send_batch( fiber, chan, msgs, batch, NULL, 0 );
+    }
+    n += batch;
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  Receiving fiber
+ * --------------------------------------------------------------------------*/
+void consumer( fiber_t *fiber )
+{
+  uint64_t msgs[BATCHMAX];
+  uint64_t expected = 0;
+  size_t i, k;
+
+  while( expected < NMSGS ) {
+    xchannel_recv_batch( fiber, chan, msgs, batch, &k, 0 );
+    for( i = 0; i < k; ++i ) {
+      if ( msgs[i] != expected++ ) {
+	fprintf( stderr, "bad sequence %lu\n", (unsigned long) msgs[i]);
+	exit(1);
+      }
+    }
+  }
+  finished = 1;
+}
+
+/* --------------------------------------------------------------------------
+ *  Thread running a scheduler with a single fiber
+ * --------------------------------------------------------------------------*/
+static void *thread( void *arg )
+{
+  scheduler_t *sched = sched_new();
+  fiber_t *fiber = fiber_new( (pf_run_t) arg, NULL );
+  static int ncpu = 0;
+  int cpu = __atomic_fetch_add( &ncpu, 1, __ATOMIC_RELAXED );
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int i;
+
+  if ( ncpus > 1 ) {
+    sched_set_cpus( sched, &cpu, 1 );
+  }
+  fiber_start( sched, fiber );
+  while( sched_numfibers( sched ) > 0 ) {
+    sched_cycle( sched, sched_elapsed() );
+    /* give the other thread a chance to wake up our fiber, then sleep
+     * until it does : a wake up while sleeping costs a system call */
+    for( i = 0; i < SPINS && sched_numfibers( sched ) > 0 &&
+	   sched_deadline( sched ) != 0; ++i ) {
+      if ( i == SPINS - 1 ) sched_poll( sched, UINT_MAX );
+      else if ( ncpus > 1 ) sched_yield();
+    }
+  }
+  sched_free( sched );
+  return NULL;
+}
+
+int main( int argc, char **argv )
+{
+  pthread_t tp, tc;
+  uint32_t t;
+  int mode = XCHANNEL_SPSC;
+
+  if ( argc > 1 ) {
+    batch = atoi( argv[1] );
+    if ( batch < 1 || batch > BATCHMAX || NMSGS % batch ) {
+      fprintf( stderr, "invalid batch size\n");
+      return 1;
+    }
+  }
+  if ( argc > 2 && strcmp( argv[2], "mpsc" ) == 0 ) {
+    mode = XCHANNEL_MPSC;
+  }
+  chan = xchannel_new( sizeof(uint64_t), 4096, mode );
+
+  sched_elapsed();
+  pthread_create( &tc, NULL, thread, consumer );
+  pthread_create( &tp, NULL, thread, producer );
+  pthread_join( tp, NULL );
+  pthread_join( tc, NULL );
+  t = sched_elapsed();
+  if ( t == 0 ) t = 1;
+  
+  printf("%s, batch %lu : %d messages in %u msec, %lu messages / second\n",
+	 (mode == XCHANNEL_SPSC) ? "spsc" : "mpsc", (unsigned long) batch,
+	 NMSGS, t, (unsigned long) ((uint64_t) NMSGS * 1000 / t));
+
+  xchannel_free( chan );
+  return 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Futures : values returned by functions run in their own fiber.
+ *
+ *  The future is the extra data of its fiber. The fiber stores the value
+ *  and fires the waiters of the future before leaving its run function, so
+ *  the awaiting fibers are scheduled through the run next slot and resume
+ *  in the same cycle. If the fiber is stopped before, its term function
+ *  marks the future as failed and wakes up the waiters. The fiber object
+ *  is owned by the future machinery and freed when the fiber is done.
+ * ----------------------------------------------------------------------------*/
+
+#include <string.h>
+
+#include "taskint.h"
+#include "future.h"
+
+struct future {
+  scheduler_t *sched;       /* scheduler the future was allocated from */
+  pf_future_t  func;        /* function computing the value */
+  void        *arg;         /* its argument */
+  void        *value;       /* value returned by 'func' */
+  int          state;       /* FUTURE_xxx */
+  waitq_t      queue;       /* fibers awaiting the future */
+};
+
+/* ----------------------------------------------------------------------------
+ * Complete a future and wake up all its waiters
+ * ----------------------------------------------------------------------------*/
+static void futureComplete( future_t *fut, int state )
+{
+  waiter_t *waiter;
+
+  fut->state = state;
+  while( (waiter = waitqFirst( &fut->queue )) != NULL ) {
+    waiterFire( waiter );
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Run function of the computing fiber
+ * ----------------------------------------------------------------------------*/
+static void futureRun( fiber_t *fiber )
+{
+  future_t *fut = (future_t*) fiber->extra;
+
+  fut->value = fut->func( fiber, fut->arg );
+  /* awaiting fibers may free the future before this fiber is done */
+  fiber->extra = NULL;
+  futureComplete( fut, fiber_canceled( fiber ) ? FUTURE_FAILED : FUTURE_READY );
+}
+
+/* ----------------------------------------------------------------------------
+ * Term function of the computing fiber : catches fibers stopped early
+ * ----------------------------------------------------------------------------*/
+static void futureTerm( fiber_t *fiber )
+{
+  future_t *fut = (future_t*) fiber->extra;
+
+  if ( fut != NULL ) {
+    fiber->extra = NULL;
+    futureComplete( fut, FUTURE_FAILED );
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Done function of the computing fiber : the fiber belongs to the future
+ * ----------------------------------------------------------------------------*/
+static void futureDone( fiber_t *fiber )
+{
+  schedMemFree( fiber->home, fiber );
+}
+
+/* ----------------------------------------------------------------------------
+ * Result of an await on a completed future
+ * ----------------------------------------------------------------------------*/
+static int futureResult( future_t *fut, void **value )
+{
+  if ( fut->state != FUTURE_READY ) {
+    return FIBER_ERROR;
+  }
+  if ( value != NULL ) {
+    *value = fut->value;
+  }
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  fiber_spawn_future --
+ * --------------------------------------------------------------------------*/
+future_t *fiber_spawn_future( scheduler_t *sched, pf_future_t func, void *arg )
+{
+  future_t *fut;
+  fiber_t *fiber;
+
+  if ( sched == NULL || func == NULL ) {
+    return NULL;
+  }
+  fut = (future_t*) schedMemAlloc( sched, sizeof(*fut));
+  if ( fut == NULL ) {
+    return NULL;
+  }
+  memset( fut, 0, sizeof(*fut));
+  fut->sched = sched;
+  fut->func = func;
+  fut->arg = arg;
+
+  fiber = sched_fiber_new( sched, futureRun, fut );
+  if ( fiber == NULL ) {
+    schedMemFree( sched, fut );
+    return NULL;
+  }
+  fiber->pf_term = futureTerm;
+  fiber->pf_done = futureDone;
+  if ( fiber_start( sched, fiber ) != FIBER_OK ) {
+    schedMemFree( sched, fiber );
+    schedMemFree( sched, fut );
+    return NULL;
+  }
+  return fut;
+}
+
+/* --------------------------------------------------------------------------
+ *  future_free --
+ * --------------------------------------------------------------------------*/
+int future_free( future_t *fut )
+{
+  if ( fut->state == FUTURE_PENDING ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  schedMemFree( fut->sched, fut );
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  future_state --
+ * --------------------------------------------------------------------------*/
+int future_state( future_t *fut )
+{
+  return fut->state;
+}
+
+/* --------------------------------------------------------------------------
+ *  future_value --
+ * --------------------------------------------------------------------------*/
+void *future_value( future_t *fut )
+{
+  return fut->value;
+}
+
+/* --------------------------------------------------------------------------
+ *  future_await --
+ * --------------------------------------------------------------------------*/
+int future_await( fiber_t *fiber, future_t *fut, uint32_t msec, void **value )
+{
+  int ret;
+
+  if ( fut->state == FUTURE_PENDING &&
+       (ret = fiberWaitQueue( fiber, &fut->queue, NULL, msec )) != FIBER_OK ) {
+    return ret;
+  }
+  return futureResult( fut, value );
+}
+
+/* --------------------------------------------------------------------------
+ *  future_await_all --
+ * --------------------------------------------------------------------------*/
+int future_await_all( fiber_t *fiber, future_t **futs, int n, uint32_t msec )
+{
+  uint32_t deadline, left = 0;
+  int i, err, ret = FIBER_OK;
+
+  if ( fiberCheckBlock( fiber ) != FIBER_OK ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  deadline = sched_timestamp( fiber->scheduler ) + msec;
+
+  for( i = 0; i < n; ++i ) {
+    if ( futs[i]->state == FUTURE_PENDING ) {
+      if ( msec > 0 ) {
+	left = deadline - sched_timestamp( fiber->scheduler );
+	if ( (int32_t) left <= 0 ) {
+	  return FIBER_TIMEOUT;
+	}
+      }
+      err = fiberWaitQueue( fiber, &futs[i]->queue, NULL, left );
+      if ( err != FIBER_OK ) {
+	return err;
+      }
+    }
+    if ( futs[i]->state != FUTURE_READY ) {
+      ret = FIBER_ERROR;
+    }
+  }
+  return ret;
+}
+
+/* --------------------------------------------------------------------------
+ *  future_await_any --
+ * --------------------------------------------------------------------------*/
+int future_await_any( fiber_t *fiber, future_t **futs, int n, uint32_t msec,
+		      int *index )
+{
+  int i, ret, fired = -1;
+
+  for( i = 0; i < n; ++i ) {
+    if ( futs[i]->state != FUTURE_PENDING ) {
+      fired = i;
+      break;
+    }
+  }
+
+  if ( fired < 0 && n > 0 ) {
+    waiter_t waiters[n];
+
+    if ( fiberCheckBlock( fiber ) != FIBER_OK ) {
+      return FIBER_ILLEGAL_STATE;
+    }
+
+    for( i = 0; i < n; ++i ) {
+      waiters[i].fiber = fiber;
+      waiters[i].data = NULL;
+      waiters[i].index = i;
+      waiters[i].fired = &fired;
+      waitqPush( &futs[i]->queue, &waiters[i] );
+    }
+    ret = fiberWaitOn( fiber, waiters, n, msec );
+    if ( ret != FIBER_OK ) {
+      return ret;
+    }
+  }
+  if ( fired < 0 ) {
+    return FIBER_TIMEOUT;
+  }
+
+  if ( index != NULL ) {
+    *index = fired;
+  }
+  return futureResult( futs[fired], NULL );
+}
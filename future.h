@@ -0,0 +1,139 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_FUTURE_H__
+#define __FIBER_FUTURE_H__
+
+#include "task.h"
+
+/* typedefs */
+typedef struct future future_t;
+
+/* function computing the value of a future */
+typedef void *(*pf_future_t)(fiber_t *fiber, void *arg);
+
+/* ---------------------------------------------------------------------------
+ *  Futures
+ *
+ *  A future holds the value returned by a function run in its own fiber.
+ *  The value is a pointer sized word stored inline in the future : small
+ *  results (integers cast to intptr_t...) need no extra allocation.
+ *
+ *  Fibers awaiting a future are parked on its wait queue and are woken up
+ *  by the computing fiber itself as soon as the value is available, they
+ *  usually run again within the same scheduler cycle.
+ *
+ *  Futures are not thread safe : the awaiting fibers must run in the
+ *  scheduler of the computing fiber.
+ * ---------------------------------------------------------------------------
+ */
+enum future_state_e
+  {
+   FUTURE_PENDING = 0,       /* function still running */
+   FUTURE_READY,             /* value available */
+   FUTURE_FAILED,            /* fiber stopped before returning a value,
+			      * or returning after being stopped */
+  };
+
+
+/* ---------------------------------------------------------------------------
+ * fiber_spawn_future --
+ *
+ * Creates a fiber in `sched' calling `func( fiber, arg )' and returns the
+ * future receiving its result. The fiber is started right away; its extra
+ * data is used by the future.
+ *
+ * Returns NULL on memory allocation failure or if the fiber can't be
+ * started.
+ * ---------------------------------------------------------------------------
+ */
+future_t *fiber_spawn_future( scheduler_t *sched, pf_future_t func, void *arg );
+
+
+/* ---------------------------------------------------------------------------
+ * future_free --
+ *
+ * Frees a future. It must not be pending and no fiber must await it.
+ *
+ * Returns FIBER_OK or FIBER_ILLEGAL_STATE if the future is still pending.
+ * ---------------------------------------------------------------------------
+ */
+int future_free( future_t *fut );
+
+
+/* ---------------------------------------------------------------------------
+ * future_state --
+ * future_value --
+ *
+ * Return the state of a future (FUTURE_xxx) and its value. The value is
+ * NULL until the future is ready.
+ * ---------------------------------------------------------------------------
+ */
+int future_state( future_t *fut );
+void *future_value( future_t *fut );
+
+
+/* ---------------------------------------------------------------------------
+ * future_await --
+ *
+ * Waits until `fut' is completed or until `msec' milliseconds elapsed,
+ * 0 means no timeout. The value is stored in `*value' if `value' is not
+ * NULL.
+ *
+ * Returns FIBER_OK, FIBER_TIMEOUT, FIBER_CANCELED if `fiber' is stopped
+ * while waiting or FIBER_ERROR if the computing fiber was stopped.
+ * ---------------------------------------------------------------------------
+ */
+int future_await( fiber_t *fiber, future_t *fut, uint32_t msec, void **value );
+
+
+/* ---------------------------------------------------------------------------
+ * future_await_all --
+ *
+ * Waits until the `n' futures of `futs' are completed, or until `msec'
+ * milliseconds elapsed.
+ *
+ * Returns FIBER_OK, FIBER_TIMEOUT, FIBER_CANCELED if `fiber' is stopped
+ * while waiting or FIBER_ERROR if one of the computing fibers was stopped.
+ * ---------------------------------------------------------------------------
+ */
+int future_await_all( fiber_t *fiber, future_t **futs, int n, uint32_t msec );
+
+
+/* ---------------------------------------------------------------------------
+ * future_await_any --
+ *
+ * Waits until one of the `n' futures of `futs' is completed or until `msec'
+ * milliseconds elapsed. The position of the first completed future is
+ * stored in `*index' if `index' is not NULL.
+ *
+ * Returns FIBER_OK, FIBER_TIMEOUT, FIBER_CANCELED if `fiber' is stopped
+ * while waiting or FIBER_ERROR if the completed future failed.
+ * ---------------------------------------------------------------------------
+ */
+int future_await_any( fiber_t *fiber, future_t **futs, int n, uint32_t msec,
+		      int *index );
+
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Generators : fibers producing values on demand.
+ *
+ *  The producer and the consumer are parked in turn and switch to each
+ *  other with fiberSwitch(). When one of them is not parked yet (the
+ *  producer before its first run, the consumer woken up at the end) the
+ *  other one falls back to a regular park and is woken up through the
+ *  run next slot.
+ * ----------------------------------------------------------------------------*/
+
+#include <string.h>
+
+#include "taskint.h"
+#include "generator.h"
+
+struct generator {
+  scheduler_t *sched;       /* scheduler the generator was allocated from */
+  pf_gen_t     func;        /* function producing the values */
+  void        *arg;         /* its argument */
+  fiber_t     *producer;    /* fiber running 'func', NULL once exhausted */
+  fiber_t     *consumer;    /* fiber waiting for a value */
+  void        *value;       /* last value yielded */
+};
+
+/* ----------------------------------------------------------------------------
+ * Hand over control to the other end of a generator
+ * Returns FIBER_OK or FIBER_CANCELED.
+ * ----------------------------------------------------------------------------*/
+static int genSwitch( fiber_t *fiber, fiber_t *peer )
+{
+  int ret = FIBER_ILLEGAL_STATE;
+
+  if ( peer != NULL ) {
+    ret = fiberSwitch( fiber, peer );
+  }
+  if ( ret == FIBER_ILLEGAL_STATE ) {
+    ret = fiberPark( fiber, 0, 0 );
+  }
+  return ret;
+}
+
+/* ----------------------------------------------------------------------------
+ * The generator is exhausted : wake up its consumer
+ * ----------------------------------------------------------------------------*/
+static void genEnd( gen_t *gen )
+{
+  gen->producer->extra = NULL;
+  gen->producer = NULL;
+  if ( gen->consumer != NULL ) {
+    schedWakeup( gen->consumer );
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Run function of the producing fiber
+ * ----------------------------------------------------------------------------*/
+static void genRun( fiber_t *fiber )
+{
+  gen_t *gen = (gen_t*) fiber->extra;
+  int ret = FIBER_OK;
+
+  /* wait for the first value to be requested
+   * the generator is gone if the fiber is stopped by gen_free() */
+  while( ret == FIBER_OK && gen->consumer == NULL ) {
+    ret = fiberPark( fiber, 0, 0 );
+  }
+  if ( ret == FIBER_OK ) {
+    gen->func( fiber, gen->arg );
+  }
+
+  /* the generator may have been freed meanwhile */
+  if ( fiber->extra != NULL ) {
+    genEnd( gen );
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Term function of the producing fiber : catches fibers stopped early
+ * ----------------------------------------------------------------------------*/
+static void genTerm( fiber_t *fiber )
+{
+  if ( fiber->extra != NULL ) {
+    genEnd( (gen_t*) fiber->extra );
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Done function of the producing fiber : the fiber belongs to the generator
+ * ----------------------------------------------------------------------------*/
+static void genDone( fiber_t *fiber )
+{
+  schedMemFree( fiber->home, fiber );
+}
+
+/* --------------------------------------------------------------------------
+ *  gen_new --
+ * --------------------------------------------------------------------------*/
+gen_t *gen_new( scheduler_t *sched, pf_gen_t func, void *arg )
+{
+  gen_t *gen;
+  fiber_t *fiber;
+
+  if ( sched == NULL || func == NULL ) {
+    return NULL;
+  }
+  gen = (gen_t*) schedMemAlloc( sched, sizeof(*gen));
+  if ( gen == NULL ) {
+    return NULL;
+  }
+  memset( gen, 0, sizeof(*gen));
+  gen->sched = sched;
+  gen->func = func;
+  gen->arg = arg;
+
+  fiber = sched_fiber_new( sched, genRun, gen );
+  if ( fiber == NULL ) {
+    schedMemFree( sched, gen );
+    return NULL;
+  }
+  fiber->pf_term = genTerm;
+  fiber->pf_done = genDone;
+  if ( fiber_start( sched, fiber ) != FIBER_OK ) {
+    schedMemFree( sched, fiber );
+    schedMemFree( sched, gen );
+    return NULL;
+  }
+  gen->producer = fiber;
+  return gen;
+}
+
+/* --------------------------------------------------------------------------
+ *  gen_free --
+ * --------------------------------------------------------------------------*/
+void gen_free( gen_t *gen )
+{
+  if ( gen->producer != NULL ) {
+    gen->producer->extra = NULL;
+    fiber_stop( gen->producer );
+  }
+  schedMemFree( gen->sched, gen );
+}
+
+/* --------------------------------------------------------------------------
+ *  gen_next --
+ * --------------------------------------------------------------------------*/
+int gen_next( fiber_t *fiber, gen_t *gen, void **value )
+{
+  int ret;
+
+  if ( gen->producer == NULL ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+
+  gen->consumer = fiber;
+  ret = genSwitch( fiber, gen->producer );
+  gen->consumer = NULL;
+
+  if ( ret != FIBER_OK ) {
+    return ret;
+  }
+
+  if ( gen->producer == NULL ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  if ( value != NULL ) {
+    *value = gen->value;
+  }
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  gen_yield --
+ * --------------------------------------------------------------------------*/
+int gen_yield( fiber_t *fiber, void *value )
+{
+  gen_t *gen = (gen_t*) fiber->extra;
+  int ret;
+
+  /* a producer yielding again after gen_free() ends here */
+  if ( fiber->flags & FIBER_F_CANCEL_SEEN ) {
+    fiberCancelPoint( fiber );
+  }
+  if ( gen == NULL || gen->producer != fiber ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  gen->value = value;
+  ret = genSwitch( fiber, gen->consumer );
+
+  /* wait for the next request */
+  while( ret == FIBER_OK && gen->consumer == NULL ) {
+    ret = fiberPark( fiber, 0, 0 );
+  }
+  return ret;
+}
@@ -0,0 +1,103 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_GENERATOR_H__
+#define __FIBER_GENERATOR_H__
+
+#include "task.h"
+
+/* typedefs */
+typedef struct generator gen_t;
+
+/* function producing the values of a generator */
+typedef void *(*pf_gen_t)(fiber_t *fiber, void *arg);
+
+/* ---------------------------------------------------------------------------
+ *  Generators
+ *
+ *  A generator is a fiber producing values on demand. The consumer calls
+ *  gen_next() which switches straight into the producer; the producer
+ *  calls gen_yield() which switches straight back to the consumer. The
+ *  scheduler is not involved and nothing is copied : each value is a
+ *  pointer sized word handed over in the generator.
+ *
+ *  Between two values the producer is parked, it costs nothing to the
+ *  scheduler. A generator has one consumer at a time, and both fibers must
+ *  run in the same scheduler.
+ * ---------------------------------------------------------------------------
+ */
+
+
+/* ---------------------------------------------------------------------------
+ * gen_new --
+ *
+ * Creates a generator whose values are produced by `func( fiber, arg )'
+ * running in a new fiber of `sched'. `func' only starts on the first call
+ * to gen_next(); the generator is exhausted when it returns. The extra
+ * data of the producing fiber is used by the generator.
+ *
+ * Returns NULL on memory allocation failure or if the fiber can't be
+ * started.
+ * ---------------------------------------------------------------------------
+ */
+gen_t *gen_new( scheduler_t *sched, pf_gen_t func, void *arg );
+
+
+/* ---------------------------------------------------------------------------
+ * gen_free --
+ *
+ * Frees a generator. Its fiber is stopped if it was not exhausted.
+ * ---------------------------------------------------------------------------
+ */
+void gen_free( gen_t *gen );
+
+
+/* ---------------------------------------------------------------------------
+ * gen_next --
+ *
+ * Switches to the producer of `gen' until it yields its next value, which
+ * is stored in `*value' if `value' is not NULL.
+ *
+ * Returns FIBER_OK, FIBER_NO_SUCH_FIBER if the generator is exhausted or
+ * FIBER_CANCELED if `fiber' is stopped while waiting.
+ * ---------------------------------------------------------------------------
+ */
+int gen_next( fiber_t *fiber, gen_t *gen, void **value );
+
+
+/* ---------------------------------------------------------------------------
+ * gen_yield --
+ *
+ * Called by the producing fiber : hands `value' over to the consumer and
+ * switches to it. Returns when the next value is requested.
+ *
+ * Returns FIBER_OK, FIBER_ILLEGAL_STATE if `fiber' is not the fiber of
+ * a generator or FIBER_CANCELED if it is stopped, for instance because
+ * the generator is freed. The producing function must return then.
+ * ---------------------------------------------------------------------------
+ */
+int gen_yield( fiber_t *fiber, void *value );
+
+
+#endif
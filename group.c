@@ -0,0 +1,221 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Fiber groups : fibers spawned and stopped together.
+ *
+ *  The members are chained through their onext/oprev links. A member leaves
+ *  the group from its done function, once it is removed from its scheduler :
+ *  the last one wakes up the fibers joining the group. A stop requested by
+ *  the group is told apart from a failure with the 'stopped' flag.
+ * ----------------------------------------------------------------------------*/
+
+#include <string.h>
+
+#include "taskint.h"
+#include "group.h"
+
+struct fiber_group {
+  scheduler_t *sched;       /* scheduler running the members */
+  fiber_t     *members;     /* first member */
+  int          count;       /* number of members */
+  int          error;       /* first failure or FIBER_OK */
+  int          stopped;     /* set when the members are stopped */
+  waitq_t      queue;       /* fibers joining the group */
+};
+
+/* ----------------------------------------------------------------------------
+ * Stop the members of a group but 'except'
+ * ----------------------------------------------------------------------------*/
+static void groupCancel( fiber_group_t *group, fiber_t *except )
+{
+  fiber_t *pf;
+
+  group->stopped = 1;
+  for( pf = group->members; pf != NULL; pf = pf->onext ) {
+    if ( pf == except ) {
+      continue;
+    }
+    if ( pf->state == FIBER_INIT ) {
+      /* never ran, like sched_stop() */
+      pf->state = FIBER_TERM;
+    }
+    else if ( pf->state < FIBER_TERM ) {
+      fiber_stop( pf );
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Done function of the members : the fiber leaves the group and is freed
+ * ----------------------------------------------------------------------------*/
+static void groupDone( fiber_t *fiber )
+{
+  fiber_group_t *group = fiber->group;
+  waiter_t *waiter;
+
+  /* stopped by someone else than the group */
+  if ( (fiber->flags & FIBER_F_CANCELED) && !group->stopped ) {
+    group->error = FIBER_CANCELED;
+    groupCancel( group, fiber );
+  }
+
+  if ( fiber->oprev ) {
+    fiber->oprev->onext = fiber->onext;
+  }
+  else {
+    group->members = fiber->onext;
+  }
+  if ( fiber->onext ) {
+    fiber->onext->oprev = fiber->oprev;
+  }
+
+  if ( --group->count == 0 ) {
+    while( (waiter = waitqFirst( &group->queue )) != NULL ) {
+      waiterFire( waiter );
+    }
+  }
+  schedMemFree( fiber->home, fiber );
+}
+
+/* --------------------------------------------------------------------------
+ *  group_new --
+ * --------------------------------------------------------------------------*/
+fiber_group_t *group_new( scheduler_t *sched )
+{
+  fiber_group_t *group;
+
+  if ( sched == NULL ) {
+    return NULL;
+  }
+  group = (fiber_group_t*) schedMemAlloc( sched, sizeof(*group));
+  if ( group == NULL ) {
+    return NULL;
+  }
+  memset( group, 0, sizeof(*group));
+  group->sched = sched;
+  return group;
+}
+
+/* --------------------------------------------------------------------------
+ *  group_free --
+ * --------------------------------------------------------------------------*/
+int group_free( fiber_group_t *group )
+{
+  if ( group->count > 0 ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  schedMemFree( group->sched, group );
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  group_spawn --
+ * --------------------------------------------------------------------------*/
+fiber_t *group_spawn( fiber_group_t *group, pf_run_t func, void *extra )
+{
+  fiber_t *fiber;
+
+  if ( group->stopped ) {
+    return NULL;
+  }
+  fiber = sched_fiber_new( group->sched, func, extra );
+  if ( fiber == NULL ) {
+    return NULL;
+  }
+  fiber->pf_done = groupDone;
+  fiber->group = group;
+  if ( fiber_start( group->sched, fiber ) != FIBER_OK ) {
+    schedMemFree( group->sched, fiber );
+    return NULL;
+  }
+
+  fiber->onext = group->members;
+  if ( group->members ) {
+    group->members->oprev = fiber;
+  }
+  group->members = fiber;
+  group->count ++;
+  return fiber;
+}
+
+/* --------------------------------------------------------------------------
+ *  group_join --
+ * --------------------------------------------------------------------------*/
+int group_join( fiber_t *fiber, fiber_group_t *group, uint32_t msec )
+{
+  int ret;
+
+  if ( fiber == NULL || fiber->group == group ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  if ( group->count > 0 ) {
+    ret = fiberWaitQueue( fiber, &group->queue, NULL, msec );
+    if ( ret != FIBER_OK ) {
+      return ret;
+    }
+  }
+  return ( group->error == FIBER_OK ) ? FIBER_OK : FIBER_ERROR;
+}
+
+/* --------------------------------------------------------------------------
+ *  group_stop --
+ * --------------------------------------------------------------------------*/
+void group_stop( fiber_group_t *group )
+{
+  groupCancel( group, NULL );
+}
+
+/* --------------------------------------------------------------------------
+ *  group_fail --
+ * --------------------------------------------------------------------------*/
+int group_fail( fiber_t *fiber, int err )
+{
+  fiber_group_t *group = fiber->group;
+
+  if ( group == NULL ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  if ( group->error == FIBER_OK ) {
+    group->error = ( err == FIBER_OK ) ? FIBER_ERROR : err;
+  }
+  groupCancel( group, fiber );
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  group_error --
+ * --------------------------------------------------------------------------*/
+int group_error( fiber_group_t *group )
+{
+  return group->error;
+}
+
+/* --------------------------------------------------------------------------
+ *  group_size --
+ * --------------------------------------------------------------------------*/
+int group_size( fiber_group_t *group )
+{
+  return group->count;
+}
@@ -0,0 +1,137 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_GROUP_H__
+#define __FIBER_GROUP_H__
+
+#include "task.h"
+
+/* typedefs */
+typedef struct fiber_group fiber_group_t;
+
+/* ---------------------------------------------------------------------------
+ *  Fiber groups
+ *
+ *  A group owns the fibers spawned into it : they are freed when they are
+ *  done and the group can't be freed while one of them is still running.
+ *  The members are linked in an intrusive list, stopping or joining a group
+ *  doesn't scan the scheduler.
+ *
+ *  A member fails when it calls group_fail() or when it is stopped from
+ *  outside the group. The first failure is recorded and the other members
+ *  are stopped : their waits return FIBER_CANCELED (see fiber_stop()).
+ *
+ *  Groups are not thread safe : the joining fibers must run in the
+ *  scheduler of the group.
+ * ---------------------------------------------------------------------------
+ */
+
+
+/* ---------------------------------------------------------------------------
+ * group_new --
+ *
+ * Allocates an empty group whose members will run in `sched'.
+ *
+ * Returns NULL on memory allocation failure.
+ * ---------------------------------------------------------------------------
+ */
+fiber_group_t *group_new( scheduler_t *sched );
+
+
+/* ---------------------------------------------------------------------------
+ * group_free --
+ *
+ * Frees a group. No fiber must be joining it.
+ *
+ * Returns FIBER_OK or FIBER_ILLEGAL_STATE if it still has members.
+ * ---------------------------------------------------------------------------
+ */
+int group_free( fiber_group_t *group );
+
+
+/* ---------------------------------------------------------------------------
+ * group_spawn --
+ *
+ * Creates a fiber running `func' with `extra' as extra data, adds it to
+ * `group' and starts it. The done function of the fiber is used by the
+ * group, the fiber must not be freed with fiber_free().
+ *
+ * Returns NULL on memory allocation failure, if the fiber can't be
+ * started or if the group was stopped.
+ * ---------------------------------------------------------------------------
+ */
+fiber_t *group_spawn( fiber_group_t *group, pf_run_t func, void *extra );
+
+
+/* ---------------------------------------------------------------------------
+ * group_join --
+ *
+ * Waits until all the members of `group' are done or until `msec'
+ * milliseconds elapsed, 0 means no timeout. A member can't join its own
+ * group.
+ *
+ * Returns FIBER_OK, FIBER_TIMEOUT, FIBER_CANCELED if `fiber' is stopped
+ * while waiting, FIBER_ERROR if a member failed or FIBER_ILLEGAL_STATE
+ * if `fiber' is a member of `group'.
+ * ---------------------------------------------------------------------------
+ */
+int group_join( fiber_t *fiber, fiber_group_t *group, uint32_t msec );
+
+
+/* ---------------------------------------------------------------------------
+ * group_stop --
+ *
+ * Stops all the members of `group' with fiber_stop(). Fibers can't be
+ * spawned in the group any more. It is not a failure.
+ * ---------------------------------------------------------------------------
+ */
+void group_stop( fiber_group_t *group );
+
+
+/* ---------------------------------------------------------------------------
+ * group_fail --
+ *
+ * Called by a member of a group to report a failure : `err' is recorded
+ * if it is the first failure of the group and the other members are
+ * stopped. The calling fiber keeps running.
+ *
+ * Returns FIBER_OK or FIBER_ILLEGAL_STATE if `fiber' is not a member
+ * of a group.
+ * ---------------------------------------------------------------------------
+ */
+int group_fail( fiber_t *fiber, int err );
+
+
+/* ---------------------------------------------------------------------------
+ * group_error, group_size --
+ *
+ * group_error() returns the first failure of `group', FIBER_OK if there
+ * was none. group_size() returns its number of members.
+ * ---------------------------------------------------------------------------
+ */
+int group_error( fiber_group_t *group );
+int group_size( fiber_group_t *group );
+
+
+#endif
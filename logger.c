@@ -29,41 +29,122 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
+#include "logger.h"
 
-enum log_level_e {
-  LOG_FATAL = 0,
-  LOG_ERROR,
-  LOG_WARN,
-  LOG_INFO,
-  LOG_DEBUG,
-  LOG_TRACE
+#define LOG_MAXARGS   16        /* arguments of a deferred message */
+#define LOG_MAXSTR    256       /* bytes kept of a string argument */
+#define LOG_MAXTEXT   1024      /* bytes kept of a formatted message */
+#define LOG_NFORMATS  64        /* formats parsed and cached per thread */
+#define LOG_MINRING   16384     /* smallest ring */
+#define LOG_OUTSIZE   65536     /* output batched per stream */
+#define LOG_WRAP      0xff      /* level of the padding at the end of a ring */
+
+/* how an argument is taken from the va_list */
+enum log_arg_e {
+  LOG_ARG_INT = 0,
+  LOG_ARG_LONG,
+  LOG_ARG_LLONG,
+  LOG_ARG_INTMAX,
+  LOG_ARG_SIZE,
+  LOG_ARG_PTRDIFF,
+  LOG_ARG_DOUBLE,
+  LOG_ARG_PTR,
+  LOG_ARG_STR
+};
+
+/* arguments of a format */
+struct logfmt {
+  const char *fmt;
+  int nargs;                    /* -1 : formatted at once */
+  uint8_t types[LOG_MAXARGS];   /* LOG_ARG_xxx */
+};
+
+/* a message in a ring : arguments follow the header then the strings they
+ * point to as offsets from the header. When 'fmt' is NULL, the text of the
+ * message follows instead. */
+struct logrec {
+  uint32_t size;                /* header included, multiple of 8 */
+  uint8_t  level;               /* LOG_xxx or LOG_WRAP */
+  uint8_t  nargs;
+  uint16_t unused;
+  uint64_t stamp;               /* see logStamp() */
+  const char *fmt;
+  uint64_t args[];
+};
+
+/* ring of a thread, written by the thread and read by log_async_flush() */
+struct logring {
+  struct logring *next;
+  char *buf;
+  uint64_t mask;                /* size - 1 */
+  uint64_t head;                /* bytes written */
+  uint64_t tail;                /* bytes read */
+  uint64_t lost;                /* messages dropped */
+  uint64_t reported;            /* lost messages already reported */
+  struct logfmt formats[LOG_NFORMATS];
+};
+
+/* output batched per stream */
+struct logout {
+  FILE *fout;
+  size_t len;
+  char buf[LOG_OUTSIZE];
 };
 
 /* --------------------------------------------------------------------------
  *  LOG level
  * --------------------------------------------------------------------------*/
-static uint8_t log_level = LOG_INFO;
+uint8_t log_level = LOG_INFO;
+
+/* --------------------------------------------------------------------------
+ *  Asynchronous logging state
+ * --------------------------------------------------------------------------*/
+static int log_async = 0;                 /* messages go to the rings */
+static unsigned log_gen = 0;              /* bumped by log_async_start() */
+static size_t log_ringsize;
+static struct logring *log_rings = NULL;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t log_thread;
+static int log_thread_on = 0;
+static int log_thread_stop = 0;
+static uint32_t log_period;
+static uint64_t log_stamp0, log_nsec0;    /* clocks when it started */
+static __thread struct logring *log_ring = NULL;
+static __thread unsigned log_ring_gen = 0;
+static struct logout log_stdout, log_stderr;
+
+/* --------------------------------------------------------------------------
+ *   Name of a level in the prefix
+ * --------------------------------------------------------------------------*/
+static const char *logLevelName( uint8_t level )
+{
+  switch(level) {
+  case LOG_FATAL: return " FATAL ";
+  case LOG_ERROR: return " ERROR ";
+  case LOG_WARN:  return " WARN  ";
+  case LOG_INFO:  return " INFO  ";
+  case LOG_DEBUG: return " DEBUG ";
+  case LOG_TRACE: return " TRACE ";
+  };
+  return "?????";
+}
 
 /* --------------------------------------------------------------------------
  *   Prefix for log messages
  * --------------------------------------------------------------------------*/
 void log_prefix( FILE *fout, uint8_t level)
 {
-  char *s = "?????";
+  const char *s = logLevelName( level );
   struct timeval tv;
   time_t nowtime;
   struct tm *nowtm;
   char tmbuf[64], buf[96];
-  
-  switch(level) {
-  case LOG_FATAL: s = " FATAL "; break;
-  case LOG_ERROR: s = " ERROR "; break;
-  case LOG_WARN:  s = " WARN  "; break;
-  case LOG_INFO:  s = " INFO  "; break;
-  case LOG_DEBUG: s = " DEBUG "; break;
-  case LOG_TRACE: s = " TRACE "; break;
-  };
 
   gettimeofday(&tv, NULL);
   nowtime = tv.tv_sec;
@@ -75,45 +156,553 @@ void log_prefix( FILE *fout, uint8_t level)
 }
 
 /* --------------------------------------------------------------------------
- *   information level
+ *   Time stamps : the time stamp counter when there is one, converted to
+ *   the real time when messages are written
  * --------------------------------------------------------------------------*/
-void info( const char *fmt, ...)
+static uint64_t logRealtime( void )
 {
-  va_list va;
-  if ( log_level >= LOG_INFO ) {
-    log_prefix( stdout, LOG_INFO );
-    va_start(va, fmt);
-    vfprintf( stdout, fmt, va);
-    va_end(va);
+  struct timespec ts;
+  clock_gettime( CLOCK_REALTIME, &ts );
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t logStamp( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return logRealtime();
+#endif
+}
+
+/* --------------------------------------------------------------------------
+ *   Parse the conversion specification following a '%'. Stores the type
+ *   of its argument and the number of '*' it has, returns its length or 0
+ *   if it can't be deferred.
+ * --------------------------------------------------------------------------*/
+static int logParseSpec( const char *p, int *type, int *nstars )
+{
+  static const uint8_t ints[] = { LOG_ARG_INT, LOG_ARG_LONG, LOG_ARG_LLONG,
+				  LOG_ARG_INTMAX, LOG_ARG_SIZE, LOG_ARG_PTRDIFF };
+  const char *s = p;
+  int len = 0, prec = 0;
+
+  *nstars = 0;
+  while( *s && strchr( "-+ #0'", *s ) ) s++;
+  if ( *s == '*' ) {
+    (*nstars)++;
+    s++;
+  }
+  while( *s >= '0' && *s <= '9' ) s++;
+  if ( *s == '.' ) {
+    prec = 1;
+    s++;
+    if ( *s == '*' ) {
+      (*nstars)++;
+      s++;
+    }
+    while( *s >= '0' && *s <= '9' ) s++;
+  }
+  switch( *s ) {
+  case 'h': s++; if ( *s == 'h' ) s++; break;
+  case 'l': s++; len = 1; if ( *s == 'l' ) { s++; len = 2; } break;
+  case 'j': s++; len = 3; break;
+  case 'z': s++; len = 4; break;
+  case 't': s++; len = 5; break;
   }
+  switch( *s ) {
+  case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+    *type = ints[len];
+    break;
+  case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+    if ( len > 1 ) return 0;
+    *type = LOG_ARG_DOUBLE;
+    break;
+  case 'p':
+    *type = LOG_ARG_PTR;
+    break;
+  case 's':
+    /* the string may not be terminated within the precision */
+    if ( len || prec ) return 0;
+    *type = LOG_ARG_STR;
+    break;
+  default:
+    return 0;
+  }
+  s++;
+  return ( s - p < 30 ) ? (int) (s - p) : 0;
 }
 
 /* --------------------------------------------------------------------------
- *   debug level
+ *   Types of the arguments of a format
  * --------------------------------------------------------------------------*/
-void debug( const char *fmt, ...)
+static void logParse( struct logfmt *f, const char *fmt )
 {
-  va_list va;
-  if ( log_level >= LOG_DEBUG ) {
-    log_prefix( stdout, LOG_DEBUG );
-    va_start(va, fmt);
-    vfprintf( stdout, fmt, va);
-    va_end(va);
+  const char *p = fmt;
+  int type, nstars, n, i;
+
+  f->fmt = fmt;
+  f->nargs = 0;
+  while( (p = strchr( p, '%' )) != NULL ) {
+    if ( p[1] == '%' ) {
+      p += 2;
+      continue;
+    }
+    n = logParseSpec( p+1, &type, &nstars );
+    if ( n == 0 || f->nargs + nstars + 1 > LOG_MAXARGS ) {
+      f->nargs = -1;
+      return;
+    }
+    for( i = 0; i < nstars; ++i ) {
+      f->types[f->nargs++] = LOG_ARG_INT;
+    }
+    f->types[f->nargs++] = (uint8_t) type;
+    p += n + 1;
   }
 }
 
 /* --------------------------------------------------------------------------
- *   trace level
+ *   Ring of the calling thread, allocated on its first message
  * --------------------------------------------------------------------------*/
-void trace( const char *fmt, ...)
+static struct logring *logRing( void )
 {
+  struct logring *r = log_ring;
+  unsigned gen = __atomic_load_n( &log_gen, __ATOMIC_ACQUIRE );
+
+  if ( r != NULL && log_ring_gen == gen ) {
+    return r;
+  }
+  r = (struct logring*) calloc( 1, sizeof(*r));
+  if ( r == NULL ) {
+    return NULL;
+  }
+  r->buf = (char*) malloc( log_ringsize );
+  if ( r->buf == NULL ) {
+    free( r );
+    return NULL;
+  }
+  r->mask = log_ringsize - 1;
+
+  pthread_mutex_lock( &log_lock );
+  r->next = log_rings;
+  log_rings = r;
+  pthread_mutex_unlock( &log_lock );
+
+  log_ring = r;
+  log_ring_gen = gen;
+  return r;
+}
+
+/* --------------------------------------------------------------------------
+ *   Room for 'size' bytes in a ring, NULL if it is full. '*adv' is set to
+ *   the bytes to publish, padding at the end of the ring included.
+ * --------------------------------------------------------------------------*/
+static struct logrec *logReserve( struct logring *r, size_t size, size_t *adv )
+{
+  uint64_t tail = __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE );
+  uint64_t pos = r->head & r->mask;
+  uint64_t pad = ( pos + size > r->mask + 1 ) ? r->mask + 1 - pos : 0;
+  struct logrec *rec;
+
+  if ( r->head + pad + size - tail > r->mask + 1 ) {
+    return NULL;
+  }
+  if ( pad > 0 ) {
+    rec = (struct logrec*) (r->buf + pos);
+    rec->size = (uint32_t) pad;
+    rec->level = LOG_WRAP;
+    pos = 0;
+  }
+  *adv = pad + size;
+  return (struct logrec*) (r->buf + pos);
+}
+
+/* --------------------------------------------------------------------------
+ *   Store a message in the ring of the calling thread
+ *   Returns -1 if there is no ring, 'va' is left untouched then.
+ * --------------------------------------------------------------------------*/
+static int logPush( uint8_t level, const char *fmt, va_list va )
+{
+  struct logring *r = logRing();
+  struct logfmt *f;
+  struct logrec *rec;
+  uint64_t args[LOG_MAXARGS];
+  const char *strs[LOG_MAXARGS];
+  size_t lens[LOG_MAXARGS];
+  char text[LOG_MAXTEXT];
+  size_t size, adv, off;
+  uint64_t stamp;
+  double d;
+  int i, n = 0;
+
+  if ( r == NULL ) {
+    return -1;
+  }
+  stamp = logStamp();
+  f = &r->formats[((uintptr_t) fmt >> 3) % LOG_NFORMATS];
+  if ( f->fmt != fmt ) {
+    logParse( f, fmt );
+  }
+
+  if ( f->nargs < 0 ) {
+    n = vsnprintf( text, sizeof(text), fmt, va );
+    if ( n < 0 ) {
+      n = 0;
+    }
+    else if ( n >= (int) sizeof(text) ) {
+      n = sizeof(text) - 1;
+    }
+    size = sizeof(*rec) + n + 1;
+  }
+  else {
+    size = sizeof(*rec) + f->nargs * sizeof(uint64_t);
+    for( i = 0; i < f->nargs; ++i ) {
+      switch( f->types[i] ) {
+      case LOG_ARG_INT:     args[i] = (uint64_t) va_arg( va, int ); break;
+      case LOG_ARG_LONG:    args[i] = (uint64_t) va_arg( va, long ); break;
+      case LOG_ARG_LLONG:   args[i] = (uint64_t) va_arg( va, long long ); break;
+      case LOG_ARG_INTMAX:  args[i] = (uint64_t) va_arg( va, intmax_t ); break;
+      case LOG_ARG_SIZE:    args[i] = (uint64_t) va_arg( va, size_t ); break;
+      case LOG_ARG_PTRDIFF: args[i] = (uint64_t) va_arg( va, ptrdiff_t ); break;
+      case LOG_ARG_PTR:     args[i] = (uintptr_t) va_arg( va, void* ); break;
+      case LOG_ARG_DOUBLE:
+	d = va_arg( va, double );
+	memcpy( &args[i], &d, sizeof(d));
+	break;
+      case LOG_ARG_STR:
+	strs[i] = va_arg( va, const char* );
+	if ( strs[i] == NULL ) {
+	  strs[i] = "(null)";
+	}
+	lens[i] = strnlen( strs[i], LOG_MAXSTR - 1 );
+	size += lens[i] + 1;
+	break;
+      }
+    }
+  }
+
+  /* a full ring drops the message : the thread never waits */
+  size = (size + 7) & ~7UL;
+  rec = logReserve( r, size, &adv );
+  if ( rec == NULL ) {
+    __atomic_store_n( &r->lost, r->lost + 1, __ATOMIC_RELAXED );
+    return 0;
+  }
+  rec->size = (uint32_t) size;
+  rec->level = level;
+  rec->stamp = stamp;
+  if ( f->nargs < 0 ) {
+    rec->fmt = NULL;
+    rec->nargs = 0;
+    memcpy( rec->args, text, n );
+    ((char*) rec->args)[n] = 0;
+  }
+  else {
+    rec->fmt = fmt;
+    rec->nargs = (uint8_t) f->nargs;
+    off = sizeof(*rec) + f->nargs * sizeof(uint64_t);
+    for( i = 0; i < f->nargs; ++i ) {
+      if ( f->types[i] == LOG_ARG_STR ) {
+	memcpy( (char*) rec + off, strs[i], lens[i] );
+	((char*) rec)[off + lens[i]] = 0;
+	args[i] = off;
+	off += lens[i] + 1;
+      }
+    }
+    memcpy( rec->args, args, f->nargs * sizeof(uint64_t));
+  }
+  __atomic_store_n( &r->head, r->head + adv, __ATOMIC_RELEASE );
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *   Format one argument of a deferred message
+ * --------------------------------------------------------------------------*/
+#define LOG_SNPRINTF(value)						\
+  ( nstars == 0 ? snprintf( out, room, spec, value ) :			\
+    nstars == 1 ? snprintf( out, room, spec, stars[0], value ) :	\
+    snprintf( out, room, spec, stars[0], stars[1], value ))
+
+static int logRenderArg( char *out, size_t room, const char *spec, int nstars,
+			 const int *stars, int type, uint64_t v, struct logrec *rec )
+{
+  double d;
+
+  switch( type ) {
+  case LOG_ARG_INT:     return LOG_SNPRINTF( (int) v );
+  case LOG_ARG_LONG:    return LOG_SNPRINTF( (long) v );
+  case LOG_ARG_LLONG:   return LOG_SNPRINTF( (long long) v );
+  case LOG_ARG_INTMAX:  return LOG_SNPRINTF( (intmax_t) v );
+  case LOG_ARG_SIZE:    return LOG_SNPRINTF( (size_t) v );
+  case LOG_ARG_PTRDIFF: return LOG_SNPRINTF( (ptrdiff_t) v );
+  case LOG_ARG_PTR:     return LOG_SNPRINTF( (void*) (uintptr_t) v );
+  case LOG_ARG_STR:     return LOG_SNPRINTF( (char*) rec + v );
+  case LOG_ARG_DOUBLE:
+    memcpy( &d, &v, sizeof(d));
+    return LOG_SNPRINTF( d );
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *   Text of a message
+ * --------------------------------------------------------------------------*/
+static size_t logRender( char *out, size_t room, struct logrec *rec )
+{
+  const char *p = rec->fmt;
+  char spec[32];
+  int type, nstars, stars[2], n, k, i = 0;
+  size_t o = 0;
+
+  if ( p == NULL ) {
+    return (size_t) snprintf( out, room, "%s", (char*) rec->args );
+  }
+  while( *p && o + 1 < room ) {
+    if ( *p != '%' ) {
+      out[o++] = *p++;
+      continue;
+    }
+    if ( p[1] == '%' ) {
+      out[o++] = '%';
+      p += 2;
+      continue;
+    }
+    n = logParseSpec( p+1, &type, &nstars ) + 1;
+    memcpy( spec, p, n );
+    spec[n] = 0;
+    for( k = 0; k < nstars; ++k ) {
+      stars[k] = (int) rec->args[i++];
+    }
+    k = logRenderArg( out + o, room - o, spec, nstars, stars, type, rec->args[i++], rec );
+    if ( k > 0 ) {
+      o += ( o + k < room ) ? (size_t) k : room - 1 - o;
+    }
+    p += n;
+  }
+  out[o] = 0;
+  return o;
+}
+
+/* --------------------------------------------------------------------------
+ *   Batched output
+ * --------------------------------------------------------------------------*/
+static void logOutFlush( struct logout *lo )
+{
+  if ( lo->len > 0 ) {
+    fwrite( lo->buf, 1, lo->len, lo->fout );
+    fflush( lo->fout );
+    lo->len = 0;
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *   Write a message with its prefix. The date is formatted once a second.
+ * --------------------------------------------------------------------------*/
+static void logWrite( uint8_t level, uint64_t nsec, struct logrec *rec, const char *text )
+{
+  static time_t last = (time_t) -1;
+  static char date[32];
+  struct logout *lo = ( level <= LOG_WARN ) ? &log_stderr : &log_stdout;
+  time_t sec = (time_t) (nsec / 1000000000ULL);
+  struct tm tm;
+  size_t room;
+  int n;
+
+  if ( sec != last ) {
+    localtime_r( &sec, &tm );
+    strftime( date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm );
+    last = sec;
+  }
+  if ( LOG_OUTSIZE - lo->len < LOG_MAXTEXT + 64 ) {
+    logOutFlush( lo );
+  }
+  room = LOG_OUTSIZE - lo->len;
+  n = snprintf( lo->buf + lo->len, room, "%s.%06lu - [%s] - ", date,
+		(unsigned long) (nsec % 1000000000ULL) / 1000, logLevelName( level ));
+  lo->len += n;
+  if ( rec != NULL ) {
+    lo->len += logRender( lo->buf + lo->len, LOG_MAXTEXT, rec );
+  }
+  else {
+    lo->len += snprintf( lo->buf + lo->len, LOG_MAXTEXT, "%s", text );
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *   Oldest message of a ring, NULL if it is empty
+ * --------------------------------------------------------------------------*/
+static struct logrec *logPeek( struct logring *r )
+{
+  uint64_t head = __atomic_load_n( &r->head, __ATOMIC_ACQUIRE );
+  struct logrec *rec;
+
+  while( r->tail != head ) {
+    rec = (struct logrec*) (r->buf + (r->tail & r->mask));
+    if ( rec->level != LOG_WRAP ) {
+      return rec;
+    }
+    __atomic_store_n( &r->tail, r->tail + rec->size, __ATOMIC_RELEASE );
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  log_async_flush --
+ * --------------------------------------------------------------------------*/
+void log_async_flush( void )
+{
+  struct logring *rings, *r, *best;
+  struct logrec *rec, *brec = NULL;
+  uint64_t s1, n1, lost;
+  char text[64];
+  double rate;
+
+  if ( pthread_mutex_trylock( &log_flush_lock )) {
+    return;
+  }
+  log_stdout.fout = stdout;
+  log_stderr.fout = stderr;
+
+  /* messages stamped after this are left for the next flush */
+  s1 = logStamp();
+  n1 = logRealtime();
+  rate = ( s1 > log_stamp0 ) ? (double) (n1 - log_nsec0) / (double) (s1 - log_stamp0) : 1.0;
+
+  /* rings are only added in front of the list */
+  pthread_mutex_lock( &log_lock );
+  rings = log_rings;
+  pthread_mutex_unlock( &log_lock );
+
+  /* merge the rings in time order */
+  for(;;) {
+    best = NULL;
+    for( r = rings; r != NULL; r = r->next ) {
+      rec = logPeek( r );
+      if ( rec != NULL && (best == NULL || (int64_t) (rec->stamp - brec->stamp) < 0) ) {
+	best = r;
+	brec = rec;
+      }
+    }
+    if ( best == NULL || (int64_t) (brec->stamp - s1) > 0 ) {
+      break;
+    }
+    logWrite( brec->level, n1 - (uint64_t) ((double) (s1 - brec->stamp) * rate), brec, NULL );
+    __atomic_store_n( &best->tail, best->tail + brec->size, __ATOMIC_RELEASE );
+  }
+
+  for( r = rings; r != NULL; r = r->next ) {
+    lost = __atomic_load_n( &r->lost, __ATOMIC_RELAXED );
+    if ( lost != r->reported ) {
+      snprintf( text, sizeof(text), "%lu log messages lost\n", (unsigned long) (lost - r->reported));
+      logWrite( LOG_WARN, n1, NULL, text );
+      r->reported = lost;
+    }
+  }
+
+  logOutFlush( &log_stdout );
+  logOutFlush( &log_stderr );
+  pthread_mutex_unlock( &log_flush_lock );
+}
+
+/* --------------------------------------------------------------------------
+ *   Thread flushing the rings periodically
+ * --------------------------------------------------------------------------*/
+static void *logThread( void *arg )
+{
+  struct timespec ts;
+
+  ts.tv_sec = log_period / 1000;
+  ts.tv_nsec = (log_period % 1000) * 1000000L;
+  while( !__atomic_load_n( &log_thread_stop, __ATOMIC_ACQUIRE )) {
+    log_async_flush();
+    nanosleep( &ts, NULL );
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  log_async_start --
+ * --------------------------------------------------------------------------*/
+int log_async_start( size_t ringsize, uint32_t period )
+{
+  struct timespec ts = { 0, 1000000 };
+  size_t sz = LOG_MINRING;
+
+  if ( log_async ) {
+    return -1;
+  }
+  while( sz < ringsize ) {
+    sz <<= 1;
+  }
+  log_ringsize = sz;
+
+  /* gives the time stamp counter rate a base of one millisecond at least */
+  log_stamp0 = logStamp();
+  log_nsec0 = logRealtime();
+  nanosleep( &ts, NULL );
+
+  log_period = period;
+  if ( period > 0 ) {
+    log_thread_stop = 0;
+    if ( pthread_create( &log_thread, NULL, logThread, NULL )) {
+      return -1;
+    }
+    log_thread_on = 1;
+  }
+  __atomic_store_n( &log_gen, log_gen + 1, __ATOMIC_RELEASE );
+  __atomic_store_n( &log_async, 1, __ATOMIC_RELEASE );
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  log_async_stop --
+ * --------------------------------------------------------------------------*/
+void log_async_stop( void )
+{
+  struct logring *r, *next;
+
+  if ( !log_async ) {
+    return;
+  }
+  __atomic_store_n( &log_async, 0, __ATOMIC_RELEASE );
+  if ( log_thread_on ) {
+    __atomic_store_n( &log_thread_stop, 1, __ATOMIC_RELEASE );
+    pthread_join( log_thread, NULL );
+    log_thread_on = 0;
+  }
+
+  /* waits for a flush from another thread to complete */
+  pthread_mutex_lock( &log_flush_lock );
+  pthread_mutex_unlock( &log_flush_lock );
+  log_async_flush();
+
+  pthread_mutex_lock( &log_lock );
+  for( r = log_rings; r != NULL; r = next ) {
+    next = r->next;
+    free( r->buf );
+    free( r );
+  }
+  log_rings = NULL;
+  pthread_mutex_unlock( &log_lock );
+}
+
+/* --------------------------------------------------------------------------
+ *   Message of any level, already filtered by the macros of logger.h
+ *   Errors and warnings go to stderr, the others to stdout.
+ * --------------------------------------------------------------------------*/
+void log_message( uint8_t level, const char *fmt, ...)
+{
+  FILE *fout = ( level <= LOG_WARN ) ? stderr : stdout;
   va_list va;
-  if ( log_level >= LOG_TRACE ) {
-    log_prefix( stdout, LOG_TRACE );
-    va_start(va, fmt);
-    vfprintf( stdout, fmt, va);
+
+  va_start(va, fmt);
+  if ( __atomic_load_n( &log_async, __ATOMIC_ACQUIRE ) && logPush( level, fmt, va ) == 0 ) {
     va_end(va);
+    return;
   }
+  log_prefix( fout, level );
+  vfprintf( fout, fmt, va);
+  va_end(va);
 }
 
 /* --------------------------------------------------------------------------
@@ -122,6 +711,9 @@ void trace( const char *fmt, ...)
 void fatal( const char *fmt, ...)
 {
   va_list va;
+  if ( log_async ) {
+    log_async_flush();
+  }
   log_prefix( stderr, LOG_FATAL );
   va_start(va, fmt);
   vfprintf( stderr, fmt, va);
@@ -136,6 +728,9 @@ void fatalif( int expr, const char *fmt, ...)
 {
   if ( expr ) {
     va_list va;
+    if ( log_async ) {
+      log_async_flush();
+    }
     log_prefix( stderr, LOG_FATAL );
     va_start(va, fmt);
     vfprintf( stderr, fmt, va);
@@ -158,30 +753,6 @@ void errorif( int expr, const char *fmt, ...)
   }
 }
 
-/* --------------------------------------------------------------------------
- *   error level
- * --------------------------------------------------------------------------*/
-void error( const char *fmt, ...)
-{
-  va_list va;
-  log_prefix( stderr, LOG_ERROR );
-  va_start(va, fmt);
-  vfprintf( stderr, fmt, va);
-  va_end(va);
-}
-
-/* --------------------------------------------------------------------------
- *   warning level
- * --------------------------------------------------------------------------*/
-void warn( const char *fmt, ...)
-{
-  va_list va;
-  log_prefix( stderr, LOG_WARN );
-  va_start(va, fmt);
-  vfprintf( stdout, fmt, va);
-  va_end(va);
-}
-
 /* --------------------------------------------------------------------------
  *   Sets the log level
  * --------------------------------------------------------------------------*/
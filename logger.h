@@ -1,6 +1,9 @@
 #ifndef __LIBFIBER_LOGGER_H__
 #define __LIBFIBER_LOGGER_H__
 
+#include <stdint.h>
+#include <stddef.h>
+
 enum log_level_e {
   LOG_FATAL = 0,
   LOG_ERROR,
@@ -10,13 +13,98 @@ enum log_level_e {
   LOG_TRACE
 };
 
+/* --------------------------------------------------------------------------
+ *  Messages more verbose than LOG_COMPILE_LEVEL are removed at compile
+ *  time, with the evaluation of their arguments. It defaults to LOG_TRACE,
+ *  or to LOG_INFO when NDEBUG is defined : build with
+ *  -DLOG_COMPILE_LEVEL=LOG_INFO to keep debug() and trace() out of the
+ *  scheduler hot paths.
+ *
+ *  The other messages are filtered at run time against the level given
+ *  to set_log_level(), before their arguments are evaluated.
+ * --------------------------------------------------------------------------*/
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL LOG_INFO
+#else
+#define LOG_COMPILE_LEVEL LOG_TRACE
+#endif
+#endif
+
+#ifndef unlikely
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#endif
+
+/* current level, see set_log_level() */
+extern uint8_t log_level;
+
+#define LOG_ENABLED(level)						\
+  ( (level) <= LOG_COMPILE_LEVEL && ( (level) <= LOG_INFO || unlikely( (level) <= log_level )))
+
+#define LOG_AT(level, ...)						\
+  do {									\
+    if ( LOG_ENABLED(level) ) {						\
+      log_message( (level), __VA_ARGS__ );				\
+    }									\
+  } while(0)
+
+#define info(...)  LOG_AT( LOG_INFO, __VA_ARGS__ )
+#define error(...) LOG_AT( LOG_ERROR, __VA_ARGS__ )
+#define warn(...)  LOG_AT( LOG_WARN, __VA_ARGS__ )
+#define debug(...) LOG_AT( LOG_DEBUG, __VA_ARGS__ )
+#define trace(...) LOG_AT( LOG_TRACE, __VA_ARGS__ )
+
 void set_log_level( uint8_t level);
-void fatal( const char *fmt, ...);
-void fatalif( int expr, const char *fmt, ...);
-void info( const char *fmt, ...);
-void error( const char *fmt, ...);
-void warn( const char *fmt, ...);
-void debug( const char *fmt, ...);
-void trace( const char *fmt, ...);
+void log_message( uint8_t level, const char *fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+void fatal( const char *fmt, ...)
+  __attribute__ ((format (printf, 1, 2), noreturn));
+void fatalif( int expr, const char *fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+/* --------------------------------------------------------------------------
+ *  Asynchronous logging
+ *
+ *  Once log_async_start() is called, a message is not formatted by the
+ *  thread logging it : its format pointer, its arguments (strings are
+ *  copied) and a time stamp counter value are stored in a ring of the
+ *  thread. log_async_flush() formats the messages of all the rings in
+ *  time order and writes them in batches. When a ring is full, messages
+ *  are dropped and counted rather than waited for.
+ *
+ *  Formats that can't be deferred (%n, %m, long double, wide strings,
+ *  strings with a precision, more than 16 arguments) are formatted at
+ *  once but still written by log_async_flush().
+ * --------------------------------------------------------------------------*/
+
+/* --------------------------------------------------------------------------
+ *  log_async_start --
+ *
+ *  Switches to asynchronous logging with rings of 'ringsize' bytes per
+ *  thread, rounded up to a power of two of 16k at least. If 'period' is
+ *  not 0, a thread calls log_async_flush() every 'period' milliseconds,
+ *  otherwise it must be called by the application, from a scheduler hook
+ *  for example.
+ *
+ *  Returns 0 or -1 if asynchronous logging is already on or the thread
+ *  can't be created.
+ * --------------------------------------------------------------------------*/
+int log_async_start( size_t ringsize, uint32_t period );
+
+/* --------------------------------------------------------------------------
+ *  log_async_flush --
+ *
+ *  Formats and writes the messages stored so far. It returns at once if
+ *  another thread is flushing.
+ * --------------------------------------------------------------------------*/
+void log_async_flush( void );
+
+/* --------------------------------------------------------------------------
+ *  log_async_stop --
+ *
+ *  Writes the pending messages and gets back to synchronous logging.
+ *  Other threads must not log meanwhile.
+ * --------------------------------------------------------------------------*/
+void log_async_stop( void );
 
 #endif
@@ -0,0 +1,311 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Node local memory for schedulers.
+ *
+ *  When a scheduler is bound to a NUMA node, the fiber stacks, the fiber
+ *  objects and the buffers allocated with sched_alloc() are taken from
+ *  memory that the kernel is asked to place on that node with mbind().
+ *
+ *  Small blocks are carved from 64k chunks and recycled through free lists,
+ *  one list per power of two size class. Bigger blocks and stacks are
+ *  mapped one by one.
+ *
+ *  If mbind() is not available or fails (single node machine, restricted
+ *  container...) the memory is still only touched by the thread running
+ *  the scheduler, so the first touch policy of the kernel places it on
+ *  the right node as long as the scheduler thread is pinned.
+ * ----------------------------------------------------------------------------*/
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <dirent.h>
+
+#include "taskint.h"
+
+/* size of the chunks small blocks are carved from */
+#define CHUNKSIZE (65536)
+
+/* header stored in front of each block returned by schedMemAlloc */
+typedef struct memhdr {
+  uint32_t  magic;          /* helps detecting bad pointers */
+  uint32_t  sclass;         /* size class, MEM_CLASS_MAP or MEM_CLASS_MALLOC */
+  size_t    size;           /* size of mapping for MEM_CLASS_MAP */
+} memhdr_t;
+
+#define MEM_MAGIC        0xf1be4a11
+#define MEM_CLASS_MAP    0xfe
+#define MEM_CLASS_MALLOC 0xff
+
+/* chunks are chained so that they can be unmapped with the scheduler */
+struct memchunk {
+  struct memchunk *next;
+};
+
+/* ----------------------------------------------------------------------------
+ * Page size rounding
+ * ----------------------------------------------------------------------------*/
+static size_t memRoundPage( size_t size )
+{
+  size_t pgsz = (size_t) sysconf(_SC_PAGESIZE);
+  return (size + pgsz - 1) & ~(pgsz - 1);
+}
+
+/* ----------------------------------------------------------------------------
+ * Map anonymous memory and ask the kernel to put it on 'node'.
+ * A failing mbind() is not an error, we rely on first touch in that case.
+ * ----------------------------------------------------------------------------*/
+static void *memMapOnNode( size_t size, int node )
+{
+  unsigned long mask[4];
+  void *p;
+
+  p = mmap( NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if ( p == MAP_FAILED ) {
+    return NULL;
+  }
+
+  if ( node >= 0 && node < (int) (8*sizeof(mask)) ) {
+    memset( mask, 0, sizeof(mask));
+    mask[node / (8*sizeof(unsigned long))] |= 1UL << (node % (8*sizeof(unsigned long)));
+    if ( syscall( SYS_mbind, p, size, MPOL_PREFERRED, mask, 8*sizeof(mask), 0) ) {
+      debug("mbind to node %d failed, relying on first touch.\n", node);
+    }
+  }
+  return p;
+}
+
+/* ----------------------------------------------------------------------------
+ * Size class of a request : 0 -> 32 bytes ... MEMCLASSES-1 -> 4096 bytes
+ * Returns -1 if the block must be mapped on its own.
+ * ----------------------------------------------------------------------------*/
+static int memClass( size_t size )
+{
+  size_t sz = 32;
+  int c;
+
+  size += sizeof(memhdr_t);
+  for( c = 0; c < MEMCLASSES; ++c, sz <<= 1 ) {
+    if ( size <= sz ) return c;
+  }
+  return -1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Refill the free list of a size class with a new chunk
+ * ----------------------------------------------------------------------------*/
+static int memRefill( scheduler_t *sched, int c )
+{
+  struct memchunk *chunk;
+  size_t bsz = (size_t) 32 << c;
+  char *p;
+
+  chunk = (struct memchunk*) memMapOnNode( CHUNKSIZE, sched->node );
+  if ( chunk == NULL ) {
+    return FIBER_MEMORY_ALLOCATION_ERROR;
+  }
+  chunk->next = sched->chunks;
+  sched->chunks = chunk;
+
+  /* first block is not used : it holds the chunk link
+   * and keeps the blocks aligned on their size */
+  for( p = (char*) chunk + bsz; p + bsz <= (char*) chunk + CHUNKSIZE; p += bsz ) {
+    *(void**) p = sched->freelists[c];
+    sched->freelists[c] = p;
+  }
+  return FIBER_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Allocate memory local to the scheduler node
+ * Falls back to malloc() when the scheduler is not bound to a node.
+ * ----------------------------------------------------------------------------*/
+void *schedMemAlloc( scheduler_t *sched, size_t size )
+{
+  memhdr_t *hdr;
+  int c;
+
+  if ( sched == NULL || sched->node < 0 ) {
+    hdr = (memhdr_t*) malloc( size + sizeof(memhdr_t));
+    if ( hdr == NULL ) return NULL;
+    hdr->sclass = MEM_CLASS_MALLOC;
+    hdr->size = size;
+  }
+  else if ( (c = memClass(size)) >= 0 ) {
+    if ( sched->freelists[c] == NULL && memRefill( sched, c ) != FIBER_OK ) {
+      return NULL;
+    }
+    hdr = (memhdr_t*) sched->freelists[c];
+    sched->freelists[c] = *(void**) hdr;
+    hdr->sclass = c;
+    hdr->size = size;
+  }
+  else {
+    size = memRoundPage( size + sizeof(memhdr_t) );
+    hdr = (memhdr_t*) memMapOnNode( size, sched->node );
+    if ( hdr == NULL ) return NULL;
+    hdr->sclass = MEM_CLASS_MAP;
+    hdr->size = size;
+  }
+  hdr->magic = MEM_MAGIC;
+  return (void*) (hdr + 1);
+}
+
+/* ----------------------------------------------------------------------------
+ * Release memory allocated with schedMemAlloc
+ * ----------------------------------------------------------------------------*/
+void schedMemFree( scheduler_t *sched, void *ptr )
+{
+  memhdr_t *hdr;
+  uint32_t c;
+
+  if ( ptr == NULL ) {
+    return;
+  }
+  hdr = ((memhdr_t*) ptr) - 1;
+  if ( hdr->magic != MEM_MAGIC ) {
+    error("schedMemFree : bad pointer %p\n", ptr);
+    return;
+  }
+  hdr->magic = 0;
+
+  switch( hdr->sclass ) {
+  case MEM_CLASS_MALLOC:
+    free( hdr );
+    break;
+  case MEM_CLASS_MAP:
+    munmap( hdr, hdr->size );
+    break;
+  default:
+    c = hdr->sclass;
+    if ( sched == NULL || c >= MEMCLASSES ) {
+      error("schedMemFree : block %p doesn't belong to a scheduler\n", ptr);
+      return;
+    }
+    *(void**) hdr = sched->freelists[c];
+    sched->freelists[c] = hdr;
+    break;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Release all the chunks of a scheduler
+ * ----------------------------------------------------------------------------*/
+void schedMemRelease( scheduler_t *sched )
+{
+  struct memchunk *chunk, *next;
+
+  for( chunk = sched->chunks; chunk; chunk = next ) {
+    next = chunk->next;
+    munmap( chunk, CHUNKSIZE );
+  }
+  sched->chunks = NULL;
+  memset( sched->freelists, 0, sizeof(sched->freelists));
+}
+
+/* ----------------------------------------------------------------------------
+ * Allocate the stack of a fiber.
+ * Stacks of fibers attached to a bound scheduler are mapped on its node.
+ * ----------------------------------------------------------------------------*/
+int schedStackAlloc( scheduler_t *sched, fiber_t *fiber )
+{
+  if ( sched->node >= 0 ) {
+    fiber->stacksz = memRoundPage( fiber->stacksz );
+    fiber->stack = memMapOnNode( fiber->stacksz, sched->node );
+    fiber->flags |= FIBER_F_MAPPED_STACK;
+  }
+  else {
+    fiber->stack = malloc( fiber->stacksz );
+    fiber->flags &= ~FIBER_F_MAPPED_STACK;
+  }
+  if ( fiber->stack == NULL ) {
+    return FIBER_MEMORY_ALLOCATION_ERROR;
+  }
+  return FIBER_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Free the stack of a fiber
+ * ----------------------------------------------------------------------------*/
+void schedStackFree( fiber_t *fiber )
+{
+  if ( fiber->stack == NULL ) {
+    return;
+  }
+  if ( fiber->flags & FIBER_F_MAPPED_STACK ) {
+    munmap( fiber->stack, fiber->stacksz );
+  }
+  else {
+    free( fiber->stack );
+  }
+  fiber->stack = NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Find the NUMA node a cpu belongs to looking in sysfs.
+ * Returns -1 if unknown.
+ * ----------------------------------------------------------------------------*/
+int schedCpuNode( int cpu )
+{
+  char path[64];
+  struct dirent *de;
+  DIR *dir;
+  int node = -1;
+
+  snprintf( path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  dir = opendir( path );
+  if ( dir == NULL ) {
+    return -1;
+  }
+  while( (de = readdir(dir)) != NULL ) {
+    if ( strncmp( de->d_name, "node", 4) == 0 &&
+	 sscanf( de->d_name + 4, "%d", &node) == 1 ) {
+      break;
+    }
+  }
+  closedir( dir );
+  return node;
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_alloc --
+ * --------------------------------------------------------------------------*/
+void *sched_alloc( scheduler_t *sched, size_t size )
+{
+  return schedMemAlloc( sched, size );
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_release --
+ * --------------------------------------------------------------------------*/
+void sched_release( scheduler_t *sched, void *ptr )
+{
+  schedMemFree( sched, ptr );
+}
@@ -0,0 +1,320 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Worker pools : long lived fibers running queued jobs.
+ *
+ *  Idle workers are parked on a wait queue, a submitted job fires the first
+ *  of them. Job cells are recycled through a free list so that a submission
+ *  doesn't allocate once the pool is warm. The workers are chained through
+ *  their onext/oprev links so that they can be stopped together.
+ * ----------------------------------------------------------------------------*/
+
+#include <string.h>
+
+#include "taskint.h"
+#include "pool.h"
+
+struct pool_job {
+  struct pool_job *next;
+  pf_job_t         func;
+  void            *arg;
+};
+
+struct fiber_pool {
+  scheduler_t     *sched;     /* scheduler running the workers */
+  int              min;       /* workers kept when idle */
+  int              max;       /* maximum number of workers */
+  uint32_t         idle_msec; /* idle time before a worker above 'min' leaves */
+  int              stopped;   /* set by pool_stop() */
+  fiber_t         *workers;   /* first worker */
+  int              nworkers;  /* number of workers */
+  int              nidle;     /* number of workers parked on 'idleq' */
+  waitq_t          idleq;     /* idle workers */
+  struct pool_job *head;      /* queued jobs, oldest first */
+  struct pool_job *tail;
+  struct pool_job *free;      /* recycled job cells */
+  int              backlog;   /* number of queued jobs */
+  int              max_backlog;
+  uint64_t         submitted;
+  uint64_t         completed;
+};
+
+static int poolSpawn( fiber_pool_t *pool );
+
+/* ----------------------------------------------------------------------------
+ * A worker leaves the pool. It is done as soon as the worker decides to
+ * quit so that the idle workers timing out together see each other leave.
+ * A worker stopped while running a job is replaced.
+ * ----------------------------------------------------------------------------*/
+static void poolLeave( fiber_t *fiber )
+{
+  fiber_pool_t *pool = fiber->pool;
+
+  if ( fiber->oprev ) {
+    fiber->oprev->onext = fiber->onext;
+  }
+  else {
+    pool->workers = fiber->onext;
+  }
+  if ( fiber->onext ) {
+    fiber->onext->oprev = fiber->oprev;
+  }
+  fiber->onext = fiber->oprev = NULL;
+  fiber->pool = NULL;
+  pool->nworkers --;
+
+  if ( !pool->stopped && pool->head != NULL && pool->nworkers < pool->max ) {
+    poolSpawn( pool );
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Run function of the workers
+ * ----------------------------------------------------------------------------*/
+static void poolWorker( fiber_t *fiber )
+{
+  fiber_pool_t *pool = fiber->pool;
+  struct pool_job *job;
+  pf_job_t func;
+  void *arg;
+  int ret;
+
+  for(;;) {
+    /* a worker stopped while running a job which didn't notice it quits */
+    while( !fiber_canceled( fiber ) && (job = pool->head) != NULL ) {
+      pool->head = job->next;
+      if ( pool->head == NULL ) {
+	pool->tail = NULL;
+      }
+      pool->backlog --;
+      func = job->func;
+      arg = job->arg;
+      job->next = pool->free;
+      pool->free = job;
+
+      fiber->extra = arg;
+      func( fiber, arg );
+      fiber->extra = NULL;
+      pool->completed ++;
+    }
+    if ( pool->stopped || fiber_canceled( fiber ) ) {
+      break;
+    }
+
+    /* wait for the next job */
+    pool->nidle ++;
+    ret = fiberWaitQueue( fiber, &pool->idleq, NULL,
+			  (pool->nworkers > pool->min) ? pool->idle_msec : 0 );
+    pool->nidle --;
+    if ( ret == FIBER_CANCELED ) {
+      break;
+    }
+    if ( ret == FIBER_TIMEOUT && pool->head == NULL &&
+	 pool->nworkers > pool->min ) {
+      break;
+    }
+  }
+
+  poolLeave( fiber );
+}
+
+/* ----------------------------------------------------------------------------
+ * Done function of the workers : the fiber belongs to the pool
+ * ----------------------------------------------------------------------------*/
+static void poolDone( fiber_t *fiber )
+{
+  /* terminated without returning from poolWorker() */
+  if ( fiber->pool != NULL ) {
+    poolLeave( fiber );
+  }
+  schedMemFree( fiber->home, fiber );
+}
+
+/* ----------------------------------------------------------------------------
+ * Start a new worker
+ * ----------------------------------------------------------------------------*/
+static int poolSpawn( fiber_pool_t *pool )
+{
+  fiber_t *fiber;
+
+  fiber = sched_fiber_new( pool->sched, poolWorker, NULL );
+  if ( fiber == NULL ) {
+    return FIBER_MEMORY_ALLOCATION_ERROR;
+  }
+  fiber->pf_done = poolDone;
+  fiber->pool = pool;
+  if ( fiber_start( pool->sched, fiber ) != FIBER_OK ) {
+    schedMemFree( pool->sched, fiber );
+    return FIBER_TOO_MANY_FIBERS;
+  }
+
+  fiber->onext = pool->workers;
+  if ( pool->workers ) {
+    pool->workers->oprev = fiber;
+  }
+  pool->workers = fiber;
+  pool->nworkers ++;
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  pool_new --
+ * --------------------------------------------------------------------------*/
+fiber_pool_t *pool_new( scheduler_t *sched, int min, int max, uint32_t idle_msec )
+{
+  fiber_pool_t *pool;
+
+  if ( sched == NULL || max <= 0 || min < 0 || min > max ) {
+    return NULL;
+  }
+  pool = (fiber_pool_t*) schedMemAlloc( sched, sizeof(*pool));
+  if ( pool == NULL ) {
+    return NULL;
+  }
+  memset( pool, 0, sizeof(*pool));
+  pool->sched = sched;
+  pool->min = min;
+  pool->max = max;
+  pool->idle_msec = idle_msec;
+
+  while( pool->nworkers < min ) {
+    if ( poolSpawn( pool ) != FIBER_OK ) {
+      /* the workers started free themselves */
+      pool_stop( pool );
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+/* --------------------------------------------------------------------------
+ *  pool_free --
+ * --------------------------------------------------------------------------*/
+int pool_free( fiber_pool_t *pool )
+{
+  struct pool_job *job;
+
+  if ( pool->nworkers > 0 ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  while( (job = pool->free) != NULL ) {
+    pool->free = job->next;
+    schedMemFree( pool->sched, job );
+  }
+  schedMemFree( pool->sched, pool );
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  pool_submit --
+ * --------------------------------------------------------------------------*/
+int pool_submit( fiber_pool_t *pool, pf_job_t func, void *arg )
+{
+  struct pool_job *job;
+  waiter_t *waiter;
+
+  if ( pool->stopped ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+
+  job = pool->free;
+  if ( job != NULL ) {
+    pool->free = job->next;
+  }
+  else {
+    job = (struct pool_job*) schedMemAlloc( pool->sched, sizeof(*job));
+    if ( job == NULL ) {
+      return FIBER_MEMORY_ALLOCATION_ERROR;
+    }
+  }
+  job->func = func;
+  job->arg = arg;
+  job->next = NULL;
+  if ( pool->tail ) {
+    pool->tail->next = job;
+  }
+  else {
+    pool->head = job;
+  }
+  pool->tail = job;
+  pool->submitted ++;
+  if ( ++pool->backlog > pool->max_backlog ) {
+    pool->max_backlog = pool->backlog;
+  }
+
+  /* hand it over to an idle worker, or grow the pool */
+  if ( (waiter = waitqFirst( &pool->idleq )) != NULL ) {
+    waiterFire( waiter );
+  }
+  else if ( pool->nworkers < pool->max ) {
+    /* if it fails the job waits for a busy worker */
+    poolSpawn( pool );
+  }
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  pool_stop --
+ * --------------------------------------------------------------------------*/
+int pool_stop( fiber_pool_t *pool )
+{
+  struct pool_job *job;
+  fiber_t *pf;
+  int n = 0;
+
+  pool->stopped = 1;
+  while( (job = pool->head) != NULL ) {
+    pool->head = job->next;
+    job->next = pool->free;
+    pool->free = job;
+    ++n;
+  }
+  pool->tail = NULL;
+  pool->backlog = 0;
+
+  for( pf = pool->workers; pf != NULL; pf = pf->onext ) {
+    if ( pf->state == FIBER_INIT ) {
+      /* never ran, like sched_stop() */
+      pf->state = FIBER_TERM;
+    }
+    else if ( pf->state < FIBER_TERM ) {
+      fiber_stop( pf );
+    }
+  }
+  return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  pool_get_stats --
+ * --------------------------------------------------------------------------*/
+void pool_get_stats( fiber_pool_t *pool, pool_stats_t *stats )
+{
+  stats->workers = pool->nworkers;
+  stats->idle = pool->nidle;
+  stats->backlog = pool->backlog;
+  stats->max_backlog = pool->max_backlog;
+  stats->submitted = pool->submitted;
+  stats->completed = pool->completed;
+}
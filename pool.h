@@ -0,0 +1,127 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_POOL_H__
+#define __FIBER_POOL_H__
+
+#include "task.h"
+
+/* typedefs */
+typedef struct fiber_pool fiber_pool_t;
+
+/* function run by a worker for each job */
+typedef void (*pf_job_t)(fiber_t *fiber, void *arg);
+
+/* ---------------------------------------------------------------------------
+ *  Worker pools
+ *
+ *  A pool is a set of long lived worker fibers running jobs, a function
+ *  and its argument, taken from a FIFO queue local to the scheduler.
+ *  Submitting a job to an idle pool costs a queue push and one switch :
+ *  the woken up worker runs right after the submitting fiber gives back
+ *  the processor. No fiber is created or booted.
+ *
+ *  The pool keeps at least `min' workers. It grows up to `max' workers when
+ *  all of them are busy; above `min', a worker idle for `idle_msec'
+ *  milliseconds leaves the pool. A worker that is stopped while running
+ *  a job leaves the pool too, it is replaced if jobs are waiting.
+ *
+ *  While it runs a job, the extra data of a worker is the argument of the
+ *  job : functions written for a fiber of their own can be used as jobs.
+ *
+ *  Pools are not thread safe : jobs must be submitted from the thread
+ *  running the scheduler of the pool.
+ * ---------------------------------------------------------------------------
+ */
+
+/* pool metrics, see pool_get_stats() */
+typedef struct pool_stats {
+  int      workers;         /* worker fibers */
+  int      idle;            /* workers waiting for a job */
+  int      backlog;         /* jobs waiting for a worker */
+  int      max_backlog;     /* highest backlog seen */
+  uint64_t submitted;       /* jobs submitted */
+  uint64_t completed;       /* jobs which returned */
+} pool_stats_t;
+
+
+/* ---------------------------------------------------------------------------
+ * pool_new --
+ *
+ * Allocates a pool whose workers run in `sched' and starts its `min'
+ * first workers. `idle_msec' = 0 means that workers never leave the pool.
+ *
+ * Returns NULL on memory allocation failure, or if `max' is not positive
+ * or is less than `min'.
+ * ---------------------------------------------------------------------------
+ */
+fiber_pool_t *pool_new( scheduler_t *sched, int min, int max, uint32_t idle_msec );
+
+
+/* ---------------------------------------------------------------------------
+ * pool_free --
+ *
+ * Frees a pool. Its workers must be gone : see pool_stop().
+ *
+ * Returns FIBER_OK or FIBER_ILLEGAL_STATE if some workers are left.
+ * ---------------------------------------------------------------------------
+ */
+int pool_free( fiber_pool_t *pool );
+
+
+/* ---------------------------------------------------------------------------
+ * pool_submit --
+ *
+ * Queues a job running `func( worker, arg )' and wakes up an idle worker,
+ * or starts a new one if none is idle and the pool is not full.
+ *
+ * Returns FIBER_OK, FIBER_MEMORY_ALLOCATION_ERROR or FIBER_ILLEGAL_STATE
+ * if the pool was stopped.
+ * ---------------------------------------------------------------------------
+ */
+int pool_submit( fiber_pool_t *pool, pf_job_t func, void *arg );
+
+
+/* ---------------------------------------------------------------------------
+ * pool_stop --
+ *
+ * Stops all the workers with fiber_stop() and discards the jobs which
+ * were not started. Jobs can't be submitted any more.
+ *
+ * Returns the number of jobs discarded.
+ * ---------------------------------------------------------------------------
+ */
+int pool_stop( fiber_pool_t *pool );
+
+
+/* ---------------------------------------------------------------------------
+ * pool_get_stats --
+ *
+ * Fills `stats' with the current metrics of `pool'.
+ * ---------------------------------------------------------------------------
+ */
+void pool_get_stats( fiber_pool_t *pool, pool_stats_t *stats );
+
+
+#endif
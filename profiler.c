@@ -0,0 +1,435 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Sampling profiler : a cpu time timer of the scheduler thread interrupts
+ *  it with SIGPROF, the handler records the running fiber and a backtrace
+ *  in a buffer allocated at start. Samples are symbolized and folded only
+ *  when they are dumped.
+ * ----------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "taskint.h"
+#include "profiler.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* samples of the profiler taken while no fiber runs */
+#define PROFILE_NO_FIBER UINT32_MAX
+
+/* a sample of the profiler */
+struct profile_sample {
+  const char *tag;          /* tag of the fiber */
+  pf_run_t run;             /* its run function */
+  uint32_t fid;             /* its id or PROFILE_NO_FIBER */
+  uint32_t nframes;
+  void *frames[FIBER_PROFILE_DEPTH]; /* innermost first */
+};
+
+/* sampling profiler of a scheduler */
+struct profiler {
+  struct profile_sample *samples;
+  size_t n, max;            /* samples taken, room for */
+  uint64_t lost;            /* samples dropped once full */
+  uint32_t hz;              /* samples per second of cpu time */
+  int stopped;              /* sched_profile_stop() was called */
+  int armed;                /* 'timer' was created */
+  timer_t timer;            /* cpu time timer of the scheduler thread */
+};
+
+/* scheduler whose cycle runs on this thread, for the signal handler */
+static __thread scheduler_t *profiledSched = NULL;
+
+/* ----------------------------------------------------------------------------
+ * Signal handler : runs on the scheduler thread, a fiber or the scheduler
+ * interrupted. Writes one sample in the buffer allocated at start.
+ * ----------------------------------------------------------------------------*/
+static void schedProfileSignal( int sig )
+{
+  scheduler_t *sched = profiledSched;
+  struct profiler *prof;
+  struct profile_sample *sample;
+  struct stack_frames sf;
+  fiber_t *fiber;
+  int saved = errno;
+
+  if ( sched == NULL || (prof = sched->prof) == NULL || prof->stopped ) {
+    return;
+  }
+  if ( prof->n == prof->max ) {
+    prof->lost ++;
+    return;
+  }
+  sample = &prof->samples[prof->n];
+  fiber = sched->running;
+  sample->fid = fiber ? fiber->fid : PROFILE_NO_FIBER;
+  sample->run = fiber ? fiber->pf_run : NULL;
+  sample->tag = fiber ? fiber->tag : NULL;
+
+  /* tasklets run on the scheduler stack */
+  if ( fiber != NULL && !(fiber->flags & FIBER_F_STACKLESS) ) {
+    sf.lo = (uintptr_t) fiber->stack;
+    sf.hi = sf.lo + fiber->stacksz;
+    sf.inside = 1;
+  }
+  else {
+    sf.lo = altStackLo;
+    sf.hi = altStackHi;
+    sf.inside = 0;
+  }
+  sf.frames = sample->frames;
+  sf.n = 0;
+  sf.max = FIBER_PROFILE_DEPTH;
+  _Unwind_Backtrace( schedStackFrame, &sf );
+  sample->nframes = sf.n;
+  prof->n ++;
+  errno = saved;
+}
+
+/* ----------------------------------------------------------------------------
+ * Record the thread running the scheduler and start its timer there.
+ * Called by sched_cycle().
+ * ----------------------------------------------------------------------------*/
+void schedProfileBind( scheduler_t *sched )
+{
+  struct profiler *prof = sched->prof;
+  struct sigevent sev;
+  struct itimerspec its;
+  uint64_t nsec;
+
+  profiledSched = sched;
+  if ( prof->armed || prof->stopped ) {
+    return;
+  }
+  schedAltStack();
+
+  memset( &sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGPROF;
+  sev.sigev_notify_thread_id = gettid();
+  if ( timer_create( CLOCK_THREAD_CPUTIME_ID, &sev, &prof->timer ) ) {
+    error( "sched_profile_start : can't create timer.\n" );
+    prof->stopped = 1;
+    return;
+  }
+  prof->armed = 1;
+
+  nsec = 1000000000ULL / prof->hz;
+  its.it_interval.tv_sec = nsec / 1000000000ULL;
+  its.it_interval.tv_nsec = nsec % 1000000000ULL;
+  its.it_value = its.it_interval;
+  timer_settime( prof->timer, 0, &its, NULL );
+}
+
+/* ----------------------------------------------------------------------------
+ * Frees the profiler and its samples
+ * ----------------------------------------------------------------------------*/
+void schedProfileFree( scheduler_t *sched )
+{
+  struct profiler *prof = sched->prof;
+
+  if ( prof == NULL ) {
+    return;
+  }
+  __atomic_store_n( &sched->prof, NULL, __ATOMIC_RELEASE );
+  if ( prof->armed ) {
+    timer_delete( prof->timer );
+  }
+  if ( profiledSched == sched ) {
+    profiledSched = NULL;
+  }
+  free( prof->samples );
+  free( prof );
+}
+
+/* ----------------------------------------------------------------------------
+ * Start of the function holding 'addr' found in the dynamic symbol table,
+ * NULL if it is not there. 'info' gets its name and the file holding it.
+ * ----------------------------------------------------------------------------*/
+static void *schedProfileSymbol( void *addr, Dl_info *info )
+{
+  const ElfW(Sym) *sym = NULL;
+
+  if ( dladdr1( addr, info, (void**) &sym, RTLD_DL_SYMENT ) == 0 ) {
+    info->dli_fname = NULL;
+    return NULL;
+  }
+  if ( info->dli_saddr == NULL || sym == NULL ||
+       (uintptr_t) addr >= (uintptr_t) info->dli_saddr + sym->st_size ) {
+    return NULL;
+  }
+  return info->dli_saddr;
+}
+
+/* ----------------------------------------------------------------------------
+ * Writes the name of the function holding 'addr', or the file holding it
+ * and the offset in that file.
+ * ----------------------------------------------------------------------------*/
+static void schedProfileName( FILE *f, void *addr )
+{
+  const char *file;
+  Dl_info info;
+
+  if ( schedProfileSymbol( addr, &info ) != NULL ) {
+    fprintf( f, ";%s", info.dli_sname );
+  }
+  else if ( info.dli_fname != NULL && info.dli_fname[0] != 0 ) {
+    file = strrchr( info.dli_fname, '/' );
+    fprintf( f, ";%s+0x%lx", file ? file + 1 : info.dli_fname,
+	     (unsigned long) ((uintptr_t) addr - (uintptr_t) info.dli_fbase) );
+  }
+  else {
+    fprintf( f, ";%p", addr );
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Root frame of a sample
+ * ----------------------------------------------------------------------------*/
+static const char *schedProfileRoot( const struct profile_sample *sample )
+{
+  if ( sample->tag != NULL ) {
+    return sample->tag;
+  }
+  return ( sample->fid == PROFILE_NO_FIBER ) ? "[scheduler]" : "untagged";
+}
+
+/* a line of the folded stacks */
+struct profile_line {
+  char *stack;
+  size_t count;
+};
+
+/* ----------------------------------------------------------------------------
+ * Sort order of the samples : equal samples are symbolized once
+ * ----------------------------------------------------------------------------*/
+static int schedProfileCompare( const void *a, const void *b, void *arg )
+{
+  const struct profile_sample *sa = (const struct profile_sample*) a;
+  const struct profile_sample *sb = (const struct profile_sample*) b;
+  int flags = *(int*) arg;
+  int ret;
+
+  ret = strcmp( schedProfileRoot( sa ), schedProfileRoot( sb ));
+  if ( ret != 0 ) {
+    return ret;
+  }
+  if ( (flags & FIBER_PROFILE_FIBERS) && sa->fid != sb->fid ) {
+    return ( sa->fid < sb->fid ) ? -1 : 1;
+  }
+  if ( sa->run != sb->run ) {
+    return ( (uintptr_t) sa->run < (uintptr_t) sb->run ) ? -1 : 1;
+  }
+  if ( sa->nframes != sb->nframes ) {
+    return ( sa->nframes < sb->nframes ) ? -1 : 1;
+  }
+  return memcmp( sa->frames, sb->frames, sa->nframes * sizeof(void*));
+}
+
+/* ----------------------------------------------------------------------------
+ * Sort order of the lines
+ * ----------------------------------------------------------------------------*/
+static int schedProfileLineCompare( const void *a, const void *b )
+{
+  return strcmp( ((const struct profile_line*) a)->stack,
+		 ((const struct profile_line*) b)->stack );
+}
+
+/* ----------------------------------------------------------------------------
+ * Writes a folded stack. Return addresses follow the call : the frames
+ * but the interrupted one are looked up one byte before.
+ * ----------------------------------------------------------------------------*/
+static void schedProfileWrite( FILE *f, const struct profile_sample *sample, int flags )
+{
+  Dl_info info;
+  int i, top = (int) sample->nframes - 1;
+
+  fputs( schedProfileRoot( sample ), f );
+  if ( (flags & FIBER_PROFILE_FIBERS) && sample->fid != PROFILE_NO_FIBER ) {
+    fprintf( f, ";fiber %u", sample->fid );
+  }
+  if ( sample->run != NULL ) {
+    /* the frames before the run function boot the fiber */
+    for( i = top; i >= 0; --i ) {
+      if ( schedProfileSymbol( (char*) sample->frames[i] - ( i > 0 ), &info ) ==
+	   (void*) sample->run ) {
+	top = i - 1;
+	break;
+      }
+    }
+    schedProfileName( f, (void*) sample->run );
+  }
+  for( i = top; i >= 0; --i ) {
+    schedProfileName( f, (char*) sample->frames[i] - ( i > 0 ));
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_profile_start --
+ * --------------------------------------------------------------------------*/
+int sched_profile_start( scheduler_t *sched, uint32_t hz, size_t nsamples )
+{
+  struct profiler *prof;
+  struct sigaction sa;
+  void *frames[1];
+
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
+  }
+  if ( sched->prof != NULL && !sched->prof->stopped ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  if ( hz == 0 || nsamples == 0 ) {
+    return FIBER_ERROR;
+  }
+
+  /* backtrace() loads libgcc_s on its first call : not in the handler */
+  backtrace( frames, 1 );
+  memset( &sa, 0, sizeof(sa));
+  sa.sa_handler = schedProfileSignal;
+  sa.sa_flags = SA_ONSTACK | SA_RESTART;
+  sigemptyset( &sa.sa_mask );
+  if ( sigaction( SIGPROF, &sa, NULL ) ) {
+    error( "sched_profile_start : sigaction failed.\n" );
+    return FIBER_SIGNALERROR;
+  }
+
+  schedProfileFree( sched );
+  prof = (struct profiler*) calloc( 1, sizeof(*prof));
+  if ( prof == NULL ) {
+    return FIBER_MEMORY_ALLOCATION_ERROR;
+  }
+  prof->samples = (struct profile_sample*) calloc( nsamples, sizeof(*prof->samples));
+  if ( prof->samples == NULL ) {
+    free( prof );
+    return FIBER_MEMORY_ALLOCATION_ERROR;
+  }
+  prof->max = nsamples;
+  prof->hz = hz;
+  sched->prof = prof;
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_profile_stop --
+ * --------------------------------------------------------------------------*/
+void sched_profile_stop( scheduler_t *sched )
+{
+  struct profiler *prof;
+
+  if ( sched == NULL || (prof = sched->prof) == NULL || prof->stopped ) {
+    return;
+  }
+  prof->stopped = 1;
+  if ( prof->armed ) {
+    timer_delete( prof->timer );
+    prof->armed = 0;
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_profile_dump --
+ * --------------------------------------------------------------------------*/
+int sched_profile_dump( scheduler_t *sched, const char *path, int flags )
+{
+  struct profiler *prof;
+  struct profile_line *lines;
+  sigset_t mask, oldmask;
+  size_t i, j, n, len;
+  FILE *f, *m;
+  int ret;
+
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
+  }
+  if ( (prof = sched->prof) == NULL ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  f = fopen( path, "w" );
+  if ( f == NULL ) {
+    error( "sched_profile_dump : can't open '%s'.\n", path );
+    return FIBER_ERROR;
+  }
+
+  /* no sample is taken while they are sorted */
+  sigemptyset( &mask );
+  sigaddset( &mask, SIGPROF );
+  pthread_sigmask( SIG_BLOCK, &mask, &oldmask );
+
+  /* samples taken at different addresses of the same functions end up
+   * on the same line once symbolized */
+  qsort_r( prof->samples, prof->n, sizeof(*prof->samples), schedProfileCompare, &flags );
+  lines = (struct profile_line*) calloc( prof->n + 1, sizeof(*lines));
+  if ( lines == NULL ) {
+    pthread_sigmask( SIG_SETMASK, &oldmask, NULL );
+    fclose( f );
+    return FIBER_MEMORY_ALLOCATION_ERROR;
+  }
+  for( i = 0, n = 0; i < prof->n; i = j, n++ ) {
+    for( j = i + 1; j < prof->n &&
+	   schedProfileCompare( &prof->samples[i], &prof->samples[j], &flags ) == 0; ++j );
+    lines[n].count = j - i;
+    m = open_memstream( &lines[n].stack, &len );
+    if ( m == NULL ) {
+      break;
+    }
+    schedProfileWrite( m, &prof->samples[i], flags );
+    fclose( m );
+  }
+  qsort( lines, n, sizeof(*lines), schedProfileLineCompare );
+  for( i = 0; i < n; i = j ) {
+    for( j = i + 1; j < n && strcmp( lines[i].stack, lines[j].stack ) == 0; ++j ) {
+      lines[i].count += lines[j].count;
+    }
+    fprintf( f, "%s %zu\n", lines[i].stack, lines[i].count );
+  }
+  for( i = 0; i < n; ++i ) {
+    free( lines[i].stack );
+  }
+  free( lines );
+  if ( prof->lost > 0 ) {
+    warn( "sched_profile_dump : %llu samples lost.\n", (unsigned long long) prof->lost );
+  }
+
+  pthread_sigmask( SIG_SETMASK, &oldmask, NULL );
+  ret = ferror( f );
+  if ( fclose( f ) != 0 || ret ) {
+    return FIBER_ERROR;
+  }
+  return FIBER_OK;
+}
@@ -0,0 +1,116 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_PROFILER_H__
+#define __FIBER_PROFILER_H__
+
+#include <signal.h>
+
+#include "task.h"
+
+/* ---------------------------------------------------------------------------
+ *  Sampling profiler
+ *
+ *  While the profiler of a scheduler is on, the thread running it gets
+ *  SIGPROF at a given rate of its cpu time. The handler records in a
+ *  buffer allocated beforehand the fiber running, its run function, its
+ *  tag (see fiber_set_tag()) and a backtrace taken on its stack, or on
+ *  the scheduler stack when no fiber runs.
+ *
+ *  sched_profile_dump() writes the samples as folded stacks, one line per
+ *  distinct stack followed by its number of samples, the tag of the fiber
+ *  as root frame :
+ *
+ *      http;handle_request;parse_headers;memchr 12
+ *
+ *  so that flamegraph.pl or speedscope show the time by kind of fiber.
+ *  Fibers without tag are under "untagged", samples taken while no fiber
+ *  runs under "[scheduler]". Signals are blocked while fibers boot : the
+ *  time spent booting them is counted in sched_cycle().
+ *
+ *  As for the watchdog, symbols are found in the dynamic symbol table :
+ *  link with -rdynamic to get the names of the functions of the program.
+ *  The others are written as the file holding them and an offset. The
+ *  handler runs on an alternate signal stack installed on the scheduler
+ *  thread, unless the thread already has one.
+ *
+ *  SIGPROF interrupts system calls : blocking calls made by fibers may
+ *  fail with EINTR meanwhile. Only one profiler of the program should
+ *  handle SIGPROF.
+ * ---------------------------------------------------------------------------
+ */
+
+/* maximum depth of the backtraces */
+#define FIBER_PROFILE_DEPTH 32
+
+/* flags of sched_profile_dump() */
+#define FIBER_PROFILE_FIBERS 1      /* one frame per fiber under its tag */
+
+
+/* ---------------------------------------------------------------------------
+ * sched_profile_start --
+ *
+ * Starts sampling the thread running 'sched' 'hz' times per second of cpu
+ * time, the samples of a previous run are discarded. At most 'nsamples'
+ * are kept, the next ones are counted as lost. Sampling starts with the
+ * next call to sched_cycle(), on the thread making it.
+ *
+ * Returns FIBER_OK, FIBER_NO_SUCH_SCHED, FIBER_ILLEGAL_STATE if it is
+ * already started, FIBER_ERROR if 'hz' or 'nsamples' is 0,
+ * FIBER_MEMORY_ALLOCATION_ERROR or FIBER_SIGNALERROR if the signal handler
+ * can't be installed.
+ * ---------------------------------------------------------------------------
+ */
+int sched_profile_start( scheduler_t *sched, uint32_t hz, size_t nsamples );
+
+
+/* ---------------------------------------------------------------------------
+ * sched_profile_stop --
+ *
+ * Stops sampling. The samples are kept for sched_profile_dump() until the
+ * next start or sched_free().
+ * ---------------------------------------------------------------------------
+ */
+void sched_profile_stop( scheduler_t *sched );
+
+
+/* ---------------------------------------------------------------------------
+ * sched_profile_dump --
+ *
+ * Writes the samples taken so far to 'path' as folded stacks. With
+ * FIBER_PROFILE_FIBERS in 'flags', a "fiber <fid>" frame is added under
+ * the tag so that fibers sharing a tag are told apart.
+ *
+ * While sampling, it must be called from the thread running the scheduler,
+ * from a hook or a fiber for instance.
+ *
+ * Returns FIBER_OK, FIBER_NO_SUCH_SCHED, FIBER_ILLEGAL_STATE if the
+ * profiler was never started, FIBER_MEMORY_ALLOCATION_ERROR or FIBER_ERROR
+ * if the file can't be written.
+ * ---------------------------------------------------------------------------
+ */
+int sched_profile_dump( scheduler_t *sched, const char *path, int flags );
+
+
+#endif
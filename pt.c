@@ -0,0 +1,294 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Protothreads : stackless coroutines resumed by sched_cycle().
+ *
+ *  A protothread is resumed by a call to ptPosted() posted with
+ *  sched_post(), at most one is pending at a time. Sleeps and deadline
+ *  sources use the timer heap of the scheduler.
+ *
+ *  The other sources of PT_WAIT_ANY() are armed with the helpers of
+ *  fiber_wait_any() on behalf of a stub fiber flagged FIBER_F_STACKLESS
+ *  and parked on a predicate that the scheduler never sees. When one of
+ *  its waiters fires, schedWakeup() calls the run function of the stub
+ *  which posts the protothread.
+ * ----------------------------------------------------------------------------*/
+
+#include <string.h>
+
+#include "taskint.h"
+#include "pt.h"
+
+/* protothread flags */
+#define PT_F_ALIVE     0x01   /* started, done function not called yet */
+#define PT_F_QUEUED    0x02   /* a call to ptPosted() is pending */
+#define PT_F_RUNNING   0x04   /* its function is running */
+#define PT_F_STOPPING  0x08   /* stopped with pt_stop() */
+
+/* sources armed by pt_wait_any() */
+struct pt_wait {
+  fiber_t          stub;      /* owner of the waiters */
+  predicate_t      pred;      /* the stub is parked on it */
+  int              fired;     /* index of the waiter fired or -1 */
+  int              nearest;   /* nearest deadline source or -1 */
+  struct var_wait *vws;       /* state of the variable sources */
+  waiter_t         waiters[]; /* one per source, followed by 'vws' */
+};
+
+static void ptPosted( scheduler_t *sched, void *arg );
+
+/* ----------------------------------------------------------------------------
+ * Resume the protothread during next cycle
+ * ----------------------------------------------------------------------------*/
+static int ptPost( pt_t *pt )
+{
+  int ret;
+
+  if ( pt->flags & PT_F_QUEUED ) {
+    return FIBER_OK;
+  }
+  ret = sched_post( pt->sched, ptPosted, pt );
+  if ( ret != FIBER_OK ) {
+    error( "protothread %p can't be resumed\n", pt );
+    return ret;
+  }
+  pt->flags |= PT_F_QUEUED;
+  return FIBER_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Run function of the stub : one of its waiters fired
+ * ----------------------------------------------------------------------------*/
+static void ptWake( fiber_t *fiber )
+{
+  ptPost( (pt_t*) fiber->extra );
+}
+
+/* ----------------------------------------------------------------------------
+ * Timer of a sleep or of the deadline sources of a wait
+ * ----------------------------------------------------------------------------*/
+static void ptTimer( scheduler_t *sched, void *arg )
+{
+  pt_t *pt = (pt_t*) arg;
+
+  /* the waiters can't fire anymore */
+  if ( pt->wait != NULL && pt->wait->pred.state == PREDICATE_ACTIVE ) {
+    pt->wait->pred.state = PREDICATE_FIRED;
+    pt->wait->stub.state = FIBER_RUNNING;
+  }
+  ptPost( pt );
+}
+
+/* ----------------------------------------------------------------------------
+ * Remove the timer and the waiters of the protothread.
+ * The result of the wait is stored in 'index'.
+ * ----------------------------------------------------------------------------*/
+static void ptDisarm( pt_t *pt )
+{
+  struct pt_wait *w = pt->wait;
+
+  schedTimerDel( pt->sched, &pt->timer );
+  if ( w == NULL ) {
+    return;
+  }
+  fiberUnlinkWaiters( &w->stub );
+  pt->index = ( w->fired >= 0 ) ? w->fired : w->nearest;
+  pt->wait = NULL;
+  schedMemFree( pt->sched, w );
+}
+
+/* ----------------------------------------------------------------------------
+ * The protothread is over : call its done function, it may free it
+ * ----------------------------------------------------------------------------*/
+static void ptFinish( pt_t *pt )
+{
+  ptDisarm( pt );
+
+  /* the pending call will finish it */
+  if ( pt->flags & PT_F_QUEUED ) {
+    pt->flags |= PT_F_STOPPING;
+    return;
+  }
+  pt->flags = 0;
+  if ( pt->done ) {
+    pt->done( pt );
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Resume a protothread. Called by sched_cycle().
+ * ----------------------------------------------------------------------------*/
+static void ptPosted( scheduler_t *sched, void *arg )
+{
+  pt_t *pt = (pt_t*) arg;
+  int ret;
+
+  pt->flags &= ~PT_F_QUEUED;
+  if ( pt->flags & PT_F_STOPPING ) {
+    ptFinish( pt );
+    return;
+  }
+  if ( pt->wait != NULL ) {
+    pt->status = FIBER_OK;
+  }
+  ptDisarm( pt );
+
+  pt->flags |= PT_F_RUNNING;
+  ret = pt->run( pt );
+  pt->flags &= ~PT_F_RUNNING;
+
+  if ( ret == PT_ENDED || (pt->flags & PT_F_STOPPING) ) {
+    ptFinish( pt );
+  }
+  else if ( ret == PT_YIELDED ) {
+    ptPost( pt );
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  pt_start --
+ * --------------------------------------------------------------------------*/
+int pt_start( scheduler_t *sched, pt_t *pt, pf_pt_t run, pf_pt_done_t done,
+	      void *extra )
+{
+  if ( sched == NULL || pt == NULL || run == NULL ) {
+    return FIBER_ERROR;
+  }
+  if ( pt->flags & PT_F_ALIVE ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  memset( pt, 0, sizeof(*pt));
+  pt->extra = extra;
+  pt->timer = -1;
+  pt->index = -1;
+  pt->sched = sched;
+  pt->run = run;
+  pt->done = done;
+  pt->flags = PT_F_ALIVE;
+  if ( ptPost( pt ) != FIBER_OK ) {
+    pt->flags = 0;
+    return FIBER_MEMORY_ALLOCATION_ERROR;
+  }
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  pt_stop --
+ * --------------------------------------------------------------------------*/
+int pt_stop( pt_t *pt )
+{
+  if ( !(pt->flags & PT_F_ALIVE) ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  if ( pt->flags & PT_F_STOPPING ) {
+    return FIBER_OK;
+  }
+  pt->flags |= PT_F_STOPPING;
+  ptDisarm( pt );
+
+  /* a running protothread is finished when its function returns */
+  if ( !(pt->flags & PT_F_RUNNING) ) {
+    return ptPost( pt );
+  }
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  pt_alive --
+ * --------------------------------------------------------------------------*/
+int pt_alive( pt_t *pt )
+{
+  return ( pt->flags & PT_F_ALIVE ) ? 1 : 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  pt_sleep --
+ * --------------------------------------------------------------------------*/
+int pt_sleep( pt_t *pt, uint32_t msec )
+{
+  if ( msec == 0 ) {
+    return ptPost( pt );
+  }
+  return schedTimerAdd( pt->sched, sched_timestamp( pt->sched ) + msec,
+			ptTimer, pt, &pt->timer );
+}
+
+/* --------------------------------------------------------------------------
+ *  pt_wait_any --
+ * --------------------------------------------------------------------------*/
+int pt_wait_any( pt_t *pt, wait_source_t *sources, int n )
+{
+  scheduler_t *sched = pt->sched;
+  struct pt_wait *w;
+  int ret, nearest;
+
+  ret = waitSourcesCheck( sched, sources, n, &pt->index, &nearest );
+  if ( ret != FIBER_TIMEOUT ) {
+    pt->status = ret;
+    return ret;
+  }
+
+  w = (struct pt_wait*) schedMemAlloc( sched, sizeof(*w) +
+				       n*(sizeof(waiter_t) + sizeof(struct var_wait)));
+  if ( w == NULL ) {
+    pt->status = FIBER_MEMORY_ALLOCATION_ERROR;
+    return pt->status;
+  }
+  memset( w, 0, sizeof(*w));
+  w->fired = -1;
+  w->nearest = nearest;
+  w->vws = (struct var_wait*) (w->waiters + n);
+
+  /* park the stub */
+  w->stub.scheduler = sched;
+  w->stub.home = sched;
+  w->stub.fid = ARRAYSIZE;
+  w->stub.flags = FIBER_F_STACKLESS;
+  w->stub.state = FIBER_SUSPEND;
+  w->stub.pf_run = ptWake;
+  w->stub.extra = pt;
+  w->stub.predicate = &w->pred;
+  w->pred.fiber = &w->stub;
+  w->pred.state = PREDICATE_ACTIVE;
+
+  ret = waitSourcesArm( &w->stub, sources, n, w->waiters, w->vws, &w->fired );
+  if ( ret == FIBER_OK ) {
+    w->stub.waiters = w->waiters;
+    w->stub.nwaiters = n;
+    if ( nearest >= 0 ) {
+      ret = schedTimerAdd( sched, sources[nearest].deadline, ptTimer, pt, &pt->timer );
+    }
+    if ( ret != FIBER_OK ) {
+      fiberUnlinkWaiters( &w->stub );
+    }
+  }
+  if ( ret != FIBER_OK ) {
+    schedMemFree( sched, w );
+    pt->status = ret;
+    return ret;
+  }
+  pt->wait = w;
+  return PT_WAITING;
+}
@@ -0,0 +1,198 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_PT_H__
+#define __FIBER_PT_H__
+
+#include "task.h"
+#include "waitany.h"
+
+/* typedefs */
+typedef struct pt pt_t;
+typedef int  (*pf_pt_t)( pt_t *pt );
+typedef void (*pf_pt_done_t)( pt_t *pt );
+
+/* ---------------------------------------------------------------------------
+ *  Protothreads
+ *
+ *  A protothread is a coroutine without a stack : its function returns
+ *  each time it waits and is called again, by sched_cycle(), when the wait
+ *  is over. The PT_xxx macros below turn the function into a state machine
+ *  switching on the line number of the last wait point, stored in `lc'.
+ *  It costs a few dozen bytes instead of a fiber and its stack, and it is
+ *  resumed without any context switch.
+ *
+ *  The price is that local variables are lost at each wait point : the
+ *  state that must survive a wait lives in a structure embedding the
+ *  pt_t (or pointed to by `extra'). For the same reason, buffers given to
+ *  channel sources must not be on the stack. Two wait points can't be on
+ *  the same line and a wait can't be inside a `switch' statement of the
+ *  protothread function.
+ *
+ *  Protothreads are local to their scheduler : they must be started and
+ *  stopped from the thread running it. They don't count as fibers and
+ *  are not stopped by sched_stop().
+ *
+ *  Example :
+ *
+ *    struct echo { pt_t pt; channel_case_t c; int v; };
+ *
+ *    int echo_run( pt_t *pt ) {
+ *      struct echo *e = (struct echo*) pt;
+ *      wait_source_t src = { .type = WAIT_CHANNEL, .chan = &e->c };
+ *      PT_BEGIN(pt);
+ *      for(;;) {
+ *        PT_WAIT_ANY(pt, &src, 1);
+ *        if ( pt->status != FIBER_OK ) PT_EXIT(pt);
+ *        printf("got %d\n", e->v);
+ *        PT_SLEEP(pt, 10);
+ *      }
+ *      PT_END(pt);
+ *    }
+ * ---------------------------------------------------------------------------
+ */
+
+/* values returned by protothread functions, see the PT_xxx macros */
+enum pt_status_e
+  {
+   PT_YIELDED = -1,          /* called again during next cycle */
+   PT_WAITING = -2,          /* called again when its wait is over */
+   PT_ENDED = -3,            /* done, its done function is called */
+  };
+
+struct pt {
+  int             lc;        /* resume point, managed by the macros */
+  int             status;    /* FIBER_xxx result of the last PT_WAIT_ANY */
+  int             index;     /* source that fired during the last PT_WAIT_ANY */
+  void           *extra;     /* given to pt_start() */
+
+  /* private */
+  int             flags;
+  int             timer;     /* position in the timer heap or -1 */
+  scheduler_t    *sched;
+  pf_pt_t         run;
+  pf_pt_done_t    done;
+  struct pt_wait *wait;      /* armed sources or NULL */
+};
+
+#define PT_BEGIN(pt)    switch( (pt)->lc ) { case 0:
+
+#define PT_END(pt)      } (pt)->lc = 0; return PT_ENDED
+
+#define PT_EXIT(pt)     do { (pt)->lc = 0; return PT_ENDED; } while(0)
+
+/* gives back control until next cycle */
+#define PT_YIELD(pt)						\
+  do {								\
+    (pt)->lc = __LINE__; return PT_YIELDED; case __LINE__:;	\
+  } while(0)
+
+/* checks `cond' once per cycle : prefer PT_WAIT_ANY() which polls nothing */
+#define PT_WAIT_UNTIL(pt, cond)					\
+  do {								\
+    (pt)->lc = __LINE__; case __LINE__:				\
+    if ( !(cond) ) return PT_YIELDED;				\
+  } while(0)
+
+/* waits `msec' milliseconds of scheduler time */
+#define PT_SLEEP(pt, msec)					\
+  do {								\
+    (pt)->lc = __LINE__;					\
+    if ( pt_sleep( (pt), (msec) ) == FIBER_OK ) return PT_WAITING;	\
+    case __LINE__:;						\
+  } while(0)
+
+/* waits until one of `n' sources fires, as fiber_wait_any(). The result
+ * is stored in `status' and the position of the source in `index' */
+#define PT_WAIT_ANY(pt, sources, n)				\
+  do {								\
+    (pt)->lc = __LINE__;					\
+    if ( pt_wait_any( (pt), (sources), (n) ) == PT_WAITING )	\
+      return PT_WAITING;					\
+    case __LINE__:;						\
+  } while(0)
+
+
+/* ---------------------------------------------------------------------------
+ * pt_start --
+ *
+ * Initializes `pt' and runs `run( pt )' for the first time during the
+ * next cycle of `sched'. `done( pt )', if not NULL, is called from a
+ * cycle once the protothread ended or was stopped : it may free `pt'.
+ *
+ * Returns FIBER_OK, FIBER_ILLEGAL_STATE if `pt' is alive or
+ * FIBER_MEMORY_ALLOCATION_ERROR.
+ * ---------------------------------------------------------------------------
+ */
+int pt_start( scheduler_t *sched, pt_t *pt, pf_pt_t run, pf_pt_done_t done,
+	      void *extra );
+
+
+/* ---------------------------------------------------------------------------
+ * pt_stop --
+ *
+ * Stops a protothread : it is not called anymore, its wait is disarmed
+ * and its done function is called during the next cycle. A protothread
+ * can stop itself.
+ *
+ * Returns FIBER_OK or FIBER_ILLEGAL_STATE if it is not alive.
+ * ---------------------------------------------------------------------------
+ */
+int pt_stop( pt_t *pt );
+
+
+/* ---------------------------------------------------------------------------
+ * pt_alive --
+ *
+ * Returns 1 from pt_start() until the done function of `pt' is called,
+ * 0 otherwise.
+ * ---------------------------------------------------------------------------
+ */
+int pt_alive( pt_t *pt );
+
+
+/* ---------------------------------------------------------------------------
+ * pt_sleep --
+ *
+ * Arms the timer of PT_SLEEP(). Returns FIBER_OK or
+ * FIBER_MEMORY_ALLOCATION_ERROR.
+ * ---------------------------------------------------------------------------
+ */
+int pt_sleep( pt_t *pt, uint32_t msec );
+
+
+/* ---------------------------------------------------------------------------
+ * pt_wait_any --
+ *
+ * Arms the sources of PT_WAIT_ANY(). Returns PT_WAITING if they are armed
+ * or the result of the wait, also stored in `status', otherwise :
+ * FIBER_OK if a source already fired, FIBER_ERROR if `n' is not positive
+ * or a source is invalid, FIBER_ILLEGAL_STATE if a file descriptor can't be
+ * watched or FIBER_MEMORY_ALLOCATION_ERROR.
+ * ---------------------------------------------------------------------------
+ */
+int pt_wait_any( pt_t *pt, wait_source_t *sources, int n );
+
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Flight recorder : the shared mapping of a scheduler. Events are written
+ *  by the scheduler itself, see schedTraceEvent() in task.c.
+ * ----------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "taskint.h"
+#include "recorder.h"
+
+/* --------------------------------------------------------------------------
+ *  sched_recorder_open --
+ * --------------------------------------------------------------------------*/
+int sched_recorder_open( scheduler_t *sched, const char *path, size_t nevents )
+{
+  recorder_header_t *rec;
+  size_t sz = 1, len;
+  void *p;
+  int fd;
+
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
+  }
+  if ( sched->rec != NULL ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  while( sz < nevents ) {
+    sz <<= 1;
+  }
+  len = sizeof(recorder_header_t) + sz*sizeof(recorder_event_t);
+
+  if ( path != NULL ) {
+    fd = open( path, O_RDWR|O_CREAT|O_TRUNC, 0644 );
+  }
+  else {
+    fd = memfd_create( "libfiber-recorder", 0 );
+  }
+  if ( fd < 0 ) {
+    error( "sched_recorder_open : can't create %s\n", path ? path : "memfd" );
+    return FIBER_ERROR;
+  }
+  if ( ftruncate( fd, len ) ) {
+    error( "sched_recorder_open : can't size %s\n", path ? path : "memfd" );
+    close( fd );
+    return FIBER_ERROR;
+  }
+  p = mmap( NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+  if ( p == MAP_FAILED ) {
+    error( "sched_recorder_open : can't map %s\n", path ? path : "memfd" );
+    close( fd );
+    return FIBER_ERROR;
+  }
+  /* a memfd stays open to be found in /proc/<pid>/fd */
+  if ( path != NULL ) {
+    close( fd );
+    fd = -1;
+  }
+
+  rec = (recorder_header_t*) p;
+  rec->magic = RECORDER_MAGIC;
+  rec->version = RECORDER_VERSION;
+  rec->evsize = sizeof(recorder_event_t);
+  rec->nevents = (uint32_t) sz;
+  rec->pid = (int32_t) getpid();
+  rec->running = -1;
+  sched->rec = rec;
+  sched->rec_events = (recorder_event_t*) (rec + 1);
+  sched->rec_mask = sz - 1;
+  sched->rec_len = len;
+  sched->rec_fd = fd;
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_recorder_close --
+ * --------------------------------------------------------------------------*/
+void sched_recorder_close( scheduler_t *sched )
+{
+  if ( sched == NULL || sched->rec == NULL ) {
+    return;
+  }
+  munmap( sched->rec, sched->rec_len );
+  if ( sched->rec_fd >= 0 ) {
+    close( sched->rec_fd );
+  }
+  sched->rec = NULL;
+  sched->rec_events = NULL;
+  sched->rec_fd = -1;
+}
@@ -0,0 +1,104 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_RECORDER_H__
+#define __FIBER_RECORDER_H__
+
+#include "tracer.h"
+
+/* ---------------------------------------------------------------------------
+ *  Flight recorder
+ *
+ *  Unlike the tracer, the flight recorder is always compiled in and is
+ *  meant to stay on in production. Once opened it keeps, in a shared
+ *  mapping of fixed size, the last scheduling events of a scheduler, the
+ *  fiber it is running and when its last cycle started. Recording never
+ *  allocates nor reads the clock : events are stamped with the cycle
+ *  number, the clock is only read once per cycle.
+ *
+ *  The mapping is a file, which survives a crash of the process, or a
+ *  memfd, which can be read through /proc/<pid>/fd while the process is
+ *  alive. The fiberrec tool (see tools/) prints it : when a fiber never
+ *  gives back control, it tells which one and since when.
+ *
+ *  The recorder is written without locks by the scheduler thread : a
+ *  reader must copy the events then check that 'head' did not move by
+ *  more than the number of free slots meanwhile.
+ * ---------------------------------------------------------------------------
+ */
+
+#define RECORDER_MAGIC   0x43455246  /* "FREC" */
+#define RECORDER_VERSION 1
+
+/* an event : type, reason and data as in the tracer (see tracer.h) */
+typedef struct recorder_event {
+  uint64_t cycle;            /* cycle it happened in */
+  int64_t  data;             /* depends on the type */
+  uint32_t fid;              /* fiber identifier, reused once it's done */
+  uint16_t type;             /* TRACE_xxx */
+  uint16_t reason;           /* TRACE_OUT_xxx */
+} recorder_event_t;
+
+/* start of the mapping, followed by 'nevents' events. The event number
+ * 'n' is in slot n % nevents. */
+typedef struct recorder_header {
+  uint32_t magic;            /* RECORDER_MAGIC */
+  uint32_t version;          /* RECORDER_VERSION */
+  uint32_t evsize;           /* sizeof(recorder_event_t) */
+  uint32_t nevents;          /* number of slots, a power of two */
+  int32_t  pid;              /* process */
+  int32_t  running;          /* fid of the running fiber or -1 */
+  uint64_t running_run;      /* its run function */
+  uint64_t head;             /* number of events recorded */
+  uint64_t cycles;           /* number of cycles started */
+  uint64_t cycle_nsec;       /* CLOCK_MONOTONIC when the last one started */
+} recorder_header_t;
+
+
+/* ---------------------------------------------------------------------------
+ * sched_recorder_open --
+ *
+ * Starts the flight recorder of a scheduler, keeping the last 'nevents'
+ * events, rounded up to a power of two. The mapping is created in file
+ * 'path', truncated first, or in a memfd named "libfiber-recorder" if
+ * 'path' is NULL.
+ *
+ * Returns FIBER_OK, FIBER_ILLEGAL_STATE if it is already started or
+ * FIBER_ERROR if the file can't be created or mapped.
+ * ---------------------------------------------------------------------------
+ */
+int sched_recorder_open( scheduler_t *sched, const char *path, size_t nevents );
+
+
+/* ---------------------------------------------------------------------------
+ * sched_recorder_close --
+ *
+ * Stops the flight recorder of a scheduler and unmaps it. A file is left
+ * in place. It is called by sched_free().
+ * ---------------------------------------------------------------------------
+ */
+void sched_recorder_close( scheduler_t *sched );
+
+
+#endif
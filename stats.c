@@ -0,0 +1,379 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Statistics : the optional accounting of the cpu, switches and waits of
+ *  each fiber, kept per run function once the fiber ended, and the cycle
+ *  and phase histograms every scheduler maintains. The scheduler feeds
+ *  them through the functions declared in taskint.h.
+ * ----------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "taskint.h"
+
+/* ----------------------------------------------------------------------------
+ * The running fiber, if any, gives back control and 'next', if not NULL,
+ * is switched to. Called when accounting is on.
+ * ----------------------------------------------------------------------------*/
+void schedAcctSwitch( scheduler_t *sched, fiber_t *next )
+{
+  fiber_t *prev = sched->running;
+  uint64_t now = schedAcctNow();
+  int kind;
+
+  if ( sched->perf != NULL ) {
+    schedPerfSwitch( sched, prev );
+  }
+
+  if ( prev != NULL ) {
+    if ( prev->acct_stamp != 0 ) {
+      prev->stats.cpu_nsec += now - prev->acct_stamp;
+    }
+    kind = ( prev->state == FIBER_SUSPEND ) ? fiberAcctKind( prev ) : -1;
+    prev->acct_wait = (uint8_t) (kind + 1);
+    prev->acct_stamp = now;
+  }
+
+  if ( next != NULL ) {
+    if ( next->acct_stamp != 0 ) {
+      if ( next->acct_wait ) {
+	/* woken up without notice */
+	next->stats.wait_nsec[next->acct_wait - 1] += now - next->acct_stamp;
+      }
+      else {
+	next->stats.runnable_nsec += now - next->acct_stamp;
+      }
+    }
+    next->acct_wait = 0;
+    next->acct_stamp = now;
+    next->stats.switches ++;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * A suspended fiber becomes runnable. Called when accounting is on.
+ * ----------------------------------------------------------------------------*/
+void fiberAcctWake( fiber_t *fiber )
+{
+  uint64_t now;
+
+  if ( fiber->acct_wait == 0 ) {
+    return;
+  }
+  now = schedAcctNow();
+  if ( fiber->acct_stamp != 0 ) {
+    fiber->stats.wait_nsec[fiber->acct_wait - 1] += now - fiber->acct_stamp;
+  }
+  fiber->acct_wait = 0;
+  fiber->acct_stamp = now;
+}
+
+/* ----------------------------------------------------------------------------
+ * Add the counters of a fiber to the ones of its run function
+ * ----------------------------------------------------------------------------*/
+static void schedRunStatsAdd( fiber_run_stats_t *rs, fiber_stats_t *stats )
+{
+  int k;
+
+  rs->nfibers ++;
+  rs->stats.cpu_nsec += stats->cpu_nsec;
+  rs->stats.runnable_nsec += stats->runnable_nsec;
+  for( k = 0; k < FIBER_WAIT_NUM_KINDS; ++k ) {
+    rs->stats.wait_nsec[k] += stats->wait_nsec[k];
+  }
+  rs->stats.switches += stats->switches;
+  for( k = 0; k < FIBER_EVENT_NUM_KINDS; ++k ) {
+    rs->stats.events[k] += stats->events[k];
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Find the entry of a run function in 'rs', add it if 'n' is not full.
+ * ----------------------------------------------------------------------------*/
+static fiber_run_stats_t *schedRunStatsFind( fiber_run_stats_t *rs, int *n,
+					     int sz, pf_run_t run )
+{
+  int i;
+
+  for( i = 0; i < *n; ++i ) {
+    if ( rs[i].run == run ) {
+      return &rs[i];
+    }
+  }
+  if ( *n == sz ) {
+    return NULL;
+  }
+  memset( &rs[*n], 0, sizeof(rs[*n]));
+  rs[*n].run = run;
+  return &rs[(*n)++];
+}
+
+/* ----------------------------------------------------------------------------
+ * A fiber is removed from its scheduler : keep its counters
+ * ----------------------------------------------------------------------------*/
+void schedAcctRetire( scheduler_t *sched, fiber_t *fiber )
+{
+  fiber_run_stats_t *rs;
+  int sz;
+
+  if ( sched->nrunstats == sched->szrunstats ) {
+    sz = sched->szrunstats ? 2*sched->szrunstats : 16;
+    rs = (fiber_run_stats_t*) realloc( sched->runstats, sz*sizeof(*rs));
+    if ( rs == NULL ) {
+      return;
+    }
+    sched->runstats = rs;
+    sched->szrunstats = sz;
+  }
+  rs = schedRunStatsFind( sched->runstats, &sched->nrunstats,
+			  sched->szrunstats, fiber->pf_run );
+  schedRunStatsAdd( rs, &fiber->stats );
+}
+
+/* ----------------------------------------------------------------------------
+ * Most cpu consuming first
+ * ----------------------------------------------------------------------------*/
+static int schedRunStatsCmp( const void *a, const void *b )
+{
+  const fiber_run_stats_t *ra = (const fiber_run_stats_t*) a;
+  const fiber_run_stats_t *rb = (const fiber_run_stats_t*) b;
+
+  if ( ra->stats.cpu_nsec != rb->stats.cpu_nsec ) {
+    return ( ra->stats.cpu_nsec > rb->stats.cpu_nsec ) ? -1 : 1;
+  }
+  return 0;
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_set_accounting --
+ * --------------------------------------------------------------------------*/
+int sched_set_accounting( scheduler_t *sched, int enable )
+{
+  fiber_t *fiber;
+  uint64_t now;
+  int i;
+
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
+  }
+  if ( enable && !sched->acct ) {
+    /* counting starts now for fibers already there */
+    now = schedAcctNow();
+    for( i = 0; i < ARRAYSIZE; ++i ) {
+      fiber = sched->fibers[i];
+      if ( fiber != NULL ) {
+	fiber->acct_stamp = now;
+	fiber->acct_wait = ( fiber->state == FIBER_SUSPEND ) ?
+	  (uint8_t) (fiberAcctKind( fiber ) + 1) : 0;
+      }
+    }
+    if ( sched->perf != NULL ) {
+      schedPerfSwitch( sched, NULL );
+    }
+  }
+  sched->acct = enable ? 1 : 0;
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  fiber_get_stats --
+ * --------------------------------------------------------------------------*/
+int fiber_get_stats( fiber_t *fiber, fiber_stats_t *stats )
+{
+  scheduler_t *sched;
+  uint64_t delta;
+
+  if ( fiberCheckExist(fiber) != FIBER_OK ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  *stats = fiber->stats;
+
+  /* time spent in its current state */
+  sched = fiber->scheduler;
+  if ( sched == NULL || !sched->acct || fiber->acct_stamp == 0 ) {
+    return FIBER_OK;
+  }
+  delta = schedAcctNow() - fiber->acct_stamp;
+  if ( sched->running == fiber ) {
+    stats->cpu_nsec += delta;
+    if ( sched->perf != NULL ) {
+      schedPerfPending( sched, stats );
+    }
+  }
+  else if ( fiber->acct_wait ) {
+    stats->wait_nsec[fiber->acct_wait - 1] += delta;
+  }
+  else if ( fiber->state == FIBER_RUNNING ) {
+    stats->runnable_nsec += delta;
+  }
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_get_run_stats --
+ * --------------------------------------------------------------------------*/
+int sched_get_run_stats( scheduler_t *sched, fiber_run_stats_t *stats, int max )
+{
+  fiber_run_stats_t *rs;
+  fiber_stats_t fs;
+  fiber_t *fiber;
+  int i, n, sz;
+
+  if ( sched == NULL ) {
+    return 0;
+  }
+
+  /* ended fibers then alive ones */
+  sz = sched->nrunstats + sched->nfibers;
+  rs = (fiber_run_stats_t*) malloc( (sz ? sz : 1)*sizeof(*rs));
+  if ( rs == NULL ) {
+    return -1;
+  }
+  n = sched->nrunstats;
+  if ( n > 0 ) {
+    memcpy( rs, sched->runstats, n*sizeof(*rs));
+  }
+  for( i = 0; i < ARRAYSIZE; ++i ) {
+    fiber = sched->fibers[i];
+    if ( fiber != NULL && fiber_get_stats( fiber, &fs ) == FIBER_OK ) {
+      schedRunStatsAdd( schedRunStatsFind( rs, &n, sz, fiber->pf_run ), &fs );
+    }
+  }
+
+  qsort( rs, n, sizeof(*rs), schedRunStatsCmp );
+  if ( stats != NULL && max > 0 ) {
+    memcpy( stats, rs, ((n < max) ? n : max)*sizeof(*rs));
+  }
+  free( rs );
+  return n;
+}
+
+/* ----------------------------------------------------------------------------
+ * Bucket of a value in a log-linear histogram : the values below
+ * SCHED_HIST_STEPS have their own bucket, then each power of two is split
+ * in SCHED_HIST_STEPS buckets.
+ * ----------------------------------------------------------------------------*/
+static int schedHistBucket( uint64_t v )
+{
+  int e, i;
+
+  if ( v < SCHED_HIST_STEPS ) {
+    return (int) v;
+  }
+  /* position of the highest bit set, SCHED_HIST_STEPS = 4 = 2^2 */
+  e = 63 - __builtin_clzll( v );
+  i = (e - 1)*SCHED_HIST_STEPS + (int) ((v >> (e - 2)) & (SCHED_HIST_STEPS - 1));
+  return ( i < SCHED_HIST_BUCKETS ) ? i : SCHED_HIST_BUCKETS - 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Count a value in a histogram
+ * ----------------------------------------------------------------------------*/
+void schedHistAdd( sched_histogram_t *h, uint64_t v )
+{
+  h->count ++;
+  h->sum_nsec += v;
+  if ( v > h->max_nsec ) {
+    h->max_nsec = v;
+  }
+  h->buckets[schedHistBucket( v )] ++;
+}
+
+/* ----------------------------------------------------------------------------
+ * A phase of the cycle which had work ends : '*t' is the time it began,
+ * it becomes the time the next one begins.
+ * ----------------------------------------------------------------------------*/
+void schedPhaseEnd( scheduler_t *sched, int phase, uint64_t *t )
+{
+  uint64_t now = schedAcctNow();
+
+  schedHistAdd( &sched->stats.phases[phase], now - *t );
+  *t = now;
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_get_stats --
+ * --------------------------------------------------------------------------*/
+int sched_get_stats( scheduler_t *sched, sched_stats_t *stats )
+{
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
+  }
+  *stats = sched->stats;
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_reset_stats --
+ * --------------------------------------------------------------------------*/
+void sched_reset_stats( scheduler_t *sched )
+{
+  if ( sched != NULL ) {
+    memset( &sched->stats, 0, sizeof(sched->stats));
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_histogram_low --
+ * --------------------------------------------------------------------------*/
+uint64_t sched_histogram_low( int i )
+{
+  if ( i < SCHED_HIST_STEPS ) {
+    return (i < 0) ? 0 : (uint64_t) i;
+  }
+  if ( i > SCHED_HIST_BUCKETS ) {
+    i = SCHED_HIST_BUCKETS;
+  }
+  return (uint64_t) (SCHED_HIST_STEPS + i % SCHED_HIST_STEPS) << (i/SCHED_HIST_STEPS - 1);
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_histogram_percentile --
+ * --------------------------------------------------------------------------*/
+uint64_t sched_histogram_percentile( const sched_histogram_t *h, double pct )
+{
+  uint64_t rank, seen = 0;
+  int i;
+
+  if ( h->count == 0 ) {
+    return 0;
+  }
+  rank = (uint64_t) (pct * h->count / 100.0);
+  if ( rank >= h->count ) {
+    return h->max_nsec;
+  }
+  for( i = 0; i < SCHED_HIST_BUCKETS - 1; ++i ) {
+    seen += h->buckets[i];
+    if ( seen > rank ) {
+      break;
+    }
+  }
+  /* the bucket bound can't be above the biggest value */
+  if ( i == SCHED_HIST_BUCKETS - 1 || sched_histogram_low( i+1 ) - 1 > h->max_nsec ) {
+    return h->max_nsec;
+  }
+  return sched_histogram_low( i+1 ) - 1;
+}
@@ -0,0 +1,389 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Mutex, condition variable, semaphore, read-write lock and barrier.
+ *
+ *  Each object has a FIFO wait queue. Releasing an object grants it to
+ *  the first live waiter (owner, count, readers...) before firing it, so
+ *  the woken fiber has nothing to check when it resumes.
+ *
+ *  A fiber waiting on a condition variable is linked in its queue with
+ *  its mutex as waiter data. Signaling moves the waiter to the queue of
+ *  the mutex : the fiber only runs once it owns the mutex again.
+ * ----------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "taskint.h"
+#include "sync.h"
+
+/* rwlock waiter kinds, stored in waiter data */
+#define RWLOCK_READ  ((void*) 0)
+#define RWLOCK_WRITE ((void*) 1)
+
+/*
+ * --------------------------------------------------------------------------
+ *  Objects
+ * --------------------------------------------------------------------------
+ */
+struct fiber_mutex {
+  fiber_t     *owner;       /* fiber holding the mutex or NULL */
+  waitq_t      queue;       /* fibers waiting for the mutex */
+};
+
+struct fiber_cond {
+  waitq_t      queue;       /* fibers waiting for a signal */
+};
+
+struct fiber_sem {
+  unsigned int count;       /* available units */
+  waitq_t      queue;       /* fibers waiting for a unit */
+};
+
+struct fiber_rwlock {
+  fiber_t     *writer;      /* fiber holding the lock for writing or NULL */
+  unsigned int readers;     /* number of fibers holding it for reading */
+  waitq_t      queue;       /* readers and writers waiting */
+};
+
+struct fiber_barrier {
+  unsigned int count;       /* number of fibers to wait for */
+  unsigned int arrived;     /* number of fibers waiting */
+  waitq_t      queue;       /* fibers waiting */
+};
+
+/* --------------------------------------------------------------------------
+ *  Allocates a zeroed object
+ * --------------------------------------------------------------------------*/
+static void *syncAlloc( size_t size )
+{
+  void *res = malloc( size );
+  if ( res != NULL ) {
+    memset( res, 0, size );
+  }
+  return res;
+}
+
+/* --------------------------------------------------------------------------
+ *  Mutex
+ * --------------------------------------------------------------------------*/
+fiber_mutex_t *fiber_mutex_new()
+{
+  return (fiber_mutex_t*) syncAlloc( sizeof(fiber_mutex_t) );
+}
+
+void fiber_mutex_free( fiber_mutex_t *mutex )
+{
+  free( mutex );
+}
+
+/* --------------------------------------------------------------------------
+ *  Hand off a released mutex to its first waiter
+ * --------------------------------------------------------------------------*/
+static void mutexRelease( fiber_mutex_t *mutex )
+{
+  waiter_t *waiter = waitqFirst( &mutex->queue );
+
+  if ( waiter != NULL ) {
+    mutex->owner = waiter->fiber;
+    waiterFire( waiter );
+  }
+  else {
+    mutex->owner = NULL;
+  }
+}
+
+int fiber_mutex_lock( fiber_t *fiber, fiber_mutex_t *mutex, uint32_t msec )
+{
+  if ( mutex->owner == NULL ) {
+    mutex->owner = fiber;
+    return FIBER_OK;
+  }
+  if ( mutex->owner == fiber ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  /* owner is set by the unlocking fiber */
+  return fiberWaitQueue( fiber, &mutex->queue, NULL, msec );
+}
+
+int fiber_mutex_trylock( fiber_t *fiber, fiber_mutex_t *mutex )
+{
+  if ( mutex->owner != NULL ) {
+    return (mutex->owner == fiber) ? FIBER_ILLEGAL_STATE : FIBER_TIMEOUT;
+  }
+  mutex->owner = fiber;
+  return FIBER_OK;
+}
+
+int fiber_mutex_unlock( fiber_t *fiber, fiber_mutex_t *mutex )
+{
+  if ( mutex->owner != fiber ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  mutexRelease( mutex );
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  Condition variable
+ * --------------------------------------------------------------------------*/
+fiber_cond_t *fiber_cond_new()
+{
+  return (fiber_cond_t*) syncAlloc( sizeof(fiber_cond_t) );
+}
+
+void fiber_cond_free( fiber_cond_t *cond )
+{
+  free( cond );
+}
+
+int fiber_cond_wait( fiber_t *fiber, fiber_cond_t *cond, fiber_mutex_t *mutex,
+		     uint32_t msec )
+{
+  waiter_t waiter;
+  int ret, fired = -1;
+
+  if ( mutex->owner != fiber || fiberCheckBlock( fiber ) != FIBER_OK ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+
+  waiter.fiber = fiber;
+  waiter.data = mutex;
+  waiter.index = 0;
+  waiter.fired = &fired;
+  waitqPush( &cond->queue, &waiter );
+  mutexRelease( mutex );
+
+  ret = fiberWaitOn( fiber, &waiter, 1, msec );
+  if ( ret != FIBER_OK && ret != FIBER_CANCELED ) {
+    /* not signaled, or signaled but the mutex was not handed off yet */
+    fiber_mutex_lock( fiber, mutex, 0 );
+  }
+  return ret;
+}
+
+/* --------------------------------------------------------------------------
+ *  Move the first live waiter of a condition to the queue of its mutex
+ *  Returns 0 if there was none.
+ * --------------------------------------------------------------------------*/
+static int condWakeOne( fiber_cond_t *cond )
+{
+  waiter_t *waiter = waitqFirst( &cond->queue );
+  fiber_mutex_t *mutex;
+
+  if ( waiter == NULL ) {
+    return 0;
+  }
+  waitqRemove( waiter );
+  mutex = (fiber_mutex_t*) waiter->data;
+  if ( mutex->owner == NULL ) {
+    mutex->owner = waiter->fiber;
+    waiterFire( waiter );
+  }
+  else {
+    waitqPush( &mutex->queue, waiter );
+  }
+  return 1;
+}
+
+int fiber_cond_signal( fiber_cond_t *cond )
+{
+  return condWakeOne( cond );
+}
+
+int fiber_cond_broadcast( fiber_cond_t *cond )
+{
+  int n = 0;
+  while( condWakeOne( cond ) ) {
+    ++n;
+  }
+  return n;
+}
+
+/* --------------------------------------------------------------------------
+ *  Semaphore
+ * --------------------------------------------------------------------------*/
+fiber_sem_t *fiber_sem_new( unsigned int count )
+{
+  fiber_sem_t *sem = (fiber_sem_t*) syncAlloc( sizeof(fiber_sem_t) );
+  if ( sem != NULL ) {
+    sem->count = count;
+  }
+  return sem;
+}
+
+void fiber_sem_free( fiber_sem_t *sem )
+{
+  free( sem );
+}
+
+int fiber_sem_wait( fiber_t *fiber, fiber_sem_t *sem, uint32_t msec )
+{
+  if ( sem->count > 0 ) {
+    sem->count --;
+    return FIBER_OK;
+  }
+  /* the unit is handed off by the posting fiber */
+  return fiberWaitQueue( fiber, &sem->queue, NULL, msec );
+}
+
+int fiber_sem_trywait( fiber_sem_t *sem )
+{
+  if ( sem->count == 0 ) {
+    return FIBER_TIMEOUT;
+  }
+  sem->count --;
+  return FIBER_OK;
+}
+
+int fiber_sem_post( fiber_sem_t *sem )
+{
+  waiter_t *waiter = waitqFirst( &sem->queue );
+
+  if ( waiter != NULL ) {
+    waiterFire( waiter );
+  }
+  else {
+    sem->count ++;
+  }
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  Read-write lock
+ * --------------------------------------------------------------------------*/
+fiber_rwlock_t *fiber_rwlock_new()
+{
+  return (fiber_rwlock_t*) syncAlloc( sizeof(fiber_rwlock_t) );
+}
+
+void fiber_rwlock_free( fiber_rwlock_t *rwlock )
+{
+  free( rwlock );
+}
+
+/* --------------------------------------------------------------------------
+ *  Grant the lock to the waiters at the head of the queue
+ * --------------------------------------------------------------------------*/
+static void rwlockGrant( fiber_rwlock_t *rwlock )
+{
+  waiter_t *waiter;
+
+  while( rwlock->writer == NULL && (waiter = waitqFirst( &rwlock->queue )) != NULL ) {
+    if ( waiter->data == RWLOCK_WRITE ) {
+      if ( rwlock->readers > 0 ) {
+	break;
+      }
+      rwlock->writer = waiter->fiber;
+    }
+    else {
+      rwlock->readers ++;
+    }
+    waiterFire( waiter );
+  }
+}
+
+int fiber_rwlock_rdlock( fiber_t *fiber, fiber_rwlock_t *rwlock, uint32_t msec )
+{
+  if ( rwlock->writer == NULL && waitqFirst( &rwlock->queue ) == NULL ) {
+    rwlock->readers ++;
+    return FIBER_OK;
+  }
+  return fiberWaitQueue( fiber, &rwlock->queue, RWLOCK_READ, msec );
+}
+
+int fiber_rwlock_wrlock( fiber_t *fiber, fiber_rwlock_t *rwlock, uint32_t msec )
+{
+  int ret;
+
+  if ( rwlock->writer == NULL && rwlock->readers == 0 ) {
+    rwlock->writer = fiber;
+    return FIBER_OK;
+  }
+  ret = fiberWaitQueue( fiber, &rwlock->queue, RWLOCK_WRITE, msec );
+  if ( ret != FIBER_OK ) {
+    /* readers queued behind this writer may go now */
+    rwlockGrant( rwlock );
+  }
+  return ret;
+}
+
+int fiber_rwlock_unlock( fiber_t *fiber, fiber_rwlock_t *rwlock )
+{
+  if ( rwlock->writer == fiber ) {
+    rwlock->writer = NULL;
+  }
+  else if ( rwlock->readers > 0 ) {
+    rwlock->readers --;
+  }
+  else {
+    return FIBER_ILLEGAL_STATE;
+  }
+  rwlockGrant( rwlock );
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  Barrier
+ * --------------------------------------------------------------------------*/
+fiber_barrier_t *fiber_barrier_new( unsigned int count )
+{
+  fiber_barrier_t *barrier;
+
+  if ( count == 0 ) {
+    return NULL;
+  }
+  barrier = (fiber_barrier_t*) syncAlloc( sizeof(fiber_barrier_t) );
+  if ( barrier != NULL ) {
+    barrier->count = count;
+  }
+  return barrier;
+}
+
+void fiber_barrier_free( fiber_barrier_t *barrier )
+{
+  free( barrier );
+}
+
+int fiber_barrier_wait( fiber_t *fiber, fiber_barrier_t *barrier, uint32_t msec )
+{
+  waiter_t *waiter;
+  int ret;
+
+  if ( ++barrier->arrived == barrier->count ) {
+    barrier->arrived = 0;
+    while( (waiter = waitqFirst( &barrier->queue )) != NULL ) {
+      waiterFire( waiter );
+    }
+    return FIBER_OK;
+  }
+
+  ret = fiberWaitQueue( fiber, &barrier->queue, NULL, msec );
+  if ( ret != FIBER_OK ) {
+    barrier->arrived --;
+  }
+  return ret;
+}
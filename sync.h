@@ -0,0 +1,202 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_SYNC_H__
+#define __FIBER_SYNC_H__
+
+#include "task.h"
+
+/* typedefs */
+typedef struct fiber_mutex   fiber_mutex_t;
+typedef struct fiber_cond    fiber_cond_t;
+typedef struct fiber_sem     fiber_sem_t;
+typedef struct fiber_rwlock  fiber_rwlock_t;
+typedef struct fiber_barrier fiber_barrier_t;
+
+/* ---------------------------------------------------------------------------
+ *  Synchronization objects for fibers of a scheduler
+ *
+ *  Fibers blocked on these objects are parked in a FIFO wait queue, they
+ *  are not polled by the scheduler. When an object is released it is
+ *  handed off to the first waiter which becomes its owner before it even
+ *  runs again : a fiber releasing an object and trying to take it back
+ *  right away can't overtake the waiters.
+ *
+ *  All the blocking functions take a timeout in milliseconds, 0 means
+ *  no timeout, and return FIBER_OK, FIBER_TIMEOUT or FIBER_CANCELED if
+ *  the fiber is stopped while blocked.
+ *
+ *  They are not thread safe : all the fibers using an object must run in
+ *  the same scheduler.
+ * ---------------------------------------------------------------------------
+ */
+
+
+/* ---------------------------------------------------------------------------
+ * fiber_mutex_new --
+ * fiber_mutex_free --
+ *
+ * Allocates and frees a mutex. fiber_mutex_new() returns NULL on memory
+ * allocation failure. No fiber must be blocked on a mutex being freed.
+ * ---------------------------------------------------------------------------
+ */
+fiber_mutex_t *fiber_mutex_new();
+void fiber_mutex_free( fiber_mutex_t *mutex );
+
+/* ---------------------------------------------------------------------------
+ * fiber_mutex_lock --
+ * fiber_mutex_trylock --
+ * fiber_mutex_unlock --
+ *
+ * A mutex is owned by a fiber. It can be kept across yields and waits.
+ *
+ * fiber_mutex_trylock() returns FIBER_TIMEOUT instead of blocking.
+ * Locking a mutex already owned by `fiber' returns FIBER_ILLEGAL_STATE.
+ * Unlocking a mutex not owned by `fiber' returns FIBER_ILLEGAL_STATE.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_mutex_lock( fiber_t *fiber, fiber_mutex_t *mutex, uint32_t msec );
+int fiber_mutex_trylock( fiber_t *fiber, fiber_mutex_t *mutex );
+int fiber_mutex_unlock( fiber_t *fiber, fiber_mutex_t *mutex );
+
+
+/* ---------------------------------------------------------------------------
+ * fiber_cond_new --
+ * fiber_cond_free --
+ *
+ * Allocates and frees a condition variable.
+ * ---------------------------------------------------------------------------
+ */
+fiber_cond_t *fiber_cond_new();
+void fiber_cond_free( fiber_cond_t *cond );
+
+/* ---------------------------------------------------------------------------
+ * fiber_cond_wait --
+ *
+ * Releases `mutex', which must be owned by `fiber', and waits until the
+ * condition is signaled or until `msec' milliseconds elapsed. The mutex
+ * is owned again when the function returns, whatever the result, unless
+ * the fiber was stopped : it is not relocked when FIBER_CANCELED is
+ * returned.
+ *
+ * Returns FIBER_OK, FIBER_TIMEOUT or FIBER_ILLEGAL_STATE if `fiber'
+ * doesn't own `mutex'.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_cond_wait( fiber_t *fiber, fiber_cond_t *cond, fiber_mutex_t *mutex,
+		     uint32_t msec );
+
+/* ---------------------------------------------------------------------------
+ * fiber_cond_signal --
+ * fiber_cond_broadcast --
+ *
+ * Wakes up the first, or all, the fibers waiting on `cond'. They are
+ * moved to the wait queue of their mutex and run once they own it.
+ * Both return the number of fibers woken up.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_cond_signal( fiber_cond_t *cond );
+int fiber_cond_broadcast( fiber_cond_t *cond );
+
+
+/* ---------------------------------------------------------------------------
+ * fiber_sem_new --
+ * fiber_sem_free --
+ *
+ * Allocates a counting semaphore initialized with `count' and frees it.
+ * ---------------------------------------------------------------------------
+ */
+fiber_sem_t *fiber_sem_new( unsigned int count );
+void fiber_sem_free( fiber_sem_t *sem );
+
+/* ---------------------------------------------------------------------------
+ * fiber_sem_wait --
+ * fiber_sem_trywait --
+ * fiber_sem_post --
+ *
+ * fiber_sem_wait() decrements the semaphore, waiting for it to be
+ * positive. fiber_sem_trywait() returns FIBER_TIMEOUT instead of blocking.
+ *
+ * fiber_sem_post() increments the semaphore or, if fibers are waiting,
+ * gives the unit to the first of them. It can be called from outside
+ * of a fiber.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_sem_wait( fiber_t *fiber, fiber_sem_t *sem, uint32_t msec );
+int fiber_sem_trywait( fiber_sem_t *sem );
+int fiber_sem_post( fiber_sem_t *sem );
+
+
+/* ---------------------------------------------------------------------------
+ * fiber_rwlock_new --
+ * fiber_rwlock_free --
+ *
+ * Allocates and frees a read-write lock.
+ * ---------------------------------------------------------------------------
+ */
+fiber_rwlock_t *fiber_rwlock_new();
+void fiber_rwlock_free( fiber_rwlock_t *rwlock );
+
+/* ---------------------------------------------------------------------------
+ * fiber_rwlock_rdlock --
+ * fiber_rwlock_wrlock --
+ * fiber_rwlock_unlock --
+ *
+ * Any number of readers or a single writer can hold the lock.
+ * Waiters are served in FIFO order : a reader arriving while a writer
+ * is waiting queues behind it, so writers are not starved. When a writer
+ * releases the lock all the readers at the head of the queue get it.
+ *
+ * fiber_rwlock_unlock() returns FIBER_ILLEGAL_STATE if the lock isn't
+ * held.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_rwlock_rdlock( fiber_t *fiber, fiber_rwlock_t *rwlock, uint32_t msec );
+int fiber_rwlock_wrlock( fiber_t *fiber, fiber_rwlock_t *rwlock, uint32_t msec );
+int fiber_rwlock_unlock( fiber_t *fiber, fiber_rwlock_t *rwlock );
+
+
+/* ---------------------------------------------------------------------------
+ * fiber_barrier_new --
+ * fiber_barrier_free --
+ *
+ * Allocates a barrier for `count' fibers and frees it.
+ * Returns NULL if `count' is 0 or on memory allocation failure.
+ * ---------------------------------------------------------------------------
+ */
+fiber_barrier_t *fiber_barrier_new( unsigned int count );
+void fiber_barrier_free( fiber_barrier_t *barrier );
+
+/* ---------------------------------------------------------------------------
+ * fiber_barrier_wait --
+ *
+ * Waits until `count' fibers called this function. The last one to arrive
+ * doesn't wait and wakes up the others, the barrier can then be used again.
+ * A fiber leaving on timeout is no longer counted.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_barrier_wait( fiber_t *fiber, fiber_barrier_t *barrier, uint32_t msec );
+
+
+#endif
@@ -22,20 +22,68 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <sys/time.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <sched.h>
 #include <signal.h>
 #include <setjmp.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #include "taskint.h"
-
+#include "tracer.h"
+#include "recorder.h"
+#include "watchdog.h"
+
+#ifdef SCHED_HAS_TSC
+#include <cpuid.h>
+#endif
+
+/* scheduling events feed the flight recorder, always compiled in, and
+ * the tracer, compiled in with -DFIBER_TRACE */
+#ifdef FIBER_TRACE
+#define schedTraceClock() schedTsc()
+#define SCHED_TRACING(sched) ( (sched)->rec != NULL || (sched)->trace != NULL )
+#else
+#define SCHED_TRACING(sched) ( (sched)->rec != NULL )
+#endif
+#define SCHED_TRACE(sched, type, fiber, reason, data)			\
+  do {									\
+    if ( SCHED_TRACING(sched) ) {					\
+      schedTraceEvent( (sched), (type), (fiber), (reason), (data) );	\
+    }									\
+  } while(0)
+#define SCHED_TRACE_OUT(sched, fiber)					\
+  do {									\
+    if ( SCHED_TRACING(sched) ) {					\
+      schedTraceOut( (sched), (fiber) );				\
+    }									\
+  } while(0)
 
 
 /* forward declarations */
 static int schedBoot( fiber_t *fiber );
 static void schedDispatch(scheduler_t *sched);
+static void schedApplyCpus( scheduler_t *sched );
+static void schedDrainInbox( scheduler_t *sched );
+static int schedEpoll( scheduler_t *sched );
+static int schedWakeArm( scheduler_t *sched );
+static void schedRunNext( fiber_t *fiber );
+static void schedRun( scheduler_t *sched, fiber_t *pf );
+static void schedRunDeferred( scheduler_t *sched );
+static void schedDeferredRelease( scheduler_t *sched );
+static void schedRunTimers( scheduler_t *sched );
+static void schedTraceEvent( scheduler_t *sched, int type, fiber_t *fiber,
+			     int reason, int64_t data );
+static void schedTraceOut( scheduler_t *sched, fiber_t *fiber );
+static void schedSliceBegin( scheduler_t *sched, fiber_t *fiber );
+static void schedTscCalibrate( void );
 
 
 /* ----------------------------------------------------------------------------
@@ -52,7 +100,7 @@ static uint32_t fiberHash(fiber_t *fiber)
 /* ----------------------------------------------------------------------------
  * Check existence of fiber
  * ----------------------------------------------------------------------------*/
-static int fiberCheckExist(fiber_t *fiber)
+int fiberCheckExist(fiber_t *fiber)
 {
   if ( fiber == NULL ) {
     return FIBER_NO_SUCH_FIBER;
@@ -75,6 +123,8 @@ static int fiberCheckExist(fiber_t *fiber)
 static int schedCheckPredicate( scheduler_t *sched, predicate_t *pred, uint32_t elapsed)
 {
   int res = PREDICATE_ACTIVE;
+
+  sched->stats.predicates ++;
   if ( (pred->deadline > 0) && (pred->deadline < elapsed) ) {
     pred->state = PREDICATE_FIRED;
     res = 1;
@@ -107,6 +157,79 @@ static void schedProcessPredicate(scheduler_t *sched, predicate_t *pp, uint32_t
   res = schedCheckPredicate( sched, pp, elapsed );
   if ( res ) {
     pf->state = FIBER_RUNNING;
+    if ( sched->acct ) {
+      fiberAcctWake( pf );
+    }
+    SCHED_TRACE( sched, (pp->state == PREDICATE_FIRED) ? TRACE_TIMEOUT : TRACE_WAKE,
+		 pf, 0, 0 );
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Wake up a fiber from any thread.
+ * The fiber is pushed in the inbox of its scheduler which is processed
+ * by the thread running the scheduler during next cycle. That thread is
+ * woken up if it sleeps in sched_poll().
+ * Only fibers parked with the PREDICATE_F_REMOTE flag are woken up, the wake up
+ * is ignored for the others. The caller must keep the fiber from ending
+ * until this function returns, a fiber that ends while it is still in the
+ * inbox is taken out of it.
+ * ----------------------------------------------------------------------------*/
+void schedRemoteWake( fiber_t *fiber )
+{
+  scheduler_t *sched = fiber->scheduler;
+  fiber_t *head;
+
+  /* already in the inbox */
+  if ( __atomic_exchange_n( &fiber->inboxed, 1, __ATOMIC_ACQ_REL ) ) {
+    return;
+  }
+
+  head = __atomic_load_n( &sched->inbox, __ATOMIC_RELAXED );
+  do {
+    fiber->inext = head;
+  } while( !__atomic_compare_exchange_n( &sched->inbox, &head, fiber, 1,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED ) );
+
+  /* the scheduler thread may sleep in sched_poll() : it sets 'polling'
+   * before checking the inbox, either it sees the fiber or we see
+   * the flag. Only the first waker writes the eventfd. */
+  if ( __atomic_load_n( &sched->polling, __ATOMIC_SEQ_CST ) &&
+       __atomic_exchange_n( &sched->polling, 0, __ATOMIC_SEQ_CST ) ) {
+    uint64_t one = 1;
+    if ( write( sched->wakefd, &one, sizeof(one) ) < 0 ) {
+      error( "write to eventfd failed\n" );
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Process the scheduler inbox
+ * ----------------------------------------------------------------------------*/
+static void schedDrainInbox( scheduler_t *sched )
+{
+  fiber_t *pf, *next;
+
+  if ( __atomic_load_n( &sched->inbox, __ATOMIC_RELAXED ) == NULL ) {
+    return;
+  }
+  
+  pf = __atomic_exchange_n( &sched->inbox, NULL, __ATOMIC_ACQUIRE );
+  for( ; pf != NULL; pf = next ) {
+    /* from now on it can be pushed again */
+    next = pf->inext;
+    __atomic_store_n( &pf->inboxed, 0, __ATOMIC_RELEASE );
+
+    if ( pf->state == FIBER_SUSPEND && pf->predicate != NULL &&
+	 (pf->predicate->flags & PREDICATE_F_REMOTE) &&
+	 pf->predicate->state == PREDICATE_ACTIVE ) {
+      pf->predicate->state = PREDICATE_REALIZED;
+      pf->state = FIBER_RUNNING;
+      if ( sched->acct ) {
+	fiberAcctWake( pf );
+      }
+      SCHED_TRACE( sched, TRACE_WAKE, pf, 0, 0 );
+    }
   }
 }
 
@@ -122,10 +245,11 @@ static void schedProcessPredicates(scheduler_t *sched)
   now = sched_timestamp( sched );
   
   for( pf = sched->lists[FIBER_SUSPEND]; pf != NULL; pf = pf->next) {
+    /* already woken up by another fiber */
     if ( pf->state != FIBER_SUSPEND ) {
-      error( "fiber %d not in FIBER_SUSPEND state\n", pf->fid );
       continue;
     }
+    sched->stats.processed[SCHED_PHASE_PREDICATES] ++;
     
     if ( pf->predicate != NULL ) {
       schedProcessPredicate( sched, pf->predicate, now);
@@ -137,6 +261,9 @@ static void schedProcessPredicates(scheduler_t *sched)
       pf->state = FIBER_RUNNING;
     }
   }
+
+  /* fibers woken up by other threads */
+  schedDrainInbox( sched );
 }
 
 /* ----------------------------------------------------------------------------
@@ -189,8 +316,7 @@ static int schedRemoveFiber(scheduler_t *sched, fiber_t *fiber)
   if (sched->fibers[fiber->fid] == fiber) {
     sched->fibers[fiber->fid] = NULL;
     --sched->nfibers;
-    free( fiber->stack );
-    fiber->stack = NULL;
+    schedStackFree( fiber );
     return FIBER_OK;
   }
 
@@ -217,6 +343,8 @@ static int schedRemoveFiber(scheduler_t *sched, fiber_t *fiber)
  *     in their current state : it will change to FIBER_SUSPEND or
  *     FIBER_DONE. They can change the state of another fiber, calling
  *     fiber_term().
+ *     A fiber they wake up (through a channel or fiber_notify() for
+ *     instance) runs as soon as they give back control, in the same pass.
  *
  *   - Then fibers in FIBER_TERM state. Their state is changed to FIBER_DONE.
  *
@@ -233,9 +361,18 @@ static int schedRemoveFiber(scheduler_t *sched, fiber_t *fiber)
 void sched_cycle(scheduler_t *sched, uint32_t timestamp )
 {
   fiber_t *pf, *opf;
+  waiter_t *w;
+  uint64_t start, t;
+  sigset_t mask, oldmask;
+  int masked;
 
   debug("scheduler %p cycle %d\n", sched, timestamp);
 
+  /* bind the calling thread if requested */
+  if ( sched->cpus_pending ) {
+    schedApplyCpus( sched );
+  }
+
   /* register timestamp */
   sched->timestamp = timestamp;
   
@@ -243,6 +380,35 @@ void sched_cycle(scheduler_t *sched, uint32_t timestamp )
   if ( sched->pf_pre_hook ) {
     sched->pf_pre_hook( sched, sched->extra );
   }
+
+  /* phases are timed only when they have work */
+  start = t = schedAcctNow();
+  sched->stats.cycles ++;
+  if ( sched->rec != NULL ) {
+    sched->rec->cycle_nsec = start;
+    sched->rec->cycles ++;
+  }
+  if ( sched->wd != NULL ) {
+    schedWatchdogBind( sched );
+  }
+  if ( sched->cycle_budget != 0 ) {
+    sched->cycle_end = schedTsc() + sched->cycle_budget;
+  }
+  if ( sched->prof != NULL ) {
+    schedProfileBind( sched );
+  }
+
+  /* while a fiber boots, its stack is the alternate signal stack : the
+   * signals of the watchdog and the profiler would be delivered on it,
+   * over the context saved by fiberStart() */
+  masked = sched->lists[FIBER_INIT] != NULL &&
+    ( sched->wd != NULL || sched->prof != NULL );
+  if ( masked ) {
+    sigemptyset( &mask );
+    sigaddset( &mask, FIBER_WATCHDOG_SIGNAL );
+    sigaddset( &mask, SIGPROF );
+    pthread_sigmask( SIG_BLOCK, &mask, &oldmask );
+  }
   
   /* FIBER_INIT to FIBER_RUNNING */
   for( pf = sched->lists[FIBER_INIT]; pf != NULL; pf = pf->next) {
@@ -258,6 +424,7 @@ void sched_cycle(scheduler_t *sched, uint32_t timestamp )
      *  - triggers a SIGUSR1 signal to jump in trampoline code
      *  - returns to */
     schedBoot(pf);
+    SCHED_TRACE( sched, TRACE_BOOT, pf, 0, 0 );
 
     /* Mark fiber as running
      * we do it before init in case yield() gets called from
@@ -268,18 +435,53 @@ void sched_cycle(scheduler_t *sched, uint32_t timestamp )
     if ( pf->pf_init ) {
       pf->pf_init(pf);
     }
+    sched->stats.processed[SCHED_PHASE_INIT] ++;
+  }
+  if ( masked ) {
+    pthread_sigmask( SIG_SETMASK, &oldmask, NULL );
   }
 
   /* Move fibers from init list depending on their new state */
-  schedCleanList( sched, FIBER_INIT );
+  if ( sched->lists[FIBER_INIT] != NULL ) {
+    schedCleanList( sched, FIBER_INIT );
+    schedPhaseEnd( sched, SCHED_PHASE_INIT, &t );
+  }
   
+  /* wake up fibers waiting on ready file descriptors */
+  if ( sched->ioq.head != NULL ) {
+    sched->stats.processed[SCHED_PHASE_IO] += schedIoPoll( sched, 0 );
+    schedPhaseEnd( sched, SCHED_PHASE_IO, &t );
+  }
+
+  /* fire timers then run posted callbacks and tasklets on this stack */
+  if ( sched->ntimers > 0 ) {
+    schedRunTimers( sched );
+    schedPhaseEnd( sched, SCHED_PHASE_TIMERS, &t );
+  }
+  if ( sched->dhead != NULL ) {
+    schedRunDeferred( sched );
+    schedPhaseEnd( sched, SCHED_PHASE_DEFERRED, &t );
+  }
+
   /* process FIBER_SUSPEND fibers */
-  schedProcessPredicates( sched );
-  schedCleanList( sched, FIBER_SUSPEND );
+  if ( sched->lists[FIBER_SUSPEND] != NULL ||
+       __atomic_load_n( &sched->inbox, __ATOMIC_RELAXED ) != NULL ) {
+    schedProcessPredicates( sched );
+    schedCleanList( sched, FIBER_SUSPEND );
+    schedPhaseEnd( sched, SCHED_PHASE_PREDICATES, &t );
+  }
 
   /* dispatch FIBER_RUNNING fibers */
-  schedDispatch( sched );
-  schedCleanList( sched, FIBER_RUNNING );
+  if ( sched->lists[FIBER_RUNNING] != NULL ) {
+    schedDispatch( sched );
+    schedCleanList( sched, FIBER_RUNNING );
+
+    /* fibers run from the run next slot may have left FIBER_SUSPEND */
+    if ( sched->budget < RUNNEXT_BUDGET ) {
+      schedCleanList( sched, FIBER_SUSPEND );
+    }
+    schedPhaseEnd( sched, SCHED_PHASE_DISPATCH, &t );
+  }
   
   /* FIBER_TERM to FIBER_DONE */
   for( pf = sched->lists[FIBER_TERM]; pf != NULL; pf = pf->next ) {
@@ -290,6 +492,16 @@ void sched_cycle(scheduler_t *sched, uint32_t timestamp )
       continue;
     }
 
+    /* resume it one last time to run its cleanup handlers
+     * fibers they wake up run during next cycle */
+    if ( pf->cleanups != NULL ) {
+      sched->budget = 0;
+      schedRun( sched, pf );
+    }
+
+    /* its waiters live on its stack which is about to be freed */
+    fiberUnlinkWaiters( pf );
+
     /* call term function pointer if supplied */
     if ( pf->pf_term ) {
       pf->pf_term(pf);
@@ -298,8 +510,12 @@ void sched_cycle(scheduler_t *sched, uint32_t timestamp )
     /* update fiber state
      * force state to done */
     pf->state = FIBER_DONE;
+    sched->stats.processed[SCHED_PHASE_TERM] ++;
+  }
+  if ( sched->lists[FIBER_TERM] != NULL ) {
+    schedCleanList( sched, FIBER_TERM );
+    schedPhaseEnd( sched, SCHED_PHASE_TERM, &t );
   }
-  schedCleanList( sched, FIBER_TERM );
 
   /* FIBER_DONE list */
   for( pf = sched->lists[FIBER_DONE]; pf != NULL; pf = opf ) {
@@ -313,6 +529,22 @@ void sched_cycle(scheduler_t *sched, uint32_t timestamp )
       continue;
     }
 
+    /* wake up fibers waiting for its end */
+    while( (w = waitqFirst( &pf->joiners )) != NULL ) {
+      waiterFire( w );
+    }
+
+    /* a wake up from another thread may have left it in the inbox */
+    if ( __atomic_load_n( &pf->inboxed, __ATOMIC_ACQUIRE ) ) {
+      schedDrainInbox( sched );
+    }
+
+    /* its counters outlive it */
+    if ( sched->acct ) {
+      schedAcctRetire( sched, pf );
+    }
+    SCHED_TRACE( sched, TRACE_DONE, pf, 0, 0 );
+
     /* Remove from scheduler and free stack */
     schedRemoveFiber( sched, pf);
     
@@ -320,8 +552,18 @@ void sched_cycle(scheduler_t *sched, uint32_t timestamp )
     if ( pf->pf_done ) {
       pf->pf_done(pf);
     }
+    sched->stats.processed[SCHED_PHASE_DONE] ++;
+  }
+  if ( sched->lists[FIBER_DONE] != NULL ) {
+    sched->lists[FIBER_DONE] = NULL;
+    schedPhaseEnd( sched, SCHED_PHASE_DONE, &t );
+  }
+
+  /* the end of the last phase is the end of the cycle */
+  if ( t == start ) {
+    t = schedAcctNow();
   }
-  sched->lists[FIBER_DONE] = NULL;
+  schedHistAdd( &sched->stats.cycle, t - start );
   
   /* Invoke hook */
   if ( sched->pf_post_hook ) {
@@ -329,44 +571,113 @@ void sched_cycle(scheduler_t *sched, uint32_t timestamp )
   }
 }
 
+/* ----------------------------------------------------------------------------
+ * Run a fiber until it gives back control to the scheduler
+ * ----------------------------------------------------------------------------*/
+static void schedRun(scheduler_t *sched, fiber_t *pf)
+{
+  trace("Will run fiber %p (fid = %d)\n", pf, pf->fid);
+    
+  /* Save the current state */
+  if ( setjmp( sched->context ) ) {
+    /* none running */
+    if ( sched->acct ) {
+      schedAcctSwitch( sched, NULL );
+    }
+    SCHED_TRACE_OUT( sched, sched->running );
+    sched->running = NULL;
+      
+    /* The fiber yielded the context to us
+     * the fiber run() method has returned */
+    if ( pf->state == FIBER_DONE ) {
+      /* If we get here, the fiber returned and is done! */
+      debug( "Fiber %d returned, cleaning up.\n", pf->fid );
+    }
+    else if ( pf->state == FIBER_TERM ) {
+      /* If we get here, the fiber returned and is done! */
+      debug( "Fiber %d kill, cleaning up.\n", pf->fid );
+    }
+    else {
+      trace( "Fiber %d yielded execution.\n", pf->fid );
+    }
+  }
+  else {
+    debug( "Switching to fiber %d\n", pf->fid );
+    if ( sched->acct ) {
+      schedAcctSwitch( sched, pf );
+    }
+    SCHED_TRACE( sched, TRACE_SWITCH_IN, pf, 0, 0 );
+    sched->switch_seq ++;
+    if ( sched->slicing ) {
+      schedSliceBegin( sched, pf );
+    }
+    sched->running = pf;
+    longjmp( pf->context, 1 );
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * The cycle budget is exhausted : 'pf' and the fibers after it in the list
+ * of running fibers are left for next cycle, 'prev' is the fiber before it.
+ * schedCleanList() reverses the list, so they are reversed here to end up
+ * first, in the same order : none of them can be left behind for good.
+ * ----------------------------------------------------------------------------*/
+static void schedDispatchCut( scheduler_t *sched, fiber_t *prev, fiber_t *pf )
+{
+  fiber_t *head = NULL, *next;
+
+  for( ; pf != NULL; pf = next ) {
+    next = pf->next;
+    pf->next = head;
+    head = pf;
+  }
+  prev->next = head;
+  sched->stats.budget_cuts ++;
+}
+
 /* ----------------------------------------------------------------------------
  * Dispatching next fiber whose state is FIBER_RUNNING
  * Naive implementation running all fibers in turn without trying to share time 
- * between them
+ * between them.
+ * A fiber woken up by the running fiber is put in the run next slot and
+ * runs right after it, in the same pass, even if it is not in the list
+ * of running fibers yet.
+ * Once the cycle budget is exhausted, the fibers left wait for next cycle.
  * ----------------------------------------------------------------------------*/
 static void schedDispatch(scheduler_t *sched)
 {
-  fiber_t *pf, *opf;
+  fiber_t *pf, *opf, *prev, *next;
+  int ran = 0;
+
+  sched->budget = RUNNEXT_BUDGET;
 
   /* scan ready to run fibers */
-  for( pf = sched->lists[FIBER_RUNNING], opf = NULL; pf; pf = opf) {
+  for( pf = sched->lists[FIBER_RUNNING], prev = NULL; pf; prev = pf, pf = opf) {
     opf = pf->next;
 
-    trace("Will run fiber %p (fid = %d)\n", pf, pf->fid);
-    
-    /* Save the current state */
-    if ( setjmp( sched->context ) ) {
-      /* none running */
-      sched->running = NULL;
-      
-      /* The fiber yielded the context to us
-       * the fiber run() method has returned */
-      if ( pf->state == FIBER_DONE ) {
-	/* If we get here, the fiber returned and is done! */
-	debug( "Fiber %d returned, cleaning up.\n", pf->fid );
-      }
-      else if ( pf->state == FIBER_TERM ) {
-	/* If we get here, the fiber returned and is done! */
-	debug( "Fiber %d kill, cleaning up.\n", pf->fid );
-      }
-      else {
-	trace( "Fiber %d yielded execution.\n", pf->fid );
-      }
+    /* it may have been stopped, or run and suspended after another
+     * fiber yielded to it */
+    if ( pf->state != FIBER_RUNNING ) {
+      continue;
     }
-    else {
-      debug( "Switching to fiber %d\n", pf->fid );
-      sched->running = pf;
-      longjmp( pf->context, 1 );
+
+    /* at least one fiber runs per cycle */
+    if ( ran > 0 && sched->cycle_end != UINT64_MAX &&
+	 schedTsc() >= sched->cycle_end ) {
+      schedDispatchCut( sched, prev, pf );
+      break;
+    }
+    ran ++;
+    schedRun( sched, pf );
+    sched->stats.processed[SCHED_PHASE_DISPATCH] ++;
+
+    /* fibers woken up meanwhile, newest first */
+    while( (next = sched->runnext) != NULL ) {
+      sched->runnext = NULL;
+      if ( next->state == FIBER_RUNNING ) {
+	schedRun( sched, next );
+	sched->stats.processed[SCHED_PHASE_DISPATCH] ++;
+      }
     }
   }
   
@@ -374,8 +685,13 @@ static void schedDispatch(scheduler_t *sched)
 }
 
 /* contains the currently booting fiber */
-/* marked as volatile to prevent access optimization by the compiler */
-static volatile fiber_t *bootingFiber = NULL;
+/* marked as volatile to prevent access optimization by the compiler
+ * there is one per thread so that schedulers can run on several threads */
+static __thread volatile fiber_t *bootingFiber = NULL;
+
+/* SIGUSR1 handler is process wide : it is installed by one booting
+ * thread at a time */
+static volatile char bootLock = 0;
 
 /*
  * ----------------------------------------------------------------------------
@@ -407,8 +723,10 @@ static void fiberStart(int ignored)
   fiber->pf_run(fiber);
 
   /* fiber function returned
+   * handlers left behind point to its dead frames
    * jump back to scheduler */
   debug("Fiber %d now in state FIBER_DONE.\n", fiber->fid);
+  fiber->cleanups = NULL;
   fiber->state = FIBER_DONE;
   longjmp(fiber->scheduler->context, FIBER_DONE);
 }
@@ -435,7 +753,7 @@ static int schedBoot( fiber_t *fiber )
   stack.ss_flags = 0;
   stack.ss_size = fiber->stacksz;
   stack.ss_sp = fiber->stack;
-  debug( "Stack address for fiber = 0x%x\n", stack.ss_sp );
+  debug( "Stack address for fiber = %p\n", stack.ss_sp );
 	
   /* Install the new stack for the signal handler */
   if ( sigaltstack( &stack, &oldStack ) ) {
@@ -449,8 +767,13 @@ static int schedBoot( fiber_t *fiber )
   handler.sa_flags = SA_ONSTACK;
   sigemptyset( &handler.sa_mask );
 
+  while( __atomic_test_and_set( &bootLock, __ATOMIC_ACQUIRE ) ) {
+    sched_yield();
+  }
   if ( sigaction( SIGUSR1, &handler, &oldHandler ) ) {
     error( "Error: sigaction failed.");
+    __atomic_clear( &bootLock, __ATOMIC_RELEASE );
+    sigaltstack( &oldStack, 0 );
     return FIBER_SIGNALERROR;
   }
 
@@ -461,6 +784,8 @@ static int schedBoot( fiber_t *fiber )
   /* Call the handler on the new stack */
   if ( raise( SIGUSR1 ) ) {
     error( "Error: raise failed.\n");
+    sigaction( SIGUSR1, &oldHandler, 0 );
+    __atomic_clear( &bootLock, __ATOMIC_RELEASE );
     bootingFiber = backup;
     return FIBER_SIGNALERROR;
   }
@@ -469,13 +794,73 @@ static int schedBoot( fiber_t *fiber )
    * Restore the original stack and handler */
   sigaltstack( &oldStack, 0 );
   sigaction( SIGUSR1, &oldHandler, 0 );
+  __atomic_clear( &bootLock, __ATOMIC_RELEASE );
 
   bootingFiber = backup;
   return FIBER_OK;
 }
 
+/* ----------------------------------------------------------------------------
+ * Terminate the running fiber : its cleanup handlers run on its stack
+ * then it goes back to the scheduler in TERM state, never to resume.
+ * ----------------------------------------------------------------------------*/
+static void fiberExit( fiber_t *fiber )
+{
+  fiber_cleanup_t *cleanup;
+
+  debug( "Fiber %d canceled.\n", fiber->fid );
+  while( (cleanup = fiber->cleanups) != NULL ) {
+    /* popped first : a handler that blocks doesn't run twice */
+    fiber->cleanups = cleanup->next;
+    cleanup->fn( cleanup->arg );
+  }
+  fiber->predicate = NULL;
+  fiber->state = FIBER_TERM;
+  longjmp( fiber->scheduler->context, FIBER_TERM );
+}
+
+/* ----------------------------------------------------------------------------
+ * Cancellation point, reached by a fiber resuming and by a fiber about to
+ * give back the processor. The first time a stopped fiber gets here,
+ * FIBER_CANCELED is returned so that the wait function it is in can return
+ * it. The next time, the fiber is terminated and this function doesn't
+ * return.
+ * ----------------------------------------------------------------------------*/
+int fiberCancelPoint( fiber_t *fiber )
+{
+  if ( !(fiber->flags & FIBER_F_CANCELED) ) {
+    return FIBER_OK;
+  }
+  if ( fiber->flags & FIBER_F_CANCEL_SEEN ) {
+    fiberExit( fiber );
+  }
+  fiber->flags |= FIBER_F_CANCEL_SEEN;
+  return FIBER_CANCELED;
+}
+
+/* ----------------------------------------------------------------------------
+ * Only the running fiber can block, and only if it has a stack : the fiber
+ * of a tasklet runs on the stack of the scheduler.
+ * Returns FIBER_OK or FIBER_ILLEGAL_STATE.
+ * ----------------------------------------------------------------------------*/
+int fiberCheckBlock( fiber_t *fiber )
+{
+  if ( fiber == NULL ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  if ( fiber->flags & FIBER_F_STACKLESS ) {
+    error("Tasklet %p tried to block : rejected.\n", fiber);
+    return FIBER_ILLEGAL_STATE;
+  }
+  if ( fiber->scheduler == NULL || fiber->scheduler->running != fiber ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  return FIBER_OK;
+}
+
 /* ----------------------------------------------------------------------------
  * Called by a fiber to give back the processor
+ * Returns FIBER_CANCELED if the fiber was stopped meanwhile.
  * ----------------------------------------------------------------------------*/
 int fiberYield(fiber_t *fiber)
 {
@@ -484,11 +869,20 @@ int fiberYield(fiber_t *fiber)
     scheduler_t *sched = fiber->scheduler;
 
     /* xtra check - only the currently running fiber can yield */
-    if ( (sched != NULL) && (sched->running == fiber)) {
+    if ( (sched != NULL) && (sched->running == fiber) &&
+	 !(fiber->flags & FIBER_F_STACKLESS) ) {
+      /* a stopped fiber blocking again ends here */
+      if ( fiber->flags & FIBER_F_CANCEL_SEEN ) {
+	fiberCancelPoint( fiber );
+      }
+
       /* Store the current state */
       if ( setjmp( fiber->context ) ) {
-	/* Returning via longjmp (resume) */
+	/* Returning via longjmp (resume) : the predicate of the wait
+	 * lives in the frame of the wait function which is returning */
 	debug( "Fiber %d resuming...\n", fiber->fid );
+	fiber->predicate = NULL;
+	return fiberCancelPoint( fiber );
       }
       else {
 	debug( "Fiber %d yielding the processor...\n", fiber->fid );
@@ -516,6 +910,50 @@ int fiber_yield(fiber_t *fiber)
   return fiber_wait( fiber, 0);
 }
 
+/* ----------------------------------------------------------------------------
+ * fiber_yield_to
+ * The scheduler context saved by the dispatch loop is left untouched :
+ * the fiber which finally gives back control to the scheduler returns
+ * to the dispatch loop as if it was 'fiber'.
+ * ----------------------------------------------------------------------------*/
+int fiber_yield_to(fiber_t *fiber, fiber_t *target)
+{
+  scheduler_t *sched;
+
+  if ( fiber != NULL && fiberCheckBlock(fiber) != FIBER_OK ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  if ( fiberCheckExist(fiber) != FIBER_OK || fiberCheckExist(target) != FIBER_OK ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  sched = fiber->scheduler;
+  if ( target == fiber ) {
+    return FIBER_OK;
+  }
+  if ( target->scheduler != sched || target->state != FIBER_RUNNING ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  if ( fiber->flags & FIBER_F_CANCEL_SEEN ) {
+    fiberCancelPoint( fiber );
+  }
+
+  if ( !setjmp( fiber->context ) ) {
+    trace( "Fiber %d yielding to fiber %d\n", fiber->fid, target->fid );
+    if ( sched->acct ) {
+      schedAcctSwitch( sched, target );
+    }
+    SCHED_TRACE_OUT( sched, fiber );
+    SCHED_TRACE( sched, TRACE_SWITCH_IN, target, 0, 0 );
+    sched->switch_seq ++;
+    if ( sched->slicing ) {
+      schedSliceBegin( sched, target );
+    }
+    sched->running = target;
+    longjmp( target->context, 1 );
+  }
+  return fiberCancelPoint( fiber );
+}
+
 /* ----------------------------------------------------------------------------
  * function to wait for a given amount of time
  * ----------------------------------------------------------------------------*/
@@ -523,6 +961,10 @@ int fiber_wait(fiber_t *fiber, uint32_t msec)
 {
   predicate_t pred;
 
+  if ( fiberCheckBlock( fiber ) != FIBER_OK ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+
   /* clean predicate */
   memset( &pred, 0, sizeof(pred));
 
@@ -542,7 +984,9 @@ int fiber_wait(fiber_t *fiber, uint32_t msec)
   }
 
   /* give processor */
-  fiberYield( fiber );
+  if ( fiberYield( fiber ) == FIBER_CANCELED ) {
+    return FIBER_CANCELED;
+  }
 
   /* point reached when resuming fiber execution */
   if ( msec > 0 ) {
@@ -561,6 +1005,10 @@ int fiber_wait_for_cond( fiber_t *fiber, uint32_t msec, pf_check_t pfun, void *p
 {
   predicate_t pred;
 
+  if ( fiberCheckBlock( fiber ) != FIBER_OK ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+
   /* check argument */
   if ( pfun == NULL ) {
     /* if bad - yield and return error */
@@ -590,7 +1038,9 @@ int fiber_wait_for_cond( fiber_t *fiber, uint32_t msec, pf_check_t pfun, void *p
   fiber->state = FIBER_SUSPEND;
 
   /* yield */
-  fiberYield( fiber );
+  if ( fiberYield( fiber ) == FIBER_CANCELED ) {
+    return FIBER_CANCELED;
+  }
 
   /* execution resume here */
   if ( pred.state == PREDICATE_FIRED ) {
@@ -600,35 +1050,20 @@ int fiber_wait_for_cond( fiber_t *fiber, uint32_t msec, pf_check_t pfun, void *p
   return FIBER_OK;
 }
 
-struct join_check_data {
-  fiber_t *other;
-  int fid;
-};
-
-/* ----------------------------------------------------------------------------
- * Check function used during join operation
- * ----------------------------------------------------------------------------*/
-static int fiber_join_check( fiber_t *fiber, void *data)
-{
-  struct join_check_data *jdata  = (fiber_t*) data;
-  fiber_t** fibers = fiber->scheduler->fibers;
-  return ( fibers[jdata->fid] != jdata->other );
-}
-
 /* ----------------------------------------------------------------------------
- * fonction to wait for a given fiber to finish
- * part of public API
+ * Suspend a fiber until it is woken up with schedWakeup(), with
+ * schedRemoteWake() if 'flags' has PREDICATE_F_REMOTE set, or until
+ * 'msec' milliseconds elapsed ('msec' = 0 means no timeout).
+ * Wake ups may be spurious : callers must check their condition again.
+ * Returns FIBER_ILLEGAL_STATE at once if the fiber can't block.
  * ----------------------------------------------------------------------------*/
-int fiber_join( fiber_t *fiber, uint32_t msec, fiber_t *other)
+int fiberPark( fiber_t *fiber, uint32_t msec, uint8_t flags )
 {
   predicate_t pred;
-  struct join_check_data jdata;
-  
-  /* check argument */
-  if ( other == NULL ) {
-    /* if bad - yield and return error */
-    fiberYield( fiber );
-    return FIBER_NO_SUCH_FIBER;
+  int ret;
+
+  if ( fiberCheckBlock( fiber ) != FIBER_OK ) {
+    return FIBER_ILLEGAL_STATE;
   }
 
   /* clean predicate */
@@ -637,16 +1072,10 @@ int fiber_join( fiber_t *fiber, uint32_t msec, fiber_t *other)
   /* fill predicate */
   pred.fiber = fiber;
   pred.state = PREDICATE_ACTIVE;
+  pred.flags = flags;
   if ( msec > 0 ) {
     pred.deadline = sched_timestamp( fiber->scheduler ) + msec;
   }
-  else {
-    pred.deadline = 0;
-  }
-  jdata.other = other;
-  jdata.fid = other->fid;
-  pred.data = (void*) &jdata;
-  pred.pf_check = &fiber_join_check;
 
   /* link fiber to predicate */
   fiber->predicate = &pred;
@@ -655,318 +1084,1465 @@ int fiber_join( fiber_t *fiber, uint32_t msec, fiber_t *other)
   fiber->state = FIBER_SUSPEND;
 
   /* yield */
-  fiberYield( fiber );
+  ret = fiberYield( fiber );
 
   /* execution resume here */
+  if ( ret == FIBER_CANCELED ) {
+    return FIBER_CANCELED;
+  }
   if ( pred.state == PREDICATE_FIRED ) {
     return FIBER_TIMEOUT;
   }
-  
   return FIBER_OK;
 }
 
-
-struct var_check_data
-{
-  int *addr;
-  int  value;
-};
-
-static int fiber_var_check( fiber_t *fiber, void *data )
-{
-  struct var_check_data *vcd = (struct var_check_data*) data;
-  return (*vcd->addr == vcd->value);
-}
-
-/* 
- * fonction to wait for a given predicate
- */
-int fiber_wait_for_var( fiber_t *fiber, uint32_t msec, int *addr, int value)
+/* ----------------------------------------------------------------------------
+ * Park the running fiber and switch directly to 'target', a fiber parked
+ * with fiberPark() which is woken up. Neither fiber goes through the
+ * scheduler, 'fiber' resumes when it is woken up in turn.
+ * Returns FIBER_ILLEGAL_STATE without switching if 'target' is not parked.
+ * ----------------------------------------------------------------------------*/
+int fiberSwitch( fiber_t *fiber, fiber_t *target )
 {
-  struct var_check_data vcd;
+  scheduler_t *sched = fiber->scheduler;
   predicate_t pred;
-  
-  /* check argument */
-  if ( addr == NULL ) {
-    /* if bad - yield and return error */
-    fiberYield( fiber );
-    return FIBER_INVALID_PREDICATE;
+
+  if ( fiberCheckBlock( fiber ) != FIBER_OK ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  if ( target->scheduler != sched ||
+       target->state != FIBER_SUSPEND || target->predicate == NULL ||
+       target->predicate->state != PREDICATE_ACTIVE ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  if ( fiber->flags & FIBER_F_CANCEL_SEEN ) {
+    fiberCancelPoint( fiber );
   }
 
-  /* clean predicate */
+  /* park */
   memset( &pred, 0, sizeof(pred));
-
-  /* fill predicate */
   pred.fiber = fiber;
   pred.state = PREDICATE_ACTIVE;
-  if ( msec > 0 ) {
-    pred.deadline = sched_timestamp( fiber->scheduler ) + msec;
-  }
-  else {
-    pred.deadline = 0;
-  }
-  pred.data = &vcd;
-  pred.pf_check = &fiber_var_check;
-
-  /* fill values used for checking */
-  vcd.addr = addr;
-  vcd.value = value;
-  
-  /* link fiber to predicate */
   fiber->predicate = &pred;
-
-  /* change fiber state */
   fiber->state = FIBER_SUSPEND;
 
-  /* yield */
-  fiberYield( fiber );
+  /* wake up target */
+  target->predicate->state = PREDICATE_REALIZED;
+  target->state = FIBER_RUNNING;
 
-  /* execution resume here */
-  if ( pred.state == PREDICATE_FIRED ) {
-    return FIBER_TIMEOUT;
+  if ( !setjmp( fiber->context ) ) {
+    trace( "Fiber %d switching to fiber %d\n", fiber->fid, target->fid );
+    if ( sched->acct ) {
+      fiberAcctWake( target );
+      schedAcctSwitch( sched, target );
+    }
+    SCHED_TRACE( sched, TRACE_WAKE, target, 0, 0 );
+    SCHED_TRACE_OUT( sched, fiber );
+    SCHED_TRACE( sched, TRACE_SWITCH_IN, target, 0, 0 );
+    sched->switch_seq ++;
+    if ( sched->slicing ) {
+      schedSliceBegin( sched, target );
+    }
+    sched->running = target;
+    longjmp( target->context, 1 );
   }
-  
-  return FIBER_OK;
+  fiber->predicate = NULL;
+  return fiberCancelPoint( fiber );
 }
 
-
-/*
- * ---------------------------------------------------------------------------
- *  fiber_new --
- *  
+/* ----------------------------------------------------------------------------
+ * Wake up a fiber parked with fiberPark() from the thread running its
+ * scheduler. It will run during the next dispatch.
+ * Returns 1 if the fiber was woken up, 0 if it was not parked.
+ * ----------------------------------------------------------------------------*/
+int schedWakeup( fiber_t *fiber )
+{
+  if ( fiber->state != FIBER_SUSPEND || fiber->predicate == NULL ||
+       fiber->predicate->state != PREDICATE_ACTIVE ) {
+    return 0;
+  }
+  fiber->predicate->state = PREDICATE_REALIZED;
+  fiber->state = FIBER_RUNNING;
+  if ( fiber->scheduler->acct ) {
+    fiberAcctWake( fiber );
+  }
+  SCHED_TRACE( fiber->scheduler, TRACE_WAKE, fiber, 0, 0 );
+  if ( fiber->flags & FIBER_F_STACKLESS ) {
+    fiber->pf_run( fiber );
+  }
+  else {
+    schedRunNext( fiber );
+  }
+  return 1;
+}
+
+/* ----------------------------------------------------------------------------
+ * Put a fiber that was just made runnable in the run next slot if it is
+ * woken up by a fiber of its scheduler. A fiber already in the slot is
+ * not lost : it stays in RUNNING state and runs during next cycle.
+ * ----------------------------------------------------------------------------*/
+static void schedRunNext( fiber_t *fiber )
+{
+  scheduler_t *sched = fiber->scheduler;
+
+  if ( sched->running != NULL && sched->running != fiber && sched->budget > 0 ) {
+    sched->runnext = fiber;
+    sched->budget --;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * fiber_notify
+ * ----------------------------------------------------------------------------*/
+int fiber_notify( fiber_t *fiber )
+{
+  predicate_t *pred;
+
+  if ( fiberCheckExist(fiber) != FIBER_OK || fiber->scheduler == NULL ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  pred = fiber->predicate;
+  if ( fiber->state != FIBER_SUSPEND || pred == NULL ||
+       pred->state != PREDICATE_ACTIVE ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+
+  /* only the condition is checked, timers are handled by the scheduler */
+  if ( pred->pf_check == NULL || !pred->pf_check( fiber, pred->data ) ) {
+    return FIBER_TIMEOUT;
+  }
+  pred->state = PREDICATE_REALIZED;
+  fiber->state = FIBER_RUNNING;
+  if ( fiber->scheduler->acct ) {
+    fiberAcctWake( fiber );
+  }
+  SCHED_TRACE( fiber->scheduler, TRACE_WAKE, fiber, 0, 0 );
+  schedRunNext( fiber );
+  return FIBER_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Append a waiter to a wait queue
+ * ----------------------------------------------------------------------------*/
+void waitqPush( waitq_t *queue, waiter_t *waiter )
+{
+  waiter->queue = queue;
+  waiter->next = NULL;
+  waiter->prev = queue->tail;
+  if ( queue->tail ) {
+    queue->tail->next = waiter;
+  }
+  else {
+    queue->head = waiter;
+  }
+  queue->tail = waiter;
+}
+
+/* ----------------------------------------------------------------------------
+ * Unlink a waiter from its wait queue, if it is still linked in one
+ * ----------------------------------------------------------------------------*/
+void waitqRemove( waiter_t *waiter )
+{
+  waitq_t *queue = waiter->queue;
+
+  if ( queue == NULL ) {
+    return;
+  }
+  if ( waiter->prev ) {
+    waiter->prev->next = waiter->next;
+  }
+  else {
+    queue->head = waiter->next;
+  }
+  if ( waiter->next ) {
+    waiter->next->prev = waiter->prev;
+  }
+  else {
+    queue->tail = waiter->prev;
+  }
+  waiter->next = waiter->prev = NULL;
+  waiter->queue = NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * A waiter can be fired if its fiber is still parked and if none of the
+ * other waiters of the fiber was fired.
+ * ----------------------------------------------------------------------------*/
+int waiterLive( waiter_t *waiter )
+{
+  fiber_t *fiber = waiter->fiber;
+  return ( *waiter->fired < 0 &&
+	   fiber->state == FIBER_SUSPEND &&
+	   fiber->predicate != NULL &&
+	   fiber->predicate->state == PREDICATE_ACTIVE );
+}
+
+/* ----------------------------------------------------------------------------
+ * Returns the first waiter of the queue that can be fired or NULL.
+ * Dead waiters met on the way are unlinked.
+ * ----------------------------------------------------------------------------*/
+waiter_t *waitqFirst( waitq_t *queue )
+{
+  waiter_t *waiter;
+
+  while( (waiter = queue->head) != NULL ) {
+    if ( waiterLive( waiter ) ) {
+      return waiter;
+    }
+    waitqRemove( waiter );
+  }
+  return NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Fire a live waiter : unlink it and wake up its fiber
+ * ----------------------------------------------------------------------------*/
+void waiterFire( waiter_t *waiter )
+{
+  *waiter->fired = waiter->index;
+  waitqRemove( waiter );
+  schedWakeup( waiter->fiber );
+}
+
+/* ----------------------------------------------------------------------------
+ * Park a fiber whose 'n' waiters were pushed in their wait queues.
+ * The caller checks with fiberCheckBlock() that the fiber can block before
+ * it pushes them. When it returns all the waiters are unlinked.
+ * Returns FIBER_OK if a waiter was fired, even if the fiber was stopped
+ * meanwhile, FIBER_CANCELED if it was stopped, FIBER_ILLEGAL_STATE if it
+ * can't block, FIBER_TIMEOUT otherwise.
+ * ----------------------------------------------------------------------------*/
+int fiberWaitOn( fiber_t *fiber, waiter_t *waiters, int n, uint32_t msec )
+{
+  int ret;
+
+  fiber->waiters = waiters;
+  fiber->nwaiters = n;
+  ret = fiberPark( fiber, msec, 0 );
+  fiberUnlinkWaiters( fiber );
+  if ( ret == FIBER_ILLEGAL_STATE ) {
+    return ret;
+  }
+  /* a fiber stopped after a waiter fired keeps what it was handed,
+   * it ends at its next cancellation point */
+  if ( *waiters[0].fired >= 0 ) {
+    return FIBER_OK;
+  }
+  return ( ret == FIBER_CANCELED ) ? FIBER_CANCELED : FIBER_TIMEOUT;
+}
+
+/* ----------------------------------------------------------------------------
+ * Park a fiber on a single wait queue. 'data' is stored in the waiter.
+ * Returns as fiberWaitOn().
+ * ----------------------------------------------------------------------------*/
+int fiberWaitQueue( fiber_t *fiber, waitq_t *queue, void *data, uint32_t msec )
+{
+  waiter_t waiter;
+  int fired = -1;
+
+  if ( fiberCheckBlock( fiber ) != FIBER_OK ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+
+  waiter.fiber = fiber;
+  waiter.data = data;
+  waiter.index = 0;
+  waiter.fired = &fired;
+  waitqPush( queue, &waiter );
+
+  return fiberWaitOn( fiber, &waiter, 1, msec );
+}
+
+/* ----------------------------------------------------------------------------
+ * Unlink the waiters of a fiber which resumes or terminates
+ * ----------------------------------------------------------------------------*/
+void fiberUnlinkWaiters( fiber_t *fiber )
+{
+  waiter_t *waiter;
+  int i;
+
+  for( i = 0; i < fiber->nwaiters; ++i ) {
+    waiter = &fiber->waiters[i];
+    if ( waiter->queue == &fiber->scheduler->ioq ) {
+      epoll_ctl( fiber->scheduler->epfd, EPOLL_CTL_DEL,
+		 (int) (intptr_t) waiter->data, NULL );
+    }
+    waitqRemove( waiter );
+  }
+  fiber->waiters = NULL;
+  fiber->nwaiters = 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Create the epoll instance of a scheduler on first use
+ * ----------------------------------------------------------------------------*/
+static int schedEpoll( scheduler_t *sched )
+{
+  if ( sched->epfd < 0 ) {
+    sched->epfd = epoll_create1( EPOLL_CLOEXEC );
+    if ( sched->epfd < 0 ) {
+      error( "epoll_create1 failed\n" );
+      return FIBER_ERROR;
+    }
+  }
+  return FIBER_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Create the eventfd other threads write to wake up a scheduler sleeping
+ * in sched_poll(). It is watched by the epoll instance with a NULL waiter.
+ * ----------------------------------------------------------------------------*/
+static int schedWakeArm( scheduler_t *sched )
+{
+  struct epoll_event ev;
+
+  if ( sched->wakefd >= 0 ) {
+    return FIBER_OK;
+  }
+  if ( schedEpoll( sched ) != FIBER_OK ) {
+    return FIBER_ERROR;
+  }
+  sched->wakefd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+  if ( sched->wakefd < 0 ) {
+    error( "eventfd failed\n" );
+    return FIBER_ERROR;
+  }
+  memset( &ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if ( epoll_ctl( sched->epfd, EPOLL_CTL_ADD, sched->wakefd, &ev ) ) {
+    close( sched->wakefd );
+    sched->wakefd = -1;
+    return FIBER_ERROR;
+  }
+  return FIBER_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Arm a waiter on a file descriptor : it is fired by schedIoPoll() when
+ * 'fd' is ready for 'events' (EPOLLIN, EPOLLOUT). The registration is
+ * removed when the waiter is fired or when its fiber unlinks its waiters.
+ * A file descriptor can only be waited on by one waiter at a time.
+ * ----------------------------------------------------------------------------*/
+int schedIoArm( scheduler_t *sched, waiter_t *waiter, int fd, uint32_t events )
+{
+  struct epoll_event ev;
+
+  if ( schedEpoll( sched ) != FIBER_OK ) {
+    return FIBER_ERROR;
+  }
+
+  memset( &ev, 0, sizeof(ev));
+  ev.events = events | EPOLLONESHOT;
+  ev.data.ptr = waiter;
+  if ( epoll_ctl( sched->epfd, EPOLL_CTL_ADD, fd, &ev ) ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  waiter->data = (void*) (intptr_t) fd;
+  waitqPush( &sched->ioq, waiter );
+  return FIBER_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Fire the waiters whose file descriptor is ready, waiting up to 'msec'
+ * milliseconds (-1 : no limit) for one to be.
+ * Returns the number of fibers woken up.
+ * ----------------------------------------------------------------------------*/
+int schedIoPoll( scheduler_t *sched, int msec )
+{
+  struct epoll_event evs[64];
+  waiter_t *waiter;
+  int i, n, woken = 0;
+
+  n = epoll_wait( sched->epfd, evs, sizeof(evs)/sizeof(evs[0]), msec );
+  for( i = 0; i < n; ++i ) {
+    waiter = (waiter_t*) evs[i].data.ptr;
+    /* woken up by schedRemoteWake(), the inbox is drained by the cycle */
+    if ( waiter == NULL ) {
+      uint64_t cnt;
+      if ( read( sched->wakefd, &cnt, sizeof(cnt) ) < 0 ) {
+	/* already read */
+      }
+      continue;
+    }
+    epoll_ctl( sched->epfd, EPOLL_CTL_DEL, (int) (intptr_t) waiter->data, NULL );
+    if ( waiterLive( waiter ) ) {
+      waiterFire( waiter );
+      woken ++;
+    }
+    else {
+      waitqRemove( waiter );
+    }
+  }
+  return woken;
+}
+
+/* ----------------------------------------------------------------------------
+ * sched_poll
+ * ----------------------------------------------------------------------------*/
+int sched_poll( scheduler_t *sched, uint32_t msec )
+{
+  int n;
+
+  if ( sched == NULL ) {
+    return 0;
+  }
+  if ( msec == 0 || schedWakeArm( sched ) != FIBER_OK ) {
+    return ( sched->ioq.head == NULL ) ? 0 : schedIoPoll( sched, 0 );
+  }
+
+  /* see schedRemoteWake() */
+  __atomic_store_n( &sched->polling, 1, __ATOMIC_SEQ_CST );
+  if ( __atomic_load_n( &sched->inbox, __ATOMIC_SEQ_CST ) != NULL ) {
+    msec = 0;
+  }
+  n = schedIoPoll( sched, (msec > INT_MAX) ? -1 : (int) msec );
+  __atomic_store_n( &sched->polling, 0, __ATOMIC_SEQ_CST );
+  return n;
+}
+
+struct join_check_data {
+  fiber_t *other;
+  int fid;
+};
+
+/* ----------------------------------------------------------------------------
+ * Check function used during join operation
+ * ----------------------------------------------------------------------------*/
+static int fiber_join_check( fiber_t *fiber, void *data)
+{
+  struct join_check_data *jdata  = (fiber_t*) data;
+  fiber_t** fibers = fiber->scheduler->fibers;
+  return ( fibers[jdata->fid] != jdata->other );
+}
+
+/* ----------------------------------------------------------------------------
+ * fonction to wait for a given fiber to finish
+ * part of public API
+ * ----------------------------------------------------------------------------*/
+int fiber_join( fiber_t *fiber, uint32_t msec, fiber_t *other)
+{
+  predicate_t pred;
+  struct join_check_data jdata;
+
+  if ( fiberCheckBlock( fiber ) != FIBER_OK ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  
+  /* check argument */
+  if ( other == NULL ) {
+    /* if bad - yield and return error */
+    fiberYield( fiber );
+    return FIBER_NO_SUCH_FIBER;
+  }
+
+  /* clean predicate */
+  memset( &pred, 0, sizeof(pred));
+
+  /* fill predicate */
+  pred.fiber = fiber;
+  pred.state = PREDICATE_ACTIVE;
+  if ( msec > 0 ) {
+    pred.deadline = sched_timestamp( fiber->scheduler ) + msec;
+  }
+  else {
+    pred.deadline = 0;
+  }
+  jdata.other = other;
+  jdata.fid = other->fid;
+  pred.data = (void*) &jdata;
+  pred.pf_check = &fiber_join_check;
+
+  /* link fiber to predicate */
+  fiber->predicate = &pred;
+
+  /* change fiber state */
+  fiber->state = FIBER_SUSPEND;
+
+  /* yield */
+  if ( fiberYield( fiber ) == FIBER_CANCELED ) {
+    return FIBER_CANCELED;
+  }
+
+  /* execution resume here */
+  if ( pred.state == PREDICATE_FIRED ) {
+    return FIBER_TIMEOUT;
+  }
+  
+  return FIBER_OK;
+}
+
+
+struct var_check_data
+{
+  int *addr;
+  int  value;
+};
+
+static int fiber_var_check( fiber_t *fiber, void *data )
+{
+  struct var_check_data *vcd = (struct var_check_data*) data;
+  return (*vcd->addr == vcd->value);
+}
+
+/* 
+ * fonction to wait for a given predicate
+ */
+int fiber_wait_for_var( fiber_t *fiber, uint32_t msec, int *addr, int value)
+{
+  struct var_check_data vcd;
+  predicate_t pred;
+
+  if ( fiberCheckBlock( fiber ) != FIBER_OK ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  
+  /* check argument */
+  if ( addr == NULL ) {
+    /* if bad - yield and return error */
+    fiberYield( fiber );
+    return FIBER_INVALID_PREDICATE;
+  }
+
+  /* clean predicate */
+  memset( &pred, 0, sizeof(pred));
+
+  /* fill predicate */
+  pred.fiber = fiber;
+  pred.state = PREDICATE_ACTIVE;
+  if ( msec > 0 ) {
+    pred.deadline = sched_timestamp( fiber->scheduler ) + msec;
+  }
+  else {
+    pred.deadline = 0;
+  }
+  pred.data = &vcd;
+  pred.pf_check = &fiber_var_check;
+
+  /* fill values used for checking */
+  vcd.addr = addr;
+  vcd.value = value;
+  
+  /* link fiber to predicate */
+  fiber->predicate = &pred;
+
+  /* change fiber state */
+  fiber->state = FIBER_SUSPEND;
+
+  /* yield */
+  if ( fiberYield( fiber ) == FIBER_CANCELED ) {
+    return FIBER_CANCELED;
+  }
+
+  /* execution resume here */
+  if ( pred.state == PREDICATE_FIRED ) {
+    return FIBER_TIMEOUT;
+  }
+  
+  return FIBER_OK;
+}
+
+
+/* ----------------------------------------------------------------------------
+ * Table of fibers waiting on a variable.
+ * Each waiter points to a var_wait structure telling which address and
+ * which value it is waiting for.
+ * ----------------------------------------------------------------------------*/
+waitq_t *schedVarQueue( scheduler_t *sched, int *addr )
+{
+  uintptr_t ad = (uintptr_t) addr;
+  return &sched->vars[ ((ad >> 2) ^ (ad >> 11)) % VARBUCKETS ];
+}
+
+/* ----------------------------------------------------------------------------
+ * fiber_var_wait
+ * ----------------------------------------------------------------------------*/
+int fiber_var_wait( fiber_t *fiber, uint32_t msec, int *addr, int value )
+{
+  struct var_wait vw;
+
+  if ( fiberCheckExist(fiber) != FIBER_OK || fiber->scheduler == NULL ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  if ( addr == NULL ) {
+    return FIBER_INVALID_PREDICATE;
+  }
+  if ( *addr == value ) {
+    return FIBER_OK;
+  }
+
+  vw.addr = addr;
+  vw.value = value;
+  return fiberWaitQueue( fiber, schedVarQueue( fiber->scheduler, addr ), &vw, msec );
+}
+
+/* ----------------------------------------------------------------------------
+ * fiber_var_notify
+ * ----------------------------------------------------------------------------*/
+int fiber_var_notify( scheduler_t *sched, int *addr )
+{
+  waiter_t *waiter, *next;
+  struct var_wait *vw;
+  int n = 0;
+
+  if ( sched == NULL || addr == NULL ) {
+    return 0;
+  }
+  for( waiter = schedVarQueue( sched, addr )->head; waiter; waiter = next ) {
+    next = waiter->next;
+    vw = (struct var_wait*) waiter->data;
+    if ( vw->addr != addr || *addr != vw->value ) {
+      continue;
+    }
+    if ( waiterLive( waiter ) ) {
+      waiterFire( waiter );
+      ++n;
+    }
+    else {
+      waitqRemove( waiter );
+    }
+  }
+  return n;
+}
+
+/* ----------------------------------------------------------------------------
+ * fiber_var_store
+ * ----------------------------------------------------------------------------*/
+int fiber_var_store( scheduler_t *sched, int *addr, int value )
+{
+  if ( addr == NULL ) {
+    return 0;
+  }
+  *addr = value;
+  return fiber_var_notify( sched, addr );
+}
+
+
+/*
+ * ---------------------------------------------------------------------------
+ *  fiber_new --
+ *  
  *  Allocates a fiber object with malloc and initializes it.
  *  It sets its state to FIBER_EGG.
  * ---------------------------------------------------------------------------
  */
-fiber_t *fiber_new(pf_run_t run_func, void *extra)
+fiber_t *fiber_new(pf_run_t run_func, void *extra)
+{
+  fiber_t *res;
+
+  /* check if there are some fibers available */
+  
+  /* allocate */
+  res = (fiber_t*) malloc(sizeof(*res));
+  if ( res == NULL ) {
+    return NULL;
+  }
+
+  /* init data structure */
+  memset( res, 0, sizeof(*res));
+  res->extra = extra;
+  res->pf_run = run_func;
+  res->state = FIBER_EGG;
+  
+  return res;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *  fiber_set_init_func --
+ * ---------------------------------------------------------------------------
+ */
+int fiber_set_init_func( fiber_t *fiber, pf_init_t init_func)
+{
+  if ( fiber == NULL ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  if ( fiber->state != FIBER_EGG ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  fiber->pf_init = init_func;
+  return FIBER_OK;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *  fiber_set_term_func --
+ * ---------------------------------------------------------------------------
+ */
+int fiber_set_term_func( fiber_t *fiber, pf_term_t term_func)
+{
+  if ( fiber == NULL ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  if ( fiber->state != FIBER_EGG ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  fiber->pf_term = term_func;
+  return FIBER_OK;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *  fiber_set_done_func --
+ * ---------------------------------------------------------------------------
+ */
+int fiber_set_done_func( fiber_t *fiber, pf_done_t done_func)
+{
+  if ( fiber == NULL ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  if ( fiber->state != FIBER_EGG ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  fiber->pf_done = done_func;
+  return FIBER_OK;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *  fiber_set_int_func --
+ * ---------------------------------------------------------------------------
+ */
+scheduler_t *fiber_get_scheduler(fiber_t *fiber)
+{
+  if ( fiber == NULL ) {
+    return NULL;
+  }
+  return fiber->scheduler;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *  fiber_get_extra --
+ *
+ *  Retreive the pointer of custom data attached to the fiber.
+ *  Returns NULL if no custom data were attached.
+ * ---------------------------------------------------------------------------
+ */
+void *fiber_get_extra(fiber_t *fiber)
+{
+  if ( fiber == NULL ) {
+    return NULL;
+  }
+  return fiber->extra;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *  fiber_set_int_func --
+ * ---------------------------------------------------------------------------
+ */
+int fiber_set_extra(fiber_t *fiber, void *extra)
 {
-  fiber_t *res;
+  if ( fiber == NULL ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  fiber->extra = extra;
+  return FIBER_OK;
+}
 
-  /* check if there are some fibers available */
-  
-  /* allocate */
-  res = (fiber_t*) malloc(sizeof(*res));
-  if ( res == NULL ) {
+/*
+ * ---------------------------------------------------------------------------
+ *  fiber_set_tag --
+ * ---------------------------------------------------------------------------
+ */
+int fiber_set_tag(fiber_t *fiber, const char *tag)
+{
+  if ( fiber == NULL ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  fiber->tag = tag;
+  return FIBER_OK;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *  fiber_get_tag --
+ * ---------------------------------------------------------------------------
+ */
+const char *fiber_get_tag(fiber_t *fiber)
+{
+  if ( fiber == NULL ) {
     return NULL;
   }
+  return fiber->tag;
+}
 
-  /* init data structure */
-  memset( res, 0, sizeof(*res));
-  res->extra = extra;
-  res->pf_run = run_func;
-  res->state = FIBER_EGG;
-  
-  return res;
+/* 
+ * ---------------------------------------------------------------------------
+ * must be called before starting the fiber
+ * if not called a defult stack size of 64k is used
+ * ---------------------------------------------------------------------------
+ */
+int fiber_set_stack_size( fiber_t *fiber, uint32_t stacksz )
+{
+  if ( fiber == NULL ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  if ( fiber->state != FIBER_EGG ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  if ( stacksz < 2048 || stacksz >= 1024*1024*1024 ) {
+    return FIBER_INVALID_STACK_SIZE;
+  }
+  fiber->stacksz = stacksz;
+  return FIBER_OK;
 }
 
 /*
  * ---------------------------------------------------------------------------
- *  fiber_set_init_func --
+ * starts a newly created fiber
  * ---------------------------------------------------------------------------
  */
-int fiber_set_init_func( fiber_t *fiber, pf_init_t init_func)
+int fiber_start( scheduler_t *sched, fiber_t *fiber )
 {
+  uint32_t h;
+  
   if ( fiber == NULL ) {
     return FIBER_NO_SUCH_FIBER;
   }
   if ( fiber->state != FIBER_EGG ) {
     return FIBER_ILLEGAL_STATE;
   }
-  fiber->pf_init = init_func;
+  if ( sched->nfibers >= MAXFIBERS ) {
+    return FIBER_TOO_MANY_FIBERS;
+  }
+  
+  /* allocate stack for fiber */
+  if ( fiber->stacksz == 0 ) {
+    fiber->stacksz = DEFAULTSTACKSIZE;
+  }
+  if ( schedStackAlloc( sched, fiber ) != FIBER_OK ) {
+    return FIBER_MEMORY_ALLOCATION_ERROR;
+  }
+
+  /* link fiber and scheduler */
+  fiber->scheduler = sched;
+  if ( fiber->slice != 0 ) {
+    sched->slicing |= SLICE_FIBERS;
+  }
+
+  /* runnable from now on */
+  memset( &fiber->stats, 0, sizeof(fiber->stats));
+  fiber->acct_wait = 0;
+  fiber->acct_stamp = sched->acct ? schedAcctNow() : 0;
+
+  /* move fiber to init state */
+  fiber->state = FIBER_INIT;
+  
+  /* insert in hash table */
+  h = fiberHash( fiber ) % ARRAYSIZE;
+  while( sched->fibers[h] != NULL ) {
+    h = (h+1) % ARRAYSIZE;
+  }
+  fiber->fid = h;
+  sched->fibers[h] = fiber;
+
+  /* insert in init list */
+  fiber->next = sched->lists[FIBER_INIT];
+  sched->lists[FIBER_INIT] = fiber;
+
+  /* increase fiber count */
+  ++sched->nfibers;
+  SCHED_TRACE( sched, TRACE_SPAWN, fiber, 0, (intptr_t) fiber->pf_run );
+  
+  /* all good */
   return FIBER_OK;
 }
 
 /*
  * ---------------------------------------------------------------------------
- *  fiber_set_term_func --
+ * explicit stop of a fiber
  * ---------------------------------------------------------------------------
  */
-int fiber_set_term_func( fiber_t *fiber, pf_term_t term_func)
+int fiber_stop( fiber_t *fiber )
+{
+  if ( fiberCheckExist(fiber) != FIBER_OK ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  /* can't stop a fiber that hasn't been started yet
+   * can't stop a fiber that is already in TERM or DONE state
+   */
+  if ( fiber->state < FIBER_TERM && fiber->state > FIBER_INIT ) {
+    if ( fiber->state == FIBER_SUSPEND ) {
+      /* wake it up : its wait function returns FIBER_CANCELED */
+      fiber->flags |= FIBER_F_CANCELED;
+      if ( fiber->predicate != NULL ) {
+	fiber->predicate->state = PREDICATE_REALIZED;
+      }
+      fiber->state = FIBER_RUNNING;
+      if ( fiber->scheduler->acct ) {
+	fiberAcctWake( fiber );
+      }
+      SCHED_TRACE( fiber->scheduler, TRACE_WAKE, fiber, 0, 0 );
+      schedRunNext( fiber );
+    }
+    else if ( fiber->predicate != NULL ) {
+      /* woken up but not resumed yet : its wait may have handed it
+       * a mutex or a unit, let the wait function return first */
+      fiber->flags |= FIBER_F_CANCELED;
+    }
+    else {
+      /* terminated at its next cancellation point, if it resumes */
+      fiber->flags |= FIBER_F_CANCELED | FIBER_F_CANCEL_SEEN;
+      fiber->state = FIBER_TERM;
+    }
+    return FIBER_OK;
+  }
+  else {
+    return FIBER_ILLEGAL_STATE;
+  }
+}
+
+/* ---------------------------------------------------------------------------
+ * cleanup handlers
+ * ---------------------------------------------------------------------------*/
+void fiber_cleanup_push( fiber_t *fiber, fiber_cleanup_t *cleanup,
+			 pf_cleanup_t fn, void *arg )
+{
+  cleanup->fn = fn;
+  cleanup->arg = arg;
+  cleanup->next = fiber->cleanups;
+  fiber->cleanups = cleanup;
+}
+
+void fiber_cleanup_pop( fiber_t *fiber, int execute )
+{
+  fiber_cleanup_t *cleanup = fiber->cleanups;
+
+  if ( cleanup == NULL ) {
+    return;
+  }
+  fiber->cleanups = cleanup->next;
+  if ( execute ) {
+    cleanup->fn( cleanup->arg );
+  }
+}
+
+int fiber_canceled( fiber_t *fiber )
+{
+  return ( fiber->flags & FIBER_F_CANCELED ) ? 1 : 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * free a fiber object
+ * if FIBER_OK is returned the associated memory is freed
+ * ---------------------------------------------------------------------------*/
+int fiber_free( fiber_t *fiber )
+{
+  if ( fiberCheckExist(fiber) != FIBER_OK ) {
+    return FIBER_NO_SUCH_FIBER;
+  }
+  if ( fiber->state > FIBER_EGG || fiber->state < FIBER_DONE ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  schedStackFree( fiber );
+  if ( fiber->home != NULL ) {
+    schedMemFree( fiber->home, fiber );
+  }
+  else {
+    free(fiber);
+  }
+  return FIBER_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Callbacks posted with sched_post() are queued in cells taken from a free
+ * list of the scheduler : once warm, posting doesn't allocate.
+ * ----------------------------------------------------------------------------*/
+struct deferred {
+  struct deferred *next;
+  pf_post_t        func;
+  void            *arg;
+};
+
+/* --------------------------------------------------------------------------
+ *  sched_post --
+ * --------------------------------------------------------------------------*/
+int sched_post( scheduler_t *sched, pf_post_t func, void *arg )
+{
+  struct deferred *d;
+
+  d = sched->dfree;
+  if ( d != NULL ) {
+    sched->dfree = d->next;
+  }
+  else {
+    d = (struct deferred*) schedMemAlloc( sched, sizeof(*d));
+    if ( d == NULL ) {
+      return FIBER_MEMORY_ALLOCATION_ERROR;
+    }
+  }
+  d->func = func;
+  d->arg = arg;
+  d->next = NULL;
+  if ( sched->dtail ) {
+    sched->dtail->next = d;
+  }
+  else {
+    sched->dhead = d;
+  }
+  sched->dtail = d;
+  return FIBER_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Run the callbacks posted before this call, tasklets included.
+ * Called by sched_cycle() : no fiber is running.
+ * ----------------------------------------------------------------------------*/
+static void schedRunDeferred( scheduler_t *sched )
+{
+  struct deferred *d, *last = sched->dtail;
+  pf_post_t func;
+  void *arg;
+  int end;
+
+  /* fibers woken up wait for the dispatch */
+  sched->budget = 0;
+
+  while( (d = sched->dhead) != NULL ) {
+    sched->dhead = d->next;
+    if ( sched->dhead == NULL ) {
+      sched->dtail = NULL;
+    }
+    end = (d == last);
+
+    /* the cell can be reused by the callback */
+    func = d->func;
+    arg = d->arg;
+    d->next = sched->dfree;
+    sched->dfree = d;
+
+    func( sched, arg );
+    sched->stats.processed[SCHED_PHASE_DEFERRED] ++;
+    if ( end ) {
+      break;
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Release the cells of a scheduler, callbacks still queued are dropped
+ * ----------------------------------------------------------------------------*/
+static void schedDeferredRelease( scheduler_t *sched )
+{
+  struct deferred *d;
+
+  while( (d = sched->dhead) != NULL ) {
+    sched->dhead = d->next;
+    schedMemFree( sched, d );
+  }
+  while( (d = sched->dfree) != NULL ) {
+    sched->dfree = d->next;
+    schedMemFree( sched, d );
+  }
+  sched->dtail = NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Timers are kept in a binary heap ordered by deadline. Each one tells its
+ * owner where it is through 'slot' so that it can be removed early.
+ * ----------------------------------------------------------------------------*/
+struct schedtimer {
+  uint32_t   deadline;
+  pf_post_t  func;
+  void      *arg;
+  int       *slot;
+};
+
+#define TIMER_BEFORE(a, b) ((int32_t) ((a).deadline - (b).deadline) < 0)
+
+static void schedTimerSet( scheduler_t *sched, int i, struct schedtimer *t )
+{
+  sched->timers[i] = *t;
+  *t->slot = i;
+}
+
+static void schedTimerUp( scheduler_t *sched, int i )
+{
+  struct schedtimer t = sched->timers[i];
+
+  while( i > 0 && TIMER_BEFORE( t, sched->timers[(i-1)/2] ) ) {
+    schedTimerSet( sched, i, &sched->timers[(i-1)/2] );
+    i = (i-1)/2;
+  }
+  schedTimerSet( sched, i, &t );
+}
+
+static void schedTimerDown( scheduler_t *sched, int i )
+{
+  struct schedtimer t = sched->timers[i];
+  int c;
+
+  while( (c = 2*i + 1) < sched->ntimers ) {
+    if ( c + 1 < sched->ntimers && TIMER_BEFORE( sched->timers[c+1], sched->timers[c] ) ) {
+      c ++;
+    }
+    if ( !TIMER_BEFORE( sched->timers[c], t ) ) {
+      break;
+    }
+    schedTimerSet( sched, i, &sched->timers[c] );
+    i = c;
+  }
+  schedTimerSet( sched, i, &t );
+}
+
+/* ----------------------------------------------------------------------------
+ * Call 'func( sched, arg )' once the scheduler time reaches 'deadline'
+ * ----------------------------------------------------------------------------*/
+int schedTimerAdd( scheduler_t *sched, uint32_t deadline, pf_post_t func,
+		   void *arg, int *slot )
+{
+  struct schedtimer *timers;
+  int sz;
+
+  if ( sched->ntimers == sched->sztimers ) {
+    sz = sched->sztimers ? 2*sched->sztimers : 64;
+    timers = (struct schedtimer*) realloc( sched->timers, sz*sizeof(*timers));
+    if ( timers == NULL ) {
+      return FIBER_MEMORY_ALLOCATION_ERROR;
+    }
+    sched->timers = timers;
+    sched->sztimers = sz;
+  }
+  timers = sched->timers + sched->ntimers;
+  timers->deadline = deadline;
+  timers->func = func;
+  timers->arg = arg;
+  timers->slot = slot;
+  *slot = sched->ntimers++;
+  schedTimerUp( sched, *slot );
+  return FIBER_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Remove a timer which didn't fire
+ * ----------------------------------------------------------------------------*/
+void schedTimerDel( scheduler_t *sched, int *slot )
+{
+  int i = *slot, *moved;
+
+  if ( i < 0 || i >= sched->ntimers || sched->timers[i].slot != slot ) {
+    return;
+  }
+  *slot = -1;
+  if ( i != --sched->ntimers ) {
+    /* the last timer takes its place */
+    moved = sched->timers[sched->ntimers].slot;
+    schedTimerSet( sched, i, &sched->timers[sched->ntimers] );
+    schedTimerDown( sched, i );
+    schedTimerUp( sched, *moved );
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Fire the timers whose deadline is reached. Called by sched_cycle().
+ * ----------------------------------------------------------------------------*/
+static void schedRunTimers( scheduler_t *sched )
+{
+  struct schedtimer t;
+
+  /* fibers woken up wait for the dispatch */
+  sched->budget = 0;
+
+  while( sched->ntimers > 0 &&
+	 (int32_t) (sched->timers[0].deadline - sched->timestamp) <= 0 ) {
+    t = sched->timers[0];
+    schedTimerDel( sched, t.slot );
+    t.func( sched, t.arg );
+    sched->stats.timers ++;
+    sched->stats.processed[SCHED_PHASE_TIMERS] ++;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Clock of the accounting in nanoseconds. CLOCK_MONOTONIC is read through
+ * the vDSO : it doesn't enter the kernel and, unlike the TSC, it needs no
+ * calibration and is consistent across cpus.
+ * ----------------------------------------------------------------------------*/
+uint64_t schedAcctNow( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/* ----------------------------------------------------------------------------
+ * Kind of wait of a suspended fiber, told from its predicate and waiters.
+ * Returns -1 if it only gave back control.
+ * ----------------------------------------------------------------------------*/
+int fiberAcctKind( fiber_t *fiber )
 {
-  if ( fiber == NULL ) {
-    return FIBER_NO_SUCH_FIBER;
+  scheduler_t *sched = fiber->scheduler;
+  predicate_t *pred = fiber->predicate;
+  int i;
+
+  if ( pred == NULL ) {
+    return -1;
   }
-  if ( fiber->state != FIBER_EGG ) {
-    return FIBER_ILLEGAL_STATE;
+  if ( pred->pf_check == fiber_join_check ) {
+    return FIBER_WAIT_JOIN;
   }
-  fiber->pf_term = term_func;
-  return FIBER_OK;
+  if ( pred->pf_check == fiber_var_check ) {
+    return FIBER_WAIT_VAR;
+  }
+  if ( pred->pf_check != NULL ) {
+    return FIBER_WAIT_COND;
+  }
+  for( i = 0; i < fiber->nwaiters; ++i ) {
+    if ( fiber->waiters[i].queue == &sched->ioq ) {
+      return FIBER_WAIT_IO;
+    }
+  }
+  if ( fiber->nwaiters > 0 && fiber->waiters[0].queue >= sched->vars &&
+       fiber->waiters[0].queue < sched->vars + VARBUCKETS ) {
+    return FIBER_WAIT_VAR;
+  }
+  if ( fiber->nwaiters == 0 && pred->deadline != 0 &&
+       !(pred->flags & PREDICATE_F_REMOTE) ) {
+    return FIBER_WAIT_SLEEP;
+  }
+  return FIBER_WAIT_SYNC;
 }
 
-/*
- * ---------------------------------------------------------------------------
- *  fiber_set_done_func --
- * ---------------------------------------------------------------------------
- */
-int fiber_set_done_func( fiber_t *fiber, pf_done_t done_func)
+/* ----------------------------------------------------------------------------
+ * Record an event in the flight recorder and in the tracer ring
+ * ----------------------------------------------------------------------------*/
+static void schedTraceEvent( scheduler_t *sched, int type, fiber_t *fiber,
+			     int reason, int64_t data )
 {
-  if ( fiber == NULL ) {
-    return FIBER_NO_SUCH_FIBER;
-  }
-  if ( fiber->state != FIBER_EGG ) {
-    return FIBER_ILLEGAL_STATE;
+  recorder_header_t *rec = sched->rec;
+  recorder_event_t *rev;
+  uint64_t head;
+#ifdef FIBER_TRACE
+  trace_event_t *ev;
+
+  if ( sched->trace != NULL ) {
+    ev = &sched->trace[sched->trace_head++ & sched->trace_mask];
+    ev->tsc = schedTraceClock();
+    ev->data = data;
+    ev->fid = fiber->fid;
+    ev->type = (uint16_t) type;
+    ev->reason = (uint16_t) reason;
+  }
+#endif
+
+  if ( rec != NULL ) {
+    head = rec->head;
+    rev = &sched->rec_events[head & sched->rec_mask];
+    rev->cycle = rec->cycles;
+    rev->data = data;
+    rev->fid = fiber->fid;
+    rev->type = (uint16_t) type;
+    rev->reason = (uint16_t) reason;
+    /* readers must not see the head before the event */
+    __atomic_store_n( &rec->head, head + 1, __ATOMIC_RELEASE );
+
+    if ( type == TRACE_SWITCH_IN ) {
+      rec->running_run = (uintptr_t) fiber->pf_run;
+      rec->running = (int32_t) fiber->fid;
+    }
+    else if ( type == TRACE_SWITCH_OUT ) {
+      rec->running = -1;
+    }
   }
-  fiber->pf_done = done_func;
-  return FIBER_OK;
 }
 
-/*
- * ---------------------------------------------------------------------------
- *  fiber_set_int_func --
- * ---------------------------------------------------------------------------
- */
-scheduler_t *fiber_get_scheduler(fiber_t *fiber)
+/* ----------------------------------------------------------------------------
+ * Record that a fiber gave back control, telling why from its state
+ * ----------------------------------------------------------------------------*/
+static void schedTraceOut( scheduler_t *sched, fiber_t *fiber )
 {
-  if ( fiber == NULL ) {
-    return NULL;
+  switch( fiber->state ) {
+  case FIBER_SUSPEND:
+    schedTraceEvent( sched, TRACE_SWITCH_OUT, fiber, TRACE_OUT_WAIT,
+		     fiberAcctKind( fiber ));
+    break;
+  case FIBER_DONE:
+    schedTraceEvent( sched, TRACE_SWITCH_OUT, fiber, TRACE_OUT_END, 0 );
+    break;
+  case FIBER_TERM:
+    schedTraceEvent( sched, TRACE_SWITCH_OUT, fiber, TRACE_OUT_STOP, 0 );
+    break;
+  default:
+    schedTraceEvent( sched, TRACE_SWITCH_OUT, fiber, TRACE_OUT_YIELD, 0 );
+    break;
   }
-  return fiber->scheduler;
 }
 
-/*
- * ---------------------------------------------------------------------------
- *  fiber_get_extra --
+/* ----------------------------------------------------------------------------
+ * Time slices
  *
- *  Retreive the pointer of custom data attached to the fiber.
- *  Returns NULL if no custom data were attached.
- * ---------------------------------------------------------------------------
- */
-void *fiber_get_extra(fiber_t *fiber)
+ * When a slice or a cycle budget is set, the deadline of the fiber switched
+ * to is computed at each switch, in clock ticks : fiber_should_yield() is
+ * then a single read of the time stamp counter.
+ * ----------------------------------------------------------------------------*/
+
+/* ticks of schedTsc() per millisecond, measured once */
+static uint64_t sliceTicksPerMsec = 0;
+
+/* ----------------------------------------------------------------------------
+ * Measures the rate of the time stamp counter, once per process : it is
+ * read from cpuid when the processor reports it, otherwise the counter is
+ * compared to the monotonic clock over 2 ms. Called by sched_new() so that
+ * setting a slice never stalls a scheduler.
+ * ----------------------------------------------------------------------------*/
+static void schedTscCalibrate( void )
 {
-  if ( fiber == NULL ) {
-    return NULL;
+#ifdef SCHED_HAS_TSC
+  struct timespec ts = { 0, 2000000 };
+  unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+  uint64_t rate = 0, tsc, nsec;
+
+  if ( __atomic_load_n( &sliceTicksPerMsec, __ATOMIC_RELAXED ) != 0 ) {
+    return;
   }
-  return fiber->extra;
+
+  /* leaf 0x15 : TSC to crystal ratio and crystal frequency */
+  if ( __get_cpuid_max( 0, NULL ) >= 0x15 &&
+       __get_cpuid_count( 0x15, 0, &eax, &ebx, &ecx, &edx ) &&
+       eax != 0 && ebx != 0 && ecx != 0 ) {
+    rate = ( (uint64_t) ecx * ebx / eax ) / 1000ULL;
+  }
+  if ( rate == 0 ) {
+    nsec = schedAcctNow();
+    tsc = schedTsc();
+    nanosleep( &ts, NULL );
+    tsc = schedTsc() - tsc;
+    nsec = schedAcctNow() - nsec;
+    rate = ( tsc * 1000000ULL ) / ( nsec ? nsec : 1 );
+  }
+  __atomic_store_n( &sliceTicksPerMsec, rate ? rate : 1, __ATOMIC_RELAXED );
+#endif
 }
 
-/*
- * ---------------------------------------------------------------------------
- *  fiber_set_int_func --
- * ---------------------------------------------------------------------------
- */
-int fiber_set_extra(fiber_t *fiber, void *extra)
+/* ----------------------------------------------------------------------------
+ * Converts microseconds to ticks of schedTsc()
+ * ----------------------------------------------------------------------------*/
+static uint64_t schedSliceTicks( uint32_t usec )
 {
-  if ( fiber == NULL ) {
-    return FIBER_NO_SUCH_FIBER;
-  }
-  fiber->extra = extra;
-  return FIBER_OK;
+#ifdef SCHED_HAS_TSC
+  uint64_t tsc, rate;
+
+  /* measured by the first sched_new() */
+  rate = __atomic_load_n( &sliceTicksPerMsec, __ATOMIC_RELAXED );
+  if ( rate == 0 ) {
+    schedTscCalibrate();
+    rate = __atomic_load_n( &sliceTicksPerMsec, __ATOMIC_RELAXED );
+  }
+  tsc = ( (uint64_t) usec * rate ) / 1000ULL;
+  return tsc ? tsc : 1;
+#else
+  (void) sliceTicksPerMsec;
+  return (uint64_t) usec * 1000ULL;
+#endif
 }
 
-/* 
- * ---------------------------------------------------------------------------
- * must be called before starting the fiber
- * if not called a defult stack size of 64k is used
- * ---------------------------------------------------------------------------
- */
-int fiber_set_stack_size( fiber_t *fiber, uint32_t stacksz )
+/* ----------------------------------------------------------------------------
+ * Sets the deadline of 'fiber' which is being switched to : the end of its
+ * slice, or of the cycle if it comes first.
+ * ----------------------------------------------------------------------------*/
+static void schedSliceBegin( scheduler_t *sched, fiber_t *fiber )
 {
-  if ( fiber == NULL ) {
-    return FIBER_NO_SUCH_FIBER;
-  }
-  if ( fiber->state != FIBER_EGG ) {
-    return FIBER_ILLEGAL_STATE;
-  }
-  if ( stacksz < 2048 || stacksz >= 1024*1024*1024 ) {
-    return FIBER_INVALID_STACK_SIZE;
+  uint64_t slice = fiber->slice ? fiber->slice : sched->slice;
+  uint64_t end = sched->cycle_end;
+
+  if ( slice != 0 && slice != SLICE_NONE ) {
+    slice += schedTsc();
+    if ( slice < end ) {
+      end = slice;
+    }
   }
-  fiber->stacksz = stacksz;
-  return FIBER_OK;
+  sched->yield_at = end;
 }
 
-/*
- * ---------------------------------------------------------------------------
- * starts a newly created fiber
- * ---------------------------------------------------------------------------
- */
-int fiber_start( scheduler_t *sched, fiber_t *fiber )
+/* ----------------------------------------------------------------------------
+ * Slicing settings changed
+ * ----------------------------------------------------------------------------*/
+static void schedSliceUpdate( scheduler_t *sched, int bit, int on )
 {
-  uint32_t h;
-  
-  if ( fiber == NULL ) {
-    return FIBER_NO_SUCH_FIBER;
+  if ( on ) {
+    sched->slicing |= bit;
   }
-  if ( fiber->state != FIBER_EGG ) {
-    return FIBER_ILLEGAL_STATE;
+  else {
+    sched->slicing &= ~bit;
   }
-  if ( sched->nfibers >= MAXFIBERS ) {
-    return FIBER_TOO_MANY_FIBERS;
+  if ( sched->cycle_budget == 0 ) {
+    sched->cycle_end = UINT64_MAX;
   }
-  
-  /* allocate stack for fiber */
-  if ( fiber->stacksz == 0 ) {
-    fiber->stacksz = DEFAULTSTACKSIZE;
+  if ( !sched->slicing ) {
+    sched->yield_at = UINT64_MAX;
   }
-  fiber->stack = malloc( fiber->stacksz );
-  if ( fiber->stack == NULL ) {
-    return FIBER_MEMORY_ALLOCATION_ERROR;
+  else if ( sched->running != NULL ) {
+    schedSliceBegin( sched, sched->running );
   }
+}
 
-  /* link fiber and scheduler */
-  fiber->scheduler = sched;
-
-  /* move fiber to init state */
-  fiber->state = FIBER_INIT;
-  
-  /* insert in hash table */
-  h = fiberHash( fiber ) % ARRAYSIZE;
-  while( sched->fibers[h] != NULL ) {
-    h = (h+1) % ARRAYSIZE;
+/* --------------------------------------------------------------------------
+ *  sched_set_time_slice --
+ * --------------------------------------------------------------------------*/
+int sched_set_time_slice( scheduler_t *sched, uint32_t usec )
+{
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
   }
-  fiber->fid = h;
-  sched->fibers[h] = fiber;
-
-  /* insert in init list */
-  fiber->next = sched->lists[FIBER_INIT];
-  sched->lists[FIBER_INIT] = fiber;
+  sched->slice = usec ? schedSliceTicks( usec ) : 0;
+  schedSliceUpdate( sched, SLICE_DEFAULT, usec != 0 );
+  return FIBER_OK;
+}
 
-  /* increase fiber count */
-  ++sched->nfibers;
-  
-  /* all good */
+/* --------------------------------------------------------------------------
+ *  sched_set_cycle_budget --
+ * --------------------------------------------------------------------------*/
+int sched_set_cycle_budget( scheduler_t *sched, uint32_t usec )
+{
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
+  }
+  sched->cycle_budget = usec ? schedSliceTicks( usec ) : 0;
+  schedSliceUpdate( sched, SLICE_CYCLE, usec != 0 );
   return FIBER_OK;
 }
 
-/*
- * ---------------------------------------------------------------------------
- * explicit stop of a fiber
- * ---------------------------------------------------------------------------
- */
-int fiber_stop( fiber_t *fiber )
+/* --------------------------------------------------------------------------
+ *  fiber_set_time_slice --
+ * --------------------------------------------------------------------------*/
+int fiber_set_time_slice( fiber_t *fiber, uint32_t usec )
 {
-  if ( fiberCheckExist(fiber) != FIBER_OK ) {
+  if ( fiber == NULL ) {
     return FIBER_NO_SUCH_FIBER;
   }
-  /* can't stop a fiber that hasn't been started yet
-   * can't stop a fiber that is already in TERM or DONE state
-   */
-  if ( fiber->state < FIBER_TERM && fiber->state > FIBER_INIT ) {
-    fiber->state = FIBER_TERM;
-    return FIBER_OK;
+  if ( usec == 0 ) {
+    fiber->slice = 0;
+  }
+  else if ( usec == FIBER_SLICE_NONE ) {
+    fiber->slice = SLICE_NONE;
   }
   else {
-    return FIBER_ILLEGAL_STATE;
+    fiber->slice = schedSliceTicks( usec );
   }
+
+  /* the fibers with their own slice are not counted : once there was
+   * one, the deadline is computed at each switch */
+  if ( fiber->scheduler != NULL && fiber->slice != 0 ) {
+    schedSliceUpdate( fiber->scheduler, SLICE_FIBERS, 1 );
+  }
+  return FIBER_OK;
 }
 
-/* ---------------------------------------------------------------------------
- * free a fiber object
- * if FIBER_OK is returned the associated memory is freed
- * ---------------------------------------------------------------------------*/
-int fiber_free( fiber_t *fiber )
+/* --------------------------------------------------------------------------
+ *  fiber_should_yield --
+ * --------------------------------------------------------------------------*/
+int fiber_should_yield( fiber_t *fiber )
 {
-  if ( fiberCheckExist(fiber) != FIBER_OK ) {
-    return FIBER_NO_SUCH_FIBER;
-  }
-  if ( fiber->state > FIBER_EGG || fiber->state < FIBER_DONE ) {
-    return FIBER_ILLEGAL_STATE;
-  }
-  if ( fiber->stack ) {
-    free( fiber->stack);
-    fiber->stack = NULL;
+  scheduler_t *sched = fiber->scheduler;
+
+  if ( sched == NULL || sched->running != fiber ||
+       sched->yield_at == UINT64_MAX ) {
+    return 0;
   }
-  free(fiber);
-  return FIBER_OK;
+  return schedTsc() >= sched->yield_at;
 }
 
 /* ---------------------------------------------------------------------------
@@ -980,6 +2556,13 @@ scheduler_t *sched_new()
     return NULL;
   }
   memset(res, 0, sizeof(*res));
+  schedTscCalibrate();
+  res->node = -1;
+  res->epfd = -1;
+  res->wakefd = -1;
+  res->rec_fd = -1;
+  res->cycle_end = UINT64_MAX;
+  res->yield_at = UINT64_MAX;
   return res;
 }
 
@@ -988,6 +2571,21 @@ scheduler_t *sched_new()
  * ---------------------------------------------------------------------------*/
 int sched_free( scheduler_t *sched )
 {
+  schedDeferredRelease( sched );
+  free( sched->timers );
+  free( sched->runstats );
+  free( sched->trace );
+  sched_recorder_close( sched );
+  sched_watchdog_stop( sched );
+  schedProfileFree( sched );
+  schedPerfClose( sched );
+  schedMemRelease( sched );
+  if ( sched->wakefd >= 0 ) {
+    close( sched->wakefd );
+  }
+  if ( sched->epfd >= 0 ) {
+    close( sched->epfd );
+  }
   free( sched );
   return FIBER_OK;
 }
@@ -996,7 +2594,8 @@ int sched_free( scheduler_t *sched )
  * Stops all fibers.
  *
  * This function is used to stop all the fibers at once, for example when
- * the program exits.
+ * the program exits. Fibers blocked in wait functions are woken up as
+ * with fiber_stop().
  *
  * A call to sched_cycle() is required to really free the resources
  * used by fibers because the call to "fiber_term()" and "fiber_done()"
@@ -1010,13 +2609,128 @@ void sched_stop( scheduler_t *sched )
 
   for (state = FIBER_INIT; state < FIBER_TERM; state++ ) {
     for( pf = sched->lists[state]; pf != NULL; pf = pf->next) {
-      pf->state = FIBER_TERM;
+      if ( pf->state == FIBER_INIT ) {
+	pf->state = FIBER_TERM;
+      }
+      else if ( pf->state < FIBER_TERM ) {
+	fiber_stop( pf );
+      }
     }
+  }
+  for (state = FIBER_INIT; state < FIBER_TERM; state++ ) {
     schedCleanList(sched, state );
   }
 }
 
 
+/* ---------------------------------------------------------------------------
+ * Bind the calling thread to the cpus of the scheduler
+ * Called at the beginning of the first cycle following sched_set_cpus()
+ * ---------------------------------------------------------------------------*/
+static void schedApplyCpus( scheduler_t *sched )
+{
+  cpu_set_t set;
+  int cpu;
+
+  CPU_ZERO( &set );
+  for( cpu = 0; cpu < MAXCPUS && cpu < CPU_SETSIZE; ++cpu ) {
+    if ( sched->cpumask[cpu / 64] & (1ULL << (cpu % 64)) ) {
+      CPU_SET( cpu, &set );
+    }
+  }
+  if ( sched_setaffinity( 0, sizeof(set), &set ) ) {
+    error("scheduler %p : unable to bind thread to its cpus.\n", sched);
+  }
+  sched->cpus_pending = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * sched_set_cpus --
+ * ---------------------------------------------------------------------------*/
+int sched_set_cpus( scheduler_t *sched, const int *cpus, int ncpus )
+{
+  int i;
+
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
+  }
+  if ( cpus == NULL || ncpus <= 0 ) {
+    return FIBER_ERROR;
+  }
+  for( i = 0; i < ncpus; ++i ) {
+    if ( cpus[i] < 0 || cpus[i] >= MAXCPUS ) {
+      return FIBER_ERROR;
+    }
+  }
+  
+  memset( sched->cpumask, 0, sizeof(sched->cpumask));
+  for( i = 0; i < ncpus; ++i ) {
+    sched->cpumask[cpus[i] / 64] |= 1ULL << (cpus[i] % 64);
+  }
+  sched->ncpus = ncpus;
+  sched->cpus_pending = 1;
+
+  /* memory comes from the node of the first cpu
+   * unless it has been chosen explicitly before */
+  if ( sched->node < 0 ) {
+    sched->node = schedCpuNode( cpus[0] );
+  }
+  return FIBER_OK;
+}
+
+/* ---------------------------------------------------------------------------
+ * sched_set_node --
+ * ---------------------------------------------------------------------------*/
+int sched_set_node( scheduler_t *sched, int node )
+{
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
+  }
+  if ( node < -1 ) {
+    return FIBER_ERROR;
+  }
+  sched->node = node;
+  return FIBER_OK;
+}
+
+/* ---------------------------------------------------------------------------
+ * sched_get_node --
+ * ---------------------------------------------------------------------------*/
+int sched_get_node( scheduler_t *sched )
+{
+  if ( sched == NULL ) {
+    return -1;
+  }
+  return sched->node;
+}
+
+/* ---------------------------------------------------------------------------
+ * sched_fiber_new --
+ *
+ * Same as fiber_new() but the fiber object is allocated in the memory
+ * local to the scheduler node.
+ * ---------------------------------------------------------------------------*/
+fiber_t *sched_fiber_new( scheduler_t *sched, pf_run_t run_func, void *extra )
+{
+  fiber_t *res;
+
+  if ( sched == NULL ) {
+    return NULL;
+  }
+  res = (fiber_t*) schedMemAlloc( sched, sizeof(*res));
+  if ( res == NULL ) {
+    return NULL;
+  }
+
+  memset( res, 0, sizeof(*res));
+  res->extra = extra;
+  res->pf_run = run_func;
+  res->state = FIBER_EGG;
+  res->home = sched;
+
+  return res;
+}
+
 /* --------------------------------------------------------------------------
  *   Returns number of msec elapsed since first call to this function
  * --------------------------------------------------------------------------*/
@@ -1052,7 +2766,8 @@ int sched_numfibers( scheduler_t *sched)
  *  This function returns the next pending deadline.
  *
  *  If all suspended fibers can wait indefinitly for an event of interest,
- *  the function returns UINT_MAX.
+ *  the function returns UINT_MAX. Fibers woken up by other threads are
+ *  ready to run : it returns 0 while the inbox is not empty.
  * --------------------------------------------------------------------------*/
 uint32_t sched_deadline( scheduler_t *sched )
 {
@@ -1066,10 +2781,18 @@ uint32_t sched_deadline( scheduler_t *sched )
   if ( sched->lists[FIBER_RUNNING] != NULL ) return 0;
   if ( sched->lists[FIBER_TERM] != NULL ) return 0;
   if ( sched->lists[FIBER_DONE] != NULL ) return 0;
+  if ( sched->dhead != NULL ) return 0;
+  if ( __atomic_load_n( &sched->inbox, __ATOMIC_RELAXED ) != NULL ) return 0;
+  if ( sched->ntimers > 0 ) res = sched->timers[0].deadline;
 
   for( fiber = sched->lists[FIBER_SUSPEND]; fiber; fiber = fiber->next ) {
+    /* woken up, it will run during next cycle */
+    if ( fiber->state != FIBER_SUSPEND ) return 0;
     if ( fiber->predicate == NULL ) continue;
     if ( fiber->predicate->state != PREDICATE_ACTIVE ) continue;
+    /* parked fibers without timeout wait for an explicit wake up */
+    if ( fiber->predicate->pf_check == NULL &&
+	 fiber->predicate->deadline == 0 ) continue;
     if ( fiber->predicate->deadline < res ) res = fiber->predicate->deadline;
   }
 
@@ -26,6 +26,7 @@
 #define __FIBER_TASK_H__
 
 #include <stdint.h>
+#include <stddef.h>
 #include <limits.h>
 
 #include "logger.h"
@@ -51,6 +52,108 @@ typedef int  (*pf_check_t)(fiber_t *, void *);
 typedef void (*pf_pre_hook_t)(scheduler_t *sched, void *extra);
 typedef void (*pf_post_hook_t)(scheduler_t *sched, void *extra);
 
+typedef void (*pf_cleanup_t)(void *arg);
+
+typedef void (*pf_post_t)(scheduler_t *sched, void *arg);
+
+
+/* ---------------------------------------------------------------------------
+ *  Kinds of waits told apart by the accounting of fibers
+ *  (see sched_set_accounting).
+ * ---------------------------------------------------------------------------
+ */
+enum fiber_wait_kind_e
+  {
+   FIBER_WAIT_SLEEP = 0,     /* timeout only : fiber_wait() */
+   FIBER_WAIT_IO,            /* file descriptors */
+   FIBER_WAIT_SYNC,          /* wait queues : channels, locks, futures... */
+   FIBER_WAIT_VAR,           /* fiber_wait_for_var(), fiber_var_wait() */
+   FIBER_WAIT_JOIN,          /* fiber_join() */
+   FIBER_WAIT_COND,          /* fiber_wait_for_cond() */
+   FIBER_WAIT_NUM_KINDS,
+  };
+
+/* ---------------------------------------------------------------------------
+ *  Performance events counted by the accounting of fibers
+ *  (see sched_set_perf_events).
+ * ---------------------------------------------------------------------------
+ */
+enum fiber_event_e
+  {
+   FIBER_EVENT_CYCLES = 0,   /* cpu cycles */
+   FIBER_EVENT_INSTRUCTIONS, /* instructions retired */
+   FIBER_EVENT_L1D_MISSES,   /* level 1 data cache read misses */
+   FIBER_EVENT_LLC_MISSES,   /* last level cache misses */
+   FIBER_EVENT_BRANCH_MISSES,/* mispredicted branches */
+   FIBER_EVENT_PAGE_FAULTS,  /* page faults, counted by the kernel */
+   FIBER_EVENT_NUM_KINDS,
+  };
+
+#define FIBER_EVENT_MASK(e) (1 << (e))
+#define FIBER_EVENTS_ALL    ((1 << FIBER_EVENT_NUM_KINDS) - 1)
+
+/* counters of a fiber, times in nanoseconds */
+typedef struct fiber_stats {
+  uint64_t cpu_nsec;        /* running */
+  uint64_t runnable_nsec;   /* ready to run but not dispatched yet */
+  uint64_t wait_nsec[FIBER_WAIT_NUM_KINDS]; /* suspended, by kind of wait */
+  uint64_t switches;        /* number of times it was switched to */
+  uint64_t events[FIBER_EVENT_NUM_KINDS]; /* performance events counted
+			     * while running */
+} fiber_stats_t;
+
+/* ---------------------------------------------------------------------------
+ *  Phases of a scheduler cycle (see sched_get_stats)
+ * ---------------------------------------------------------------------------
+ */
+enum sched_phase_e
+  {
+   SCHED_PHASE_INIT = 0,     /* boot of new fibers */
+   SCHED_PHASE_IO,           /* ready file descriptors */
+   SCHED_PHASE_TIMERS,       /* timers due */
+   SCHED_PHASE_DEFERRED,     /* posted callbacks and tasklets */
+   SCHED_PHASE_PREDICATES,   /* suspended fibers and inbox */
+   SCHED_PHASE_DISPATCH,     /* runnable fibers */
+   SCHED_PHASE_TERM,         /* cleanup handlers and term functions */
+   SCHED_PHASE_DONE,         /* joiners and done functions */
+   SCHED_NUM_PHASES,
+  };
+
+/* Log-linear histogram of durations in nanoseconds : each power of two
+ * is split in SCHED_HIST_STEPS buckets of the same width. Bucket i holds
+ * the values from sched_histogram_low( i ) to sched_histogram_low( i+1 )
+ * excluded, the last one every value above. */
+#define SCHED_HIST_STEPS   4
+#define SCHED_HIST_BUCKETS (36*SCHED_HIST_STEPS)
+
+typedef struct sched_histogram {
+  uint64_t count;           /* number of values */
+  uint64_t sum_nsec;        /* their sum */
+  uint64_t max_nsec;        /* the biggest */
+  uint64_t buckets[SCHED_HIST_BUCKETS];
+} sched_histogram_t;
+
+/* statistics of a scheduler */
+typedef struct sched_stats {
+  uint64_t cycles;          /* calls to sched_cycle() */
+  sched_histogram_t cycle;  /* duration of cycles, hooks excluded */
+  sched_histogram_t phases[SCHED_NUM_PHASES]; /* duration of each phase,
+			     * counted only in cycles where it had work */
+  uint64_t processed[SCHED_NUM_PHASES]; /* fibers, timers or callbacks
+			     * handled by each phase */
+  uint64_t predicates;      /* predicates evaluated */
+  uint64_t timers;          /* timers fired */
+  uint64_t budget_cuts;     /* dispatch phases cut short by the cycle
+			     * budget, see sched_set_cycle_budget() */
+} sched_stats_t;
+
+/* counters of the fibers sharing a run function */
+typedef struct fiber_run_stats {
+  pf_run_t      run;        /* the run function */
+  uint32_t      nfibers;    /* fibers counted, alive or ended */
+  fiber_stats_t stats;      /* sum of their counters */
+} fiber_run_stats_t;
+
 
 /* ---------------------------------------------------------------------------
  *  This enumeration defines the states of a fiber.
@@ -103,6 +206,8 @@ enum fiber_error_e
    FIBER_INVALID_PREDICATE,  /* invalid test predicate */
 
    FIBER_NO_SUCH_SCHED,      /* scheduler is NULL */
+   FIBER_CANCELED,           /* a wait function was interrupted because
+			      * the fiber was stopped */
 };
 
 
@@ -139,17 +244,57 @@ int fiber_start( scheduler_t *sched, fiber_t *fiber );
  * ---------------------------------------------------------------------------
  * fiber_stop --
  *
- * Change fiber's state to TERM which will end it on next scheduler cycle
- * in most cases. If this function is called during the fiber's scheduler
- * execution cycle, the fiber will end during this cycle.
- *
- * There are two `normal' ways for a fiber to end :
+ * Stops a fiber. There are two `normal' ways for a fiber to end :
  *  - when its `run' method returns, its state becomes DONE
  *  - when this function is called, its state becomes TERM (and after DONE)
+ *
+ * A fiber blocked in a wait function is woken up at once : the wait
+ * function returns FIBER_CANCELED and the fiber gets a chance to release
+ * its resources before returning. If it blocks again instead, it is
+ * terminated at that point. A fiber which was already handed what it
+ * waited for (a mutex, a semaphore unit, a message) but didn't resume yet
+ * gets it : its wait function returns FIBER_OK, fiber_canceled() returns
+ * 1 and it is terminated at its next cancellation point.
+ *
+ * A fiber which is ready to run changes to TERM state which will end it
+ * on next scheduler cycle in most cases. If this function is called during
+ * the fiber's scheduler execution cycle, the fiber will end during this
+ * cycle.
+ *
+ * In both cases the cleanup handlers still registered by the fiber with
+ * fiber_cleanup_push() run on its stack before it ends.
  * ---------------------------------------------------------------------------
  */
 int fiber_stop( fiber_t *fiber );
 
+
+/*
+ * ---------------------------------------------------------------------------
+ * fiber_cleanup_push, fiber_cleanup_pop --
+ *
+ * Registers a cleanup handler : `fn( arg )' is called if the fiber is
+ * terminated while the handler is registered. Handlers are stacked, the
+ * last pushed runs first. `cleanup' is storage provided by the caller,
+ * usually a local variable of the function pushing the handler : it must
+ * be popped before that function returns.
+ *
+ * fiber_cleanup_pop() unregisters the last handler pushed, and calls it if
+ * `execute' is not 0.
+ *
+ * fiber_canceled() returns 1 if `fiber' was stopped, 0 otherwise.
+ * ---------------------------------------------------------------------------
+ */
+typedef struct fiber_cleanup {
+  struct fiber_cleanup *next;
+  pf_cleanup_t fn;
+  void *arg;
+} fiber_cleanup_t;
+
+void fiber_cleanup_push( fiber_t *fiber, fiber_cleanup_t *cleanup,
+			 pf_cleanup_t fn, void *arg );
+void fiber_cleanup_pop( fiber_t *fiber, int execute );
+int  fiber_canceled( fiber_t *fiber );
+
 /* ---------------------------------------------------------------------------
  * fiber_free--
  *
@@ -185,6 +330,69 @@ int fiber_free( fiber_t *fiber );
 int fiber_yield(fiber_t *fiber);
 
 
+/*
+ * ---------------------------------------------------------------------------
+ * fiber_yield_to --
+ *
+ * The running fiber `fiber' gives the processor directly to `target',
+ * without going back to the scheduler. `target' must be attached to the
+ * same scheduler and be in RUNNING state : it resumes where it yielded.
+ *
+ * `fiber' stays in RUNNING state. It resumes when another fiber yields
+ * to it or, at the latest, when the scheduler dispatches it again.
+ * Two fibers yielding to each other never give back control to the
+ * scheduler : one of them must eventually yield or wait.
+ *
+ * Returns FIBER_OK once `fiber' resumes and :
+ *  - FIBER_NO_SUCH_FIBER if `fiber' or `target' doesn't exist.
+ *  - FIBER_ILLEGAL_STATE if `fiber' is not the running fiber or if
+ *       `target' can't run. The caller keeps the processor in that case.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_yield_to(fiber_t *fiber, fiber_t *target);
+
+
+/*
+ * ---------------------------------------------------------------------------
+ * fiber_should_yield --
+ *
+ * Tells a compute bound fiber whether it has used up its time slice (see
+ * fiber_set_time_slice() and sched_set_time_slice()) or its scheduler the
+ * budget of the cycle (see sched_set_cycle_budget()). The deadline is set
+ * when the fiber is switched to : the check is a read of the time stamp
+ * counter, cheap enough to be done in a loop, between two calls to
+ * fiber_yield() for instance.
+ *
+ * Returns 1 if `fiber' should give back control, 0 if it has time left,
+ * if no slice applies or if it is not the running fiber.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_should_yield(fiber_t *fiber);
+
+
+/*
+ * ---------------------------------------------------------------------------
+ * fiber_set_time_slice --
+ *
+ * Sets the time slice of `fiber' to `usec' microseconds : the time it may
+ * run each time it is switched to before fiber_should_yield() returns 1.
+ * 0 gives it the slice of its scheduler back and FIBER_SLICE_NONE exempts
+ * it from the slice of its scheduler. The slice only makes
+ * fiber_should_yield() return 1 : the fiber is never preempted.
+ *
+ * Once a fiber of a scheduler has its own slice, the scheduler reads the
+ * time stamp counter at each switch. Its rate is measured once, by the
+ * first sched_new() of the process : when the processor doesn't report it,
+ * that call sleeps 2 ms. Setting a slice never blocks.
+ *
+ * Returns FIBER_NO_SUCH_FIBER if `fiber' is NULL and FIBER_OK otherwise.
+ * ---------------------------------------------------------------------------
+ */
+#define FIBER_SLICE_NONE UINT32_MAX
+
+int fiber_set_time_slice(fiber_t *fiber, uint32_t usec);
+
+
 /*
  * ---------------------------------------------------------------------------
  * fiber_wait --
@@ -197,7 +405,8 @@ int fiber_yield(fiber_t *fiber);
  * If this function is called while the fiber is not running or not
  * attached to a schedule, it returns immediately and the execution continue.
  *
- * This function always return FIBER_TIMEOUT.
+ * This function always return FIBER_TIMEOUT, or FIBER_CANCELED if the
+ * fiber was stopped while waiting.
  * ---------------------------------------------------------------------------
  */
 int fiber_wait(fiber_t *fiber, uint32_t msec);
@@ -254,6 +463,60 @@ int fiber_join( fiber_t *fiber, uint32_t msec, fiber_t *other);
  */
 int fiber_wait_for_var( fiber_t *fiber, uint32_t msec, int *addr, int value);
 
+/*
+ * ---------------------------------------------------------------------------
+ * fiber_var_wait --
+ *
+ * Same as fiber_wait_for_var() except that the variable is not checked
+ * by the scheduler on each cycle. The fiber is parked in a table of its
+ * scheduler keyed by `addr' and it is woken up only by fiber_var_store()
+ * or fiber_var_notify() called for `addr', when the variable contains
+ * `value'. A waiting fiber costs nothing to the scheduler.
+ *
+ * Returns FIBER_OK at once if `*addr' already contains `value'.
+ * Otherwise returns FIBER_OK when woken up or FIBER_TIMEOUT after `msec'
+ * milliseconds ('msec' = 0 means no timeout).
+ * ---------------------------------------------------------------------------
+ */
+int fiber_var_wait( fiber_t *fiber, uint32_t msec, int *addr, int value);
+
+/*
+ * ---------------------------------------------------------------------------
+ * fiber_var_store --
+ * fiber_var_notify --
+ *
+ * fiber_var_store() stores `value' at `addr' and wakes up the fibers of
+ * `sched' waiting in fiber_var_wait() for `addr' to contain `value'.
+ *
+ * fiber_var_notify() is used when the variable has been changed directly :
+ * it wakes up the fibers waiting for its current value.
+ *
+ * Both can be called from a fiber or from outside of the scheduler (a pre
+ * cycle hook for instance). They return the number of fibers woken up.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_var_store( scheduler_t *sched, int *addr, int value );
+int fiber_var_notify( scheduler_t *sched, int *addr );
+
+/*
+ * ---------------------------------------------------------------------------
+ * fiber_notify --
+ *
+ * Tells that the condition `fiber' is waiting for (see fiber_wait_for_cond,
+ * fiber_wait_for_var and fiber_join) may have become true. The condition
+ * is checked right away instead of during the next scheduler cycle.
+ *
+ * When called by a running fiber, the woken up fiber runs as soon as the
+ * caller gives back control to the scheduler, in the same cycle. The last
+ * fiber woken up this way runs first.
+ *
+ * Returns FIBER_OK if `fiber' was woken up, FIBER_TIMEOUT if its condition
+ * is still false, FIBER_ILLEGAL_STATE if it is not waiting for a condition
+ * and FIBER_NO_SUCH_FIBER if it doesn't exist.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_notify( fiber_t *fiber );
+
 
 
 /* --------------------------------------------------------------------------
@@ -332,6 +595,31 @@ void *fiber_get_extra(fiber_t *fiber);
 int fiber_set_extra( fiber_t *fiber, void *extra );
 
 
+/*
+ * --------------------------------------------------------------------------
+ * fiber_set_tag --
+ *
+ * Sets the tag of a `fiber', a string naming what it is doing : the kind
+ * of request it serves for instance. The profiler groups its samples by
+ * tag (see profiler.h). The string is not copied, it must outlive the
+ * fiber or the next call. NULL removes the tag.
+ *
+ * Returns FIBER_NO_SUCH_FIBER if `fiber' is NULL and FIBER_OK otherwise.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_set_tag( fiber_t *fiber, const char *tag );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * fiber_get_tag --
+ *
+ * Returns the tag of a `fiber', NULL if it has none or if `fiber' is NULL.
+ * ---------------------------------------------------------------------------
+ */
+const char *fiber_get_tag( fiber_t *fiber );
+
+
 /*
  * --------------------------------------------------------------------------
  * fiber_set_stack_size --
@@ -369,6 +657,10 @@ int fiber_get_stack_size( fiber_t *fiber );
  *
  * Create a new scheduler. The created scheduler has no fiber.
  *
+ * The first call of the process measures the rate of the time stamp
+ * counter used by time slices (see fiber_set_time_slice()), it may take
+ * 2 ms.
+ *
  * Returns NULL is memory allocation failed.
  * ---------------------------------------------------------------------------
  */
@@ -392,7 +684,9 @@ int sched_free( scheduler_t *sched );
  * Stops all fibers.
  *
  * This function is used to stop all the fibers at once, for example when
- * the program exits.
+ * the program exits. Fibers blocked in wait functions are woken up as
+ * with fiber_stop() : they release their resources during the next
+ * cycle instead of waiting for their timeouts.
  *
  * A call to sched_cycle() is required to really free the resources
  * used by fibers because the call to "fiber_term()" and "fiber_done()"
@@ -416,6 +710,39 @@ void sched_stop( scheduler_t *sched );
  */
 uint32_t sched_elapsed();
 
+/*
+ * ---------------------------------------------------------------------------
+ * sched_deadline --
+ *
+ * Returns 0 if some fibers of 'sched' are ready to run, woken up by other
+ * threads included. Otherwise all its fibers are suspended and it returns
+ * the nearest deadline of their timers, or UINT_MAX if none has a timer.
+ *
+ * An event loop can use it to decide how long it may sleep before running
+ * the next scheduler cycle.
+ * ---------------------------------------------------------------------------
+ */
+uint32_t sched_deadline( scheduler_t *sched );
+
+/*
+ * ---------------------------------------------------------------------------
+ * sched_poll --
+ *
+ * Waits up to 'msec' milliseconds for one of the file descriptors fibers
+ * of 'sched' wait on (see fiber_wait_any) to be ready, and wakes up the
+ * fibers waiting on the ready ones. 'msec' = 0 only checks them and
+ * UINT_MAX waits with no limit. sched_cycle() checks them too, without
+ * waiting.
+ *
+ * It also returns as soon as another thread wakes up a fiber of 'sched'
+ * (see xchannel.h), so that an event loop sleeping here until
+ * sched_deadline() runs the next cycle at once.
+ *
+ * Returns the number of fibers woken up.
+ * ---------------------------------------------------------------------------
+ */
+int sched_poll( scheduler_t *sched, uint32_t msec );
+
 /* 
  * ---------------------------------------------------------------------------
  * sched_cycle --
@@ -443,6 +770,56 @@ uint32_t sched_elapsed();
 void sched_cycle(scheduler_t *sched, uint32_t timestamp);
 
 
+/*
+ * ---------------------------------------------------------------------------
+ * sched_set_time_slice --
+ *
+ * Sets to `usec' microseconds the time slice of the fibers of `sched' which
+ * have none of their own (see fiber_set_time_slice()). 0, the default,
+ * removes it.
+ *
+ * Returns FIBER_NO_SUCH_SCHED if 'sched' is NULL and FIBER_OK otherwise.
+ * ---------------------------------------------------------------------------
+ */
+int sched_set_time_slice( scheduler_t *sched, uint32_t usec );
+
+
+/*
+ * ---------------------------------------------------------------------------
+ * sched_set_cycle_budget --
+ *
+ * Bounds to about `usec' microseconds the time sched_cycle() spends running
+ * fibers. Once it is over, fiber_should_yield() returns 1 and the fibers
+ * which didn't run yet are left for the next cycle, where they run first :
+ * the next cycle polls file descriptors and fires timers sooner. At least
+ * one fiber runs per cycle. 0, the default, removes the bound.
+ *
+ * Fibers that don't check fiber_should_yield() can still exceed the budget.
+ *
+ * Returns FIBER_NO_SUCH_SCHED if 'sched' is NULL and FIBER_OK otherwise.
+ * ---------------------------------------------------------------------------
+ */
+int sched_set_cycle_budget( scheduler_t *sched, uint32_t usec );
+
+
+/*
+ * ---------------------------------------------------------------------------
+ * sched_post --
+ *
+ * Calls `func( sched, arg )' once during the next cycle of `sched'.
+ *
+ * Posted callbacks run on the stack of the thread running the scheduler,
+ * in the order they were posted, early in the cycle : fibers they wake up
+ * run during the same cycle. Callbacks posted while they run wait for the
+ * next cycle, sched_deadline() returns 0 meanwhile. They must not block
+ * and must be posted from the thread running the scheduler.
+ *
+ * Returns FIBER_OK or FIBER_MEMORY_ALLOCATION_ERROR.
+ * ---------------------------------------------------------------------------
+ */
+int sched_post( scheduler_t *sched, pf_post_t func, void *arg );
+
+
 /* ---------------------------------------------------------------------------
  * Sets the hooks function
  * ---------------------------------------------------------------------------
@@ -496,4 +873,218 @@ void *sched_get_extra(scheduler_t *sched);
 int sched_set_extra( scheduler_t *sched, void *extra );
 
 
+/*
+ * --------------------------------------------------------------------------
+ * sched_set_cpus --
+ *
+ * Binds the scheduler to a set of cpus. The binding is applied to the
+ * thread that runs the next call to sched_cycle(), so one scheduler per
+ * core is obtained by calling sched_cycle() on each scheduler from its
+ * own thread.
+ *
+ * Unless sched_set_node() was called before, the scheduler memory will
+ * be taken from the NUMA node of the first cpu of the set.
+ *
+ * Returns FIBER_OK in most cases, otherwise :
+ *  - FIBER_NO_SUCH_SCHED if 'sched' is NULL.
+ *  - FIBER_ERROR if the cpu list is empty or a cpu number is invalid.
+ * ---------------------------------------------------------------------------
+ */
+int sched_set_cpus( scheduler_t *sched, const int *cpus, int ncpus );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_set_node --
+ *
+ * Sets the NUMA node the scheduler takes its memory from. The stacks of
+ * the fibers started afterwards, the fibers created with sched_fiber_new()
+ * and the buffers returned by sched_alloc() will be local to this node.
+ * -1 restores the default behaviour : plain malloc().
+ *
+ * Returns FIBER_NO_SUCH_SCHED if 'sched' is NULL, FIBER_ERROR if 'node'
+ * is invalid and FIBER_OK otherwise.
+ * ---------------------------------------------------------------------------
+ */
+int sched_set_node( scheduler_t *sched, int node );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_get_node --
+ *
+ * Returns the NUMA node of the scheduler or -1 if it is not bound to any.
+ * ---------------------------------------------------------------------------
+ */
+int sched_get_node( scheduler_t *sched );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_fiber_new --
+ *
+ * Same as fiber_new() except that the fiber object is allocated in the
+ * memory local to the scheduler node. It must still be started with
+ * fiber_start() on the same scheduler, and it must not outlive it.
+ *
+ * Returns NULL if 'sched' is NULL or on memory allocation failure.
+ * ---------------------------------------------------------------------------
+ */
+fiber_t *sched_fiber_new( scheduler_t *sched, pf_run_t run_func, void *extra );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_alloc --
+ *
+ * Allocates 'size' bytes local to the scheduler node, typically for the
+ * `extra' data of its fibers. Small blocks are pooled by the scheduler.
+ * The memory must be released with sched_release() before the scheduler
+ * is freed.
+ *
+ * Returns NULL on memory allocation failure.
+ * ---------------------------------------------------------------------------
+ */
+void *sched_alloc( scheduler_t *sched, size_t size );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_release --
+ *
+ * Gives back to scheduler 'sched' a block allocated with sched_alloc().
+ * ---------------------------------------------------------------------------
+ */
+void sched_release( scheduler_t *sched, void *ptr );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_set_accounting --
+ *
+ * Turns on (`enable' != 0) or off the accounting of the fibers of `sched'.
+ * When it is on, the scheduler reads the monotonic clock at each switch
+ * and each wake up : it measures for each fiber the time it runs, the time
+ * it waits to be dispatched once runnable and the time it is suspended,
+ * split by kind of wait. The counters of ended fibers are added up by run
+ * function. It is off by default.
+ *
+ * Returns FIBER_NO_SUCH_SCHED if 'sched' is NULL and FIBER_OK otherwise.
+ * ---------------------------------------------------------------------------
+ */
+int sched_set_accounting( scheduler_t *sched, int enable );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_set_perf_events --
+ *
+ * Opens with perf_event_open() the performance events of `events', a
+ * combination of FIBER_EVENT_MASK( FIBER_EVENT_xxx ), for the calling
+ * thread : it must be the thread running `sched'. When the accounting is
+ * on, they are read at each switch and counted in the `events' of the
+ * fiber that was running (see fiber_get_stats() and sched_get_run_stats()).
+ * 0 closes them.
+ *
+ * The events are opened as a single group. They are read with rdpmc when
+ * the kernel allows it for all of them, otherwise with a single system
+ * call per switch. An event which doesn't fit in the counters of the cpu
+ * along with the previous ones is not counted.
+ *
+ * Returns FIBER_NO_SUCH_SCHED if 'sched' is NULL, FIBER_ERROR if none of
+ * the events can be counted (no PMU, perf_event_paranoid...) and FIBER_OK
+ * otherwise : sched_get_perf_events() tells which ones are.
+ * ---------------------------------------------------------------------------
+ */
+int sched_set_perf_events( scheduler_t *sched, int events );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_get_perf_events --
+ *
+ * Returns the combination of FIBER_EVENT_MASK( FIBER_EVENT_xxx ) counted
+ * by `sched', 0 if none or if `sched' is NULL.
+ * ---------------------------------------------------------------------------
+ */
+int sched_get_perf_events( scheduler_t *sched );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * fiber_get_stats --
+ *
+ * Copies the counters of `fiber' in `*stats', the time spent in its
+ * current state included.
+ *
+ * Returns FIBER_NO_SUCH_FIBER if `fiber' doesn't exist, FIBER_OK otherwise.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_get_stats( fiber_t *fiber, fiber_stats_t *stats );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_get_run_stats --
+ *
+ * Adds up the counters of the fibers of `sched', alive or ended while the
+ * accounting was on, by run function. Up to `max' entries are stored in
+ * `stats', the most cpu consuming first.
+ *
+ * Returns the number of run functions, which may be more than `max', or
+ * -1 on memory allocation failure.
+ * ---------------------------------------------------------------------------
+ */
+int sched_get_run_stats( scheduler_t *sched, fiber_run_stats_t *stats, int max );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_get_stats --
+ *
+ * Copies the statistics of the cycles of `sched' in `*stats'. They are
+ * always collected : the clock is read at the beginning of a cycle and
+ * at the end of each phase that had work, that is twice per cycle for a
+ * scheduler which only dispatches fibers.
+ *
+ * Returns FIBER_NO_SUCH_SCHED if 'sched' is NULL and FIBER_OK otherwise.
+ * ---------------------------------------------------------------------------
+ */
+int sched_get_stats( scheduler_t *sched, sched_stats_t *stats );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_reset_stats --
+ *
+ * Clears the statistics of the cycles of `sched'.
+ * ---------------------------------------------------------------------------
+ */
+void sched_reset_stats( scheduler_t *sched );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_histogram_low --
+ *
+ * Returns the smallest value, in nanoseconds, counted in bucket `i' of a
+ * histogram.
+ * ---------------------------------------------------------------------------
+ */
+uint64_t sched_histogram_low( int i );
+
+
+/*
+ * --------------------------------------------------------------------------
+ * sched_histogram_percentile --
+ *
+ * Returns an upper bound of the `pct' percentile (0 to 100) of the values
+ * of histogram `h', 0 if it is empty.
+ * ---------------------------------------------------------------------------
+ */
+uint64_t sched_histogram_percentile( const sched_histogram_t *h, double pct );
+
+
+
+
 #endif
@@ -28,6 +28,65 @@
 #include "task.h"
 
 #include <setjmp.h>
+#include <stddef.h>
+#include <unwind.h>
+
+/* number of size classes of the node local allocator (32 bytes to 4k) */
+#define MEMCLASSES 8
+
+/* maximum number of cpus a scheduler can be bound to */
+#define MAXCPUS 1024
+
+/* number of fibers that can be run from the run next slot during
+ * a dispatch pass, so that fibers waking each other up endlessly
+ * can't prevent the cycle from ending */
+#define RUNNEXT_BUDGET 1024
+
+/* number of buckets of the table of fibers waiting on a variable */
+#define VARBUCKETS 64
+
+typedef struct waiter waiter_t;
+typedef struct waitq waitq_t;
+
+/*
+ * --------------------------------------------------------------------------
+ * Wait queues
+ *
+ * A fiber blocked on an object (a channel for instance) links a waiter
+ * in the wait queue of the object and parks. The fiber releasing the object
+ * fires the first waiter of the queue which wakes up the parked fiber
+ * directly : nothing is polled.
+ *
+ * A fiber can wait on several queues at once (see fiber_select). All its
+ * waiters share the same 'fired' variable which holds the index of the
+ * waiter that was fired, or -1. The first one to fire wins, the fiber
+ * unlinks the others when it resumes.
+ *
+ * Waiters live on the stack of the parked fiber.
+ * --------------------------------------------------------------------------
+ */
+struct waiter {
+  waiter_t    *next;        /* next in wait queue */
+  waiter_t    *prev;        /* previous in wait queue */
+  waitq_t     *queue;       /* queue the waiter is linked in or NULL */
+  fiber_t     *fiber;       /* parked fiber */
+  void        *data;        /* buffer used for direct hand off */
+  int          index;       /* value stored in '*fired' */
+  int         *fired;       /* shared by all the waiters of the fiber */
+};
+
+struct waitq {
+  waiter_t *head;
+  waiter_t *tail;
+};
+
+/* data of the waiters of fibers waiting for a variable to take a value */
+struct var_wait
+{
+  int *addr;
+  int  value;
+};
+
 
 /* fiber data structure */
 struct fiber
@@ -62,6 +121,8 @@ struct fiber
 
   uint8_t state;            /* Current state of fiber */
 
+  uint8_t flags;            /* Combination of FIBER_F_xxx flags */
+
   uint32_t fid;             /* fiber identifier generated on creation */
 
   
@@ -76,8 +137,57 @@ struct fiber
 			     * is attached to it. When the predicate will be true
 			     * the fiber will wake up and resume execution,
 			     * it will enter the RUNNING state again */
+
+  scheduler_t *home;        /* Scheduler whose node local memory holds this
+			     * fiber object (see sched_fiber_new) or NULL
+			     * if it was malloced. */
+
+  fiber_t *inext;           /* Link in the inbox of the scheduler when
+			     * the fiber is woken up from another thread */
+  uint8_t  inboxed;         /* set while the fiber is in the inbox, it can
+			     * only be there once */
+
+  waiter_t *waiters;        /* waiters linked in wait queues while the
+			     * fiber is parked on them, or NULL */
+  int      nwaiters;        /* number of entries in 'waiters' */
+
+  waitq_t  joiners;         /* fibers waiting for the end of this one,
+			     * fired when it is removed from its
+			     * scheduler */
+
+  fiber_cleanup_t *cleanups; /* cleanup handlers registered with
+			     * fiber_cleanup_push(), last pushed first */
+
+  struct fiber_group *group; /* group the fiber was spawned in or NULL */
+  struct fiber_pool  *pool;  /* pool the fiber is a worker of or NULL */
+  fiber_t  *onext;          /* links in the list of fibers of the group
+			     * or the pool owning the fiber */
+  fiber_t  *oprev;
+
+  fiber_stats_t stats;      /* counters updated when accounting is on */
+  uint64_t acct_stamp;      /* clock at its last switch or wake up,
+			     * 0 if unknown */
+  uint8_t  acct_wait;       /* 1 + FIBER_WAIT_xxx while suspended, 0 while
+			     * runnable or running */
+
+  uint64_t slice;           /* time slice in ticks of the time stamp
+			     * counter, 0 for the one of the scheduler,
+			     * SLICE_NONE for none */
+
+  const char *tag;          /* see fiber_set_tag() or NULL */
 };
 
+/* fiber without time slice */
+#define SLICE_NONE UINT64_MAX
+
+/* fiber flags */
+#define FIBER_F_MAPPED_STACK 0x01   /* stack was mmapped on a NUMA node */
+#define FIBER_F_CANCELED     0x02   /* stopped with fiber_stop() */
+#define FIBER_F_CANCEL_SEEN  0x04   /* FIBER_CANCELED was returned to it */
+#define FIBER_F_STACKLESS    0x08   /* fiber without a stack : it can't block.
+				     * Parked, its run function is called
+				     * by its waker instead of a switch */
+
 /*
  * ---------------------------------------------------------------------------
  *  Scheduler data structure
@@ -93,6 +203,11 @@ struct scheduler
   fiber_t *lists[FIBER_NUM_STATES]; /* A linked list of fibers is kept for each
 				     * possible fiber state. */
   fiber_t *running;                 /* Currently running fiber. */
+  fiber_t *runnext;                 /* Fiber woken up during dispatch that
+				     * runs as soon as the running fiber
+				     * gives back control. */
+  int budget;                       /* remaining run next slots in the
+				     * current dispatch pass */
   int nfibers;                      /* Total number of fibers */
 
   uint32_t timestamp;               /* scheduler notion of time */
@@ -106,8 +221,87 @@ struct scheduler
 
   jmp_buf context;                  /* main context: used by fibers to give back 
 				     * control to scheduler when yielding */
+
+  /* CPU binding and NUMA node local memory */
+  uint64_t cpumask[MAXCPUS/64];     /* cpus the scheduler thread is bound to */
+  int ncpus;                        /* number of cpus set in 'cpumask' */
+  int cpus_pending;                 /* binding must be applied by the thread
+				     * running the next cycle */
+  int node;                         /* NUMA node memory is taken from or -1 */
+  struct memchunk *chunks;          /* chunks mapped for small blocks */
+  void *freelists[MEMCLASSES];      /* free blocks of each size class */
+
+  fiber_t *inbox;                   /* fibers woken up by other threads, they
+				     * are linked through their 'inext' field.
+				     * Updated with atomic operations only. */
+
+  waitq_t vars[VARBUCKETS];         /* fibers blocked in fiber_var_wait()
+				     * hashed by address of the variable */
+
+  int epfd;                         /* epoll instance watching the file
+				     * descriptors fibers wait on, -1 until
+				     * first needed */
+  waitq_t ioq;                      /* waiters armed on a file descriptor */
+  int wakefd;                       /* eventfd in 'epfd' waking up the thread
+				     * sleeping in sched_poll(), -1 until
+				     * first needed */
+  int polling;                      /* set while sleeping in sched_poll(),
+				     * see schedRemoteWake() */
+
+  struct deferred *dhead;           /* callbacks posted with sched_post(),
+				     * oldest first */
+  struct deferred *dtail;
+  struct deferred *dfree;           /* recycled cells */
+
+  struct schedtimer *timers;        /* binary heap of timers, nearest
+				     * deadline first */
+  int ntimers;                      /* timers in the heap */
+  int sztimers;                     /* allocated entries */
+
+  int acct;                         /* fibers accounting is on */
+  fiber_run_stats_t *runstats;      /* counters of the fibers ended while
+				     * accounting was on, by run function */
+  int nrunstats;
+  int szrunstats;
+
+  sched_stats_t stats;              /* see sched_get_stats() */
+
+  struct trace_event *trace;        /* ring of events recorded with
+				     * -DFIBER_TRACE or NULL */
+  uint64_t trace_mask;              /* ring size - 1 */
+  uint64_t trace_head;              /* events recorded since start */
+  uint64_t trace_tsc0;              /* clocks when recording started */
+  uint64_t trace_nsec0;
+
+  struct recorder_header *rec;      /* flight recorder mapping or NULL */
+  struct recorder_event *rec_events;
+  uint64_t rec_mask;                /* number of slots - 1 */
+  size_t rec_len;                   /* size of the mapping */
+  int rec_fd;                       /* memfd kept open or -1 */
+
+  uint64_t switch_seq;              /* bumped each time a fiber is switched to */
+  struct watchdog *wd;              /* see sched_watchdog_start() or NULL */
+
+  /* time slices, in ticks of the time stamp counter */
+  int slicing;                      /* combination of SLICE_xxx bits, the
+				     * deadline is set at each switch when
+				     * it is not 0 */
+  uint64_t slice;                   /* default slice of the fibers or 0 */
+  uint64_t cycle_budget;            /* dispatch stops past it or 0 */
+  uint64_t cycle_end;               /* end of the budget of the current
+				     * cycle or UINT64_MAX */
+  uint64_t yield_at;                /* deadline of the running fiber or
+				     * UINT64_MAX */
+
+  struct profiler *prof;            /* see sched_profile_start() or NULL */
+  struct perf_events *perf;         /* see sched_set_perf_events() or NULL */
 };
 
+/* scheduler slicing bits */
+#define SLICE_DEFAULT 0x01          /* default slice set */
+#define SLICE_FIBERS  0x02          /* fibers with their own slice */
+#define SLICE_CYCLE   0x04          /* cycle budget set */
+
 
 /*
  * --------------------------------------------------------------------------
@@ -122,8 +316,13 @@ struct predicate {
   void        *data;        /* data to pass to predicate function */
   pf_check_t   pf_check;    /* predicate function called for fiber */
   uint8_t      state;       /* state of predicate (ACTIVE, EXPIRED, DEAD) */
+  uint8_t      flags;       /* combination of PREDICATE_F_xxx flags */
 };
 
+/* predicate flags */
+#define PREDICATE_F_REMOTE 0x01  /* can be realized by a wake up posted to
+				  * the scheduler inbox */
+
 
 
 enum predicate_state_e
@@ -138,4 +337,105 @@ enum predicate_state_e
   };
 
 
+/* node local memory (numa.c) */
+void *schedMemAlloc( scheduler_t *sched, size_t size );
+void  schedMemFree( scheduler_t *sched, void *ptr );
+void  schedMemRelease( scheduler_t *sched );
+int   schedStackAlloc( scheduler_t *sched, fiber_t *fiber );
+void  schedStackFree( fiber_t *fiber );
+int   schedCpuNode( int cpu );
+
+/* clocks (task.c) : the monotonic clock in nanoseconds, and the time stamp
+ * counter read by the tracer and the time slices, or the monotonic clock
+ * where there is none */
+uint64_t schedAcctNow( void );
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define SCHED_HAS_TSC
+#define schedTsc() __rdtsc()
+#else
+#define schedTsc() schedAcctNow()
+#endif
+
+/* parking and wake up (task.c) */
+int   fiberPark( fiber_t *fiber, uint32_t msec, uint8_t flags );
+int   schedWakeup( fiber_t *fiber );
+int   fiberSwitch( fiber_t *fiber, fiber_t *target );
+int   fiberCancelPoint( fiber_t *fiber );
+int   fiberCheckBlock( fiber_t *fiber );
+int   fiberCheckExist( fiber_t *fiber );
+int   fiberAcctKind( fiber_t *fiber );
+
+/* timers run by the scheduler (task.c)
+ * '*slot' follows the position of the timer in the heap, -1 once fired */
+int   schedTimerAdd( scheduler_t *sched, uint32_t deadline, pf_post_t func,
+		     void *arg, int *slot );
+void  schedTimerDel( scheduler_t *sched, int *slot );
+void  schedRemoteWake( fiber_t *fiber );
+
+/* wait queues (task.c) */
+void      waitqPush( waitq_t *queue, waiter_t *waiter );
+void      waitqRemove( waiter_t *waiter );
+waiter_t *waitqFirst( waitq_t *queue );
+int       waiterLive( waiter_t *waiter );
+void      waiterFire( waiter_t *waiter );
+int       fiberWaitOn( fiber_t *fiber, waiter_t *waiters, int n, uint32_t msec );
+int       fiberWaitQueue( fiber_t *fiber, waitq_t *queue, void *data, uint32_t msec );
+void      fiberUnlinkWaiters( fiber_t *fiber );
+waitq_t  *schedVarQueue( scheduler_t *sched, int *addr );
+
+/* file descriptor readiness (task.c) */
+int   schedIoArm( scheduler_t *sched, waiter_t *waiter, int fd, uint32_t events );
+int   schedIoPoll( scheduler_t *sched, int msec );
+
+/* statistics (stats.c) : the cycle and its phases are always measured,
+ * switches and wake ups only when accounting is on */
+void  schedAcctSwitch( scheduler_t *sched, fiber_t *next );
+void  fiberAcctWake( fiber_t *fiber );
+void  schedAcctRetire( scheduler_t *sched, fiber_t *fiber );
+void  schedHistAdd( sched_histogram_t *h, uint64_t v );
+void  schedPhaseEnd( scheduler_t *sched, int phase, uint64_t *t );
+
+/* hardware counters (counters.c), read on switches when accounting is on
+ * and closed with their scheduler */
+void  schedPerfSwitch( scheduler_t *sched, fiber_t *prev );
+void  schedPerfPending( scheduler_t *sched, fiber_stats_t *stats );
+void  schedPerfClose( scheduler_t *sched );
+
+/* watchdog (watchdog.c), bound to the thread running the cycle */
+void  schedWatchdogBind( scheduler_t *sched );
+
+/* sampling profiler (profiler.c), bound to the thread running the cycle
+ * and freed with its scheduler */
+void  schedProfileBind( scheduler_t *sched );
+void  schedProfileFree( scheduler_t *sched );
+
+/* stacks interrupted by the signals of the watchdog and the profiler
+ * (watchdog.c) : schedStackFrame() is an _Unwind_Backtrace() callback
+ * filling a struct stack_frames, schedAltStack() installs an alternate
+ * signal stack on the calling thread and records its bounds */
+struct stack_frames {
+  uintptr_t lo, hi;         /* stack bounds */
+  int inside;               /* keep the frames inside the bounds, or the
+			     * ones outside */
+  void **frames;
+  int n, max;
+};
+
+extern __thread uintptr_t altStackLo, altStackHi;
+_Unwind_Reason_Code schedStackFrame( struct _Unwind_Context *ctx, void *arg );
+void  schedAltStack( void );
+
+/* multi source waits (waitany.c) */
+struct wait_source;
+int   waitSourcesCheck( scheduler_t *sched, struct wait_source *sources, int n,
+			int *index, int *nearest );
+int   waitSourcesArm( fiber_t *fiber, struct wait_source *sources, int n,
+		      waiter_t *waiters, struct var_wait *vws, int *fired );
+
+/* channel operations used by multi source waits (channel.c) */
+struct channel_case;
+int   channelTryCase( struct channel_case *c );
+void  channelPushCase( struct channel_case *c, waiter_t *waiter );
+
 #endif
@@ -0,0 +1,121 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Tasklets : run to completion work run by sched_cycle() without a stack.
+ *
+ *  A scheduled tasklet is a call to taskletRun() posted with sched_post().
+ *
+ *  The fiber handed over to a tasklet is flagged FIBER_F_STACKLESS and is
+ *  not registered in the scheduler : fiberCheckBlock() rejects it.
+ * ----------------------------------------------------------------------------*/
+
+#include <string.h>
+
+#include "taskint.h"
+#include "tasklet.h"
+
+struct tasklet {
+  fiber_t  fiber;           /* handed over to the run function */
+  int      scheduled;       /* set until it runs */
+};
+
+/* ----------------------------------------------------------------------------
+ * Run a scheduled tasklet. It may free itself : it isn't touched after.
+ * ----------------------------------------------------------------------------*/
+static void taskletRun( scheduler_t *sched, void *arg )
+{
+  tasklet_t *tasklet = (tasklet_t*) arg;
+  fiber_t *fiber = &tasklet->fiber;
+
+  tasklet->scheduled = 0;
+  sched->running = fiber;
+  fiber->pf_run( fiber );
+  sched->running = NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  tasklet_new --
+ * --------------------------------------------------------------------------*/
+tasklet_t *tasklet_new( scheduler_t *sched, pf_run_t run, void *extra )
+{
+  tasklet_t *tasklet;
+
+  if ( sched == NULL || run == NULL ) {
+    return NULL;
+  }
+  tasklet = (tasklet_t*) schedMemAlloc( sched, sizeof(*tasklet));
+  if ( tasklet == NULL ) {
+    return NULL;
+  }
+  memset( tasklet, 0, sizeof(*tasklet));
+  tasklet->fiber.pf_run = run;
+  tasklet->fiber.extra = extra;
+  tasklet->fiber.scheduler = sched;
+  tasklet->fiber.home = sched;
+  tasklet->fiber.fid = ARRAYSIZE;
+  tasklet->fiber.flags = FIBER_F_STACKLESS;
+  tasklet->fiber.state = FIBER_RUNNING;
+  return tasklet;
+}
+
+/* --------------------------------------------------------------------------
+ *  tasklet_free --
+ * --------------------------------------------------------------------------*/
+int tasklet_free( tasklet_t *tasklet )
+{
+  if ( tasklet->scheduled ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  schedMemFree( tasklet->fiber.home, tasklet );
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  tasklet_self --
+ * --------------------------------------------------------------------------*/
+tasklet_t *tasklet_self( fiber_t *fiber )
+{
+  if ( fiber == NULL || !(fiber->flags & FIBER_F_STACKLESS) ) {
+    return NULL;
+  }
+  return (tasklet_t*) ((char*) fiber - offsetof(tasklet_t, fiber));
+}
+
+/* --------------------------------------------------------------------------
+ *  tasklet_schedule --
+ * --------------------------------------------------------------------------*/
+int tasklet_schedule( tasklet_t *tasklet )
+{
+  int ret;
+
+  if ( tasklet->scheduled ) {
+    return FIBER_OK;
+  }
+  ret = sched_post( tasklet->fiber.scheduler, taskletRun, tasklet );
+  if ( ret == FIBER_OK ) {
+    tasklet->scheduled = 1;
+  }
+  return ret;
+}
@@ -0,0 +1,100 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_TASKLET_H__
+#define __FIBER_TASKLET_H__
+
+#include "task.h"
+
+/* typedefs */
+typedef struct tasklet tasklet_t;
+
+/* ---------------------------------------------------------------------------
+ *  Tasklets
+ *
+ *  Work that never blocks doesn't need a fiber : no stack has to be
+ *  allocated and booted, nothing is switched. A scheduled tasklet is run
+ *  once by sched_cycle() itself, on the stack of the thread running the
+ *  scheduler, like a callback posted with sched_post().
+ *
+ *  A tasklet is a function with the same signature as the run function of
+ *  a fiber. It receives a fiber object without a stack, so that
+ *  fiber_get_extra() and the other accessors work. The wait functions,
+ *  fiber_yield() and the blocking operations of channels, locks... reject
+ *  it with FIBER_ILLEGAL_STATE instead of parking it, and an error is
+ *  logged : a tasklet must run to completion.
+ *
+ *  Tasklets are local to their scheduler : they must be scheduled from
+ *  the thread running it.
+ * ---------------------------------------------------------------------------
+ */
+
+
+/* ---------------------------------------------------------------------------
+ * tasklet_new --
+ *
+ * Allocates a tasklet running `run' in `sched' each time it is scheduled.
+ * `extra' is returned by fiber_get_extra() on the fiber given to `run'.
+ *
+ * Returns NULL on memory allocation failure.
+ * ---------------------------------------------------------------------------
+ */
+tasklet_t *tasklet_new( scheduler_t *sched, pf_run_t run, void *extra );
+
+
+/* ---------------------------------------------------------------------------
+ * tasklet_free --
+ *
+ * Frees a tasklet. A tasklet can free itself from its run function.
+ *
+ * Returns FIBER_OK or FIBER_ILLEGAL_STATE if it is scheduled.
+ * ---------------------------------------------------------------------------
+ */
+int tasklet_free( tasklet_t *tasklet );
+
+
+/* ---------------------------------------------------------------------------
+ * tasklet_self --
+ *
+ * Returns the tasklet whose run function received `fiber', or NULL if
+ * `fiber' is a regular fiber.
+ * ---------------------------------------------------------------------------
+ */
+tasklet_t *tasklet_self( fiber_t *fiber );
+
+
+/* ---------------------------------------------------------------------------
+ * tasklet_schedule --
+ *
+ * The tasklet will run once during the next cycle. Scheduling a tasklet
+ * which didn't run yet does nothing. A tasklet can schedule itself again
+ * from its run function.
+ *
+ * Returns FIBER_OK or FIBER_MEMORY_ALLOCATION_ERROR.
+ * ---------------------------------------------------------------------------
+ */
+int tasklet_schedule( tasklet_t *tasklet );
+
+
+#endif
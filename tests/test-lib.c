@@ -23,9 +23,29 @@
  */
 #include <check.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 
 #include "taskint.h"
+#include "channel.h"
+#include "xchannel.h"
+#include "sync.h"
+#include "future.h"
+#include "generator.h"
+#include "waitany.h"
+#include "group.h"
+#include "pool.h"
+#include "tasklet.h"
+#include "pt.h"
+#include "tracer.h"
+#include "recorder.h"
+#include "watchdog.h"
+#include "profiler.h"
 
 void pre_hook_func(scheduler_t *sched, void *extra)
 {
@@ -847,6 +867,2630 @@ START_TEST (test_single_fiber_set_parameters)
 }
 END_TEST
 
+/* --------------------------------------------------------------------------
+ *   fibers, stacks and buffers taken from node local memory
+ * --------------------------------------------------------------------------*/
+START_TEST (test_sched_node_memory)
+{
+  scheduler_t *sched = sched_new();
+  fiber_t *f1, *f2;
+  char *buf1, *buf2;
+  int cpu = 0;
+
+  ck_assert_int_eq( sched_get_node(sched), -1 );
+  ck_assert_int_eq( sched_set_cpus(sched, &cpu, 0), FIBER_ERROR );
+  ck_assert_int_eq( sched_set_cpus(sched, &cpu, 1), FIBER_OK );
+  ck_assert_int_eq( sched_set_node(sched, 0), FIBER_OK );
+  ck_assert_int_eq( sched_get_node(sched), 0 );
+
+  /* pooled buffers are recycled */
+  buf1 = sched_alloc( sched, 100 );
+  ck_assert_int_eq( buf1 != NULL, 1 );
+  memset( buf1, 0xa5, 100 );
+  sched_release( sched, buf1 );
+  buf2 = sched_alloc( sched, 100 );
+  ck_assert_int_eq( buf1 == buf2, 1 );
+  sched_release( sched, buf2 );
+
+  /* big buffers are mapped */
+  buf1 = sched_alloc( sched, 100000 );
+  ck_assert_int_eq( buf1 != NULL, 1 );
+  memset( buf1, 0x5a, 100000 );
+  sched_release( sched, buf1 );
+
+  /* fibers run as usual */
+  f1 = sched_fiber_new( sched, run_2iter, NULL );
+  f2 = sched_fiber_new( sched, run_forever, NULL );
+  ck_assert_int_eq( f1->home == sched, 1 );
+  ck_assert_int_eq( fiber_start( sched, f1), FIBER_OK );
+  ck_assert_int_eq( fiber_start( sched, f2), FIBER_OK );
+  ck_assert_int_eq( f1->flags & FIBER_F_MAPPED_STACK, FIBER_F_MAPPED_STACK );
+
+  sched_cycle( sched, sched_elapsed());
+  sched_cycle( sched, sched_elapsed());
+  sched_cycle( sched, sched_elapsed());
+  ck_assert_int_eq(sched_numfibers(sched), 1);
+  ck_assert_int_eq( f1->stack == NULL, 1 );
+
+  sched_stop( sched );
+  sched_cycle( sched, sched_elapsed());
+  ck_assert_int_eq(sched_numfibers(sched), 0);
+
+  /* clean */
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   cross thread channel fed by a thread without scheduler
+ * --------------------------------------------------------------------------*/
+#define XCHAN_NMSGS 10000
+
+static void *xchan_producer( void *arg )
+{
+  xchannel_t *chan = (xchannel_t*) arg;
+  int i;
+
+  for( i = 0; i < XCHAN_NMSGS; ) {
+    if ( xchannel_try_send( chan, &i ) == FIBER_OK ) ++i;
+    else sched_yield();
+  }
+  return NULL;
+}
+
+/* sends a single message once the receiving scheduler sleeps */
+static void *xchan_late_producer( void *arg )
+{
+  xchannel_t *chan = (xchannel_t*) arg;
+  int v = 42;
+
+  usleep( 50000 );
+  xchannel_try_send( chan, &v );
+  return NULL;
+}
+
+static int xchan_received;
+static int xchan_sent;
+static int xchan_error;
+
+/* drains a MPSC channel fed by two senders */
+static void *xchan_consumer( void *arg )
+{
+  xchannel_t *chan = (xchannel_t*) arg;
+  int v;
+
+  while( xchan_received < 16 ) {
+    if ( xchannel_try_recv( chan, &v ) == FIBER_OK ) xchan_received ++;
+    else sched_yield();
+  }
+  return NULL;
+}
+
+static void run_xchan_sender( fiber_t *fiber )
+{
+  xchannel_t *chan = (xchannel_t*) fiber_get_extra( fiber );
+  int i;
+
+  for( i = 0; i < 8; ++i ) {
+    if ( xchannel_send( fiber, chan, &i, 0 ) != FIBER_OK ) {
+      xchan_error = 1;
+      return;
+    }
+    xchan_sent ++;
+  }
+}
+
+static void run_xchan_consumer( fiber_t *fiber )
+{
+  xchannel_t *chan = (xchannel_t*) fiber_get_extra( fiber );
+  int buf[16];
+  size_t i, n;
+
+  while( xchan_received < XCHAN_NMSGS ) {
+    if ( xchannel_recv_batch( fiber, chan, buf, 16, &n, 0) != FIBER_OK ) {
+      xchan_error = 1;
+      return;
+    }
+    for( i = 0; i < n; ++i ) {
+      if ( buf[i] != xchan_received++ ) xchan_error = 1;
+    }
+  }
+}
+
+static fiber_t *xchan_receiver;
+
+static void run_xchan_recv_one( fiber_t *fiber )
+{
+  xchannel_t *chan = (xchannel_t*) fiber_get_extra( fiber );
+  int v;
+
+  xchannel_recv( fiber, chan, &v, 0 );
+}
+
+/* wakes up the receiver then stops it before it resumes */
+static void run_xchan_stopper( fiber_t *fiber )
+{
+  xchannel_t *chan = (xchannel_t*) fiber_get_extra( fiber );
+  int v = 1;
+
+  xchannel_try_send( chan, &v );
+  fiber_stop( xchan_receiver );
+}
+
+START_TEST (test_xchannel)
+{
+  scheduler_t *sched = sched_new();
+  xchannel_t *chan;
+  fiber_t *f1;
+  pthread_t th;
+  uint32_t t;
+  int i, v;
+
+  /* non blocking use */
+  ck_assert_int_eq( xchannel_new( sizeof(int), 4, 99 ) == NULL, 1 );
+  chan = xchannel_new( sizeof(int), 3, XCHANNEL_MPSC );
+  ck_assert_int_eq( xchannel_try_recv( chan, &v ), FIBER_TIMEOUT );
+  for( i = 0; i < 4; ++i ) {
+    ck_assert_int_eq( xchannel_try_send( chan, &i ), FIBER_OK );
+  }
+  ck_assert_int_eq( xchannel_try_send( chan, &i ), FIBER_TIMEOUT );
+  for( i = 0; i < 4; ++i ) {
+    ck_assert_int_eq( xchannel_try_recv( chan, &v ), FIBER_OK );
+    ck_assert_int_eq( v, i );
+  }
+  xchannel_free( chan );
+
+  /* parked receiver woken up by another thread */
+  chan = xchannel_new( sizeof(int), 64, XCHANNEL_SPSC );
+  f1 = fiber_new( run_xchan_consumer, chan );
+  fiber_start( sched, f1 );
+  sched_cycle( sched, sched_elapsed());
+  ck_assert_int_eq( sched_deadline(sched), UINT_MAX );
+
+  xchan_received = 0;
+  xchan_error = 0;
+  pthread_create( &th, NULL, xchan_producer, chan );
+  while( sched_numfibers(sched) > 0 ) {
+    sched_cycle( sched, sched_elapsed());
+    if ( sched_numfibers(sched) > 0 && sched_deadline(sched) != 0 ) {
+      ck_assert_int_eq( sched_poll( sched, 2000 ), 0 );
+    }
+  }
+  pthread_join( th, NULL );
+  ck_assert_int_eq( xchan_received, XCHAN_NMSGS );
+  ck_assert_int_eq( xchan_error, 0 );
+
+  /* the wake up interrupts a sleep with no limit */
+  xchan_received = XCHAN_NMSGS - 1;
+  f1 = fiber_new( run_xchan_consumer, chan );
+  fiber_start( sched, f1 );
+  sched_cycle( sched, sched_elapsed());
+  ck_assert_int_eq( sched_deadline(sched), UINT_MAX );
+  t = sched_elapsed();
+  pthread_create( &th, NULL, xchan_late_producer, chan );
+  sched_poll( sched, UINT_MAX );
+  ck_assert_int_eq( sched_deadline(sched), 0 );
+  sched_cycle( sched, sched_elapsed());
+  pthread_join( th, NULL );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  ck_assert_int_eq( xchan_received, XCHAN_NMSGS );
+  ck_assert_int_lt( sched_elapsed() - t, 1000 );
+  xchannel_free( chan );
+
+  /* senders blocked on a full MPSC channel are parked too */
+  chan = xchannel_new( sizeof(int), 4, XCHANNEL_MPSC );
+  xchan_received = xchan_sent = xchan_error = 0;
+  fiber_start( sched, fiber_new( run_xchan_sender, chan ));
+  fiber_start( sched, fiber_new( run_xchan_sender, chan ));
+  sched_cycle( sched, sched_elapsed());
+  ck_assert_int_eq( xchan_sent, 4 );
+  ck_assert_int_eq( sched_deadline(sched), UINT_MAX );
+  pthread_create( &th, NULL, xchan_consumer, chan );
+  while( sched_numfibers(sched) > 0 ) {
+    sched_cycle( sched, sched_elapsed());
+    if ( sched_numfibers(sched) > 0 && sched_deadline(sched) != 0 ) {
+      sched_poll( sched, UINT_MAX );
+    }
+  }
+  pthread_join( th, NULL );
+  ck_assert_int_eq( xchan_sent, 16 );
+  ck_assert_int_eq( xchan_received, 16 );
+  ck_assert_int_eq( xchan_error, 0 );
+  xchannel_free( chan );
+
+  /* a fiber ending with its wake up in the inbox is taken out of it */
+  chan = xchannel_new( sizeof(int), 4, XCHANNEL_SPSC );
+  xchan_receiver = fiber_new( run_xchan_recv_one, chan );
+  fiber_start( sched, xchan_receiver );
+  sched_cycle( sched, sched_elapsed());
+  ck_assert_int_eq( xchan_receiver->state, FIBER_SUSPEND );
+  fiber_start( sched, fiber_new( run_xchan_stopper, chan ));
+  sched_cycle( sched, sched_elapsed());
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  ck_assert_ptr_eq( sched->inbox, NULL );
+
+  /* clean */
+  xchannel_free( chan );
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   channels between fibers
+ * --------------------------------------------------------------------------*/
+static channel_t *chan_a, *chan_b;
+static int chan_sum, chan_res;
+
+/* sends 1..10 to chan_a then 0 */
+static void run_chan_producer( fiber_t *fiber )
+{
+  int i;
+  for( i = 1; i <= 10; ++i ) {
+    channel_send( fiber, chan_a, &i, 0 );
+  }
+  i = 0;
+  channel_send( fiber, chan_a, &i, 0 );
+}
+
+/* sums what it receives from chan_a until 0 */
+static void run_chan_consumer( fiber_t *fiber )
+{
+  int v;
+  do {
+    chan_res = channel_recv( fiber, chan_a, &v, 0 );
+    chan_sum += v;
+  } while( chan_res == FIBER_OK && v != 0 );
+}
+
+/* receives from chan_a or chan_b, 100 msec max */
+static void run_chan_select( fiber_t *fiber )
+{
+  channel_case_t cases[2];
+  int v = -1, idx = -1;
+
+  cases[0].chan = chan_a;
+  cases[0].op = CHANNEL_RECV;
+  cases[0].data = &v;
+  cases[1].chan = chan_b;
+  cases[1].op = CHANNEL_RECV;
+  cases[1].data = &v;
+  chan_res = fiber_select( fiber, 100, cases, 2, &idx );
+  chan_sum = (chan_res == FIBER_OK) ? 10*idx + v : -1;
+}
+
+static void run_sched_until_done( scheduler_t *sched )
+{
+  while( sched_numfibers(sched) > 0 ) {
+    sched_cycle( sched, sched_elapsed());
+  }
+}
+
+START_TEST (test_channel)
+{
+  scheduler_t *sched = sched_new();
+  int v;
+
+  /* unbuffered and buffered channels */
+  for( v = 0; v <= 3; v += 3 ) {
+    chan_a = channel_new( sizeof(int), v );
+    chan_sum = 0;
+    fiber_start( sched, fiber_new( run_chan_consumer, NULL ));
+    fiber_start( sched, fiber_new( run_chan_producer, NULL ));
+    run_sched_until_done( sched );
+    ck_assert_int_eq( chan_res, FIBER_OK );
+    ck_assert_int_eq( chan_sum, 55 );
+    channel_free( chan_a );
+  }
+
+  /* non blocking operations */
+  chan_a = channel_new( sizeof(int), 1 );
+  v = 7;
+  ck_assert_int_eq( channel_try_recv( chan_a, &v ), FIBER_TIMEOUT );
+  ck_assert_int_eq( channel_try_send( chan_a, &v ), FIBER_OK );
+  ck_assert_int_eq( channel_try_send( chan_a, &v ), FIBER_TIMEOUT );
+  v = 0;
+  ck_assert_int_eq( channel_try_recv( chan_a, &v ), FIBER_OK );
+  ck_assert_int_eq( v, 7 );
+
+  /* a blocked receiver is not polled and can be stopped */
+  fiber_start( sched, fiber_new( run_chan_consumer, NULL ));
+  sched_cycle( sched, 0 );
+  sched_cycle( sched, 10 );
+  ck_assert_int_eq( sched_deadline( sched ), UINT_MAX );
+  sched_stop( sched );
+  sched_cycle( sched, 20 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  ck_assert_int_eq( channel_try_send( chan_a, &v ), FIBER_OK );
+  channel_free( chan_a );
+
+  /* clean */
+  sched_free( sched );
+}
+END_TEST
+
+START_TEST (test_fiber_select)
+{
+  scheduler_t *sched = sched_new();
+  int v = 4;
+
+  chan_a = channel_new( sizeof(int), 0 );
+  chan_b = channel_new( sizeof(int), 0 );
+
+  /* second channel fires */
+  fiber_start( sched, fiber_new( run_chan_select, NULL ));
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( channel_try_send( chan_b, &v ), FIBER_OK );
+  ck_assert_int_eq( channel_try_send( chan_a, &v ), FIBER_TIMEOUT );
+  sched_cycle( sched, 1 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  ck_assert_int_eq( chan_res, FIBER_OK );
+  ck_assert_int_eq( chan_sum, 14 );
+
+  /* timeout */
+  fiber_start( sched, fiber_new( run_chan_select, NULL ));
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( sched_deadline( sched ), 100 );
+  sched_cycle( sched, 101 );
+  sched_cycle( sched, 102 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  ck_assert_int_eq( chan_res, FIBER_TIMEOUT );
+  ck_assert_int_eq( channel_try_send( chan_a, &v ), FIBER_TIMEOUT );
+
+  /* clean */
+  channel_free( chan_a );
+  channel_free( chan_b );
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   direct switch between fibers
+ * --------------------------------------------------------------------------*/
+static fiber_t *pingpong[2];
+static int pingpong_count;
+
+static void run_pingpong( fiber_t *fiber )
+{
+  fiber_t *other = (fiber == pingpong[0]) ? pingpong[1] : pingpong[0];
+
+  while( pingpong_count < 1000 ) {
+    pingpong_count ++;
+    if ( fiber_yield_to( fiber, other ) != FIBER_OK ) {
+      fiber_yield( fiber );
+    }
+  }
+}
+
+START_TEST (test_fiber_yield_to)
+{
+  scheduler_t *sched = sched_new();
+
+  pingpong_count = 0;
+  pingpong[0] = fiber_new( run_pingpong, NULL );
+  pingpong[1] = fiber_new( run_pingpong, NULL );
+
+  /* not running */
+  ck_assert_int_eq( fiber_yield_to( pingpong[0], pingpong[1] ), FIBER_ILLEGAL_STATE );
+
+  /* the whole exchange takes place during the first cycle */
+  fiber_start( sched, pingpong[0] );
+  fiber_start( sched, pingpong[1] );
+  sched_cycle( sched, sched_elapsed());
+  ck_assert_int_eq( pingpong_count, 1000 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* clean */
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   fibers woken up run in the same cycle
+ * --------------------------------------------------------------------------*/
+static int runnext_flag;
+
+/* forwards what it receives on chan_a to chan_b */
+static void run_chan_relay( fiber_t *fiber )
+{
+  int v;
+  channel_recv( fiber, chan_a, &v, 0 );
+  channel_send( fiber, chan_b, &v, 0 );
+}
+
+static void run_chan_sink( fiber_t *fiber )
+{
+  channel_recv( fiber, chan_b, &chan_sum, 0 );
+}
+
+static int pred_runnext_flag( fiber_t *fiber, void *arg )
+{
+  return runnext_flag;
+}
+
+static void run_wait_flag( fiber_t *fiber )
+{
+  fiber_wait_for_cond( fiber, 0, pred_runnext_flag, NULL );
+  chan_sum = 1;
+}
+
+static void run_set_flag( fiber_t *fiber )
+{
+  fiber_t *waiter = (fiber_t*) fiber_get_extra( fiber );
+  ck_assert_int_eq( fiber_notify( waiter ), FIBER_TIMEOUT );
+  runnext_flag = 1;
+  ck_assert_int_eq( fiber_notify( waiter ), FIBER_OK );
+  ck_assert_int_eq( chan_sum, 0 );
+}
+
+START_TEST (test_run_next)
+{
+  scheduler_t *sched = sched_new();
+  fiber_t *f1;
+  int v = 5;
+
+  /* a message goes through 3 fibers in a single cycle */
+  chan_a = channel_new( sizeof(int), 0 );
+  chan_b = channel_new( sizeof(int), 0 );
+  chan_sum = 0;
+  fiber_start( sched, fiber_new( run_chan_sink, NULL ));
+  fiber_start( sched, fiber_new( run_chan_relay, NULL ));
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( sched_numfibers(sched), 2 );
+
+  ck_assert_int_eq( channel_try_send( chan_a, &v ), FIBER_OK );
+  sched_cycle( sched, 1 );
+  ck_assert_int_eq( chan_sum, 5 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  channel_free( chan_a );
+  channel_free( chan_b );
+
+  /* condition checked when notified */
+  runnext_flag = 0;
+  chan_sum = 0;
+  f1 = fiber_new( run_wait_flag, NULL );
+  fiber_start( sched, f1 );
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( fiber_notify( f1 ), FIBER_TIMEOUT );
+  fiber_start( sched, fiber_new( run_set_flag, f1 ));
+  sched_cycle( sched, 1 );
+  ck_assert_int_eq( chan_sum, 1 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* clean */
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   fibers parked on a variable
+ * --------------------------------------------------------------------------*/
+static int parkvar;
+static int parkvar_res[3];
+
+/* waits for parkvar to become its index + 1 */
+static void run_var_wait( fiber_t *fiber )
+{
+  int i = (int) (intptr_t) fiber_get_extra( fiber );
+  parkvar_res[i] = fiber_var_wait( fiber, (i == 2) ? 100 : 0, &parkvar, i + 1 );
+}
+
+START_TEST (test_fiber_var_wait)
+{
+  scheduler_t *sched = sched_new();
+  int i;
+
+  parkvar = 0;
+  for( i = 0; i < 3; ++i ) {
+    parkvar_res[i] = -1;
+    fiber_start( sched, fiber_new( run_var_wait, (void*) (intptr_t) i ));
+  }
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( sched_deadline( sched ), 100 );
+
+  /* plain stores are not seen */
+  parkvar = 1;
+  sched_cycle( sched, 1 );
+  ck_assert_int_eq( parkvar_res[0], -1 );
+
+  /* only the fiber waiting for the value is woken up */
+  ck_assert_int_eq( fiber_var_notify( sched, &parkvar ), 1 );
+  ck_assert_int_eq( fiber_var_store( sched, &parkvar, 4 ), 0 );
+  sched_cycle( sched, 2 );
+  ck_assert_int_eq( parkvar_res[0], FIBER_OK );
+  ck_assert_int_eq( parkvar_res[1], -1 );
+  ck_assert_int_eq( sched_numfibers(sched), 2 );
+
+  /* timeout */
+  sched_cycle( sched, 101 );
+  sched_cycle( sched, 102 );
+  ck_assert_int_eq( parkvar_res[2], FIBER_TIMEOUT );
+  ck_assert_int_eq( sched_deadline( sched ), UINT_MAX );
+
+  ck_assert_int_eq( fiber_var_store( sched, &parkvar, 2 ), 1 );
+  sched_cycle( sched, 103 );
+  ck_assert_int_eq( parkvar_res[1], FIBER_OK );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* clean */
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   mutex and condition variable
+ * --------------------------------------------------------------------------*/
+static fiber_mutex_t *sync_mutex;
+static fiber_cond_t *sync_cond;
+static int sync_count;
+static int sync_order[4];
+static int sync_norder;
+
+/* holds the mutex for one cycle */
+static void run_mutex_hold( fiber_t *fiber )
+{
+  ck_assert_int_eq( fiber_mutex_lock( fiber, sync_mutex, 0 ), FIBER_OK );
+  ck_assert_int_eq( fiber_mutex_lock( fiber, sync_mutex, 0 ), FIBER_ILLEGAL_STATE );
+  fiber_yield( fiber );
+  sync_order[sync_norder++] = 0;
+  ck_assert_int_eq( fiber_mutex_unlock( fiber, sync_mutex ), FIBER_OK );
+}
+
+/* takes one unit of sync_count under the mutex */
+static void run_cond_consume( fiber_t *fiber )
+{
+  int i = (int) (intptr_t) fiber_get_extra( fiber );
+
+  ck_assert_int_eq( fiber_mutex_lock( fiber, sync_mutex, 0 ), FIBER_OK );
+  while( sync_count == 0 ) {
+    ck_assert_int_eq( fiber_cond_wait( fiber, sync_cond, sync_mutex, 0 ), FIBER_OK );
+  }
+  sync_count --;
+  sync_order[sync_norder++] = i;
+  ck_assert_int_eq( fiber_mutex_unlock( fiber, sync_mutex ), FIBER_OK );
+}
+
+static void run_cond_timeout( fiber_t *fiber )
+{
+  ck_assert_int_eq( fiber_mutex_lock( fiber, sync_mutex, 0 ), FIBER_OK );
+  ck_assert_int_eq( fiber_cond_wait( fiber, sync_cond, sync_mutex, 10 ), FIBER_TIMEOUT );
+  ck_assert_int_eq( fiber_mutex_unlock( fiber, sync_mutex ), FIBER_OK );
+  sync_order[sync_norder++] = 3;
+}
+
+START_TEST (test_fiber_mutex_cond)
+{
+  scheduler_t *sched = sched_new();
+  fiber_t *f1;
+
+  sync_mutex = fiber_mutex_new();
+  sync_cond = fiber_cond_new();
+  sync_count = 0;
+  sync_norder = 0;
+
+  /* contention : consumers wait for the mutex then for the condition */
+  f1 = fiber_new( run_mutex_hold, NULL );
+  fiber_start( sched, f1 );
+  fiber_start( sched, fiber_new( run_cond_consume, (void*) 1 ));
+  fiber_start( sched, fiber_new( run_cond_consume, (void*) 2 ));
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( fiber_mutex_trylock( f1, sync_mutex ), FIBER_ILLEGAL_STATE );
+  sched_cycle( sched, 1 );
+  sched_cycle( sched, 2 );
+  ck_assert_int_eq( sync_norder, 1 );
+  ck_assert_int_eq( sched_numfibers(sched), 2 );
+
+  /* signal wakes up the first waiter, broadcast the other */
+  sync_count = 2;
+  ck_assert_int_eq( fiber_cond_signal( sync_cond ), 1 );
+  ck_assert_int_eq( fiber_cond_broadcast( sync_cond ), 1 );
+  ck_assert_int_eq( fiber_cond_broadcast( sync_cond ), 0 );
+  sched_cycle( sched, 3 );
+  ck_assert_int_eq( sync_norder, 3 );
+  ck_assert_int_eq( sync_order[1], 1 );
+  ck_assert_int_eq( sync_order[2], 2 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* timeout, the mutex is owned again on return */
+  fiber_start( sched, fiber_new( run_cond_timeout, NULL ));
+  sched_cycle( sched, 4 );
+  sched_cycle( sched, 15 );
+  sched_cycle( sched, 16 );
+  ck_assert_int_eq( sync_norder, 4 );
+  ck_assert_int_eq( sync_order[3], 3 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* clean */
+  sched_free( sched );
+  fiber_cond_free( sync_cond );
+  fiber_mutex_free( sync_mutex );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   semaphore, read-write lock and barrier
+ * --------------------------------------------------------------------------*/
+static fiber_sem_t *sync_sem;
+static fiber_rwlock_t *sync_rwlock;
+static fiber_barrier_t *sync_barrier;
+
+static void run_sem_wait( fiber_t *fiber )
+{
+  ck_assert_int_eq( fiber_sem_wait( fiber, sync_sem, 0 ), FIBER_OK );
+  sync_count ++;
+}
+
+/* extra is 1 for writers */
+static void run_rwlock( fiber_t *fiber )
+{
+  int w = (int) (intptr_t) fiber_get_extra( fiber );
+
+  if ( w ) {
+    ck_assert_int_eq( fiber_rwlock_wrlock( fiber, sync_rwlock, 0 ), FIBER_OK );
+  }
+  else {
+    ck_assert_int_eq( fiber_rwlock_rdlock( fiber, sync_rwlock, 0 ), FIBER_OK );
+  }
+  sync_order[sync_norder++] = w;
+  fiber_yield( fiber );
+  ck_assert_int_eq( fiber_rwlock_unlock( fiber, sync_rwlock ), FIBER_OK );
+}
+
+static void run_barrier( fiber_t *fiber )
+{
+  ck_assert_int_eq( fiber_barrier_wait( fiber, sync_barrier, 0 ), FIBER_OK );
+  sync_count ++;
+}
+
+START_TEST (test_fiber_sem_rwlock_barrier)
+{
+  scheduler_t *sched = sched_new();
+  int i;
+
+  /* semaphore */
+  sync_sem = fiber_sem_new( 1 );
+  sync_count = 0;
+  for( i = 0; i < 3; ++i ) {
+    fiber_start( sched, fiber_new( run_sem_wait, NULL ));
+  }
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( sync_count, 1 );
+  ck_assert_int_eq( fiber_sem_trywait( sync_sem ), FIBER_TIMEOUT );
+  fiber_sem_post( sync_sem );
+  fiber_sem_post( sync_sem );
+  fiber_sem_post( sync_sem );
+  sched_cycle( sched, 1 );
+  ck_assert_int_eq( sync_count, 3 );
+  ck_assert_int_eq( fiber_sem_trywait( sync_sem ), FIBER_OK );
+  ck_assert_int_eq( fiber_sem_trywait( sync_sem ), FIBER_TIMEOUT );
+  fiber_sem_free( sync_sem );
+
+  /* rwlock : readers share the lock, a queued writer blocks later readers */
+  sync_rwlock = fiber_rwlock_new();
+  sync_norder = 0;
+  fiber_start( sched, fiber_new( run_rwlock, (void*) 0 ));
+  fiber_start( sched, fiber_new( run_rwlock, (void*) 0 ));
+  fiber_start( sched, fiber_new( run_rwlock, (void*) 1 ));
+  fiber_start( sched, fiber_new( run_rwlock, (void*) 0 ));
+  sched_cycle( sched, 2 );
+  ck_assert_int_eq( sync_norder, 2 );
+  sched_cycle( sched, 3 );
+  ck_assert_int_eq( sync_norder, 3 );
+  ck_assert_int_eq( sync_order[2], 1 );
+  sched_cycle( sched, 4 );
+  ck_assert_int_eq( sync_norder, 4 );
+  ck_assert_int_eq( sync_order[3], 0 );
+  sched_cycle( sched, 5 );
+  sched_cycle( sched, 6 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  fiber_rwlock_free( sync_rwlock );
+
+  /* barrier */
+  ck_assert_ptr_eq( fiber_barrier_new( 0 ), NULL );
+  sync_barrier = fiber_barrier_new( 3 );
+  sync_count = 0;
+  for( i = 0; i < 2; ++i ) {
+    fiber_start( sched, fiber_new( run_barrier, NULL ));
+  }
+  sched_cycle( sched, 7 );
+  sched_cycle( sched, 8 );
+  ck_assert_int_eq( sync_count, 0 );
+  fiber_start( sched, fiber_new( run_barrier, NULL ));
+  sched_cycle( sched, 9 );
+  sched_cycle( sched, 10 );
+  ck_assert_int_eq( sync_count, 3 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  fiber_barrier_free( sync_barrier );
+
+  /* clean */
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   futures
+ * --------------------------------------------------------------------------*/
+static future_t *futs[3];
+static int fut_res[3];
+
+/* returns its argument times 2 after 'arg' cycles */
+static void *run_future_double( fiber_t *fiber, void *arg )
+{
+  intptr_t i, n = (intptr_t) arg;
+  for( i = 0; i < n; ++i ) {
+    fiber_yield( fiber );
+  }
+  return (void*) (2 * n);
+}
+
+static void *run_future_forever( fiber_t *fiber, void *arg )
+{
+  for(;;) {
+    fiber_yield( fiber );
+  }
+  return NULL;
+}
+
+static void run_future_await( fiber_t *fiber )
+{
+  void *value = NULL;
+  int index = -1;
+
+  fut_res[0] = future_await_any( fiber, futs, 3, 0, &index );
+  ck_assert_int_eq( index, 1 );
+  fut_res[1] = future_await( fiber, futs[0], 0, &value );
+  ck_assert_int_eq( (intptr_t) value, 6 );
+  fut_res[2] = future_await_all( fiber, futs, 3, 10 );
+}
+
+START_TEST (test_future)
+{
+  scheduler_t *sched = sched_new();
+  int i;
+
+  futs[0] = fiber_spawn_future( sched, run_future_double, (void*) 3 );
+  futs[1] = fiber_spawn_future( sched, run_future_double, (void*) 1 );
+  futs[2] = fiber_spawn_future( sched, run_future_forever, NULL );
+  for( i = 0; i < 3; ++i ) {
+    ck_assert_ptr_ne( futs[i], NULL );
+    fut_res[i] = -1;
+  }
+  fiber_start( sched, fiber_new( run_future_await, NULL ));
+
+  /* futs[1] completes in the second cycle and wakes up the awaiter */
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( future_state( futs[1] ), FUTURE_PENDING );
+  sched_cycle( sched, 1 );
+  ck_assert_int_eq( future_state( futs[1] ), FUTURE_READY );
+  ck_assert_int_eq( (intptr_t) future_value( futs[1] ), 2 );
+  ck_assert_int_eq( fut_res[0], FIBER_OK );
+  ck_assert_int_eq( fut_res[1], -1 );
+  sched_cycle( sched, 2 );
+  sched_cycle( sched, 3 );
+  ck_assert_int_eq( fut_res[1], FIBER_OK );
+
+  /* futs[2] never completes */
+  ck_assert_int_eq( future_free( futs[2] ), FIBER_ILLEGAL_STATE );
+  sched_cycle( sched, 14 );
+  sched_cycle( sched, 15 );
+  ck_assert_int_eq( fut_res[2], FIBER_TIMEOUT );
+  ck_assert_int_eq( sched_numfibers(sched), 1 );
+
+  /* stopping the fiber fails the future */
+  sched_stop( sched );
+  sched_cycle( sched, 16 );
+  ck_assert_int_eq( future_state( futs[2] ), FUTURE_FAILED );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* clean */
+  for( i = 0; i < 3; ++i ) {
+    ck_assert_int_eq( future_free( futs[i] ), FIBER_OK );
+  }
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   generators
+ * --------------------------------------------------------------------------*/
+static int gen_count;
+static int gen_sum;
+
+/* yields 0 .. arg - 1 */
+static void *run_gen_range( fiber_t *fiber, void *arg )
+{
+  intptr_t i, n = (intptr_t) arg;
+  for( i = 0; i < n; ++i ) {
+    ck_assert_int_eq( gen_yield( fiber, (void*) i ), FIBER_OK );
+  }
+  return NULL;
+}
+
+/* sums the squares of a range */
+static void *run_gen_square( fiber_t *fiber, void *arg )
+{
+  void *value;
+  while( gen_next( fiber, (gen_t*) arg, &value ) == FIBER_OK ) {
+    gen_yield( fiber, (void*) ((intptr_t) value * (intptr_t) value) );
+  }
+  return NULL;
+}
+
+/* ignores FIBER_CANCELED */
+static void *run_gen_forever( fiber_t *fiber, void *arg )
+{
+  for(;;) {
+    gen_yield( fiber, NULL );
+  }
+  return NULL;
+}
+
+/* frees its generator after 3 values */
+static void run_gen_take3( fiber_t *fiber )
+{
+  gen_t *gen = (gen_t*) fiber_get_extra( fiber );
+
+  while( gen_count < 3 && gen_next( fiber, gen, NULL ) == FIBER_OK ) {
+    gen_count ++;
+  }
+  gen_free( gen );
+}
+
+static void run_gen_consume( fiber_t *fiber )
+{
+  gen_t *gen = (gen_t*) fiber_get_extra( fiber );
+  void *value;
+
+  ck_assert_int_eq( gen_yield( fiber, NULL ), FIBER_ILLEGAL_STATE );
+  while( gen_next( fiber, gen, &value ) == FIBER_OK ) {
+    gen_count ++;
+    gen_sum += (intptr_t) value;
+  }
+  ck_assert_int_eq( gen_next( fiber, gen, &value ), FIBER_NO_SUCH_FIBER );
+  gen_free( gen );
+}
+
+START_TEST (test_generator)
+{
+  scheduler_t *sched = sched_new();
+  gen_t *range, *square;
+
+  /* chained generators run in a single cycle */
+  gen_count = gen_sum = 0;
+  range = gen_new( sched, run_gen_range, (void*) 5 );
+  square = gen_new( sched, run_gen_square, range );
+  ck_assert_ptr_ne( range, NULL );
+  ck_assert_ptr_ne( square, NULL );
+  fiber_start( sched, fiber_new( run_gen_consume, square ));
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( gen_count, 5 );
+  ck_assert_int_eq( gen_sum, 0 + 1 + 4 + 9 + 16 );
+  sched_cycle( sched, 1 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  gen_free( range );
+
+  /* an unfinished generator is stopped when freed */
+  range = gen_new( sched, run_gen_range, (void*) 1000 );
+  sched_cycle( sched, 2 );
+  ck_assert_int_eq( sched_numfibers(sched), 1 );
+  gen_free( range );
+  sched_cycle( sched, 3 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* so is a running one, from its consumer */
+  gen_count = 0;
+  range = gen_new( sched, run_gen_forever, NULL );
+  fiber_start( sched, fiber_new( run_gen_take3, range ));
+  sched_cycle( sched, 4 );
+  ck_assert_int_eq( gen_count, 3 );
+  sched_cycle( sched, 5 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* clean */
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   waiting on several sources
+ * --------------------------------------------------------------------------*/
+static wait_source_t wsrc[5];
+static int wany_index;
+static int wany_count;
+static int wany_var;
+
+static void run_wait_any( fiber_t *fiber )
+{
+  while( fiber_wait_any( fiber, wsrc, 5, &wany_index ) == FIBER_OK ) {
+    wany_count ++;
+    if ( wany_index == 2 ) {
+      wany_var = 0;
+    }
+    if ( wany_index == 3 ) {
+      /* the other fiber is gone : replace it by a deadline */
+      wsrc[3].type = WAIT_DEADLINE;
+      wsrc[3].deadline = 200;
+    }
+    if ( wany_index == 4 ) {
+      break;
+    }
+  }
+}
+
+static void run_wait_nothing( fiber_t *fiber )
+{
+  fiber_wait( fiber, 5 );
+}
+
+/* joins the fiber given as extra, which has already ended */
+static void run_wait_join_ended( fiber_t *fiber )
+{
+  wait_source_t src;
+
+  memset( &src, 0, sizeof(src));
+  src.type = WAIT_JOIN;
+  src.other = (fiber_t*) fiber_get_extra( fiber );
+  wany_index = -1;
+  wany_count = fiber_wait_any( fiber, &src, 1, &wany_index );
+}
+
+START_TEST (test_fiber_wait_any)
+{
+  scheduler_t *sched = sched_new();
+  channel_case_t ccase;
+  channel_t *chan;
+  fiber_t *other;
+  int fds[2], v = 7, r = 0;
+  char c = 'x';
+
+  ck_assert_int_eq( pipe( fds ), 0 );
+  chan = channel_new( sizeof(int), 0 );
+  ccase.chan = chan;
+  ccase.op = CHANNEL_RECV;
+  ccase.data = &r;
+  other = fiber_new( run_wait_nothing, NULL );
+  fiber_start( sched, other );
+
+  memset( wsrc, 0, sizeof(wsrc));
+  wsrc[0].type = WAIT_READ;
+  wsrc[0].fd = fds[0];
+  wsrc[1].type = WAIT_CHANNEL;
+  wsrc[1].chan = &ccase;
+  wsrc[2].type = WAIT_VAR;
+  wsrc[2].var = &wany_var;
+  wsrc[2].value = 1;
+  wsrc[3].type = WAIT_JOIN;
+  wsrc[3].other = other;
+  wsrc[4].type = WAIT_DEADLINE;
+  wsrc[4].deadline = 100;
+  wany_count = 0;
+  fiber_start( sched, fiber_new( run_wait_any, NULL ));
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( wany_count, 0 );
+  ck_assert_int_eq( sched_deadline( sched ), 5 );
+
+  /* channel */
+  ck_assert_int_eq( channel_try_send( chan, &v ), FIBER_OK );
+  ck_assert_int_eq( channel_try_send( chan, &v ), FIBER_TIMEOUT );
+  sched_cycle( sched, 1 );
+  ck_assert_int_eq( wany_count, 1 );
+  ck_assert_int_eq( wany_index, 1 );
+  ck_assert_int_eq( r, 7 );
+
+  /* file descriptor, woken up by sched_poll() */
+  ck_assert_int_eq( write( fds[1], &c, 1 ), 1 );
+  ck_assert_int_eq( sched_poll( sched, 0 ), 1 );
+  sched_cycle( sched, 2 );
+  ck_assert_int_eq( wany_count, 2 );
+  ck_assert_int_eq( wany_index, 0 );
+  ck_assert_int_eq( read( fds[0], &c, 1 ), 1 );
+  ck_assert_int_eq( sched_poll( sched, 0 ), 0 );
+
+  /* variable */
+  wany_var = 0;
+  ck_assert_int_eq( fiber_var_store( sched, &wany_var, 1 ), 1 );
+  sched_cycle( sched, 3 );
+  ck_assert_int_eq( wany_count, 3 );
+  ck_assert_int_eq( wany_index, 2 );
+
+  /* join */
+  sched_cycle( sched, 10 );
+  sched_cycle( sched, 11 );
+  ck_assert_int_eq( wany_count, 4 );
+  ck_assert_int_eq( wany_index, 3 );
+
+  /* then the deadline */
+  sched_cycle( sched, 50 );
+  ck_assert_int_eq( sched_deadline( sched ), 99 );
+  sched_cycle( sched, 99 );
+  ck_assert_int_eq( wany_count, 4 );
+  sched_cycle( sched, 100 );
+  sched_cycle( sched, 101 );
+  ck_assert_int_eq( wany_count, 5 );
+  ck_assert_int_eq( wany_index, 4 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* clean */
+  sched_free( sched );
+  channel_free( chan );
+  close( fds[0] );
+  close( fds[1] );
+}
+END_TEST
+
+START_TEST (test_fiber_wait_any_ended)
+{
+  scheduler_t *sched = sched_new();
+  fiber_t *other;
+
+  other = fiber_new( run_wait_nothing, NULL );
+  fiber_start( sched, other );
+  sched_cycle( sched, 0 );
+  sched_cycle( sched, 10 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* returns at once, as fiber_join() */
+  wany_count = -1;
+  fiber_start( sched, fiber_new( run_wait_join_ended, other ));
+  sched_cycle( sched, 11 );
+  ck_assert_int_eq( wany_count, FIBER_OK );
+  ck_assert_int_eq( wany_index, 0 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* clean */
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   cancellation of waiting fibers
+ * --------------------------------------------------------------------------*/
+static int cancel_res;
+static int cancel_seen;
+static int cancel_loops;
+static int cancel_cleanups;
+static char *cancel_sp;
+
+static void cancel_cleanup( void *arg )
+{
+  char here;
+  cancel_sp = &here;
+  cancel_cleanups ++;
+}
+
+/* returns when its wait is canceled */
+static void run_cancel_wait( fiber_t *fiber )
+{
+  fiber_cleanup_t cleanup;
+
+  fiber_cleanup_push( fiber, &cleanup, cancel_cleanup, NULL );
+  cancel_res = fiber_wait( fiber, 1000 );
+  cancel_seen = fiber_canceled( fiber );
+  fiber_cleanup_pop( fiber, 0 );
+}
+
+/* ignores FIBER_CANCELED */
+static void run_cancel_ignore( fiber_t *fiber )
+{
+  fiber_sem_t *sem = (fiber_sem_t*) fiber_get_extra( fiber );
+  fiber_cleanup_t cleanup;
+
+  fiber_cleanup_push( fiber, &cleanup, cancel_cleanup, NULL );
+  for(;;) {
+    fiber_sem_wait( fiber, sem, 0 );
+    cancel_loops ++;
+  }
+}
+
+/* never waits */
+static void run_cancel_busy( fiber_t *fiber )
+{
+  fiber_cleanup_t cleanup;
+
+  fiber_cleanup_push( fiber, &cleanup, cancel_cleanup, NULL );
+  for(;;) {
+    fiber_yield( fiber );
+  }
+}
+
+static fiber_t *handoff[2];
+
+/* hands off the mutex and a unit, then stops the fibers they went to */
+static void run_handoff_release( fiber_t *fiber )
+{
+  ck_assert_int_eq( fiber_mutex_lock( fiber, sync_mutex, 0 ), FIBER_OK );
+  ck_assert_int_eq( fiber_sem_wait( fiber, sync_sem, 0 ), FIBER_OK );
+  fiber_yield( fiber );
+  ck_assert_int_eq( fiber_mutex_unlock( fiber, sync_mutex ), FIBER_OK );
+  fiber_sem_post( sync_sem );
+  ck_assert_int_eq( fiber_stop( handoff[0] ), FIBER_OK );
+  ck_assert_int_eq( fiber_stop( handoff[1] ), FIBER_OK );
+}
+
+/* gives back what it was handed, then ends at next cancellation point */
+static void run_handoff_mutex( fiber_t *fiber )
+{
+  ck_assert_int_eq( fiber_mutex_lock( fiber, sync_mutex, 0 ), FIBER_OK );
+  cancel_seen += fiber_canceled( fiber );
+  ck_assert_int_eq( fiber_mutex_unlock( fiber, sync_mutex ), FIBER_OK );
+  fiber_yield( fiber );
+  cancel_loops ++;
+}
+
+static void run_handoff_sem( fiber_t *fiber )
+{
+  ck_assert_int_eq( fiber_sem_wait( fiber, sync_sem, 0 ), FIBER_OK );
+  cancel_seen += fiber_canceled( fiber );
+  fiber_sem_post( sync_sem );
+  fiber_yield( fiber );
+  cancel_loops ++;
+}
+
+static void run_handoff_relock( fiber_t *fiber )
+{
+  cancel_res = fiber_mutex_lock( fiber, sync_mutex, 10 );
+  if ( cancel_res == FIBER_OK ) {
+    fiber_mutex_unlock( fiber, sync_mutex );
+    cancel_res = fiber_sem_wait( fiber, sync_sem, 10 );
+  }
+}
+
+/* runnable again after a wait */
+static void run_stop_after_wait( fiber_t *fiber )
+{
+  fiber_wait( fiber, 1 );
+  for(;;) {
+    cancel_loops ++;
+    fiber_yield( fiber );
+  }
+}
+
+START_TEST (test_fiber_cancel_handoff)
+{
+  scheduler_t *sched = sched_new();
+
+  sync_mutex = fiber_mutex_new();
+  sync_sem = fiber_sem_new( 1 );
+  cancel_res = -1;
+  cancel_seen = cancel_loops = 0;
+
+  /* the waiters are stopped after the hand off, before they resume */
+  handoff[0] = fiber_new( run_handoff_mutex, NULL );
+  handoff[1] = fiber_new( run_handoff_sem, NULL );
+  fiber_start( sched, fiber_new( run_handoff_release, NULL ));
+  fiber_start( sched, handoff[0] );
+  fiber_start( sched, handoff[1] );
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( handoff[0]->state, FIBER_SUSPEND );
+  ck_assert_int_eq( handoff[1]->state, FIBER_SUSPEND );
+  sched_cycle( sched, 1 );
+  sched_cycle( sched, 2 );
+  ck_assert_int_eq( cancel_seen, 2 );
+  ck_assert_int_eq( cancel_loops, 0 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* neither the mutex nor the unit were lost */
+  fiber_start( sched, fiber_new( run_handoff_relock, NULL ));
+  sched_cycle( sched, 3 );
+  sched_cycle( sched, 20 );
+  ck_assert_int_eq( cancel_res, FIBER_OK );
+
+  /* clean */
+  sched_free( sched );
+  fiber_sem_free( sync_sem );
+  fiber_mutex_free( sync_mutex );
+}
+END_TEST
+
+START_TEST (test_fiber_stop_after_wait)
+{
+  scheduler_t *sched = sched_new();
+  fiber_t *fiber;
+
+  cancel_loops = 0;
+  fiber = fiber_new( run_stop_after_wait, NULL );
+  fiber_start( sched, fiber );
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( fiber->state, FIBER_SUSPEND );
+  sched_cycle( sched, 5 );
+  ck_assert_int_eq( cancel_loops, 1 );
+  ck_assert_int_eq( fiber->state, FIBER_RUNNING );
+
+  /* the wait it resumed from is over : it ends without running again */
+  ck_assert_int_eq( fiber_stop( fiber ), FIBER_OK );
+  ck_assert_int_eq( fiber->state, FIBER_TERM );
+  sched_cycle( sched, 6 );
+  ck_assert_int_eq( cancel_loops, 1 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+
+  /* clean */
+  sched_free( sched );
+}
+END_TEST
+
+START_TEST (test_wait_illegal_context)
+{
+  scheduler_t *sched = sched_new();
+  channel_t *chan = channel_new( sizeof(int), 0 );
+  channel_case_t cc;
+  wait_source_t src;
+  future_t *fut;
+  fiber_t *f1, *f2;
+  int v = 0, index;
+
+  sync_sem = fiber_sem_new( 0 );
+  sync_mutex = fiber_mutex_new();
+  sync_count = 0;
+  fut = fiber_spawn_future( sched, run_future_forever, NULL );
+  f1 = fiber_new( run_sem_wait, NULL );
+  f2 = fiber_new( run_sem_wait, NULL );
+  fiber_start( sched, f1 );
+  fiber_start( sched, f2 );
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( f2->state, FIBER_SUSPEND );
+
+  /* no fiber */
+  ck_assert_int_eq( channel_send( NULL, chan, &v, 0 ), FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( channel_recv( NULL, chan, &v, 0 ), FIBER_ILLEGAL_STATE );
+  cc.chan = chan;
+  cc.op = CHANNEL_RECV;
+  cc.data = &v;
+  ck_assert_int_eq( fiber_select( NULL, 0, &cc, 1, &index ), FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( future_await_any( NULL, &fut, 1, 0, &index ), FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( future_await_all( NULL, &fut, 1, 0 ), FIBER_ILLEGAL_STATE );
+  memset( &src, 0, sizeof(src));
+  src.type = WAIT_VAR;
+  src.var = &v;
+  src.value = 1;
+  ck_assert_int_eq( fiber_wait_any( NULL, &src, 1, &index ), FIBER_ILLEGAL_STATE );
+
+  /* a parked fiber keeps its waiter */
+  ck_assert_int_eq( fiber_mutex_lock( f1, sync_mutex, 0 ), FIBER_OK );
+  ck_assert_int_eq( fiber_mutex_lock( f2, sync_mutex, 0 ), FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( channel_send( f2, chan, &v, 0 ), FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( fiber_select( f2, 0, &cc, 1, &index ), FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( future_await_any( f2, &fut, 1, 0, &index ), FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( fiber_wait_any( f2, &src, 1, &index ), FIBER_ILLEGAL_STATE );
+  fiber_sem_post( sync_sem );
+  fiber_sem_post( sync_sem );
+  sched_cycle( sched, 1 );
+  ck_assert_int_eq( sync_count, 2 );
+
+  /* clean */
+  sched_stop( sched );
+  sched_cycle( sched, 2 );
+  ck_assert_int_eq( future_free( fut ), FIBER_OK );
+  channel_free( chan );
+  fiber_mutex_free( sync_mutex );
+  fiber_sem_free( sync_sem );
+  sched_free( sched );
+}
+END_TEST
+
+START_TEST (test_fiber_cancel)
+{
+  scheduler_t *sched = sched_new();
+  fiber_sem_t *sem = fiber_sem_new( 0 );
+  fiber_t *f1, *f2, *f3;
+  char *stack;
+
+  cancel_res = -1;
+  cancel_seen = cancel_loops = cancel_cleanups = 0;
+  f1 = fiber_new( run_cancel_wait, NULL );
+  f2 = fiber_new( run_cancel_ignore, sem );
+  f3 = fiber_new( run_cancel_busy, NULL );
+  fiber_start( sched, f1 );
+  fiber_start( sched, f2 );
+  fiber_start( sched, f3 );
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( sched_numfibers(sched), 3 );
+  ck_assert_int_eq( fiber_canceled( f1 ), 0 );
+
+  /* the wait returns at once and the fiber leaves on its own */
+  ck_assert_int_eq( fiber_stop( f1 ), FIBER_OK );
+  ck_assert_int_eq( f1->state, FIBER_RUNNING );
+  sched_cycle( sched, 1 );
+  ck_assert_int_eq( cancel_res, FIBER_CANCELED );
+  ck_assert_int_eq( cancel_seen, 1 );
+  ck_assert_int_eq( cancel_cleanups, 0 );
+  ck_assert_int_eq( sched_numfibers(sched), 2 );
+
+  /* a fiber stopped while ready to run is resumed for its cleanup
+   * handlers, which run on its stack */
+  ck_assert_int_eq( fiber_stop( f3 ), FIBER_OK );
+  ck_assert_int_eq( f3->state, FIBER_TERM );
+  stack = (char*) f3->stack;
+  sched_cycle( sched, 2 );
+  ck_assert_int_eq( cancel_cleanups, 1 );
+  ck_assert_int_eq( cancel_sp >= stack && cancel_sp < stack + f3->stacksz, 1 );
+  ck_assert_int_eq( sched_numfibers(sched), 1 );
+
+  /* a fiber blocking again after FIBER_CANCELED is terminated */
+  sched_stop( sched );
+  sched_cycle( sched, 3 );
+  ck_assert_int_eq( cancel_loops, 1 );
+  ck_assert_int_eq( cancel_cleanups, 2 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  ck_assert_int_eq( fiber_sem_trywait( sem ), FIBER_TIMEOUT );
+
+  /* clean */
+  fiber_sem_free( sem );
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   fiber groups
+ * --------------------------------------------------------------------------*/
+static fiber_group_t *grp;
+static int grp_res;
+static int grp_canceled;
+
+/* waits the number of msec given as extra */
+static void run_group_member( fiber_t *fiber )
+{
+  if ( fiber_wait( fiber, (intptr_t) fiber_get_extra( fiber )) == FIBER_CANCELED ) {
+    grp_canceled ++;
+  }
+}
+
+static void run_group_failing( fiber_t *fiber )
+{
+  fiber_wait( fiber, 2 );
+  ck_assert_int_eq( group_fail( fiber, FIBER_INVALID_TIMEOUT ), FIBER_OK );
+}
+
+static void run_group_join( fiber_t *fiber )
+{
+  ck_assert_int_eq( group_join( fiber, grp, 1 ), FIBER_TIMEOUT );
+  grp_res = group_join( fiber, grp, 0 );
+}
+
+START_TEST (test_fiber_group)
+{
+  scheduler_t *sched = sched_new();
+  fiber_t *f;
+
+  /* all the members end normally */
+  grp = group_new( sched );
+  grp_res = -1;
+  grp_canceled = 0;
+  group_spawn( grp, run_group_member, (void*) 3 );
+  group_spawn( grp, run_group_member, (void*) 5 );
+  fiber_start( sched, fiber_new( run_group_join, NULL ));
+  ck_assert_int_eq( group_size( grp ), 2 );
+  ck_assert_int_eq( group_free( grp ), FIBER_ILLEGAL_STATE );
+  sched_cycle( sched, 0 );
+  sched_cycle( sched, 4 );
+  ck_assert_int_eq( group_size( grp ), 1 );
+  ck_assert_int_eq( grp_res, -1 );
+  sched_cycle( sched, 6 );
+  ck_assert_int_eq( group_size( grp ), 0 );
+  sched_cycle( sched, 7 );
+  ck_assert_int_eq( grp_res, FIBER_OK );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  ck_assert_int_eq( group_free( grp ), FIBER_OK );
+
+  /* a failure stops the siblings */
+  grp = group_new( sched );
+  grp_res = -1;
+  group_spawn( grp, run_group_member, (void*) 1000 );
+  group_spawn( grp, run_group_member, (void*) 1000 );
+  group_spawn( grp, run_group_failing, NULL );
+  fiber_start( sched, fiber_new( run_group_join, NULL ));
+  sched_cycle( sched, 10 );
+  sched_cycle( sched, 13 );
+  ck_assert_int_eq( group_error( grp ), FIBER_INVALID_TIMEOUT );
+  sched_cycle( sched, 14 );
+  ck_assert_int_eq( grp_canceled, 2 );
+  ck_assert_int_eq( group_size( grp ), 0 );
+  sched_cycle( sched, 15 );
+  ck_assert_int_eq( grp_res, FIBER_ERROR );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  ck_assert_ptr_eq( group_spawn( grp, run_group_member, NULL ), NULL );
+  ck_assert_int_eq( group_free( grp ), FIBER_OK );
+
+  /* stopping a member from outside is a failure, group_stop() is not */
+  grp = group_new( sched );
+  grp_canceled = 0;
+  f = group_spawn( grp, run_group_member, (void*) 1000 );
+  group_spawn( grp, run_group_member, (void*) 1000 );
+  sched_cycle( sched, 20 );
+  fiber_stop( f );
+  sched_cycle( sched, 21 );
+  ck_assert_int_eq( group_error( grp ), FIBER_CANCELED );
+  sched_cycle( sched, 22 );
+  ck_assert_int_eq( grp_canceled, 2 );
+  ck_assert_int_eq( group_free( grp ), FIBER_OK );
+
+  grp = group_new( sched );
+  group_spawn( grp, run_group_member, (void*) 1000 );
+  group_spawn( grp, run_group_member, (void*) 1000 );
+  sched_cycle( sched, 30 );
+  group_stop( grp );
+  sched_cycle( sched, 31 );
+  ck_assert_int_eq( group_size( grp ), 0 );
+  ck_assert_int_eq( group_error( grp ), FIBER_OK );
+  ck_assert_int_eq( group_free( grp ), FIBER_OK );
+
+  /* clean */
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   worker pools
+ * --------------------------------------------------------------------------*/
+static int pool_runs;
+static int pool_canceled;
+static fiber_t *pool_worker;
+
+static void job_count( fiber_t *fiber, void *arg )
+{
+  ck_assert_ptr_eq( fiber_get_extra( fiber ), arg );
+  pool_runs ++;
+}
+
+/* waits the number of msec given as argument */
+static void job_wait( fiber_t *fiber, void *arg )
+{
+  pool_worker = fiber;
+  if ( fiber_wait( fiber, (intptr_t) arg ) == FIBER_CANCELED ) {
+    pool_canceled ++;
+  }
+}
+
+START_TEST (test_fiber_pool)
+{
+  scheduler_t *sched = sched_new();
+  fiber_pool_t *pool;
+  pool_stats_t st;
+  fiber_t *w;
+
+  ck_assert_ptr_eq( pool_new( sched, 2, 1, 0 ), NULL );
+  ck_assert_ptr_eq( pool_new( sched, 0, 0, 0 ), NULL );
+
+  /* one worker kept, a second one started on demand */
+  pool = pool_new( sched, 1, 2, 5 );
+  ck_assert_ptr_ne( pool, NULL );
+  sched_cycle( sched, 0 );
+  pool_get_stats( pool, &st );
+  ck_assert_int_eq( st.workers, 1 );
+  ck_assert_int_eq( st.idle, 1 );
+
+  pool_runs = 0;
+  ck_assert_int_eq( pool_submit( pool, job_count, (void*) 1 ), FIBER_OK );
+  ck_assert_int_eq( pool_submit( pool, job_count, (void*) 2 ), FIBER_OK );
+  ck_assert_int_eq( pool_submit( pool, job_count, (void*) 3 ), FIBER_OK );
+  pool_get_stats( pool, &st );
+  ck_assert_int_eq( st.workers, 2 );
+  ck_assert_int_eq( st.backlog, 3 );
+  sched_cycle( sched, 1 );
+  ck_assert_int_eq( pool_runs, 3 );
+  pool_get_stats( pool, &st );
+  ck_assert_int_eq( st.backlog, 0 );
+  ck_assert_int_eq( st.max_backlog, 3 );
+  ck_assert_int_eq( st.submitted, 3 );
+  ck_assert_int_eq( st.completed, 3 );
+  ck_assert_int_eq( st.idle, 2 );
+
+  /* the extra worker leaves after being idle for 5 msec */
+  sched_cycle( sched, 3 );
+  ck_assert_int_eq( sched_numfibers(sched), 2 );
+  sched_cycle( sched, 7 );
+  sched_cycle( sched, 8 );
+  ck_assert_int_eq( sched_numfibers(sched), 1 );
+  pool_get_stats( pool, &st );
+  ck_assert_int_eq( st.workers, 1 );
+
+  /* a worker stopped in a job is replaced when jobs are waiting */
+  pool_canceled = 0;
+  pool_submit( pool, job_wait, (void*) 1000 );
+  sched_cycle( sched, 10 );
+  w = pool_worker;
+  pool_submit( pool, job_wait, (void*) 1000 );
+  pool_submit( pool, job_count, (void*) 4 );
+  sched_cycle( sched, 11 );
+  ck_assert_ptr_ne( pool_worker, w );
+  pool_get_stats( pool, &st );
+  ck_assert_int_eq( st.workers, 2 );
+  ck_assert_int_eq( st.backlog, 1 );
+  fiber_stop( w );
+  sched_cycle( sched, 12 );
+  sched_cycle( sched, 13 );
+  ck_assert_int_eq( pool_canceled, 1 );
+  ck_assert_int_eq( pool_runs, 4 );
+  pool_get_stats( pool, &st );
+  ck_assert_int_eq( st.workers, 2 );
+  ck_assert_int_eq( st.backlog, 0 );
+
+  /* stop discards the pending jobs */
+  pool_submit( pool, job_count, (void*) 5 );
+  ck_assert_int_eq( pool_stop( pool ), 1 );
+  ck_assert_int_eq( pool_submit( pool, job_count, (void*) 6 ), FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( pool_free( pool ), FIBER_ILLEGAL_STATE );
+  sched_cycle( sched, 14 );
+  sched_cycle( sched, 15 );
+  ck_assert_int_eq( pool_canceled, 2 );
+  ck_assert_int_eq( pool_runs, 4 );
+  ck_assert_int_eq( sched_numfibers(sched), 0 );
+  ck_assert_int_eq( pool_free( pool ), FIBER_OK );
+
+  /* clean */
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   deferred callbacks and tasklets
+ * --------------------------------------------------------------------------*/
+static char posted[8];
+static int nposted;
+static int tasklet_runs;
+static int tasklet_res[4];
+static channel_t *tasklet_chan;
+static int tasklet_recv;
+
+static void post_char( scheduler_t *sched, void *arg )
+{
+  posted[nposted++] = (char) (intptr_t) arg;
+  /* runs during next cycle */
+  if ( arg == (void*) 'b' ) {
+    sched_post( sched, post_char, (void*) 'd' );
+  }
+}
+
+/* tries to block in all the possible ways */
+static void run_tasklet( fiber_t *fiber )
+{
+  int v = 1;
+
+  ck_assert_ptr_eq( fiber_get_extra( fiber ), (void*) &tasklet_runs );
+  ck_assert_ptr_ne( tasklet_self( fiber ), NULL );
+  tasklet_runs ++;
+  tasklet_res[0] = fiber_yield( fiber );
+  tasklet_res[1] = fiber_wait( fiber, 10 );
+  tasklet_res[2] = channel_recv( fiber, tasklet_chan, &v, 0 );
+  /* non blocking calls work and wake up fibers */
+  tasklet_res[3] = channel_try_send( tasklet_chan, &v );
+}
+
+static void run_tasklet_once( fiber_t *fiber )
+{
+  tasklet_runs ++;
+  ck_assert_int_eq( tasklet_free( tasklet_self( fiber )), FIBER_OK );
+}
+
+static void run_tasklet_receiver( fiber_t *fiber )
+{
+  int v;
+  ck_assert_ptr_eq( tasklet_self( fiber ), NULL );
+  if ( channel_recv( fiber, tasklet_chan, &v, 0 ) == FIBER_OK ) {
+    tasklet_recv = v;
+  }
+}
+
+START_TEST (test_tasklet)
+{
+  scheduler_t *sched = sched_new();
+  tasklet_t *t;
+  int i;
+
+  /* callbacks run in order, those posted meanwhile during next cycle */
+  nposted = 0;
+  memset( posted, 0, sizeof(posted));
+  sched_post( sched, post_char, (void*) 'a' );
+  sched_post( sched, post_char, (void*) 'b' );
+  sched_post( sched, post_char, (void*) 'c' );
+  ck_assert_int_eq( sched_deadline( sched ), 0 );
+  sched_cycle( sched, 0 );
+  ck_assert_str_eq( posted, "abc" );
+  ck_assert_int_eq( sched_deadline( sched ), 0 );
+  sched_cycle( sched, 1 );
+  ck_assert_str_eq( posted, "abcd" );
+  ck_assert_int_eq( sched_deadline( sched ), UINT_MAX );
+  ck_assert_int_eq( sched_numfibers( sched ), 0 );
+
+  /* a tasklet can't block, it wakes up a fiber which runs in the same cycle */
+  tasklet_chan = channel_new( sizeof(int), 1 );
+  tasklet_recv = 0;
+  tasklet_runs = 0;
+  fiber_start( sched, fiber_new( run_tasklet_receiver, NULL ));
+  sched_cycle( sched, 2 );
+  t = tasklet_new( sched, run_tasklet, &tasklet_runs );
+  ck_assert_ptr_ne( t, NULL );
+  ck_assert_int_eq( tasklet_schedule( t ), FIBER_OK );
+  ck_assert_int_eq( tasklet_schedule( t ), FIBER_OK );
+  ck_assert_int_eq( tasklet_free( t ), FIBER_ILLEGAL_STATE );
+  sched_cycle( sched, 3 );
+  ck_assert_int_eq( tasklet_runs, 1 );
+  ck_assert_int_eq( tasklet_res[0], FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( tasklet_res[1], FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( tasklet_res[2], FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( tasklet_res[3], FIBER_OK );
+  ck_assert_int_eq( tasklet_recv, 1 );
+  ck_assert_int_eq( sched_numfibers( sched ), 0 );
+  sched_cycle( sched, 4 );
+  ck_assert_int_eq( tasklet_runs, 1 );
+  ck_assert_int_eq( tasklet_free( t ), FIBER_OK );
+
+  /* tasklets freeing themselves */
+  for( i = 0; i < 10; ++i ) {
+    tasklet_schedule( tasklet_new( sched, run_tasklet_once, NULL ));
+  }
+  sched_cycle( sched, 5 );
+  ck_assert_int_eq( tasklet_runs, 11 );
+
+  /* clean */
+  channel_free( tasklet_chan );
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   protothreads
+ * --------------------------------------------------------------------------*/
+struct pt_test {
+  pt_t            pt;
+  int             count;
+  int             got;
+  int             results[4];
+  channel_case_t  c;
+};
+
+static int pt_done_count;
+
+static void done_pt( pt_t *pt )
+{
+  ck_assert_int_eq( pt_alive( pt ), 0 );
+  pt_done_count ++;
+}
+
+/* yields twice, sleeps, ends */
+static int run_pt_counter( pt_t *pt )
+{
+  struct pt_test *t = (struct pt_test*) pt;
+
+  PT_BEGIN(pt);
+  t->count ++;
+  PT_YIELD(pt);
+  t->count ++;
+  PT_YIELD(pt);
+  t->count ++;
+  PT_SLEEP(pt, 10);
+  t->count ++;
+  PT_END(pt);
+}
+
+/* receives values from a channel until a deadline */
+static int run_pt_receiver( pt_t *pt )
+{
+  struct pt_test *t = (struct pt_test*) pt;
+  wait_source_t src[2];
+
+  memset( src, 0, sizeof(src));
+  src[0].type = WAIT_CHANNEL;
+  src[0].chan = &t->c;
+  src[1].type = WAIT_DEADLINE;
+  src[1].deadline = 50;
+
+  PT_BEGIN(pt);
+  for(;;) {
+    PT_WAIT_ANY(pt, src, 2);
+    ck_assert_int_eq( pt->status, FIBER_OK );
+    if ( pt->index == 1 ) {
+      PT_EXIT(pt);
+    }
+    t->results[t->count++ & 3] = t->got;
+  }
+  PT_END(pt);
+}
+
+static void run_pt_sender( fiber_t *fiber )
+{
+  channel_t *chan = (channel_t*) fiber_get_extra( fiber );
+  int v;
+
+  for( v = 1; v <= 3; ++v ) {
+    channel_send( fiber, chan, &v, 0 );
+  }
+}
+
+START_TEST (test_pt)
+{
+  scheduler_t *sched = sched_new();
+  struct pt_test t, *many;
+  channel_t *chan;
+  int i, v = 1;
+
+  /* yield and sleep on the timer heap */
+  pt_done_count = 0;
+  memset( &t, 0, sizeof(t));
+  ck_assert_int_eq( pt_start( sched, &t.pt, run_pt_counter, done_pt, NULL ), FIBER_OK );
+  ck_assert_int_eq( pt_alive( &t.pt ), 1 );
+  ck_assert_int_eq( pt_start( sched, &t.pt, run_pt_counter, done_pt, NULL ), FIBER_ILLEGAL_STATE );
+  sched_cycle( sched, 0 );
+  ck_assert_int_eq( t.count, 1 );
+  sched_cycle( sched, 1 );
+  sched_cycle( sched, 2 );
+  ck_assert_int_eq( t.count, 3 );
+  ck_assert_int_eq( sched_deadline( sched ), 12 );
+  sched_cycle( sched, 11 );
+  ck_assert_int_eq( t.count, 3 );
+  sched_cycle( sched, 12 );
+  ck_assert_int_eq( t.count, 4 );
+  ck_assert_int_eq( pt_done_count, 1 );
+  ck_assert_int_eq( sched_deadline( sched ), UINT_MAX );
+  ck_assert_int_eq( sched_numfibers( sched ), 0 );
+
+  /* channel source fed by a fiber, then deadline */
+  chan = channel_new( sizeof(int), 0 );
+  memset( &t, 0, sizeof(t));
+  t.c.chan = chan;
+  t.c.op = CHANNEL_RECV;
+  t.c.data = &t.got;
+  ck_assert_int_eq( pt_start( sched, &t.pt, run_pt_receiver, done_pt, NULL ), FIBER_OK );
+  fiber_start( sched, fiber_new( run_pt_sender, chan ));
+  for( i = 13; i < 20; ++i ) {
+    sched_cycle( sched, i );
+  }
+  ck_assert_int_eq( t.count, 3 );
+  ck_assert_int_eq( t.results[0], 1 );
+  ck_assert_int_eq( t.results[1], 2 );
+  ck_assert_int_eq( t.results[2], 3 );
+  ck_assert_int_eq( sched_numfibers( sched ), 0 );
+  ck_assert_int_eq( sched_deadline( sched ), 50 );
+  sched_cycle( sched, 49 );
+  ck_assert_int_eq( pt_done_count, 1 );
+  sched_cycle( sched, 50 );
+  ck_assert_int_eq( pt_done_count, 2 );
+  ck_assert_int_eq( t.count, 3 );
+  ck_assert_int_eq( channel_try_send( chan, &v ), FIBER_TIMEOUT );
+
+  /* stopped while waiting : the waiter is unlinked */
+  memset( &t, 0, sizeof(t));
+  t.c.chan = chan;
+  t.c.op = CHANNEL_RECV;
+  t.c.data = &t.got;
+  pt_start( sched, &t.pt, run_pt_receiver, done_pt, NULL );
+  sched_cycle( sched, 20 );
+  ck_assert_int_eq( pt_stop( &t.pt ), FIBER_OK );
+  ck_assert_int_eq( channel_try_send( chan, &v ), FIBER_TIMEOUT );
+  ck_assert_int_eq( pt_done_count, 2 );
+  sched_cycle( sched, 21 );
+  ck_assert_int_eq( pt_done_count, 3 );
+  ck_assert_int_eq( pt_stop( &t.pt ), FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( t.count, 0 );
+
+  /* lots of them */
+  many = (struct pt_test*) calloc( 1000, sizeof(*many));
+  for( i = 0; i < 1000; ++i ) {
+    pt_start( sched, &many[i].pt, run_pt_counter, done_pt, NULL );
+  }
+  for( i = 22; i < 40; ++i ) {
+    sched_cycle( sched, i );
+  }
+  ck_assert_int_eq( pt_done_count, 1003 );
+  for( i = 0; i < 1000; ++i ) {
+    ck_assert_int_eq( many[i].count, 4 );
+  }
+
+  /* clean */
+  free( many );
+  channel_free( chan );
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   accounting
+ * --------------------------------------------------------------------------*/
+static channel_t *acct_chan;
+static fiber_t *acct_spinner;
+
+static uint64_t acct_now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* burns 2ms then sleeps */
+static void run_acct_spin( fiber_t *fiber )
+{
+  uint64_t start = acct_now();
+  while( acct_now() - start < 2000000 );
+  fiber_wait( fiber, 5 );
+}
+
+static void run_acct_recv( fiber_t *fiber )
+{
+  int v;
+  channel_recv( fiber, acct_chan, &v, 0 );
+}
+
+static void run_acct_join( fiber_t *fiber )
+{
+  fiber_join( fiber, 0, acct_spinner );
+}
+
+static fiber_run_stats_t *acct_find( fiber_run_stats_t *rs, int n, pf_run_t run )
+{
+  int i;
+  for( i = 0; i < n; ++i ) {
+    if ( rs[i].run == run ) return &rs[i];
+  }
+  return NULL;
+}
+
+START_TEST (test_fiber_accounting)
+{
+  scheduler_t *sched = sched_new();
+  fiber_run_stats_t rs[4], *r;
+  fiber_stats_t st;
+  fiber_t *recv, *other;
+  int v = 1;
+
+  acct_chan = channel_new( sizeof(int), 0 );
+  ck_assert_int_eq( sched_set_accounting( sched, 1 ), FIBER_OK );
+  acct_spinner = fiber_new( run_acct_spin, NULL );
+  recv = fiber_new( run_acct_recv, NULL );
+  fiber_start( sched, acct_spinner );
+  fiber_start( sched, recv );
+  fiber_start( sched, fiber_new( run_acct_join, NULL ));
+  sched_cycle( sched, 0 );
+
+  ck_assert_int_eq( fiber_get_stats( acct_spinner, &st ), FIBER_OK );
+  ck_assert_int_ge( st.cpu_nsec, 2000000 );
+  ck_assert_int_eq( st.switches, 1 );
+
+  /* suspended time grows while it waits */
+  usleep( 3000 );
+  ck_assert_int_eq( fiber_get_stats( recv, &st ), FIBER_OK );
+  ck_assert_int_ge( st.wait_nsec[FIBER_WAIT_SYNC], 3000000 );
+  ck_assert_int_eq( st.wait_nsec[FIBER_WAIT_SLEEP], 0 );
+
+  /* the spinner wakes up and ends, its joiner runs during next cycle */
+  sched_cycle( sched, 10 );
+  ck_assert_int_eq( channel_try_send( acct_chan, &v ), FIBER_OK );
+  sched_cycle( sched, 11 );
+  sched_cycle( sched, 12 );
+  ck_assert_int_eq( sched_numfibers( sched ), 0 );
+
+  /* by run function, the most cpu consuming first */
+  ck_assert_int_eq( sched_get_run_stats( sched, rs, 4 ), 3 );
+  ck_assert_ptr_eq( rs[0].run, run_acct_spin );
+  ck_assert_int_eq( rs[0].nfibers, 1 );
+  ck_assert_int_ge( rs[0].stats.cpu_nsec, 2000000 );
+  ck_assert_int_ge( rs[0].stats.wait_nsec[FIBER_WAIT_SLEEP], 3000000 );
+  ck_assert_int_eq( rs[0].stats.switches, 2 );
+  ck_assert_int_eq( sched_get_run_stats( sched, rs, 1 ), 3 );
+  ck_assert_ptr_eq( rs[0].run, run_acct_spin );
+  ck_assert_int_eq( sched_get_run_stats( sched, rs, 4 ), 3 );
+  r = acct_find( rs, 3, run_acct_join );
+  ck_assert_ptr_ne( r, NULL );
+  ck_assert_int_ge( r->stats.wait_nsec[FIBER_WAIT_JOIN], 3000000 );
+  r = acct_find( rs, 3, run_acct_recv );
+  ck_assert_ptr_ne( r, NULL );
+  ck_assert_int_ge( r->stats.wait_nsec[FIBER_WAIT_SYNC], 3000000 );
+  ck_assert_int_eq( r->stats.switches, 2 );
+
+  /* off : nothing is counted, alive fibers are listed */
+  sched_set_accounting( sched, 0 );
+  other = fiber_new( run_acct_recv, NULL );
+  fiber_start( sched, other );
+  sched_cycle( sched, 13 );
+  ck_assert_int_eq( fiber_get_stats( other, &st ), FIBER_OK );
+  ck_assert_int_eq( st.switches, 0 );
+  ck_assert_int_eq( sched_get_run_stats( sched, rs, 4 ), 3 );
+  r = acct_find( rs, 3, run_acct_recv );
+  ck_assert_ptr_ne( r, NULL );
+  ck_assert_int_eq( r->nfibers, 2 );
+
+  /* clean */
+  channel_try_send( acct_chan, &v );
+  sched_cycle( sched, 14 );
+  sched_cycle( sched, 15 );
+  channel_free( acct_chan );
+  sched_free( sched );
+}
+END_TEST
+
+
+/* --------------------------------------------------------------------------
+ *   cycle statistics
+ * --------------------------------------------------------------------------*/
+static void run_stats_sleep( fiber_t *fiber )
+{
+  fiber_wait( fiber, 2 );
+}
+
+static void post_nothing( scheduler_t *sched, void *arg )
+{
+}
+
+START_TEST (test_sched_stats)
+{
+  scheduler_t *sched = sched_new();
+  sched_histogram_t h;
+  sched_stats_t st;
+  pt_t pt;
+  int i;
+
+  ck_assert_int_eq( sched_get_stats( NULL, &st ), FIBER_NO_SUCH_SCHED );
+
+  /* empty cycles : only the cycle is timed */
+  sched_cycle( sched, 0 );
+  sched_cycle( sched, 1 );
+  ck_assert_int_eq( sched_get_stats( sched, &st ), FIBER_OK );
+  ck_assert_int_eq( st.cycles, 2 );
+  ck_assert_int_eq( st.cycle.count, 2 );
+  for( i = 0; i < SCHED_NUM_PHASES; ++i ) {
+    ck_assert_int_eq( st.phases[i].count, 0 );
+  }
+
+  /* 3 fibers sleeping then ending, a callback and a timer */
+  sched_reset_stats( sched );
+  for( i = 0; i < 3; ++i ) {
+    fiber_start( sched, fiber_new( run_stats_sleep, NULL ));
+  }
+  sched_post( sched, post_nothing, NULL );
+  pt_start( sched, &pt, run_pt_counter, NULL, NULL );
+  for( i = 2; i < 20; ++i ) {
+    sched_cycle( sched, i );
+  }
+  ck_assert_int_eq( sched_numfibers( sched ), 0 );
+  ck_assert_int_eq( pt_alive( &pt ), 0 );
+  sched_get_stats( sched, &st );
+  ck_assert_int_eq( st.cycles, 18 );
+  ck_assert_int_eq( st.cycle.count, 18 );
+  ck_assert_int_eq( st.phases[SCHED_PHASE_INIT].count, 1 );
+  ck_assert_int_eq( st.processed[SCHED_PHASE_INIT], 3 );
+  ck_assert_int_eq( st.processed[SCHED_PHASE_DISPATCH], 6 );
+  ck_assert_int_eq( st.phases[SCHED_PHASE_DONE].count, 1 );
+  ck_assert_int_eq( st.processed[SCHED_PHASE_DONE], 3 );
+  ck_assert_int_eq( st.timers, 1 );
+  ck_assert_int_eq( st.processed[SCHED_PHASE_TIMERS], 1 );
+  /* the callback and the 4 resumes of the protothread */
+  ck_assert_int_eq( st.processed[SCHED_PHASE_DEFERRED], 5 );
+  ck_assert_int_ge( st.predicates, 3 );
+  ck_assert_int_ge( st.cycle.max_nsec, st.phases[SCHED_PHASE_DISPATCH].max_nsec );
+
+  /* log-linear buckets */
+  ck_assert_int_eq( sched_histogram_low( 3 ), 3 );
+  ck_assert_int_eq( sched_histogram_low( 4 ), 4 );
+  ck_assert_int_eq( sched_histogram_low( 8 ), 8 );
+  ck_assert_int_eq( sched_histogram_low( 11 ), 14 );
+  ck_assert_int_eq( sched_histogram_low( 12 ), 16 );
+  memset( &h, 0, sizeof(h));
+  ck_assert_int_eq( sched_histogram_percentile( &h, 50 ), 0 );
+  h.count = 4;
+  h.max_nsec = 1000;
+  h.buckets[8] = 3;          /* 8 and 9 */
+  h.buckets[35] = 1;         /* 1000 is in 896 to 1023 */
+  ck_assert_int_eq( sched_histogram_low( 35 ), 896 );
+  ck_assert_int_eq( sched_histogram_percentile( &h, 50 ), 9 );
+  ck_assert_int_eq( sched_histogram_percentile( &h, 99 ), 1000 );
+
+  /* clean */
+  sched_free( sched );
+}
+END_TEST
+
+START_TEST (test_logger_levels)
+{
+  int n = 0;
+
+  /* filtered messages don't evaluate their arguments */
+  debug( "%d\n", ++n );
+  trace( "%d\n", ++n );
+  ck_assert_int_eq( n, 0 );
+
+  set_log_level( LOG_DEBUG );
+  debug( "debug message %d\n", ++n );
+  trace( "%d\n", ++n );
+  ck_assert_int_eq( n, LOG_COMPILE_LEVEL >= LOG_DEBUG ? 1 : 0 );
+
+  /* invalid levels are ignored */
+  set_log_level( LOG_ERROR );
+  debug( "debug message %d\n", ++n );
+  ck_assert_int_eq( n, LOG_COMPILE_LEVEL >= LOG_DEBUG ? 2 : 0 );
+  set_log_level( LOG_INFO );
+  debug( "%d\n", ++n );
+  ck_assert_int_eq( n, LOG_COMPILE_LEVEL >= LOG_DEBUG ? 2 : 0 );
+}
+END_TEST
+
+static void *log_from_thread( void *arg )
+{
+  info( "two from %s\n", (const char*) arg );
+  return NULL;
+}
+
+START_TEST (test_logger_async)
+{
+  char path[] = "/tmp/fiber-log-XXXXXX";
+  static char out[65536];
+  char buf[16];
+  int fd, saved1, saved2, i;
+  pthread_t thread;
+  ssize_t n;
+
+  fd = mkstemp( path );
+  ck_assert_int_ge( fd, 0 );
+  fflush( stdout );
+  fflush( stderr );
+  saved1 = dup( 1 );
+  saved2 = dup( 2 );
+  dup2( fd, 1 );
+  dup2( fd, 2 );
+
+  ck_assert_int_eq( log_async_start( 0, 0 ), 0 );
+  ck_assert_int_eq( log_async_start( 0, 0 ), -1 );
+
+  /* strings are copied, the others formatted later */
+  strcpy( buf, "first" );
+  info( "one %s %d %5.2f %*d %lu %p %%\n", buf, -3, 2.5, 4, 7, 12UL, (void*) 0 );
+  strcpy( buf, "XXXXX" );
+  pthread_create( &thread, NULL, log_from_thread, "thread" );
+  pthread_join( thread, NULL );
+  error( "three %.3s\n", "abcdef" );
+  ck_assert_int_eq( lseek( fd, 0, SEEK_END ), 0 );
+
+  log_async_flush();
+  lseek( fd, 0, SEEK_SET );
+  n = read( fd, out, sizeof(out) - 1 );
+  ck_assert_int_gt( n, 0 );
+  out[n] = 0;
+  ck_assert_ptr_ne( strstr( out, "[ INFO  ] - one first -3  2.50    7 12 (nil) %\n" ), NULL );
+  ck_assert_ptr_ne( strstr( out, "two from thread\n" ), NULL );
+  ck_assert_ptr_ne( strstr( out, "[ ERROR ] - three abc\n" ), NULL );
+  ck_assert( strstr( out, "one" ) < strstr( out, "two" ));
+  ck_assert( strstr( out, "two" ) < strstr( out, "three" ));
+
+  /* a full ring drops messages */
+  for( i = 0; i < 1000; ++i ) {
+    debug( "%d\n", i );
+    info( "message %d\n", i );
+  }
+  log_async_stop();
+  info( "sync\n" );
+  fflush( stdout );
+
+  dup2( saved1, 1 );
+  dup2( saved2, 2 );
+  close( saved1 );
+  close( saved2 );
+  lseek( fd, 0, SEEK_SET );
+  n = read( fd, out, sizeof(out) - 1 );
+  out[n] = 0;
+  close( fd );
+  unlink( path );
+  ck_assert_ptr_ne( strstr( out, "message 0\n" ), NULL );
+  ck_assert_ptr_eq( strstr( out, "message 999\n" ), NULL );
+  ck_assert_ptr_ne( strstr( out, "log messages lost\n" ), NULL );
+}
+END_TEST
+
+/* runs 'arg' milliseconds without giving back control, forever if 0 */
+static void run_busy( fiber_t *fiber )
+{
+  intptr_t msec = (intptr_t) fiber_get_extra( fiber );
+  struct timespec t0, t1;
+
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  do {
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+  } while( msec == 0 ||
+	   (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000 < msec );
+}
+
+static void run_short_slices( fiber_t *fiber )
+{
+  int i;
+
+  for( i = 0; i < 20; ++i ) {
+    usleep( 1000 );
+    fiber_yield( fiber );
+  }
+}
+
+START_TEST (test_sched_watchdog)
+{
+  char path[] = "/tmp/fiber-wd-XXXXXX";
+  static char out[8192];
+  char expect[64];
+  scheduler_t *sched = sched_new();
+  fiber_t *busy;
+  int fd, saved, status;
+  pid_t pid;
+  ssize_t n;
+
+  ck_assert_int_eq( sched_watchdog_start( NULL, 10, 0 ), FIBER_NO_SUCH_SCHED );
+  ck_assert_int_eq( sched_watchdog_start( sched, 0, 0 ), FIBER_INVALID_TIMEOUT );
+  ck_assert_int_eq( sched_watchdog_start( sched, 10, 0 ), FIBER_OK );
+  ck_assert_int_eq( sched_watchdog_start( sched, 10, 0 ), FIBER_ILLEGAL_STATE );
+
+  fd = mkstemp( path );
+  ck_assert_int_ge( fd, 0 );
+  fflush( stderr );
+  saved = dup( 2 );
+  dup2( fd, 2 );
+
+  /* only the fiber keeping the cpu 60ms is reported, once */
+  fiber_start( sched, fiber_new( run_short_slices, NULL ));
+  busy = fiber_new( run_busy, (void*) 60 );
+  fiber_start( sched, busy );
+  snprintf( expect, sizeof(expect), "watchdog : fiber %d has run for ", busy->fid );
+  while( sched_numfibers( sched ) > 0 ) {
+    sched_cycle( sched, 0 );
+  }
+  sched_free( sched );
+
+  dup2( saved, 2 );
+  close( saved );
+  n = pread( fd, out, sizeof(out) - 1, 0 );
+  close( fd );
+  unlink( path );
+  ck_assert_int_gt( n, 0 );
+  out[n] = 0;
+  ck_assert_ptr_ne( strstr( out, expect ), NULL );
+  ck_assert_ptr_eq( strstr( strstr( out, expect ) + 1, "watchdog" ), NULL );
+  ck_assert_ptr_ne( strstr( out, "run function : " ), NULL );
+  ck_assert_ptr_ne( strstr( out, "backtrace :\n" ), NULL );
+
+  /* a stalled fiber aborts the process */
+  pid = fork();
+  if ( pid == 0 ) {
+    fd = open( "/dev/null", O_WRONLY );
+    dup2( fd, 2 );
+    sched = sched_new();
+    sched_watchdog_start( sched, 10, FIBER_WATCHDOG_ABORT );
+    fiber_start( sched, fiber_new( run_busy, (void*) 0 ));
+    sched_cycle( sched, 0 );
+    exit( 0 );
+  }
+  ck_assert_int_eq( waitpid( pid, &status, 0 ), pid );
+  ck_assert( WIFSIGNALED( status ) );
+  ck_assert_int_eq( WTERMSIG( status ), SIGABRT );
+}
+END_TEST
+
+static int slice_runs[3];
+static int64_t slice_min[3];
+static int slice_stop, slice_early;
+
+/* spins until its slice is used up, 3 times or until 'slice_stop' */
+static void run_sliced( fiber_t *fiber )
+{
+  intptr_t i = (intptr_t) fiber_get_extra( fiber );
+  struct timespec t0, t1;
+  int64_t nsec;
+
+  while( !slice_stop && slice_runs[i] < 3 ) {
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+    while( !fiber_should_yield( fiber ));
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+    nsec = (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+    if ( slice_min[i] == 0 || nsec < slice_min[i] ) {
+      slice_min[i] = nsec;
+    }
+    slice_runs[i] ++;
+    fiber_yield( fiber );
+  }
+}
+
+/* exempted from the slice of the scheduler */
+static void run_unsliced( fiber_t *fiber )
+{
+  run_busy( fiber );
+  slice_early = fiber_should_yield( fiber );
+}
+
+START_TEST (test_sched_time_slice)
+{
+  scheduler_t *sched = sched_new();
+  fiber_t *fibers[3];
+  sched_stats_t st;
+  uint32_t t = 1;
+  intptr_t i;
+
+  ck_assert_int_eq( sched_set_time_slice( NULL, 100 ), FIBER_NO_SUCH_SCHED );
+  ck_assert_int_eq( sched_set_cycle_budget( NULL, 100 ), FIBER_NO_SUCH_SCHED );
+  ck_assert_int_eq( fiber_set_time_slice( NULL, 100 ), FIBER_NO_SUCH_FIBER );
+
+  /* the slice of the scheduler, a slice of its own, none */
+  ck_assert_int_eq( sched_set_time_slice( sched, 2000 ), FIBER_OK );
+  for( i = 0; i < 2; ++i ) {
+    fibers[i] = fiber_new( run_sliced, (void*) i );
+  }
+  fibers[2] = fiber_new( run_unsliced, (void*) 4 );
+  ck_assert_int_eq( fiber_set_time_slice( fibers[1], 500 ), FIBER_OK );
+  ck_assert_int_eq( fiber_set_time_slice( fibers[2], FIBER_SLICE_NONE ), FIBER_OK );
+  for( i = 0; i < 3; ++i ) {
+    fiber_start( sched, fibers[i] );
+  }
+  ck_assert_int_eq( fiber_should_yield( fibers[0] ), 0 );
+  while( sched_numfibers( sched ) > 0 ) {
+    sched_cycle( sched, t++ );
+  }
+  ck_assert_int_eq( slice_runs[0], 3 );
+  ck_assert_int_eq( slice_runs[1], 3 );
+  ck_assert_int_ge( slice_min[0], 1500000 );
+  ck_assert_int_ge( slice_min[1], 400000 );
+  ck_assert_int_lt( slice_min[1], slice_min[0] );
+  ck_assert_int_eq( slice_early, 0 );
+  sched_free( sched );
+
+  /* one fiber uses up the cycle budget : the others wait their turn */
+  sched = sched_new();
+  memset( slice_runs, 0, sizeof(slice_runs));
+  ck_assert_int_eq( sched_set_cycle_budget( sched, 1000 ), FIBER_OK );
+  for( i = 0; i < 3; ++i ) {
+    fiber_start( sched, fiber_new( run_sliced, (void*) i ));
+  }
+  sched_cycle( sched, t++ );
+  for( i = 0; i < 5; ++i ) {
+    sched_cycle( sched, t++ );
+  }
+  ck_assert_int_eq( slice_runs[0], 2 );
+  ck_assert_int_eq( slice_runs[1], 2 );
+  ck_assert_int_eq( slice_runs[2], 2 );
+  sched_get_stats( sched, &st );
+  ck_assert_int_eq( st.budget_cuts, 6 );
+
+  slice_stop = 1;
+  while( sched_numfibers( sched ) > 0 ) {
+    sched_cycle( sched, t++ );
+  }
+  sched_free( sched );
+}
+END_TEST
+
+/* samples of the folded stacks of 'out' whose root frame is 'root' */
+static int profile_count( const char *out, const char *root )
+{
+  char *copy = strdup( out ), *line, *sp, *save = NULL;
+  size_t len = strlen( root );
+  int n = 0;
+
+  for( line = strtok_r( copy, "\n", &save ); line; line = strtok_r( NULL, "\n", &save )) {
+    sp = strrchr( line, ' ' );
+    ck_assert_ptr_ne( sp, NULL );
+    if ( strncmp( line, root, len ) == 0 && line[len] == ';' ) {
+      n += atoi( sp + 1 );
+    }
+  }
+  free( copy );
+  return n;
+}
+
+START_TEST (test_sched_profile)
+{
+  char path[] = "/tmp/fiber-prof-XXXXXX";
+  static char out[65536];
+  char expect[64];
+  scheduler_t *sched = sched_new();
+  fiber_t *alpha, *beta;
+  int fd;
+  ssize_t n;
+
+  ck_assert_int_eq( sched_profile_start( NULL, 1000, 100 ), FIBER_NO_SUCH_SCHED );
+  ck_assert_int_eq( sched_profile_start( sched, 0, 100 ), FIBER_ERROR );
+  ck_assert_int_eq( sched_profile_dump( sched, "/dev/null", 0 ), FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( sched_profile_start( sched, 1000, 4096 ), FIBER_OK );
+  ck_assert_int_eq( sched_profile_start( sched, 1000, 4096 ), FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( fiber_set_tag( NULL, "x" ), FIBER_NO_SUCH_FIBER );
+
+  /* two kinds of fibers burning cpu */
+  alpha = fiber_new( run_busy, (void*) 100 );
+  beta = fiber_new( run_busy, (void*) 100 );
+  ck_assert_int_eq( fiber_set_tag( alpha, "alpha" ), FIBER_OK );
+  ck_assert_int_eq( fiber_set_tag( beta, "beta" ), FIBER_OK );
+  ck_assert_str_eq( fiber_get_tag( alpha ), "alpha" );
+  fiber_start( sched, alpha );
+  fiber_start( sched, beta );
+  snprintf( expect, sizeof(expect), "\nalpha;fiber %d;", alpha->fid );
+  sched_cycle( sched, 1 );
+  sched_profile_stop( sched );
+
+  fd = mkstemp( path );
+  ck_assert_int_ge( fd, 0 );
+  ck_assert_int_eq( sched_profile_dump( sched, path, 0 ), FIBER_OK );
+  n = pread( fd, out, sizeof(out) - 1, 0 );
+  ck_assert_int_gt( n, 0 );
+  out[n] = 0;
+  ck_assert_int_gt( profile_count( out, "alpha" ), 0 );
+  ck_assert_int_gt( profile_count( out, "beta" ), 0 );
+  ck_assert_int_eq( profile_count( out, "untagged" ), 0 );
+
+  /* a frame for each fiber under its tag */
+  ck_assert_int_eq( sched_profile_dump( sched, path, FIBER_PROFILE_FIBERS ), FIBER_OK );
+  out[0] = '\n';
+  n = pread( fd, out + 1, sizeof(out) - 2, 0 );
+  ck_assert_int_gt( n, 0 );
+  out[n+1] = 0;
+  ck_assert_ptr_ne( strstr( out, expect ), NULL );
+  close( fd );
+  unlink( path );
+
+  /* restarted : the samples are discarded */
+  ck_assert_int_eq( sched_profile_start( sched, 1000, 16 ), FIBER_OK );
+  ck_assert_int_eq( sched_profile_dump( sched, "/dev/null", 0 ), FIBER_OK );
+  while( sched_numfibers( sched ) > 0 ) {
+    sched_cycle( sched, 2 );
+  }
+  sched_free( sched );
+}
+END_TEST
+
+/* touches 256 new pages, then spins a little */
+static void run_perf_faults( fiber_t *fiber )
+{
+  size_t i, sz = 256*4096;
+  char *p = mmap( NULL, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+
+  ck_assert_ptr_ne( p, MAP_FAILED );
+  for( i = 0; i < sz; i += 4096 ) {
+    p[i] = 1;
+  }
+  munmap( p, sz );
+  fiber_yield( fiber );
+  for( i = 0; i < 100000; ++i ) {
+    __asm__ volatile( "" ::: "memory" );
+  }
+}
+
+static void run_perf_idle( fiber_t *fiber )
+{
+  fiber_yield( fiber );
+}
+
+START_TEST (test_sched_perf_events)
+{
+  scheduler_t *sched = sched_new();
+  fiber_run_stats_t rs[2], *r;
+  fiber_stats_t st;
+  fiber_t *faulty, *idle;
+  int mask;
+
+  ck_assert_int_eq( sched_set_perf_events( NULL, FIBER_EVENTS_ALL ), FIBER_NO_SUCH_SCHED );
+  ck_assert_int_eq( sched_get_perf_events( NULL ), 0 );
+  ck_assert_int_eq( sched_set_perf_events( sched, 0 ), FIBER_OK );
+  ck_assert_int_eq( sched_get_perf_events( sched ), 0 );
+
+  /* perf_event_open() may be denied altogether */
+  if ( sched_set_perf_events( sched, FIBER_EVENTS_ALL ) != FIBER_OK ) {
+    ck_assert_int_eq( sched_get_perf_events( sched ), 0 );
+    sched_free( sched );
+    return;
+  }
+  mask = sched_get_perf_events( sched );
+  ck_assert_int_ne( mask, 0 );
+  ck_assert_int_eq( mask & ~FIBER_EVENTS_ALL, 0 );
+
+  sched_set_accounting( sched, 1 );
+  faulty = fiber_new( run_perf_faults, NULL );
+  idle = fiber_new( run_perf_idle, NULL );
+  fiber_start( sched, faulty );
+  fiber_start( sched, idle );
+  sched_cycle( sched, 1 );
+
+  ck_assert_int_eq( fiber_get_stats( faulty, &st ), FIBER_OK );
+  if ( mask & FIBER_EVENT_MASK( FIBER_EVENT_PAGE_FAULTS )) {
+    ck_assert_int_ge( st.events[FIBER_EVENT_PAGE_FAULTS], 256 );
+    ck_assert_int_eq( fiber_get_stats( idle, &st ), FIBER_OK );
+    ck_assert_int_lt( st.events[FIBER_EVENT_PAGE_FAULTS], 256 );
+  }
+  if ( mask & FIBER_EVENT_MASK( FIBER_EVENT_INSTRUCTIONS )) {
+    ck_assert_int_gt( st.events[FIBER_EVENT_INSTRUCTIONS], 0 );
+  }
+
+  /* by run function once they end */
+  sched_cycle( sched, 2 );
+  ck_assert_int_eq( sched_numfibers( sched ), 0 );
+  ck_assert_int_eq( sched_get_run_stats( sched, rs, 2 ), 2 );
+  r = acct_find( rs, 2, run_perf_faults );
+  ck_assert_ptr_ne( r, NULL );
+  if ( mask & FIBER_EVENT_MASK( FIBER_EVENT_PAGE_FAULTS )) {
+    ck_assert_int_ge( r->stats.events[FIBER_EVENT_PAGE_FAULTS], 256 );
+  }
+  if ( mask & FIBER_EVENT_MASK( FIBER_EVENT_INSTRUCTIONS )) {
+    ck_assert_int_gt( r->stats.events[FIBER_EVENT_INSTRUCTIONS], 100000 );
+  }
+
+  ck_assert_int_eq( sched_set_perf_events( sched, 0 ), FIBER_OK );
+  ck_assert_int_eq( sched_get_perf_events( sched ), 0 );
+  sched_free( sched );
+}
+END_TEST
+
+static char rec_path[] = "/tmp/fiber-rec-XXXXXX";
+static int rec_running;
+
+/* read the recorder as another process would, from its file */
+static void run_rec_check( fiber_t *fiber )
+{
+  recorder_header_t hdr;
+  FILE *f = fopen( rec_path, "rb" );
+
+  if ( f != NULL && fread( &hdr, sizeof(hdr), 1, f ) == 1 ) {
+    rec_running = hdr.running;
+  }
+  if ( f != NULL ) {
+    fclose( f );
+  }
+  fiber_wait( fiber, 2 );
+}
+
+START_TEST (test_sched_recorder)
+{
+  scheduler_t *sched = sched_new();
+  static const uint16_t expected[] = {
+    TRACE_SPAWN, TRACE_BOOT, TRACE_SWITCH_IN, TRACE_SWITCH_OUT,
+    TRACE_TIMEOUT, TRACE_SWITCH_IN, TRACE_SWITCH_OUT, TRACE_DONE,
+  };
+  recorder_header_t *hdr;
+  recorder_event_t *ev;
+  fiber_t *fiber;
+  uint32_t fid;
+  int i, fd;
+
+  fd = mkstemp( rec_path );
+  ck_assert_int_ge( fd, 0 );
+  close( fd );
+  ck_assert_int_eq( sched_recorder_open( NULL, rec_path, 8 ), FIBER_NO_SUCH_SCHED );
+  ck_assert_int_eq( sched_recorder_open( sched, rec_path, 5 ), FIBER_OK );
+  ck_assert_int_eq( sched_recorder_open( sched, NULL, 8 ), FIBER_ILLEGAL_STATE );
+
+  rec_running = -2;
+  fiber = fiber_new( run_rec_check, NULL );
+  fiber_start( sched, fiber );
+  fid = fiber->fid;
+  for( i = 2; i < 10; ++i ) {
+    sched_cycle( sched, i );
+  }
+  ck_assert_int_eq( sched_numfibers( sched ), 0 );
+  ck_assert_int_eq( rec_running, fid );
+
+  /* the scheduler's own view of the mapping */
+  hdr = sched->rec;
+  ck_assert_int_eq( hdr->magic, RECORDER_MAGIC );
+  ck_assert_int_eq( hdr->nevents, 8 );
+  ck_assert_int_eq( hdr->cycles, 8 );
+  ck_assert_int_eq( hdr->running, -1 );
+  ck_assert_int_eq( hdr->head, 8 );
+  ev = (recorder_event_t*) (hdr + 1);
+  for( i = 0; i < 8; ++i ) {
+    ck_assert_int_eq( ev[i].type, expected[i] );
+    ck_assert_int_eq( ev[i].fid, fid );
+    if ( i > 0 ) {
+      ck_assert( ev[i].cycle >= ev[i-1].cycle );
+    }
+  }
+  ck_assert_int_eq( ev[0].cycle, 0 );
+  ck_assert_int_eq( ev[3].reason, TRACE_OUT_WAIT );
+  ck_assert_int_eq( ev[3].data, FIBER_WAIT_SLEEP );
+  ck_assert_int_eq( ev[6].reason, TRACE_OUT_END );
+
+  /* the ring wraps around */
+  fiber_start( sched, fiber_new( run_stats_sleep, NULL ));
+  for( i = 10; i < 20; ++i ) {
+    sched_cycle( sched, i );
+  }
+  ck_assert_int_eq( hdr->head, 16 );
+  ck_assert_int_eq( ev[0].type, TRACE_SPAWN );
+  ck_assert_int_eq( ev[0].cycle, 8 );
+
+  sched_recorder_close( sched );
+  ck_assert_ptr_eq( sched->rec, NULL );
+  unlink( rec_path );
+
+  /* in a memfd */
+  ck_assert_int_eq( sched_recorder_open( sched, NULL, 8 ), FIBER_OK );
+  ck_assert_int_ge( sched->rec_fd, 0 );
+  sched_free( sched );
+}
+END_TEST
+
+START_TEST (test_sched_trace)
+{
+  scheduler_t *sched = sched_new();
+#ifdef FIBER_TRACE
+  static const uint16_t expected[][2] = {
+    { TRACE_SPAWN, 0 }, { TRACE_BOOT, 0 },
+    { TRACE_SWITCH_IN, 0 }, { TRACE_SWITCH_OUT, TRACE_OUT_WAIT },
+    { TRACE_TIMEOUT, 0 },
+    { TRACE_SWITCH_IN, 0 }, { TRACE_SWITCH_OUT, TRACE_OUT_END },
+    { TRACE_DONE, 0 },
+  };
+  char path[] = "/tmp/fiber-trace-XXXXXX";
+  trace_event_t ev[16];
+  trace_header_t hdr;
+  fiber_t *fiber;
+  FILE *f;
+  int i, fd;
+
+  /* nothing recorded yet */
+  ck_assert_int_eq( sched_trace_dump( sched, "/dev/null" ), FIBER_ILLEGAL_STATE );
+  ck_assert_int_eq( sched_trace_start( sched, 12 ), FIBER_OK );
+
+  fiber = fiber_new( run_stats_sleep, NULL );
+  fiber_start( sched, fiber );
+  for( i = 2; i < 10; ++i ) {
+    sched_cycle( sched, i );
+  }
+  ck_assert_int_eq( sched_numfibers( sched ), 0 );
+
+  fd = mkstemp( path );
+  ck_assert_int_ge( fd, 0 );
+  close( fd );
+  ck_assert_int_eq( sched_trace_dump( sched, path ), FIBER_OK );
+
+  f = fopen( path, "rb" );
+  ck_assert_ptr_ne( f, NULL );
+  ck_assert_int_eq( fread( &hdr, sizeof(hdr), 1, f ), 1 );
+  ck_assert_int_eq( hdr.magic, TRACE_MAGIC );
+  ck_assert_int_eq( hdr.evsize, sizeof(trace_event_t) );
+  ck_assert_int_eq( hdr.count, 8 );
+  ck_assert_int_eq( hdr.lost, 0 );
+  ck_assert_int_eq( fread( ev, sizeof(ev[0]), hdr.count, f ), hdr.count );
+  fclose( f );
+  unlink( path );
+
+  for( i = 0; i < 8; ++i ) {
+    ck_assert_int_eq( ev[i].type, expected[i][0] );
+    ck_assert_int_eq( ev[i].fid, ev[0].fid );
+    if ( ev[i].type == TRACE_SWITCH_OUT ) {
+      ck_assert_int_eq( ev[i].reason, expected[i][1] );
+    }
+    if ( i > 0 ) {
+      ck_assert( ev[i].tsc >= ev[i-1].tsc );
+    }
+  }
+  ck_assert_int_eq( ev[0].data, (intptr_t) run_stats_sleep );
+  ck_assert_int_eq( ev[3].data, FIBER_WAIT_SLEEP );
+
+  /* the ring was rounded up to 16 events : the oldest ones are lost */
+  for( i = 0; i < 3; ++i ) {
+    fiber_start( sched, fiber_new( run_stats_sleep, NULL ));
+  }
+  for( i = 10; i < 20; ++i ) {
+    sched_cycle( sched, i );
+  }
+  ck_assert_int_eq( sched_trace_dump( sched, path ), FIBER_OK );
+  f = fopen( path, "rb" );
+  ck_assert_ptr_ne( f, NULL );
+  ck_assert_int_eq( fread( &hdr, sizeof(hdr), 1, f ), 1 );
+  ck_assert_int_eq( hdr.count, 16 );
+  ck_assert_int_eq( hdr.lost, 16 );
+  fclose( f );
+  unlink( path );
+  sched_trace_stop( sched );
+  ck_assert_int_eq( sched_trace_dump( sched, "/dev/null" ), FIBER_ILLEGAL_STATE );
+#else
+  ck_assert_int_eq( sched_trace_start( sched, 16 ), FIBER_ERROR );
+#endif
+  sched_free( sched );
+}
+END_TEST
+
+
 
 /* scheduler test suite */
 Suite *sched_suite(void)
@@ -877,6 +3521,37 @@ Suite *sched_suite(void)
   tcase_add_test(tc_core, test_single_fiber_spawn_forever_3);
   tcase_add_test(tc_core, test_single_fiber_spawn_done_1);
   tcase_add_test(tc_core, test_single_fiber_set_parameters);
+  tcase_add_test(tc_core, test_sched_node_memory);
+  tcase_add_test(tc_core, test_xchannel);
+  tcase_add_test(tc_core, test_channel);
+  tcase_add_test(tc_core, test_fiber_select);
+  tcase_add_test(tc_core, test_fiber_yield_to);
+  tcase_add_test(tc_core, test_run_next);
+  tcase_add_test(tc_core, test_fiber_var_wait);
+  tcase_add_test(tc_core, test_fiber_mutex_cond);
+  tcase_add_test(tc_core, test_fiber_sem_rwlock_barrier);
+  tcase_add_test(tc_core, test_future);
+  tcase_add_test(tc_core, test_generator);
+  tcase_add_test(tc_core, test_fiber_wait_any);
+  tcase_add_test(tc_core, test_fiber_wait_any_ended);
+  tcase_add_test(tc_core, test_fiber_cancel);
+  tcase_add_test(tc_core, test_fiber_cancel_handoff);
+  tcase_add_test(tc_core, test_fiber_stop_after_wait);
+  tcase_add_test(tc_core, test_wait_illegal_context);
+  tcase_add_test(tc_core, test_fiber_group);
+  tcase_add_test(tc_core, test_fiber_pool);
+  tcase_add_test(tc_core, test_tasklet);
+  tcase_add_test(tc_core, test_pt);
+  tcase_add_test(tc_core, test_fiber_accounting);
+  tcase_add_test(tc_core, test_sched_stats);
+  tcase_add_test(tc_core, test_logger_levels);
+  tcase_add_test(tc_core, test_logger_async);
+  tcase_add_test(tc_core, test_sched_recorder);
+  tcase_add_test(tc_core, test_sched_watchdog);
+  tcase_add_test(tc_core, test_sched_time_slice);
+  tcase_add_test(tc_core, test_sched_profile);
+  tcase_add_test(tc_core, test_sched_perf_events);
+  tcase_add_test(tc_core, test_sched_trace);
   
   suite_add_tcase(s, tc_core);
 
@@ -0,0 +1,209 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  fiberrec : prints the flight recorder of a scheduler (see recorder.h),
+ *  the fiber it is running, when its last cycle started and its last
+ *  events. It reads the file given to sched_recorder_open(), or all the
+ *  recorder memfds of a live process with -p.
+ *
+ *  usage : fiberrec [-n count] file...
+ *          fiberrec [-n count] -p pid
+ * ----------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "recorder.h"
+
+static const char *types[] = { "spawn", "boot", "switch in", "switch out",
+			       "wake", "timeout", "done" };
+static const char *reasons[] = { "yield", "wait", "end", "stop" };
+static const char *kinds[] = { "sleep", "io", "sync", "var", "join", "cond" };
+
+/* ----------------------------------------------------------------------------
+ * Print one event
+ * ----------------------------------------------------------------------------*/
+static void printEvent( const recorder_event_t *ev )
+{
+  printf( "  cycle %-10" PRIu64 " fiber %-4" PRIu32 " %s",
+	  ev->cycle, ev->fid, (ev->type < 7) ? types[ev->type] : "?" );
+  if ( ev->type == TRACE_SPAWN ) {
+    printf( " (run %#" PRIx64 ")", (uint64_t) ev->data );
+  }
+  else if ( ev->type == TRACE_SWITCH_OUT ) {
+    printf( " (%s", (ev->reason < 4) ? reasons[ev->reason] : "?" );
+    if ( ev->reason == TRACE_OUT_WAIT && ev->data >= 0 ) {
+      printf( " %s", (ev->data < FIBER_WAIT_NUM_KINDS) ? kinds[ev->data] : "?" );
+    }
+    printf( ")" );
+  }
+  printf( "\n" );
+}
+
+/* ----------------------------------------------------------------------------
+ * Print a recorder, 'count' last events at most
+ * ----------------------------------------------------------------------------*/
+static int dump( const char *path, uint64_t count )
+{
+  recorder_header_t hdr;
+  recorder_event_t *evs;
+  struct timespec ts;
+  uint64_t head, first, i, now;
+  FILE *f;
+
+  f = fopen( path, "rb" );
+  if ( f == NULL ) {
+    perror( path );
+    return 1;
+  }
+  if ( fread( &hdr, sizeof(hdr), 1, f ) != 1 || hdr.magic != RECORDER_MAGIC ||
+       hdr.version != RECORDER_VERSION || hdr.evsize != sizeof(recorder_event_t) ||
+       hdr.nevents == 0 || (hdr.nevents & (hdr.nevents - 1)) ) {
+    fprintf( stderr, "%s : not a flight recorder or wrong version\n", path );
+    fclose( f );
+    return 1;
+  }
+  evs = (recorder_event_t*) malloc( hdr.nevents * sizeof(*evs));
+  if ( evs == NULL || fread( evs, sizeof(*evs), hdr.nevents, f ) != hdr.nevents ) {
+    fprintf( stderr, "%s : truncated\n", path );
+    free( evs );
+    fclose( f );
+    return 1;
+  }
+  /* slots overwritten while they were read are dropped */
+  rewind( f );
+  head = hdr.head;
+  if ( fread( &hdr, sizeof(hdr), 1, f ) != 1 ) {
+    hdr.head = head;
+  }
+  fclose( f );
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  now = (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+
+  printf( "%s : process %" PRId32 ", %" PRIu64 " cycles, %" PRIu64 " events\n",
+	  path, hdr.pid, hdr.cycles, hdr.head );
+  if ( hdr.cycles > 0 && now >= hdr.cycle_nsec ) {
+    printf( "last cycle started %.3f s ago\n", (now - hdr.cycle_nsec) / 1e9 );
+  }
+  if ( hdr.running >= 0 ) {
+    printf( "fiber %" PRId32 " (run %#" PRIx64 ") is running\n",
+	    hdr.running, hdr.running_run );
+  }
+  else {
+    printf( "no fiber is running\n" );
+  }
+
+  first = ( hdr.head > hdr.nevents ) ? hdr.head - hdr.nevents : 0;
+  if ( first > head ) {
+    first = head;
+  }
+  if ( head - first > count ) {
+    first = head - count;
+  }
+  if ( first < head ) {
+    printf( "last %" PRIu64 " events :\n", head - first );
+  }
+  for( i = first; i < head; ++i ) {
+    printEvent( &evs[i & (hdr.nevents - 1)] );
+  }
+  free( evs );
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Print the recorders of a live process, found in its file descriptors
+ * ----------------------------------------------------------------------------*/
+static int dumpProcess( const char *pid, uint64_t count )
+{
+  char dir[64], path[320], link[256];
+  struct dirent *de;
+  DIR *d;
+  ssize_t n;
+  int found = 0, ret = 0;
+
+  snprintf( dir, sizeof(dir), "/proc/%s/fd", pid );
+  d = opendir( dir );
+  if ( d == NULL ) {
+    perror( dir );
+    return 1;
+  }
+  while( (de = readdir( d )) != NULL ) {
+    snprintf( path, sizeof(path), "%s/%s", dir, de->d_name );
+    n = readlink( path, link, sizeof(link) - 1 );
+    if ( n < 0 ) {
+      continue;
+    }
+    link[n] = 0;
+    if ( strncmp( link, "/memfd:libfiber-recorder", 24 ) == 0 ) {
+      ret |= dump( path, count );
+      found = 1;
+    }
+  }
+  closedir( d );
+  if ( !found ) {
+    fprintf( stderr, "process %s has no flight recorder\n", pid );
+    return 1;
+  }
+  return ret;
+}
+
+int main( int argc, char **argv )
+{
+  uint64_t count = 32;
+  const char *pid = NULL;
+  int c, ret = 0;
+
+  while( (c = getopt( argc, argv, "n:p:" )) != -1 ) {
+    switch( c ) {
+    case 'n':
+      count = strtoull( optarg, NULL, 10 );
+      break;
+    case 'p':
+      pid = optarg;
+      break;
+    default:
+      optind = argc + 1;
+      break;
+    }
+  }
+  if ( optind > argc || (pid == NULL && optind == argc) ) {
+    fprintf( stderr, "usage : %s [-n count] file...\n"
+	     "        %s [-n count] -p pid\n", argv[0], argv[0] );
+    return 1;
+  }
+  if ( pid != NULL ) {
+    return dumpProcess( pid, count );
+  }
+  for( ; optind < argc; ++optind ) {
+    ret |= dump( argv[optind], count );
+  }
+  return ret;
+}
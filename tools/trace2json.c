@@ -0,0 +1,216 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  trace2json : converts a file written by sched_trace_dump() to the
+ *  Chrome trace event format, opened by chrome://tracing and by the
+ *  Perfetto UI (https://ui.perfetto.dev).
+ *
+ *  Each fiber gets its own track, on which the time it runs, the time it
+ *  waits to be dispatched ("runnable") and the time it is suspended
+ *  ("wait <kind>") are drawn as slices.
+ *
+ *  usage : trace2json file.trace [file.json]
+ * ----------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdarg.h>
+
+#include "tracer.h"
+
+/* what is known of a fiber identifier */
+struct track {
+  int      id;              /* track number, 0 if unused */
+  double   in;              /* time it was switched to or -1 */
+  double   runnable;        /* time it became runnable or -1 */
+  double   wait;            /* time it was suspended or -1 */
+  int      kind;            /* its kind of wait */
+};
+
+static struct track tracks[ARRAYSIZE];
+static int ntracks;
+static FILE *out;
+static int first = 1;
+
+static const char *kinds[] = { "sleep", "io", "sync", "var", "join", "cond" };
+static const char *reasons[] = { "yield", "wait", "end", "stop" };
+
+/* ----------------------------------------------------------------------------
+ * Emit one JSON event, comma separated
+ * ----------------------------------------------------------------------------*/
+static void emit( const char *fmt, ... )
+{
+  va_list ap;
+
+  fputs( first ? "\n  " : ",\n  ", out );
+  first = 0;
+  va_start( ap, fmt );
+  vfprintf( out, fmt, ap );
+  va_end( ap );
+}
+
+/* ----------------------------------------------------------------------------
+ * Track of a fiber, created when it is first seen
+ * ----------------------------------------------------------------------------*/
+static struct track *trackOf( uint32_t fid, int64_t run )
+{
+  struct track *t = &tracks[fid % ARRAYSIZE];
+
+  if ( t->id == 0 ) {
+    t->id = ++ntracks;
+    t->in = t->runnable = t->wait = -1;
+    if ( run != 0 ) {
+      emit( "{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\","
+	    "\"args\":{\"name\":\"fiber %" PRIu32 " (run %#" PRIx64 ")\"}}",
+	    t->id, fid, (uint64_t) run );
+    }
+    else {
+      emit( "{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\","
+	    "\"args\":{\"name\":\"fiber %" PRIu32 "\"}}", t->id, fid );
+    }
+  }
+  return t;
+}
+
+/* ----------------------------------------------------------------------------
+ * Emit a slice from 'from' to 'to' (microseconds)
+ * ----------------------------------------------------------------------------*/
+static void slice( struct track *t, const char *name, double from, double to,
+		   const char *key, const char *value )
+{
+  if ( key != NULL ) {
+    emit( "{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"name\":\"%s\",\"ts\":%.3f,\"dur\":%.3f,"
+	  "\"args\":{\"%s\":\"%s\"}}", t->id, name, from, to - from, key, value );
+  }
+  else {
+    emit( "{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"name\":\"%s\",\"ts\":%.3f,\"dur\":%.3f}",
+	  t->id, name, from, to - from );
+  }
+}
+
+int main( int argc, char **argv )
+{
+  trace_header_t hdr;
+  trace_event_t ev;
+  struct track *t;
+  double scale, ts;
+  char name[32];
+  uint64_t i;
+  FILE *in;
+
+  if ( argc < 2 || argc > 3 ) {
+    fprintf( stderr, "usage : %s file.trace [file.json]\n", argv[0] );
+    return 1;
+  }
+  in = fopen( argv[1], "rb" );
+  if ( in == NULL ) {
+    perror( argv[1] );
+    return 1;
+  }
+  if ( fread( &hdr, sizeof(hdr), 1, in ) != 1 || hdr.magic != TRACE_MAGIC ||
+       hdr.version != TRACE_VERSION || hdr.evsize != sizeof(trace_event_t) ) {
+    fprintf( stderr, "%s : not a trace file or wrong version\n", argv[1] );
+    return 1;
+  }
+  out = ( argc == 3 ) ? fopen( argv[2], "w" ) : stdout;
+  if ( out == NULL ) {
+    perror( argv[2] );
+    return 1;
+  }
+
+  /* time stamp counter ticks to microseconds */
+  scale = ( hdr.tsc1 > hdr.tsc0 ) ?
+    (double) (hdr.nsec1 - hdr.nsec0) / (double) (hdr.tsc1 - hdr.tsc0) : 1.0;
+  scale /= 1000.0;
+
+  fprintf( out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" );
+  emit( "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\","
+	"\"args\":{\"name\":\"scheduler (%" PRIu64 " events lost)\"}}", hdr.lost );
+
+  for( i = 0; i < hdr.count; ++i ) {
+    if ( fread( &ev, sizeof(ev), 1, in ) != 1 ) {
+      fprintf( stderr, "%s : truncated\n", argv[1] );
+      break;
+    }
+    ts = (double) (int64_t) (ev.tsc - hdr.tsc0) * scale;
+    t = trackOf( ev.fid, (ev.type == TRACE_SPAWN) ? ev.data : 0 );
+
+    switch( ev.type ) {
+    case TRACE_SPAWN:
+    case TRACE_BOOT:
+      if ( t->runnable < 0 ) {
+	t->runnable = ts;
+      }
+      break;
+    case TRACE_SWITCH_IN:
+      if ( t->runnable >= 0 ) {
+	slice( t, "runnable", t->runnable, ts, NULL, NULL );
+	t->runnable = -1;
+      }
+      t->in = ts;
+      break;
+    case TRACE_SWITCH_OUT:
+      if ( t->in >= 0 ) {
+	slice( t, "run", t->in, ts, "out",
+	       (ev.reason < 4) ? reasons[ev.reason] : "?" );
+	t->in = -1;
+      }
+      if ( ev.reason == TRACE_OUT_WAIT && ev.data >= 0 ) {
+	t->wait = ts;
+	t->kind = (int) ev.data;
+      }
+      else if ( ev.reason == TRACE_OUT_YIELD || ev.reason == TRACE_OUT_WAIT ) {
+	t->runnable = ts;
+      }
+      break;
+    case TRACE_WAKE:
+    case TRACE_TIMEOUT:
+      if ( t->wait >= 0 ) {
+	snprintf( name, sizeof(name), "wait %s",
+		  (t->kind < FIBER_WAIT_NUM_KINDS) ? kinds[t->kind] : "?" );
+	slice( t, name, t->wait, ts, "end",
+	       (ev.type == TRACE_WAKE) ? "wake" : "timeout" );
+	t->wait = -1;
+      }
+      t->runnable = ts;
+      break;
+    case TRACE_DONE:
+      emit( "{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"name\":\"done\",\"ts\":%.3f}",
+	    t->id, ts );
+      /* the identifier can be reused */
+      t->id = 0;
+      break;
+    }
+  }
+
+  fprintf( out, "\n]}\n" );
+  fclose( in );
+  if ( out != stdout ) {
+    fclose( out );
+  }
+  return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Scheduling event tracer : the ring of a scheduler and its dump. Events
+ *  are recorded by the scheduler itself, see schedTraceEvent() in task.c.
+ * ----------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "taskint.h"
+#include "tracer.h"
+
+/* --------------------------------------------------------------------------
+ *  sched_trace_start --
+ * --------------------------------------------------------------------------*/
+int sched_trace_start( scheduler_t *sched, size_t nevents )
+{
+#ifdef FIBER_TRACE
+  trace_event_t *ring;
+  size_t sz = 1;
+
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
+  }
+  while( sz < nevents ) {
+    sz <<= 1;
+  }
+  ring = (trace_event_t*) malloc( sz*sizeof(*ring));
+  if ( ring == NULL ) {
+    return FIBER_MEMORY_ALLOCATION_ERROR;
+  }
+  free( sched->trace );
+  sched->trace = ring;
+  sched->trace_mask = sz - 1;
+  sched->trace_head = 0;
+  sched->trace_tsc0 = schedTsc();
+  sched->trace_nsec0 = schedAcctNow();
+  return FIBER_OK;
+#else
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
+  }
+  error( "sched_trace_start : the library was compiled without FIBER_TRACE\n" );
+  return FIBER_ERROR;
+#endif
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_trace_stop --
+ * --------------------------------------------------------------------------*/
+void sched_trace_stop( scheduler_t *sched )
+{
+  if ( sched != NULL ) {
+    free( sched->trace );
+    sched->trace = NULL;
+  }
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_trace_dump --
+ * --------------------------------------------------------------------------*/
+int sched_trace_dump( scheduler_t *sched, const char *path )
+{
+#ifdef FIBER_TRACE
+  trace_header_t hdr;
+  uint64_t first, size;
+  FILE *f;
+  int ok;
+
+  if ( sched == NULL || sched->trace == NULL ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+
+  memset( &hdr, 0, sizeof(hdr));
+  hdr.magic = TRACE_MAGIC;
+  hdr.version = TRACE_VERSION;
+  hdr.evsize = sizeof(trace_event_t);
+  size = sched->trace_mask + 1;
+  hdr.count = ( sched->trace_head < size ) ? sched->trace_head : size;
+  hdr.lost = sched->trace_head - hdr.count;
+  hdr.tsc0 = sched->trace_tsc0;
+  hdr.nsec0 = sched->trace_nsec0;
+  hdr.tsc1 = schedTsc();
+  hdr.nsec1 = schedAcctNow();
+
+  f = fopen( path, "wb" );
+  if ( f == NULL ) {
+    error( "sched_trace_dump : can't open %s\n", path );
+    return FIBER_ERROR;
+  }
+
+  /* the ring may wrap around : oldest part first */
+  first = sched->trace_head - hdr.count;
+  ok = ( fwrite( &hdr, sizeof(hdr), 1, f ) == 1 );
+  if ( ok && hdr.count > 0 ) {
+    uint64_t i = first & sched->trace_mask;
+    uint64_t n1 = ( i + hdr.count <= size ) ? hdr.count : size - i;
+
+    ok = ( fwrite( sched->trace + i, sizeof(trace_event_t), n1, f ) == n1 );
+    if ( ok && n1 < hdr.count ) {
+      ok = ( fwrite( sched->trace, sizeof(trace_event_t), hdr.count - n1, f ) == hdr.count - n1 );
+    }
+  }
+  if ( fclose( f ) != 0 ) {
+    ok = 0;
+  }
+  return ok ? FIBER_OK : FIBER_ERROR;
+#else
+  return FIBER_ILLEGAL_STATE;
+#endif
+}
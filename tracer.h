@@ -0,0 +1,132 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_TRACER_H__
+#define __FIBER_TRACER_H__
+
+#include "task.h"
+
+/* ---------------------------------------------------------------------------
+ *  Scheduling event tracer
+ *
+ *  When the library is compiled with -DFIBER_TRACE, a scheduler can record
+ *  what its fibers do in a ring of fixed size events : the oldest events
+ *  are overwritten when it is full. Recording an event is a read of the
+ *  time stamp counter and a few stores, nothing is formatted.
+ *
+ *  sched_trace_dump() writes the ring to a file that the trace2json tool
+ *  (see tools/) converts to the Chrome trace event format, which both
+ *  chrome://tracing and the Perfetto UI open.
+ *
+ *  Without -DFIBER_TRACE, nothing is recorded and sched_trace_start()
+ *  returns FIBER_ERROR.
+ * ---------------------------------------------------------------------------
+ */
+
+/* event types */
+enum trace_event_e
+  {
+   TRACE_SPAWN = 0,          /* fiber started, 'data' is its run function */
+   TRACE_BOOT,               /* its stack was set up */
+   TRACE_SWITCH_IN,          /* it runs */
+   TRACE_SWITCH_OUT,         /* it gave back control, see 'reason' */
+   TRACE_WAKE,               /* suspended, it becomes runnable */
+   TRACE_TIMEOUT,            /* same, its timeout expired */
+   TRACE_DONE,               /* removed from its scheduler */
+  };
+
+/* reasons of TRACE_SWITCH_OUT */
+enum trace_reason_e
+  {
+   TRACE_OUT_YIELD = 0,      /* still runnable */
+   TRACE_OUT_WAIT,           /* suspended, 'data' is the FIBER_WAIT_xxx kind
+			      * or -1 if it only gave back control */
+   TRACE_OUT_END,            /* its run function returned */
+   TRACE_OUT_STOP,           /* stopped */
+  };
+
+/* an event, as stored in the ring and in the file */
+typedef struct trace_event {
+  uint64_t tsc;              /* time stamp counter */
+  int64_t  data;             /* depends on the type */
+  uint32_t fid;              /* fiber identifier, reused once it's done */
+  uint16_t type;             /* TRACE_xxx */
+  uint16_t reason;           /* TRACE_OUT_xxx */
+} trace_event_t;
+
+/* header of a trace file, followed by 'count' events, oldest first.
+ * Two samples of the time stamp counter and of the monotonic clock, taken
+ * when tracing started and when the file was written, convert the time
+ * stamps to nanoseconds. */
+#define TRACE_MAGIC   0x43525446     /* "FTRC" */
+#define TRACE_VERSION 1
+
+typedef struct trace_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t evsize;           /* sizeof(trace_event_t) */
+  uint64_t count;            /* events in the file */
+  uint64_t lost;             /* older events overwritten */
+  uint64_t tsc0, nsec0;      /* first sample */
+  uint64_t tsc1, nsec1;      /* second sample */
+} trace_header_t;
+
+
+/* ---------------------------------------------------------------------------
+ * sched_trace_start --
+ *
+ * Starts recording the events of `sched' in a ring of `nevents' events,
+ * rounded up to a power of two. Events already recorded are dropped.
+ *
+ * Returns FIBER_OK, FIBER_MEMORY_ALLOCATION_ERROR, FIBER_NO_SUCH_SCHED or
+ * FIBER_ERROR if the library was compiled without tracing.
+ * ---------------------------------------------------------------------------
+ */
+int sched_trace_start( scheduler_t *sched, size_t nevents );
+
+
+/* ---------------------------------------------------------------------------
+ * sched_trace_stop --
+ *
+ * Stops recording and frees the ring. Dump it before if needed.
+ * ---------------------------------------------------------------------------
+ */
+void sched_trace_stop( scheduler_t *sched );
+
+
+/* ---------------------------------------------------------------------------
+ * sched_trace_dump --
+ *
+ * Writes the events recorded by `sched' to the file `path'. Recording goes
+ * on. It must be called from the thread running the scheduler, or while
+ * it doesn't run.
+ *
+ * Returns FIBER_OK, FIBER_ILLEGAL_STATE if nothing is recorded or
+ * FIBER_ERROR if the file can't be written.
+ * ---------------------------------------------------------------------------
+ */
+int sched_trace_dump( scheduler_t *sched, const char *path );
+
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Multi source waits.
+ *
+ *  The fiber gets one waiter per source, all sharing the same 'fired'
+ *  variable like fiber_select() does. Sources are first checked once, then
+ *  armed; fiberWaitOn() unlinks all of them, including the file descriptor
+ *  registrations, when the fiber resumes. Deadline sources are not armed :
+ *  the nearest one is the deadline of the park.
+ * ----------------------------------------------------------------------------*/
+
+#include <sys/epoll.h>
+#include <string.h>
+
+#include "taskint.h"
+#include "waitany.h"
+
+/* ----------------------------------------------------------------------------
+ * Is a source already fired ?
+ * ----------------------------------------------------------------------------*/
+static int waitSourceReady( scheduler_t *sched, wait_source_t *src )
+{
+  switch( src->type ) {
+  case WAIT_CHANNEL:
+    return channelTryCase( src->chan ) == FIBER_OK;
+  case WAIT_VAR:
+    return *src->var == src->value;
+  case WAIT_JOIN:
+    /* as in fiber_join(), a fiber which left its scheduler has ended */
+    return ( src->other->fid >= ARRAYSIZE ||
+	     sched->fibers[src->other->fid] != src->other );
+  case WAIT_DEADLINE:
+    return (int32_t) (src->deadline - sched_timestamp( sched )) <= 0;
+  }
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Check the sources of a wait
+ * ----------------------------------------------------------------------------*/
+static int waitSourceValid( wait_source_t *src )
+{
+  switch( src->type ) {
+  case WAIT_READ:
+  case WAIT_WRITE:
+    return src->fd >= 0;
+  case WAIT_CHANNEL:
+    return src->chan != NULL;
+  case WAIT_VAR:
+    return src->var != NULL;
+  case WAIT_JOIN:
+    return src->other != NULL;
+  case WAIT_DEADLINE:
+    return 1;
+  }
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Look for a source already fired, its position is stored in '*index'.
+ * The position of the nearest deadline source, or -1, is stored in
+ * '*nearest'.
+ * Returns FIBER_OK if one was found, FIBER_TIMEOUT if the caller must wait
+ * or FIBER_ERROR if a source is invalid.
+ * ----------------------------------------------------------------------------*/
+int waitSourcesCheck( scheduler_t *sched, wait_source_t *sources, int n,
+		      int *index, int *nearest )
+{
+  int i;
+
+  if ( n <= 0 || sources == NULL ) {
+    return FIBER_ERROR;
+  }
+
+  /* first fired source wins */
+  *nearest = -1;
+  for( i = 0; i < n; ++i ) {
+    if ( !waitSourceValid( &sources[i] ) ) {
+      return FIBER_ERROR;
+    }
+    if ( waitSourceReady( sched, &sources[i] ) ) {
+      if ( index ) *index = i;
+      return FIBER_OK;
+    }
+    if ( sources[i].type == WAIT_DEADLINE &&
+	 (*nearest < 0 || (int32_t) (sources[i].deadline - sources[*nearest].deadline) < 0) ) {
+      *nearest = i;
+    }
+  }
+  return FIBER_TIMEOUT;
+}
+
+/* ----------------------------------------------------------------------------
+ * Arm one waiter of 'fiber' per source, they share 'fired'. 'vws' holds
+ * the state of variable sources. The caller parks the fiber on them.
+ * If one can't be armed the others are unlinked and an error is returned.
+ * ----------------------------------------------------------------------------*/
+int waitSourcesArm( fiber_t *fiber, wait_source_t *sources, int n,
+		    waiter_t *waiters, struct var_wait *vws, int *fired )
+{
+  scheduler_t *sched = fiber->scheduler;
+  int i, ret = FIBER_OK;
+
+  for( i = 0; i < n; ++i ) {
+    waiters[i].queue = NULL;
+    waiters[i].fiber = fiber;
+    waiters[i].data = NULL;
+    waiters[i].index = i;
+    waiters[i].fired = fired;
+  }
+  for( i = 0; i < n && ret == FIBER_OK; ++i ) {
+    switch( sources[i].type ) {
+    case WAIT_READ:
+      ret = schedIoArm( sched, &waiters[i], sources[i].fd, EPOLLIN );
+      break;
+    case WAIT_WRITE:
+      ret = schedIoArm( sched, &waiters[i], sources[i].fd, EPOLLOUT );
+      break;
+    case WAIT_CHANNEL:
+      channelPushCase( sources[i].chan, &waiters[i] );
+      break;
+    case WAIT_VAR:
+      vws[i].addr = sources[i].var;
+      vws[i].value = sources[i].value;
+      waiters[i].data = &vws[i];
+      waitqPush( schedVarQueue( sched, sources[i].var ), &waiters[i] );
+      break;
+    case WAIT_JOIN:
+      waitqPush( &sources[i].other->joiners, &waiters[i] );
+      break;
+    }
+  }
+
+  if ( ret != FIBER_OK ) {
+    /* unlink what was armed */
+    fiber->waiters = waiters;
+    fiber->nwaiters = n;
+    fiberUnlinkWaiters( fiber );
+  }
+  return ret;
+}
+
+/* --------------------------------------------------------------------------
+ *  fiber_wait_any --
+ * --------------------------------------------------------------------------*/
+int fiber_wait_any( fiber_t *fiber, wait_source_t *sources, int n, int *index )
+{
+  scheduler_t *sched;
+  int ret, fired = -1, nearest;
+  int32_t left;
+  uint32_t msec = 0;
+
+  /* before anything is armed */
+  if ( fiberCheckBlock( fiber ) != FIBER_OK ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  sched = fiber->scheduler;
+
+  ret = waitSourcesCheck( sched, sources, n, index, &nearest );
+  if ( ret != FIBER_TIMEOUT ) {
+    return ret;
+  }
+
+  /* the park deadline is strictly checked against the scheduler time */
+  if ( nearest >= 0 ) {
+    left = (int32_t) (sources[nearest].deadline - sched_timestamp( sched ));
+    msec = (left > 1) ? (uint32_t) left - 1 : 1;
+  }
+
+  /* arm all of them */
+  {
+    waiter_t waiters[n];
+    struct var_wait vws[n];
+
+    ret = waitSourcesArm( fiber, sources, n, waiters, vws, &fired );
+    if ( ret != FIBER_OK ) {
+      return ret;
+    }
+
+    ret = fiberWaitOn( fiber, waiters, n, msec );
+    if ( ret == FIBER_CANCELED || ret == FIBER_ILLEGAL_STATE ) {
+      return ret;
+    }
+    if ( ret != FIBER_OK ) {
+      fired = nearest;
+    }
+  }
+
+  if ( index ) *index = fired;
+  return FIBER_OK;
+}
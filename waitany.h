@@ -0,0 +1,88 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_WAITANY_H__
+#define __FIBER_WAITANY_H__
+
+#include "task.h"
+#include "channel.h"
+
+/* typedefs */
+typedef struct wait_source wait_source_t;
+
+/* ---------------------------------------------------------------------------
+ *  Waiting on several sources at once
+ *
+ *  fiber_wait_any() parks a fiber until one of its sources fires. Each
+ *  source is armed in the object it watches (the wait queue of a channel,
+ *  of a variable or of a fiber, the epoll set of the scheduler) and is
+ *  disarmed when the fiber resumes : nothing is polled, the cost is
+ *  proportional to the number of sources.
+ * ---------------------------------------------------------------------------
+ */
+enum wait_source_e
+  {
+   WAIT_READ = 0,            /* 'fd' is readable */
+   WAIT_WRITE,               /* 'fd' is writable */
+   WAIT_CHANNEL,             /* the operation of channel case 'chan' is done */
+   WAIT_VAR,                 /* '*var' is set to 'value' and notified */
+   WAIT_JOIN,                /* fiber 'other' ended */
+   WAIT_DEADLINE,            /* scheduler time reached 'deadline' */
+  };
+
+struct wait_source {
+  int             type;      /* WAIT_xxx */
+  int             fd;        /* WAIT_READ, WAIT_WRITE */
+  channel_case_t *chan;      /* WAIT_CHANNEL */
+  int            *var;       /* WAIT_VAR */
+  int             value;     /* WAIT_VAR */
+  fiber_t        *other;     /* WAIT_JOIN */
+  uint32_t        deadline;  /* WAIT_DEADLINE, absolute like sched_timestamp() */
+};
+
+
+/* ---------------------------------------------------------------------------
+ * fiber_wait_any --
+ *
+ * Waits until one of the `n' sources of `sources' fires and stores its
+ * position in `*index' if `index' is not NULL. A source that is already
+ * fired when the function is called is reported without parking.
+ *
+ * A channel source completes its operation like fiber_select(). A variable
+ * source must be woken up with fiber_var_store() or fiber_var_notify().
+ * File descriptors are checked at the beginning of each scheduler cycle
+ * and by sched_poll(); a file descriptor can only be waited on by one
+ * fiber at a time. Several deadline sources can be given, the nearest
+ * one fires.
+ *
+ * Returns FIBER_OK, FIBER_ERROR if `n' is not positive or a source is
+ * invalid, FIBER_ILLEGAL_STATE if `fiber' is not the running fiber or a
+ * file descriptor can't be watched, or
+ * FIBER_CANCELED if `fiber' is stopped while waiting.
+ * ---------------------------------------------------------------------------
+ */
+int fiber_wait_any( fiber_t *fiber, wait_source_t *sources, int n, int *index );
+
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Watchdog : a thread per scheduler checks that the running fiber gives
+ *  back control within a budget, and interrupts the scheduler thread with
+ *  a signal when it doesn't. The unwinder callback and the alternate signal
+ *  stack are shared with the profiler.
+ * ----------------------------------------------------------------------------*/
+
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "taskint.h"
+#include "watchdog.h"
+
+/* watchdog of a scheduler */
+struct watchdog {
+  scheduler_t *sched;
+  pthread_t monitor;        /* thread checking the scheduler */
+  pthread_t thread;         /* thread running the scheduler */
+  int bound;                /* 'thread' is known */
+  int stop;                 /* asks 'monitor' to end */
+  int flags;                /* FIBER_WATCHDOG_xxx */
+  uint32_t budget;          /* milliseconds */
+  uint32_t stalled;         /* milliseconds, reported by the handler */
+};
+
+/* scheduler whose cycle runs on this thread, for the signal handler */
+static __thread scheduler_t *watchedSched = NULL;
+
+/* alternate signal stack of the thread, for the signal handlers of the
+ * watchdog and the profiler */
+__thread uintptr_t altStackLo = 0, altStackHi = 0;
+
+/* ----------------------------------------------------------------------------
+ * Unwinder callback keeping the frames on the fiber stack or, when running
+ * on the scheduler stack, the frames out of the alternate signal stack.
+ * Past its first frames, the fiber stack leads to the scheduler stack as it
+ * was when the fiber was booted : the walk stops there.
+ * ----------------------------------------------------------------------------*/
+_Unwind_Reason_Code schedStackFrame( struct _Unwind_Context *ctx, void *arg )
+{
+  struct stack_frames *sf = (struct stack_frames*) arg;
+  uintptr_t cfa = _Unwind_GetCFA( ctx );
+  uintptr_t ip = _Unwind_GetIP( ctx );
+  int inside = ( cfa > sf->lo && cfa <= sf->hi );
+
+  if ( inside != sf->inside ) {
+    return ( sf->n > 0 ) ? _URC_END_OF_STACK : _URC_NO_REASON;
+  }
+  if ( sf->n == sf->max || ip == 0 ) {
+    return _URC_END_OF_STACK;
+  }
+  sf->frames[sf->n++] = (void*) ip;
+  return _URC_NO_REASON;
+}
+
+/* ----------------------------------------------------------------------------
+ * Installs an alternate signal stack on the calling thread unless it has
+ * one, and records its bounds.
+ * ----------------------------------------------------------------------------*/
+void schedAltStack( void )
+{
+  stack_t stack, old;
+
+  if ( altStackHi != 0 || sigaltstack( NULL, &old ) != 0 ) {
+    return;
+  }
+  if ( old.ss_flags & SS_DISABLE ) {
+    stack.ss_size = 65536;
+    stack.ss_sp = malloc( stack.ss_size );
+    stack.ss_flags = 0;
+    if ( stack.ss_sp == NULL || sigaltstack( &stack, NULL ) != 0 ) {
+      free( stack.ss_sp );
+      return;
+    }
+    old.ss_sp = stack.ss_sp;
+    old.ss_size = stack.ss_size;
+  }
+  altStackLo = (uintptr_t) old.ss_sp;
+  altStackHi = altStackLo + old.ss_size;
+}
+
+/* ----------------------------------------------------------------------------
+ * Signal handler : runs on the scheduler thread, the running fiber
+ * interrupted. Only writes to stderr.
+ * ----------------------------------------------------------------------------*/
+static void schedWatchdogSignal( int sig )
+{
+  scheduler_t *sched = watchedSched;
+  struct stack_frames sf;
+  fiber_t *fiber;
+  void *frames[64];
+  char buf[160];
+  int n, saved = errno;
+
+  if ( sched == NULL || sched->wd == NULL || (fiber = sched->running) == NULL ) {
+    return;
+  }
+  n = snprintf( buf, sizeof(buf),
+		"watchdog : fiber %d has run for %u ms without giving back control\n"
+		"run function : ", fiber->fid, sched->wd->stalled );
+  if ( write( 2, buf, n ) < 0 ) {
+    /* nothing else to do */
+  }
+  frames[0] = (void*) fiber->pf_run;
+  backtrace_symbols_fd( frames, 1, 2 );
+
+  sf.lo = (uintptr_t) fiber->stack;
+  sf.hi = sf.lo + fiber->stacksz;
+  sf.inside = 1;
+  sf.frames = frames;
+  sf.n = 0;
+  sf.max = 64;
+  _Unwind_Backtrace( schedStackFrame, &sf );
+  if ( write( 2, "backtrace :\n", 12 ) < 0 ) {
+    /* nothing else to do */
+  }
+  backtrace_symbols_fd( frames, sf.n, 2 );
+
+  if ( sched->wd->flags & FIBER_WATCHDOG_ABORT ) {
+    abort();
+  }
+  errno = saved;
+}
+
+/* ----------------------------------------------------------------------------
+ * Record the thread running the scheduler. Called by sched_cycle().
+ * The alternate signal stack is restored after booting a fiber.
+ * ----------------------------------------------------------------------------*/
+void schedWatchdogBind( scheduler_t *sched )
+{
+  watchedSched = sched;
+  if ( sched->wd->bound ) {
+    return;
+  }
+  schedAltStack();
+  sched->wd->thread = pthread_self();
+  __atomic_store_n( &sched->wd->bound, 1, __ATOMIC_RELEASE );
+}
+
+/* ----------------------------------------------------------------------------
+ * Thread watching a scheduler : the running fiber is stalled if no fiber
+ * was switched to since the budget elapsed.
+ * ----------------------------------------------------------------------------*/
+static void *schedWatchdog( void *arg )
+{
+  struct watchdog *wd = (struct watchdog*) arg;
+  scheduler_t *sched = wd->sched;
+  uint64_t seq, last = 0, since = schedAcctNow(), now;
+  uint64_t budget = (uint64_t) wd->budget * 1000000ULL;
+  struct timespec ts;
+  int reported = 0;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = ( wd->budget >= 8 ) ? (wd->budget / 4) * 1000000L : 1000000L;
+  if ( ts.tv_nsec >= 1000000000L ) {
+    ts.tv_sec = ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+  }
+
+  while( !__atomic_load_n( &wd->stop, __ATOMIC_ACQUIRE )) {
+    nanosleep( &ts, NULL );
+    now = schedAcctNow();
+    seq = __atomic_load_n( &sched->switch_seq, __ATOMIC_RELAXED );
+    if ( seq != last || __atomic_load_n( &sched->running, __ATOMIC_RELAXED ) == NULL ) {
+      last = seq;
+      since = now;
+      reported = 0;
+    }
+    else if ( !reported && now - since >= budget &&
+	      __atomic_load_n( &wd->bound, __ATOMIC_ACQUIRE )) {
+      wd->stalled = (uint32_t) ((now - since) / 1000000ULL);
+      pthread_kill( wd->thread, FIBER_WATCHDOG_SIGNAL );
+      reported = 1;
+    }
+  }
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_watchdog_start --
+ * --------------------------------------------------------------------------*/
+int sched_watchdog_start( scheduler_t *sched, uint32_t budget, int flags )
+{
+  struct watchdog *wd;
+  struct sigaction sa;
+  void *frames[1];
+
+  if ( sched == NULL ) {
+    return FIBER_NO_SUCH_SCHED;
+  }
+  if ( sched->wd != NULL ) {
+    return FIBER_ILLEGAL_STATE;
+  }
+  if ( budget == 0 ) {
+    return FIBER_INVALID_TIMEOUT;
+  }
+
+  /* backtrace() loads libgcc_s on its first call : not in the handler */
+  backtrace( frames, 1 );
+  memset( &sa, 0, sizeof(sa));
+  sa.sa_handler = schedWatchdogSignal;
+  sa.sa_flags = SA_ONSTACK | SA_RESTART;
+  sigemptyset( &sa.sa_mask );
+  if ( sigaction( FIBER_WATCHDOG_SIGNAL, &sa, NULL ) ) {
+    error( "sched_watchdog_start : sigaction failed.\n" );
+    return FIBER_SIGNALERROR;
+  }
+
+  wd = (struct watchdog*) calloc( 1, sizeof(*wd));
+  if ( wd == NULL ) {
+    return FIBER_MEMORY_ALLOCATION_ERROR;
+  }
+  wd->sched = sched;
+  wd->budget = budget;
+  wd->flags = flags;
+  sched->wd = wd;
+  if ( pthread_create( &wd->monitor, NULL, schedWatchdog, wd )) {
+    error( "sched_watchdog_start : can't create thread.\n" );
+    sched->wd = NULL;
+    free( wd );
+    return FIBER_ERROR;
+  }
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  sched_watchdog_stop --
+ * --------------------------------------------------------------------------*/
+void sched_watchdog_stop( scheduler_t *sched )
+{
+  struct watchdog *wd;
+
+  if ( sched == NULL || (wd = sched->wd) == NULL ) {
+    return;
+  }
+  __atomic_store_n( &wd->stop, 1, __ATOMIC_RELEASE );
+  pthread_join( wd->monitor, NULL );
+  sched->wd = NULL;
+  free( wd );
+}
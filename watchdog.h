@@ -0,0 +1,83 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_WATCHDOG_H__
+#define __FIBER_WATCHDOG_H__
+
+#include <signal.h>
+
+#include "task.h"
+
+/* ---------------------------------------------------------------------------
+ *  Watchdog
+ *
+ *  A fiber that never gives back control stalls all the fibers of its
+ *  scheduler. The watchdog of a scheduler is a thread checking that the
+ *  fiber running doesn't keep the cpu longer than a budget. When it does,
+ *  the scheduler thread is sent FIBER_WATCHDOG_SIGNAL : the handler writes
+ *  to stderr the fiber, its run function and a backtrace taken from the
+ *  fiber stack, then aborts if requested so that a core dump is left.
+ *
+ *  Symbols of the backtrace are found in the dynamic symbol table : link
+ *  with -rdynamic to get the names of the functions of the program. The
+ *  handler runs on an alternate signal stack installed on the scheduler
+ *  thread, unless the thread already has one.
+ *
+ *  Only the fibers are watched : a callback, a tasklet or a protothread
+ *  running on the scheduler stack are not.
+ * ---------------------------------------------------------------------------
+ */
+#ifndef FIBER_WATCHDOG_SIGNAL
+#define FIBER_WATCHDOG_SIGNAL SIGUSR2
+#endif
+
+/* flags of sched_watchdog_start() */
+#define FIBER_WATCHDOG_ABORT 1      /* abort() once the backtrace is written */
+
+
+/* ---------------------------------------------------------------------------
+ * sched_watchdog_start --
+ *
+ * Starts the watchdog of a scheduler : a fiber running more than 'budget'
+ * milliseconds without giving back control is reported once. The thread
+ * running the scheduler is the one that calls sched_cycle().
+ *
+ * Returns FIBER_OK, FIBER_ILLEGAL_STATE if it is already started,
+ * FIBER_INVALID_TIMEOUT if 'budget' is 0, FIBER_SIGNALERROR if the signal
+ * handler can't be installed or FIBER_ERROR if the thread can't be created.
+ * ---------------------------------------------------------------------------
+ */
+int sched_watchdog_start( scheduler_t *sched, uint32_t budget, int flags );
+
+
+/* ---------------------------------------------------------------------------
+ * sched_watchdog_stop --
+ *
+ * Stops the watchdog of a scheduler. It is called by sched_free().
+ * ---------------------------------------------------------------------------
+ */
+void sched_watchdog_stop( scheduler_t *sched );
+
+
+#endif
@@ -0,0 +1,529 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* ----------------------------------------------------------------------------
+ *  Lock free channels between threads.
+ *
+ *  'head' is the index of the next element to read, it is only written
+ *  by the receiver. 'tail' is the index of the next element to write.
+ *  Both indices always increase, they are reduced modulo the ring size
+ *  when accessing the elements. Each one lives in its own cache line
+ *  with the copy of the other index that its owner uses to avoid
+ *  reading the shared line on every operation.
+ *
+ *  In MPSC mode senders reserve slots moving 'tail' with a CAS and each
+ *  slot has a sequence number telling the receiver when the data written
+ *  in it is complete (D. Vyukov bounded queue).
+ *
+ *  A fiber that needs to block links itself in 'rwait' (receiver) or
+ *  'swait' (senders), checks the channel again and parks. Its peer
+ *  unlinks the waiters after publishing and wakes them up through the
+ *  inbox of their scheduler. Both sides hold the spin lock of the queue
+ *  while touching it : a fiber which unlinked itself is sure that no
+ *  other thread is still waking it up, the waiter on its stack can go.
+ * ----------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "taskint.h"
+#include "xchannel.h"
+
+#define CACHELINE 64
+
+#define load_acquire(p)      __atomic_load_n( (p), __ATOMIC_ACQUIRE )
+#define load_relaxed(p)      __atomic_load_n( (p), __ATOMIC_RELAXED )
+#define store_release(p, v)  __atomic_store_n( (p), (v), __ATOMIC_RELEASE )
+
+/*
+ * --------------------------------------------------------------------------
+ *  Fibers blocked on a channel
+ * --------------------------------------------------------------------------
+ */
+typedef struct xwaiter {
+  fiber_t         *fiber;
+  struct xwaiter  *next;
+  struct xwaiter **pprev;   /* NULL once unlinked by a waker */
+} xwaiter_t;
+
+typedef struct xwaitq {
+  xwaiter_t *head;
+  char       lock;
+} xwaitq_t;
+
+/*
+ * --------------------------------------------------------------------------
+ *  Channel structure
+ * --------------------------------------------------------------------------
+ */
+struct xchannel {
+  /* read only after creation */
+  size_t   szelem;          /* size of an element */
+  size_t   mask;            /* number of elements - 1 */
+  int      mode;            /* XCHANNEL_SPSC or XCHANNEL_MPSC */
+  size_t  *seqs;            /* MPSC : sequence number of each slot */
+  char    *data;            /* elements */
+
+  /* receiver side */
+  size_t   head __attribute__((aligned(CACHELINE)));
+  size_t   tailcache;       /* last value of 'tail' read by receiver (SPSC) */
+
+  /* sender side */
+  size_t   tail __attribute__((aligned(CACHELINE)));
+  size_t   headcache;       /* last value of 'head' read by sender */
+
+  /* blocked fibers */
+  xwaitq_t rwait __attribute__((aligned(CACHELINE)));
+  xwaitq_t swait;
+};
+
+/*
+ * --------------------------------------------------------------------------
+ *  Allocates a new channel
+ * --------------------------------------------------------------------------
+ */
+xchannel_t *xchannel_new( size_t szelem, size_t nbelem, int mode )
+{
+  xchannel_t *chan;
+  size_t n, i;
+
+  if ( mode != XCHANNEL_SPSC && mode != XCHANNEL_MPSC ) {
+    return NULL;
+  }
+  if ( szelem < 1 ) {
+    szelem = 1;
+  }
+  for( n = 1; n < nbelem; n <<= 1 );
+
+  if ( posix_memalign( (void**) &chan, CACHELINE, sizeof(*chan) ) ) {
+    return NULL;
+  }
+  memset( chan, 0, sizeof(*chan));
+  chan->szelem = szelem;
+  chan->mask = n - 1;
+  chan->mode = mode;
+
+  chan->data = (char*) malloc( n * szelem );
+  if ( chan->data == NULL ) {
+    free( chan );
+    return NULL;
+  }
+
+  if ( mode == XCHANNEL_MPSC ) {
+    chan->seqs = (size_t*) malloc( n * sizeof(size_t));
+    if ( chan->seqs == NULL ) {
+      free( chan->data );
+      free( chan );
+      return NULL;
+    }
+    for( i = 0; i < n; ++i ) {
+      chan->seqs[i] = i;
+    }
+  }
+  return chan;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Frees a channel object
+ * --------------------------------------------------------------------------
+ */
+void xchannel_free( xchannel_t *chan )
+{
+  if ( chan == NULL ) {
+    return;
+  }
+  free( chan->seqs );
+  free( chan->data );
+  free( chan );
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Copy 'n' elements to the ring starting at index 'pos'
+ * --------------------------------------------------------------------------
+ */
+static void xchannelCopyIn( xchannel_t *chan, size_t pos, const char *data, size_t n )
+{
+  size_t idx = pos & chan->mask;
+  size_t first = chan->mask + 1 - idx;
+
+  if ( first > n ) first = n;
+  memcpy( chan->data + idx*chan->szelem, data, first*chan->szelem );
+  if ( first < n ) {
+    memcpy( chan->data, data + first*chan->szelem, (n - first)*chan->szelem );
+  }
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Copy 'n' elements from the ring starting at index 'pos'
+ * --------------------------------------------------------------------------
+ */
+static void xchannelCopyOut( xchannel_t *chan, size_t pos, char *data, size_t n )
+{
+  size_t idx = pos & chan->mask;
+  size_t first = chan->mask + 1 - idx;
+
+  if ( first > n ) first = n;
+  memcpy( data, chan->data + idx*chan->szelem, first*chan->szelem );
+  if ( first < n ) {
+    memcpy( data + first*chan->szelem, chan->data, (n - first)*chan->szelem );
+  }
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Wait queue lock, held for a few instructions only
+ * --------------------------------------------------------------------------
+ */
+static void xwaitqLock( xwaitq_t *queue )
+{
+  while( __atomic_test_and_set( &queue->lock, __ATOMIC_ACQUIRE ) ) {
+    /* the holder may have been preempted */
+    while( load_relaxed( &queue->lock ) ) {
+      sched_yield();
+    }
+  }
+}
+
+static void xwaitqUnlock( xwaitq_t *queue )
+{
+  __atomic_clear( &queue->lock, __ATOMIC_RELEASE );
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Wake up all the fibers blocked in 'queue'.
+ *  The full barrier orders the publication of the indices with the
+ *  read of the queue, the blocking side does the opposite. The fibers
+ *  are woken up before the lock is released : they can't return from
+ *  xchannelPark() meanwhile.
+ * --------------------------------------------------------------------------
+ */
+static void xchannelWake( xwaitq_t *queue )
+{
+  xwaiter_t *w, *next;
+
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  if ( load_relaxed( &queue->head ) == NULL ) {
+    return;
+  }
+  xwaitqLock( queue );
+  for( w = queue->head; w != NULL; w = next ) {
+    next = w->next;
+    w->pprev = NULL;
+    schedRemoteWake( w->fiber );
+  }
+  __atomic_store_n( &queue->head, NULL, __ATOMIC_RELAXED );
+  xwaitqUnlock( queue );
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Sends up to 'n' elements without blocking.
+ *  Returns the number of elements sent.
+ * --------------------------------------------------------------------------
+ */
+static size_t xchannelSendSome( xchannel_t *chan, const char *data, size_t n )
+{
+  size_t cap = chan->mask + 1;
+  size_t tail, room, i;
+
+  if ( chan->mode == XCHANNEL_SPSC ) {
+    tail = chan->tail;
+    room = cap - (tail - chan->headcache);
+    if ( room < n ) {
+      chan->headcache = load_acquire( &chan->head );
+      room = cap - (tail - chan->headcache);
+    }
+    if ( room < n ) n = room;
+    if ( n == 0 ) return 0;
+
+    xchannelCopyIn( chan, tail, data, n );
+    store_release( &chan->tail, tail + n );
+    return n;
+  }
+
+  /* MPSC : reserve n slots moving tail */
+  tail = load_relaxed( &chan->tail );
+  for(;;) {
+    room = cap - (tail - load_acquire( &chan->head ));
+    if ( room > cap ) {
+      /* tail was read before the last update of head */
+      tail = load_relaxed( &chan->tail );
+      continue;
+    }
+    if ( room == 0 ) return 0;
+    if ( room < n ) n = room;
+    if ( __atomic_compare_exchange_n( &chan->tail, &tail, tail + n, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+      break;
+    }
+  }
+
+  /* the slots are ours : wait for the receiver to release them
+   * (it releases the slot before moving head, so this is immediate) */
+  for( i = 0; i < n; ++i ) {
+    while( load_acquire( &chan->seqs[(tail + i) & chan->mask] ) != tail + i );
+  }
+  xchannelCopyIn( chan, tail, data, n );
+  for( i = 0; i < n; ++i ) {
+    store_release( &chan->seqs[(tail + i) & chan->mask], tail + i + 1 );
+  }
+  return n;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Receives up to 'n' elements without blocking.
+ *  Returns the number of elements received.
+ * --------------------------------------------------------------------------
+ */
+static size_t xchannelRecvSome( xchannel_t *chan, char *data, size_t n )
+{
+  size_t head = chan->head;
+  size_t avail, i;
+
+  if ( chan->mode == XCHANNEL_SPSC ) {
+    avail = chan->tailcache - head;
+    if ( avail < n ) {
+      chan->tailcache = load_acquire( &chan->tail );
+      avail = chan->tailcache - head;
+    }
+    if ( avail < n ) n = avail;
+    if ( n == 0 ) return 0;
+
+    xchannelCopyOut( chan, head, data, n );
+    store_release( &chan->head, head + n );
+    return n;
+  }
+
+  /* MPSC : take the slots whose data is complete */
+  for( avail = 0; avail < n; ++avail ) {
+    if ( load_acquire( &chan->seqs[(head + avail) & chan->mask] ) != head + avail + 1 ) {
+      break;
+    }
+  }
+  if ( avail == 0 ) return 0;
+
+  xchannelCopyOut( chan, head, data, avail );
+  for( i = 0; i < avail; ++i ) {
+    store_release( &chan->seqs[(head + i) & chan->mask], head + i + chan->mask + 1 );
+  }
+  store_release( &chan->head, head + avail );
+  return avail;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Channel state checks used before parking
+ * --------------------------------------------------------------------------
+ */
+static int xchannelCanRecv( xchannel_t *chan )
+{
+  if ( chan->mode == XCHANNEL_SPSC ) {
+    return load_acquire( &chan->tail ) != chan->head;
+  }
+  return load_acquire( &chan->seqs[chan->head & chan->mask] ) == chan->head + 1;
+}
+
+static int xchannelCanSend( xchannel_t *chan )
+{
+  return (load_relaxed( &chan->tail ) - load_acquire( &chan->head )) <= chan->mask;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Remaining time before timeout, 0 if expired, UINT32_MAX if none
+ * --------------------------------------------------------------------------
+ */
+static uint32_t xchannelRemaining( fiber_t *fiber, uint32_t start, uint32_t msec )
+{
+  uint32_t elapsed;
+
+  if ( msec == 0 ) {
+    return UINT32_MAX;
+  }
+  elapsed = sched_timestamp( fiber->scheduler ) - start;
+  return (elapsed >= msec) ? 0 : msec - elapsed;
+}
+
+/*
+ * --------------------------------------------------------------------------
+ *  Park 'fiber' in 'queue' unless 'ready' becomes true in the meantime.
+ *  Once unlinked, a wake up that was not consumed by fiberPark() may still
+ *  be in the inbox : it is spurious and ignored by any other wait.
+ * --------------------------------------------------------------------------
+ */
+static int xchannelPark( fiber_t *fiber, xwaitq_t *queue, uint32_t remaining,
+			 int (*ready)(xchannel_t*), xchannel_t *chan )
+{
+  xwaiter_t w;
+  int ret = FIBER_OK;
+
+  w.fiber = fiber;
+  xwaitqLock( queue );
+  w.next = queue->head;
+  if ( w.next != NULL ) {
+    w.next->pprev = &w.next;
+  }
+  w.pprev = &queue->head;
+  __atomic_store_n( &queue->head, &w, __ATOMIC_RELAXED );
+  xwaitqUnlock( queue );
+
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  if ( !ready( chan ) ) {
+    ret = fiberPark( fiber, (remaining == UINT32_MAX) ? 0 : remaining,
+		     PREDICATE_F_REMOTE );
+  }
+
+  /* unless a waker did it */
+  xwaitqLock( queue );
+  if ( w.pprev != NULL ) {
+    __atomic_store_n( w.pprev, w.next, __ATOMIC_RELAXED );
+    if ( w.next != NULL ) {
+      w.next->pprev = w.pprev;
+    }
+  }
+  xwaitqUnlock( queue );
+  return ret;
+}
+
+/* --------------------------------------------------------------------------
+ *  xchannel_try_send --
+ * --------------------------------------------------------------------------*/
+int xchannel_try_send( xchannel_t *chan, const void *data )
+{
+  if ( xchannelSendSome( chan, (const char*) data, 1 ) == 0 ) {
+    return FIBER_TIMEOUT;
+  }
+  xchannelWake( &chan->rwait );
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  xchannel_try_recv --
+ * --------------------------------------------------------------------------*/
+int xchannel_try_recv( xchannel_t *chan, void *data )
+{
+  if ( xchannelRecvSome( chan, (char*) data, 1 ) == 0 ) {
+    return FIBER_TIMEOUT;
+  }
+  xchannelWake( &chan->swait );
+  return FIBER_OK;
+}
+
+/* --------------------------------------------------------------------------
+ *  xchannel_send_batch --
+ * --------------------------------------------------------------------------*/
+int xchannel_send_batch( fiber_t *fiber, xchannel_t *chan, const void *data,
+			 size_t n, size_t *nsent, uint32_t msec )
+{
+  const char *p = (const char*) data;
+  uint32_t start = sched_timestamp( fiber_get_scheduler( fiber ) );
+  uint32_t remaining;
+  size_t sent = 0, k;
+  int ret = FIBER_OK;
+
+  while( sent < n ) {
+    k = xchannelSendSome( chan, p + sent*chan->szelem, n - sent );
+    if ( k > 0 ) {
+      sent += k;
+      xchannelWake( &chan->rwait );
+      continue;
+    }
+
+    /* channel is full */
+    remaining = xchannelRemaining( fiber, start, msec );
+    if ( remaining == 0 ) {
+      ret = FIBER_TIMEOUT;
+      break;
+    }
+    ret = xchannelPark( fiber, &chan->swait, remaining, xchannelCanSend, chan );
+    if ( ret == FIBER_CANCELED || ret == FIBER_ILLEGAL_STATE ) {
+      break;
+    }
+    ret = FIBER_OK;
+  }
+
+  if ( nsent != NULL ) {
+    *nsent = sent;
+  }
+  return ret;
+}
+
+/* --------------------------------------------------------------------------
+ *  xchannel_recv_batch --
+ * --------------------------------------------------------------------------*/
+int xchannel_recv_batch( fiber_t *fiber, xchannel_t *chan, void *data,
+			 size_t n, size_t *nrecv, uint32_t msec )
+{
+  uint32_t start = sched_timestamp( fiber_get_scheduler( fiber ) );
+  uint32_t remaining;
+  size_t k = 0;
+  int ret = FIBER_OK;
+
+  while( n > 0 ) {
+    k = xchannelRecvSome( chan, (char*) data, n );
+    if ( k > 0 ) {
+      xchannelWake( &chan->swait );
+      break;
+    }
+
+    /* channel is empty */
+    remaining = xchannelRemaining( fiber, start, msec );
+    if ( remaining == 0 ) {
+      ret = FIBER_TIMEOUT;
+      break;
+    }
+    ret = xchannelPark( fiber, &chan->rwait, remaining, xchannelCanRecv, chan );
+    if ( ret == FIBER_CANCELED || ret == FIBER_ILLEGAL_STATE ) {
+      break;
+    }
+    ret = FIBER_OK;
+  }
+
+  if ( nrecv != NULL ) {
+    *nrecv = k;
+  }
+  return ret;
+}
+
+/* --------------------------------------------------------------------------
+ *  xchannel_send --
+ * --------------------------------------------------------------------------*/
+int xchannel_send( fiber_t *fiber, xchannel_t *chan, const void *data, uint32_t msec )
+{
+  return xchannel_send_batch( fiber, chan, data, 1, NULL, msec );
+}
+
+/* --------------------------------------------------------------------------
+ *  xchannel_recv --
+ * --------------------------------------------------------------------------*/
+int xchannel_recv( fiber_t *fiber, xchannel_t *chan, void *data, uint32_t msec )
+{
+  return xchannel_recv_batch( fiber, chan, data, 1, NULL, msec );
+}
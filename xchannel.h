@@ -0,0 +1,159 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 vzvca
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FIBER_XCHANNEL_H__
+#define __FIBER_XCHANNEL_H__
+
+#include "task.h"
+
+/* typedefs */
+typedef struct xchannel xchannel_t;
+
+/* ---------------------------------------------------------------------------
+ *  Cross thread channels
+ *
+ *  A xchannel is a lock free ring of fixed size elements used to exchange
+ *  messages between fibers running in schedulers on different threads.
+ *
+ *  In XCHANNEL_SPSC mode there must be a single sending fiber (or thread)
+ *  and a single receiving fiber. In XCHANNEL_MPSC mode any number of
+ *  fibers or threads can send, there is still a single receiver.
+ *
+ *  A fiber blocked on an empty (or full) channel is parked : it costs
+ *  nothing to its scheduler. It is woken up by its peer through the inbox
+ *  of its scheduler. In XCHANNEL_MPSC mode, all the senders blocked on a
+ *  full channel are woken up when the receiver makes room.
+ * ---------------------------------------------------------------------------
+ */
+enum xchannel_mode_e
+  {
+   XCHANNEL_SPSC = 0,        /* single producer, single consumer */
+   XCHANNEL_MPSC,            /* multiple producers, single consumer */
+  };
+
+
+/* ---------------------------------------------------------------------------
+ * xchannel_new --
+ *
+ * Allocates a channel that can hold 'nbelem' elements of 'szelem' bytes.
+ * 'nbelem' is rounded up to the next power of two.
+ *
+ * Returns NULL on memory allocation failure or invalid 'mode'.
+ * ---------------------------------------------------------------------------
+ */
+xchannel_t *xchannel_new( size_t szelem, size_t nbelem, int mode );
+
+
+/* ---------------------------------------------------------------------------
+ * xchannel_free --
+ *
+ * Frees a channel. No fiber must be blocked on it.
+ * ---------------------------------------------------------------------------
+ */
+void xchannel_free( xchannel_t *chan );
+
+
+/* ---------------------------------------------------------------------------
+ * xchannel_try_send --
+ *
+ * Copies one element in the channel if there is room for it.
+ * It never blocks and can be called from a thread which is not running
+ * a scheduler.
+ *
+ * Returns FIBER_OK if the element was sent and FIBER_TIMEOUT if the
+ * channel is full.
+ * ---------------------------------------------------------------------------
+ */
+int xchannel_try_send( xchannel_t *chan, const void *data );
+
+
+/* ---------------------------------------------------------------------------
+ * xchannel_try_recv --
+ *
+ * Copies one element out of the channel if it is not empty.
+ * It never blocks.
+ *
+ * Returns FIBER_OK if an element was received and FIBER_TIMEOUT if the
+ * channel is empty.
+ * ---------------------------------------------------------------------------
+ */
+int xchannel_try_recv( xchannel_t *chan, void *data );
+
+
+/* ---------------------------------------------------------------------------
+ * xchannel_send --
+ *
+ * Sends one element. If the channel is full the fiber is parked until
+ * there is room or until 'msec' milliseconds elapsed. 'msec' = 0 means
+ * no timeout.
+ *
+ * Returns FIBER_OK, FIBER_TIMEOUT or FIBER_CANCELED.
+ * ---------------------------------------------------------------------------
+ */
+int xchannel_send( fiber_t *fiber, xchannel_t *chan, const void *data, uint32_t msec );
+
+
+/* ---------------------------------------------------------------------------
+ * xchannel_recv --
+ *
+ * Receives one element. If the channel is empty the fiber is parked until
+ * an element is sent or until 'msec' milliseconds elapsed. 'msec' = 0 means
+ * no timeout.
+ *
+ * Returns FIBER_OK, FIBER_TIMEOUT or FIBER_CANCELED.
+ * ---------------------------------------------------------------------------
+ */
+int xchannel_recv( fiber_t *fiber, xchannel_t *chan, void *data, uint32_t msec );
+
+
+/* ---------------------------------------------------------------------------
+ * xchannel_send_batch --
+ *
+ * Sends the 'n' elements stored contiguously at 'data', blocking as
+ * xchannel_send() when the channel is full. Elements are published in
+ * groups : the receiver is woken up once per group, not once per element.
+ *
+ * The number of elements sent is stored in '*nsent' if it is not NULL.
+ * It is less than 'n' only when FIBER_TIMEOUT or FIBER_CANCELED is returned.
+ * ---------------------------------------------------------------------------
+ */
+int xchannel_send_batch( fiber_t *fiber, xchannel_t *chan, const void *data,
+			 size_t n, size_t *nsent, uint32_t msec );
+
+
+/* ---------------------------------------------------------------------------
+ * xchannel_recv_batch --
+ *
+ * Waits until the channel is not empty, as xchannel_recv(), then receives
+ * all the available elements up to 'n'. The number of elements received
+ * is stored in '*nrecv' if it is not NULL.
+ *
+ * Returns FIBER_OK, FIBER_TIMEOUT or FIBER_CANCELED.
+ * ---------------------------------------------------------------------------
+ */
+int xchannel_recv_batch( fiber_t *fiber, xchannel_t *chan, void *data,
+			 size_t n, size_t *nrecv, uint32_t msec );
+
+
+#endif